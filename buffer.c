@@ -5,32 +5,23 @@
 
 
 int buffer_init(buffer_t* buffer, size_t size) {
-  buffer->size      = size;
-  buffer->data      = malloc(size);
-  buffer->mutex     = SDL_CreateMutex();
-  buffer->element_added = SDL_CreateCond();
-  buffer->element_removed  = SDL_CreateCond();
+  if (size == 0 || (size & (size - 1)) != 0) {
+    log_err("buffer: size %lu is not a power of two\n", size);
+    return 1;
+  }
 
-  if (buffer->data == NULL || buffer->mutex == NULL || buffer->element_added == NULL || buffer->element_removed == NULL) {
-    log_wrn("buffer: out of memory\n");
+  buffer->size            = size;
+  buffer->data            = malloc(size);
+  buffer->mutex           = SDL_CreateMutex();
+  buffer->space_available = SDL_CreateCond();
 
-    if (buffer->data) {
-      free(buffer->data);
-      buffer->data = NULL;
-    }
-    if (buffer->mutex) {
-      SDL_DestroyMutex(buffer->mutex);
-      buffer->mutex = NULL;
-    }
-    if (buffer->element_added) {
-      SDL_DestroyCond(buffer->element_added);
-      buffer->element_added = NULL;
-    }
-    if (buffer->element_removed) {
-      SDL_DestroyCond(buffer->element_removed);
-      buffer->element_removed = NULL;
-    }
+  SDL_AtomicSet(&buffer->read_index,          0);
+  SDL_AtomicSet(&buffer->write_index,         0);
+  SDL_AtomicSet(&buffer->is_producer_waiting, 0);
 
+  if (buffer->data == NULL || buffer->mutex == NULL || buffer->space_available == NULL) {
+    log_wrn("buffer: out of memory\n");
+    buffer_finit(buffer);
     return 1;
   }
 
@@ -47,78 +38,140 @@ void buffer_finit(buffer_t* buffer) {
     SDL_DestroyMutex(buffer->mutex);
     buffer->mutex = NULL;
   }
-  if (buffer->element_added) {
-    SDL_DestroyCond(buffer->element_added);
-    buffer->element_added = NULL;
+  if (buffer->space_available) {
+    SDL_DestroyCond(buffer->space_available);
+    buffer->space_available = NULL;
   }
-  if (buffer->element_removed) {
-    SDL_DestroyCond(buffer->element_removed);
-    buffer->element_removed = NULL;
+}
+
+
+/* Wakes up a producer waiting for room, if any. */
+static void buffer_space_made(buffer_t* buffer) {
+  if (SDL_AtomicGet(&buffer->is_producer_waiting)) {
+    SDL_LockMutex(buffer->mutex);
+    SDL_CondSignal(buffer->space_available);
+    SDL_UnlockMutex(buffer->mutex);
   }
 }
 
 
+/* Empties the buffer, which is up to the consumer. */
 void buffer_reset(buffer_t* buffer) {
-  buffer->read_index = 0;
-  buffer->n_elements = 0;
+  SDL_AtomicSet(&buffer->read_index, SDL_AtomicGet(&buffer->write_index));
+  buffer_space_made(buffer);
 }
 
 
-size_t buffer_read_n(buffer_t* buffer, size_t n, u8_t* values) {
-  size_t i;
+size_t buffer_n_elements(buffer_t* buffer) {
+  return (u32_t) (SDL_AtomicGet(&buffer->write_index) - SDL_AtomicGet(&buffer->read_index));
+}
 
-  SDL_LockMutex(buffer->mutex);
 
-  for (i = 0; buffer->n_elements && (i < n); i++) {
-    if (values) {
-      values[i] = buffer->data[buffer->read_index];
-    }
-    buffer->n_elements--;
-    buffer->read_index = (buffer->read_index + 1) % buffer->size;
+static void buffer_copy_out(const buffer_t* buffer, u32_t from, size_t n, u8_t* values) {
+  const size_t offset = from & (buffer->size - 1);
+  const size_t first  = (n < buffer->size - offset) ? n : buffer->size - offset;
+
+  memcpy(values, &buffer->data[offset], first);
+  memcpy(&values[first], buffer->data, n - first);
+}
+
+
+size_t buffer_read_n(buffer_t* buffer, size_t n, u8_t* values) {
+  const u32_t read_index = SDL_AtomicGet(&buffer->read_index);
+  const u32_t available  = SDL_AtomicGet(&buffer->write_index) - read_index;
+
+  if (n > available) {
+    n = available;
+  }
+  if (n == 0) {
+    return 0;
   }
 
-  if (n > 0) {
-    SDL_CondSignal(buffer->element_removed);
+  if (values) {
+    buffer_copy_out(buffer, read_index, n, values);
   }
 
-  SDL_UnlockMutex(buffer->mutex);
+  /* Only hand the space back once we're done with the data. */
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&buffer->read_index, read_index + n);
+
+  buffer_space_made(buffer);
 
-  return i;
+  return n;
 }
 
 
 size_t buffer_peek_n(buffer_t* buffer, size_t index, size_t n, u8_t* values) {
-  size_t i;
+  const u32_t read_index = SDL_AtomicGet(&buffer->read_index);
+  const u32_t available  = SDL_AtomicGet(&buffer->write_index) - read_index;
+
+  if (index >= available) {
+    return 0;
+  }
+  if (n > available - index) {
+    n = available - index;
+  }
+
+  buffer_copy_out(buffer, read_index + index, n, values);
+
+  return n;
+}
 
-  SDL_LockMutex(buffer->mutex);
 
-  for (i = 0; (index + i < buffer->n_elements) && (i < n); i++) {
-    values[i] = buffer->data[(buffer->read_index + index + i) % buffer->size];
+size_t buffer_write_n(buffer_t* buffer, size_t n, const u8_t* values) {
+  const u32_t  write_index = SDL_AtomicGet(&buffer->write_index);
+  const u32_t  space       = buffer->size - (write_index - SDL_AtomicGet(&buffer->read_index));
+  size_t       offset;
+  size_t       first;
+
+  if (n > space) {
+    n = space;
+  }
+  if (n == 0) {
+    return 0;
   }
 
-  SDL_UnlockMutex(buffer->mutex);
+  offset = write_index & (buffer->size - 1);
+  first  = (n < buffer->size - offset) ? n : buffer->size - offset;
+
+  memcpy(&buffer->data[offset], values, first);
+  memcpy(buffer->data, &values[first], n - first);
+
+  /* Only publish the data once it's there. */
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&buffer->write_index, write_index + n);
 
-  return i;
+  return n;
 }
 
 
 size_t buffer_write(buffer_t* buffer, u8_t value) {
+  return buffer_write_n(buffer, 1, &value);
+}
 
-  SDL_LockMutex(buffer->mutex);
 
-  if (buffer->n_elements == buffer->size) {
-    SDL_UnlockMutex(buffer->mutex);
-    return 0;
+/**
+ * Blocks the producer until there is room for n bytes, or until the timeout
+ * expires. Returns whether there is room.
+ */
+int buffer_wait_for_space(buffer_t* buffer, size_t n, u32_t timeout_ms) {
+  int is_timed_out = 0;
+
+  if (buffer->size - buffer_n_elements(buffer) >= n) {
+    return 1;
   }
 
-  buffer->data[(buffer->read_index + buffer->n_elements) % buffer->size] = value;
-  buffer->n_elements++;
+  SDL_LockMutex(buffer->mutex);
+  SDL_AtomicSet(&buffer->is_producer_waiting, 1);
 
-  SDL_CondSignal(buffer->element_added);
+  /* The consumer checks the flag after making room, so either we see the
+   * room here or it sees us waiting. */
+  while (buffer->size - buffer_n_elements(buffer) < n && !is_timed_out) {
+    is_timed_out = (SDL_CondWaitTimeout(buffer->space_available, buffer->mutex, timeout_ms) == SDL_MUTEX_TIMEDOUT);
+  }
 
+  SDL_AtomicSet(&buffer->is_producer_waiting, 0);
   SDL_UnlockMutex(buffer->mutex);
-  
-  return 1;
-}
-
 
+  return buffer->size - buffer_n_elements(buffer) >= n;
+}
@@ -6,23 +6,31 @@
 #include "defs.h"
 
 
+/**
+ * A ring of bytes for one producer and one consumer, which may be different
+ * threads. Neither side takes a lock, unless the producer has to wait for
+ * the consumer to make room.
+ */
 typedef struct {
-  u8_t*      data;
-  size_t     size;
-  size_t     read_index;
-  size_t     n_elements;
-  SDL_mutex* mutex;
-  SDL_cond*  element_added;
-  SDL_cond*  element_removed;
+  u8_t*        data;
+  size_t       size;                 /* A power of two. */
+  SDL_atomic_t read_index;           /* Free running, only advanced by the consumer. */
+  SDL_atomic_t write_index;          /* Free running, only advanced by the producer. */
+  SDL_atomic_t is_producer_waiting;
+  SDL_mutex*   mutex;
+  SDL_cond*    space_available;
 } buffer_t;
 
 
 int    buffer_init(buffer_t* buffer, size_t size);
 void   buffer_finit(buffer_t* buffer);
 void   buffer_reset(buffer_t* buffer);
+size_t buffer_n_elements(buffer_t* buffer);
 size_t buffer_peek_n(buffer_t* buffer, size_t index, size_t n, u8_t* values);
 size_t buffer_read_n(buffer_t* buffer, size_t n, u8_t* values);
 size_t buffer_write(buffer_t* buffer, u8_t value);
+size_t buffer_write_n(buffer_t* buffer, size_t n, const u8_t* values);
+int    buffer_wait_for_space(buffer_t* buffer, size_t n, u32_t timeout_ms);
 
 
 #endif  /* __BUFFER_H */
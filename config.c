@@ -63,6 +63,10 @@ u8_t config_read(u16_t address) {
 
 void config_write(u16_t address, u8_t value) {
   self.sram[self.rom_ram_bank_base + address] = value;
+
+  if (self.rom_ram_bank_base >= MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM) {
+    memory_ram_written(self.rom_ram_bank_base - MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM + address, value);
+  }
 }
 
 
@@ -5,6 +5,7 @@
 #include "copper.h"
 #include "log.h"
 #include "nextreg.h"
+#include "timeline.h"
 
 
 /**
@@ -33,6 +34,13 @@ typedef struct {
 } instruction_t;
 
 
+typedef enum {
+  E_COPPER_OP_NOOP = 0,
+  E_COPPER_OP_WAIT,
+  E_COPPER_OP_MOVE
+} copper_op_t;
+
+
 typedef struct {
   u16_t         cpc;      /** 0 - 1023 */
   u16_t         address;  /** 0 - 2047 */
@@ -41,6 +49,14 @@ typedef struct {
   int           is_running;
   int           do_reset_pc_on_irq;
   int           do_move_wait_one_cycle;
+
+  /* The instruction at cpc, decoded once until something changes it. */
+  int           is_decoded;
+  copper_op_t   op;
+  u32_t         wait_row;
+  u32_t         wait_column;
+  u8_t          move_reg;
+  u8_t          move_value;
 } copper_t;
 
 
@@ -61,12 +77,14 @@ void copper_finit(void) {
 void copper_reset(reset_t reset) {
   self.address    = 0;
   self.is_running = 0;
+  self.is_decoded = 0;
 }
 
 
 void copper_data_8bit_write(u8_t value) {
   ((u8_t*) self.instruction)[self.address] = value;
-  self.address = (self.address + 1) & 0x7FF;
+  self.address    = (self.address + 1) & 0x7FF;
+  self.is_decoded = 0;
 }
 
 
@@ -75,6 +93,7 @@ void copper_data_16bit_write(u8_t value)  {
     const u16_t even = self.address - 1;
     self.instruction[even].msb = self.cached;
     self.instruction[even].lsb = value;
+    self.is_decoded            = 0;
   } else {
     self.cached = value;
   }
@@ -119,7 +138,8 @@ static void copper_dump_program(void) {
 
 
 void copper_control_write(u8_t value) {
-  self.address = ((value & 0x07) << 8) | (self.address & 0x00FF);
+  self.address    = ((value & 0x07) << 8) | (self.address & 0x00FF);
+  self.is_decoded = 0;
 
   switch (value >> 6) {
     case 0:
@@ -154,37 +174,82 @@ void copper_control_write(u8_t value) {
 }
 
 
-void copper_tick(u32_t beam_row, u32_t beam_column) {
-  if (!self.is_running) {
-    return;
-  }
-
+static void copper_decode(void) {
   const u16_t instruction = (self.instruction[self.cpc].msb << 8) | self.instruction[self.cpc].lsb;
 
   if (instruction == 0x0000) {
-    /* NOOP: 1 cycle. */
-    self.cpc = (self.cpc + 1) & 0x3FF;
+    self.op = E_COPPER_OP_NOOP;
+  } else if (instruction & 0x8000) {
+    self.op          = E_COPPER_OP_WAIT;
+    self.wait_row    = instruction & 0x01FF;
+    self.wait_column = (instruction & 0x7E00) >> 6;
+  } else {
+    self.op          = E_COPPER_OP_MOVE;
+    self.move_reg    = (instruction & 0x7F00) >> 8;
+    self.move_value  = instruction & 0x00FF;
+  }
+
+  self.is_decoded = 1;
+}
+
+
+static void copper_next(void) {
+  self.cpc        = (self.cpc + 1) & 0x3FF;
+  self.is_decoded = 0;
+}
+
+
+/* One 28 MHz copper cycle. */
+static void copper_cycle(u32_t beam_row, u32_t beam_column) {
+  if (!self.is_decoded) {
+    copper_decode();
+  }
+
+  switch (self.op) {
+    case E_COPPER_OP_NOOP:
+      /* 1 cycle. */
+      copper_next();
+      break;
+
+    case E_COPPER_OP_WAIT:
+      /* 1 cycle. */
+      if (beam_row == self.wait_row && beam_column >= self.wait_column) {
+        copper_next();
+      }
+      break;
+
+    case E_COPPER_OP_MOVE:
+      /* 2 cycles. */
+      if (self.do_move_wait_one_cycle) {
+        timeline_event(E_TIMELINE_EVENT_COPPER_MOVE, self.move_reg, self.move_value, 0);
+        nextreg_write_internal(self.move_reg, self.move_value);
+        copper_next();
+      }
+      self.do_move_wait_one_cycle = !self.do_move_wait_one_cycle;
+      break;
+  }
+}
+
+
+/**
+ * Runs the two copper cycles that fit in one 14 MHz tick. While waiting for
+ * a beam position that hasn't come yet, this is a mere comparison against
+ * the decoded WAIT.
+ */
+void copper_tick(u32_t beam_row, u32_t beam_column) {
+  if (!self.is_running) {
     return;
   }
 
-  if (instruction & 0x8000) {
-    /* WAIT: 1 cycle. */
-    const u32_t wait_row    = instruction & 0x01FF;
-    const u32_t wait_column = (instruction & 0x7E00) >> 6;
-    if (beam_row == wait_row && beam_column >= wait_column) {
-      self.cpc = (self.cpc + 1) & 0x3FF;
-    }
+  if (self.is_decoded && self.op == E_COPPER_OP_WAIT && (beam_row != self.wait_row || beam_column < self.wait_column)) {
     return;
   }
-  
-  /* MOVE: 2 cycles. */
-  if (self.do_move_wait_one_cycle) {
-    const u8_t reg   = (instruction & 0x7F00) >> 8;
-    const u8_t value = instruction & 0x00FF;
-    nextreg_write_internal(reg, value);
-    self.cpc = (self.cpc + 1) & 0x3FF;
+
+  copper_cycle(beam_row, beam_column);
+
+  if (self.is_running) {
+    copper_cycle(beam_row, beam_column);
   }
-  self.do_move_wait_one_cycle = !self.do_move_wait_one_cycle;
 }
 
 
@@ -192,5 +257,6 @@ void copper_irq(void) {
   if (self.do_reset_pc_on_irq) {
     self.cpc                    = 0;
     self.do_move_wait_one_cycle = 0;
+    self.is_decoded             = 0;
   }
 }
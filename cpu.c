@@ -4,11 +4,14 @@
 #include "cpu.h"
 #include "defs.h"
 #include "divmmc.h"  /* For debugging. */
+#include "hostfs.h"
 #include "io.h"
 #include "log.h"
 #include "memory.h"
 #include "mf.h"
 #include "nextreg.h"
+#include "spi.h"
+#include "tape.h"
 
 #ifdef TRACE
 #include "bootrom.h"
@@ -210,6 +213,63 @@ typedef struct {
 static cpu_t self;
 
 
+/**
+ * INIR while an SD card is streaming a block over the SPI data port: moves as
+ * much of the block as B allows in one go instead of one byte per iteration.
+ * Returns whether it did, otherwise INIR continues as normal.
+ *
+ * The exact accelerator charges every iteration as inxr() in opcodes.py does,
+ * contention included. The fast one charges a single iteration.
+ */
+static int cpu_inir_accelerated(int step) {
+  const u32_t requested = B ? B : 256;
+  const u8_t* data;
+  u32_t       n;
+  u32_t       i;
+  int         j;
+
+  n = io_read_n(BC, &data, requested);
+  if (n == 0) {
+    return 0;
+  }
+
+  if (spi_accelerator_get() == E_SPI_ACCELERATOR_FAST) {
+    for (i = 0; i < n; i++) {
+      memory_write(HL, data[i]);
+      HL += step;
+    }
+    B -= n;
+
+    /* The fetch of ED B2 has been charged already. */
+    T(B ? 18 : 13);
+  } else {
+    for (i = 0; i < n; i++) {
+      if (i > 0) {
+        /* Fetching ED B2 again. */
+        T(8);
+      }
+      T(1);
+      T(4);  /* As io_read() of the port. */
+      memory_write(HL, data[i]); T(3);
+      for (j = (--B ? 10 : 5); j > 0; j--) {
+        memory_contend(HL); T(1);
+      }
+      HL += step;
+    }
+  }
+
+  /* Every further iteration fetches ED B2 again, so advances R twice. */
+  R = (R & 0x80) | ((R + 2 * (n - 1)) & 0x7F);
+
+  F = SZ53P(B) | NF_MASK | (F & CF_MASK);
+  if (B) {
+    PC -= 2;
+  }
+
+  return 1;
+}
+
+
 #include "opcodes.c"
 
 
@@ -428,6 +488,14 @@ void cpu_step(void) {
   if (trace) log_wrn("cpu: PC=$%04X HL=%d BC=%d\n", PC, HL, BC);
 #endif
 
+  if (PC == TAPE_LD_BYTES && tape_ld_bytes_trap()) {
+    return;
+  }
+
+  if (PC == HOSTFS_RST8 && hostfs_rst8_trap()) {
+    return;
+  }
+
   cpu_trace();
   cpu_execute_next_opcode();
 
@@ -451,3 +519,65 @@ void cpu_step(void) {
 u16_t cpu_pc_get(void) {
   return PC;
 }
+
+
+void cpu_registers_get(cpu_registers_t* registers) {
+  registers->af   = AF;
+  registers->bc   = BC;
+  registers->de   = DE;
+  registers->hl   = HL;
+  registers->af_  = AF_;
+  registers->bc_  = BC_;
+  registers->de_  = DE_;
+  registers->hl_  = HL_;
+  registers->ix   = IX;
+  registers->iy   = IY;
+  registers->sp   = SP;
+  registers->pc   = PC;
+  registers->i    = I;
+  registers->r    = R;
+  registers->im   = IM;
+  registers->iff1 = IFF1;
+  registers->iff2 = IFF2;
+}
+
+
+/**
+ * Replaces the whole register file when loading machine state, so it also
+ * drops pending resets and NMIs. Traps use cpu_registers_update() instead.
+ */
+void cpu_registers_set(const cpu_registers_t* registers) {
+  AF   = registers->af;
+  BC   = registers->bc;
+  DE   = registers->de;
+  HL   = registers->hl;
+  AF_  = registers->af_;
+  BC_  = registers->bc_;
+  DE_  = registers->de_;
+  HL_  = registers->hl_;
+  IX   = registers->ix;
+  IY   = registers->iy;
+  SP   = registers->sp;
+  PC   = registers->pc;
+  I    = registers->i;
+  R    = registers->r;
+  IM   = registers->im;
+  IFF1 = registers->iff1;
+  IFF2 = registers->iff2;
+
+  /* Pending resets and NMIs belong to the state we just replaced. */
+  self.requests &= ~(CPU_REQUEST_RESET | CPU_REQUEST_NMI);
+  self.irq_delay = 0;
+}
+
+
+/* Writes only the given CPU_REGISTER_* registers, e.g. those a trap returns. */
+void cpu_registers_update(const cpu_registers_t* registers, u32_t which) {
+  if (which & CPU_REGISTER_AF) AF = registers->af;
+  if (which & CPU_REGISTER_BC) BC = registers->bc;
+  if (which & CPU_REGISTER_DE) DE = registers->de;
+  if (which & CPU_REGISTER_HL) HL = registers->hl;
+  if (which & CPU_REGISTER_IX) IX = registers->ix;
+  if (which & CPU_REGISTER_SP) SP = registers->sp;
+  if (which & CPU_REGISTER_PC) PC = registers->pc;
+}
@@ -17,6 +17,38 @@ typedef enum {
 } cpu_nmi_t;
 
 
+/* Register file, used to load and save machine state. */
+typedef struct {
+  u16_t af;
+  u16_t bc;
+  u16_t de;
+  u16_t hl;
+  u16_t af_;
+  u16_t bc_;
+  u16_t de_;
+  u16_t hl_;
+  u16_t ix;
+  u16_t iy;
+  u16_t sp;
+  u16_t pc;
+  u8_t  i;
+  u8_t  r;
+  u8_t  im;
+  int   iff1;
+  int   iff2;
+} cpu_registers_t;
+
+
+/* Registers for cpu_registers_update(), as traps return them. */
+#define CPU_REGISTER_AF  0x0001
+#define CPU_REGISTER_BC  0x0002
+#define CPU_REGISTER_DE  0x0004
+#define CPU_REGISTER_HL  0x0008
+#define CPU_REGISTER_IX  0x0010
+#define CPU_REGISTER_SP  0x0020
+#define CPU_REGISTER_PC  0x0040
+
+
 int   cpu_init(void);
 void  cpu_finit(void);
 void  cpu_step(void);
@@ -24,6 +56,9 @@ void  cpu_reset(void);
 void  cpu_irq(cpu_irq_t irq, int active);
 void  cpu_nmi(cpu_nmi_t nmi);
 u16_t cpu_pc_get(void);
+void  cpu_registers_get(cpu_registers_t* registers);
+void  cpu_registers_set(const cpu_registers_t* registers);
+void  cpu_registers_update(const cpu_registers_t* registers, u32_t which);
 
 
 #endif  /* __CPU_H */
@@ -1,6 +1,10 @@
+#include <string.h>
 #include "defs.h"
+#include "divmmc.h"
 #include "log.h"
 #include "memory.h"
+#include "mmu.h"
+#include "rom.h"
 #include "utils.h"
 
 
@@ -15,11 +19,29 @@
 #define BANK_NUMBER(value)     ((value) & 0x0F)
 
 
+/* What an opcode fetch from a trapped address does to the automap. */
+#define TRAP_INSTANT  0x01
+#define TRAP_DELAYED  0x02
+#define TRAP_UNMAP    0x04
+
+
+/* Indices into the NEXTREG $B8-$BB entry point registers. */
+#define ENTRY_POINTS_0        0
+#define ENTRY_POINTS_VALID_0  1
+#define ENTRY_POINTS_TIMING_0 2
+#define ENTRY_POINTS_1        3
+
+
 typedef struct {
   u8_t* sram;
   u8_t* rom;
   u8_t* ram;
   u8_t  value;
+  int   is_automap_enabled;
+  int   is_automapped;
+  int   is_nmi_button_pressed;
+  u8_t  entry_points[4];
+  u8_t  traps[DIVMMC_TRAPS_SIZE];
 } divmmc_t;
 
 
@@ -49,8 +71,180 @@ void divmmc_finit(void) {
 }
 
 
+/**
+ * Only an opcode fetch from an address with its bit set in this bitmap can
+ * change the automap state. Whether it actually does so, depends on which ROM
+ * is paged in and whether the NMI button was pressed, which we only check
+ * when the bit is set.
+ */
+static void divmmc_traps_rebuild(void) {
+  const u8_t entry_points_1 = self.entry_points[ENTRY_POINTS_1];
+  const u16_t addresses[5]  = {0x0066, 0x04C6, 0x0562, 0x04D7, 0x056A};
+  const u8_t  masks[5]      = {0x03,   0x04,   0x08,   0x10,   0x20};
+  u16_t       address;
+  int         i;
+
+  memset(self.traps, 0, sizeof(self.traps));
+
+  if (!self.is_automap_enabled) {
+    return;
+  }
+
+  for (i = 0; i < 8; i++) {
+    if (self.entry_points[ENTRY_POINTS_0] & (1 << i)) {
+      address = i * 8;
+      self.traps[address >> 3] |= 1 << (address & 7);
+    }
+  }
+
+  for (i = 0; i < 5; i++) {
+    if (entry_points_1 & masks[i]) {
+      address = addresses[i];
+      self.traps[address >> 3] |= 1 << (address & 7);
+    }
+  }
+
+  if (entry_points_1 & 0x80) {
+    memset(&self.traps[0x3D00 >> 3], 0xFF, 0x100 >> 3);
+  }
+
+  if (entry_points_1 & 0x40) {
+    self.traps[0x1FF8 >> 3] = 0xFF;
+  }
+}
+
+
+static void divmmc_automap_set(int automap) {
+  if (automap != self.is_automapped) {
+    self.is_automapped = automap;
+    memory_refresh_accessors(0, 2);
+  }
+}
+
+
+void divmmc_reset(reset_t reset) {
+  /**
+   * https://gitlab.com/SpectrumNext/ZX_Spectrum_Next_FPGA/-/raw/master/cores/zxnext/nextreg.txt
+   *
+   * Soft reset values of NEXTREG $B8-$BB.
+   */
+  self.entry_points[ENTRY_POINTS_0]        = 0x83;
+  self.entry_points[ENTRY_POINTS_VALID_0]  = 0x01;
+  self.entry_points[ENTRY_POINTS_TIMING_0] = 0x00;
+  self.entry_points[ENTRY_POINTS_1]        = 0xCD;
+
+  if (reset == E_RESET_HARD) {
+    /* NEXTREG $0A bit 4. */
+    self.is_automap_enabled = 0;
+  }
+
+  self.is_nmi_button_pressed = 0;
+  divmmc_automap_set(0);
+  divmmc_traps_rebuild();
+}
+
+
+const u8_t* divmmc_traps(void) {
+  return self.traps;
+}
+
+
+void divmmc_automap_enable(int enable) {
+  if (enable != self.is_automap_enabled) {
+    self.is_automap_enabled = enable;
+    if (!enable) {
+      divmmc_automap_set(0);
+    }
+    divmmc_traps_rebuild();
+  }
+}
+
+
+u8_t divmmc_entry_points_read(int index) {
+  return self.entry_points[index];
+}
+
+
+void divmmc_entry_points_write(int index, u8_t value) {
+  self.entry_points[index] = value;
+  divmmc_traps_rebuild();
+}
+
+
+void divmmc_nmi_button_press(void) {
+  self.is_nmi_button_pressed = 1;
+}
+
+
+void divmmc_retn(void) {
+  self.is_nmi_button_pressed = 0;
+  divmmc_automap_set(0);
+}
+
+
+static int divmmc_rom3_is_paged_in(void) {
+  return mmu_page_get(0) == MMU_ROM_PAGE && rom_active() == E_ROM_48K_BASIC;
+}
+
+
+static u8_t divmmc_trap_lookup(u16_t address) {
+  const u8_t entry_points_1 = self.entry_points[ENTRY_POINTS_1];
+
+  if (address <= 0x0038 && (address & 0x07) == 0) {
+    const u8_t bit = 1 << (address >> 3);
+
+    if (!(self.entry_points[ENTRY_POINTS_VALID_0] & bit) && !divmmc_rom3_is_paged_in()) {
+      return 0;
+    }
+    return (self.entry_points[ENTRY_POINTS_TIMING_0] & bit) ? TRAP_INSTANT : TRAP_DELAYED;
+  }
+
+  if (address >= 0x1FF8 && address <= 0x1FFF) {
+    return TRAP_UNMAP;
+  }
+
+  if (address == 0x0066) {
+    if (!self.is_nmi_button_pressed) {
+      return 0;
+    }
+    return (entry_points_1 & 0x02) ? TRAP_INSTANT : TRAP_DELAYED;
+  }
+
+  if (!divmmc_rom3_is_paged_in()) {
+    return 0;
+  }
+
+  return ((address & 0xFF00) == 0x3D00) ? TRAP_INSTANT : TRAP_DELAYED;
+}
+
+
+/**
+ * Called for opcode fetches from addresses in the trap bitmap. An instant
+ * entry point maps in DivMMC memory for the fetch itself, a delayed one only
+ * after it.
+ */
+u8_t divmmc_fetch(u16_t address) {
+  const u8_t trap = divmmc_trap_lookup(address);
+  u8_t       opcode;
+
+  if (trap & TRAP_INSTANT) {
+    divmmc_automap_set(1);
+  }
+
+  opcode = memory_read(address);
+
+  if (trap & TRAP_DELAYED) {
+    divmmc_automap_set(1);
+  } else if (trap & TRAP_UNMAP) {
+    divmmc_automap_set(0);
+  }
+
+  return opcode;
+}
+
+
 int divmmc_is_active(void) {
-  return CONMEM_ENABLED(self.value);
+  return CONMEM_ENABLED(self.value) || self.is_automapped;
 }
 
 
@@ -5,15 +5,27 @@
 #include "defs.h"
 
 
-int  divmmc_init(u8_t* sram);
-void divmmc_finit(void);
-int  divmmc_is_active(void);
-u8_t divmmc_ram_read(u16_t address);
-void divmmc_ram_write(u16_t address, u8_t value);
-u8_t divmmc_rom_read(u16_t address);
-void divmmc_rom_write(u16_t address, u8_t value);
-u8_t divmmc_control_read(u16_t address); 
-void divmmc_control_write(u16_t address, u8_t value);
+/* One bit per address in the lower 16K. */
+#define DIVMMC_TRAPS_SIZE  (0x4000 / 8)
+
+
+int         divmmc_init(u8_t* sram);
+void        divmmc_finit(void);
+void        divmmc_reset(reset_t reset);
+int         divmmc_is_active(void);
+const u8_t* divmmc_traps(void);
+u8_t        divmmc_fetch(u16_t address);
+void        divmmc_automap_enable(int enable);
+u8_t        divmmc_entry_points_read(int index);
+void        divmmc_entry_points_write(int index, u8_t value);
+void        divmmc_nmi_button_press(void);
+void        divmmc_retn(void);
+u8_t        divmmc_ram_read(u16_t address);
+void        divmmc_ram_write(u16_t address, u8_t value);
+u8_t        divmmc_rom_read(u16_t address);
+void        divmmc_rom_write(u16_t address, u8_t value);
+u8_t        divmmc_control_read(u16_t address); 
+void        divmmc_control_write(u16_t address, u8_t value);
 
 
 #endif  /* __DIVMMC_H */
@@ -5,6 +5,7 @@
 #include "io.h"
 #include "log.h"
 #include "memory.h"
+#include "timeline.h"
 
 
 /**
@@ -70,6 +71,8 @@ typedef struct {
   int    do_restart;
   u64_t  next_transfer_ticks;
   u8_t   read_bit;
+  u64_t  burst_start_ticks;
+  u16_t  burst_n_bytes;  /* Transferred so far in burst mode, for the timeline. */
 
   int   is_a_to_b;
   u16_t src_address;
@@ -108,6 +111,16 @@ void dma_reset(reset_t reset) {
   self.zxn_prescalar       = 0;
   self.do_restart          = 0;
   self.next_transfer_ticks = 0;
+  self.burst_n_bytes       = 0;
+}
+
+
+/* Records the bytes transferred in burst mode so far as one span. */
+static void dma_burst_end(void) {
+  if (self.burst_n_bytes > 0) {
+    timeline_span(E_TIMELINE_EVENT_DMA, self.burst_start_ticks, self.burst_n_bytes, 0, 0);
+    self.burst_n_bytes = 0;
+  }
 }
 
 
@@ -371,6 +384,7 @@ static void dma_group_6_write(u8_t value, int is_first_write) {
     switch (value) {
       case E_DMA_CMD_RESET:
         self.is_enabled = 0;
+        dma_burst_end();
         break;
 
       case E_DMA_CMD_RESET_PORT_A_TIMING:
@@ -395,6 +409,7 @@ static void dma_group_6_write(u8_t value, int is_first_write) {
 
       case E_DMA_CMD_DISABLE_DMA:
         self.is_enabled = 0;
+        dma_burst_end();
         break;
 
       case E_DMA_CMD_LOAD:
@@ -526,17 +541,25 @@ static void transfer_one_byte(void) {
 
 
 void dma_run(void) {
+  u64_t start_ticks;
+  u16_t n_bytes;
   u64_t now;
 
   if (!self.is_enabled) {
     return;
   }
 
+  start_ticks = clock_ticks();
+  n_bytes     = self.n_bytes_transferred;
+
   switch (self.mode) {
     case E_MODE_BURST:
       if (self.zxn_prescalar != 0 && clock_ticks() < self.next_transfer_ticks) {
         return;
       }
+      if (self.burst_n_bytes++ == 0) {
+        self.burst_start_ticks = start_ticks;
+      }
       transfer_one_byte();
       break;
 
@@ -557,7 +580,14 @@ void dma_run(void) {
       return;
   }
 
+  if (self.mode != E_MODE_BURST) {
+    timeline_span(E_TIMELINE_EVENT_DMA, start_ticks, self.n_bytes_transferred - n_bytes, 0, 0);
+  }
+
   if (self.n_bytes_transferred == self.block_length) {
+    /* A burst ends with its block. */
+    dma_burst_end();
+
     if (self.do_restart) {
       block_reload();
       self.n_blocks_transferred++;
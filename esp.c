@@ -1,8 +1,13 @@
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_net.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "buffer.h"
 #include "defs.h"
 #include "esp.h"
@@ -12,8 +17,17 @@
 #define MAX_AT_PREFIX_LENGTH    20
 #define MAX_PACKET_LENGTH     2048
 
+/* Room for "+IPD,<id>,<length>:" in front of a packet. */
+#define MAX_IPD_HEADER_LENGTH   24
+
+/* The RX ring takes a whole +IPD frame, and then some. */
 #define TX_SIZE  MAX_PACKET_LENGTH
-#define RX_SIZE  MAX_PACKET_LENGTH
+#define RX_SIZE  (2 * MAX_PACKET_LENGTH)
+
+#define RX_WAIT_MS  1000
+
+/* AT+CIPMUX=1 allows link IDs 0 to 4, with 5 meaning all in AT+CIPCLOSE. */
+#define N_LINKS     5
 
 #define CR       '\r'
 #define LF       '\n'
@@ -28,11 +42,25 @@ static void idle_tx(void);
 static void send_tx(void);
 
 
+typedef enum {
+  E_LINK_NONE = 0,
+  E_LINK_TCP,
+  E_LINK_UDP
+} link_type_t;
+
+
+/* UDP sockets are connected, so both kinds are read and written alike. */
+typedef struct {
+  link_type_t type;
+  int         fd;
+} link_t;
+
+
 typedef struct {
   buffer_t     tx;
   buffer_t     rx;
+  SDL_mutex*   rx_mutex;  /* Both threads write to the RX ring, one at a time. */
   u8_t*        rx_temp;
-  size_t       rx_temp_index;
   tx_handler_t tx_handler;
 
   u32_t        baudrate;
@@ -41,15 +69,15 @@ typedef struct {
   int          use_odd_parity;
   int          use_two_stop_bits;
   int          do_echo;
+  int          is_mux;
 
-  SDLNet_SocketSet socket_set;
-
-  TCPsocket    socket;
-  SDL_mutex*   socket_mutex;
-  SDL_cond*    socket_changed;
+  link_t       links[N_LINKS];
+  SDL_mutex*   links_mutex;
+  int          wake[2];  /* Pipe to wake up the I/O thread when links change. */
 
+  int          send_link;
   size_t       length;
-  SDL_Thread*  rx_thread;
+  SDL_Thread*  io_thread;
   int          do_finit;
 } esp_t;
 
@@ -57,22 +85,42 @@ typedef struct {
 static esp_t self;
 
 
-#define HEADER       "+IPD,0000:"
-#define HEADER_SIZE  10
+/**
+ * Hands a response from the emulation thread to the UART. That thread is
+ * also the one emptying the RX ring, so it cannot wait for room: whatever
+ * does not fit is dropped, like a real UART overrun.
+ */
+static void respond_n(const u8_t* response, size_t length) {
+  size_t n;
 
+  SDL_LockMutex(self.rx_mutex);
+  n = buffer_write_n(&self.rx, length, response);
+  SDL_UnlockMutex(self.rx_mutex);
+
+  if (n < length) {
+    log_wrn("esp: RX overrun, dropped %lu bytes\n", length - n);
+  }
+}
 
-static void respond_n(const u8_t* response, size_t length) {
-  size_t i;
 
-  for (i = 0; (i < length) && !self.do_finit; i++) {
-    SDL_LockMutex(self.rx.mutex);
-    while (self.rx.n_elements == self.rx.size && !self.do_finit) {
-      SDL_CondWaitTimeout(self.rx.element_removed, self.rx.mutex, 1000);
+/**
+ * Hands a whole response from the I/O thread to the UART, waiting outside
+ * the lock until the ring has room for all of it.
+ */
+static void io_respond_n(const u8_t* response, size_t length) {
+  size_t n = 0;
+
+  while (n == 0 && !self.do_finit) {
+    if (!buffer_wait_for_space(&self.rx, length, RX_WAIT_MS)) {
+      continue;
     }
-    if (!self.do_finit) {
-      buffer_write(&self.rx, response[i]);
+
+    /* The emulation thread may have responded in the meantime. */
+    SDL_LockMutex(self.rx_mutex);
+    if (self.rx.size - buffer_n_elements(&self.rx) >= length) {
+      n = buffer_write_n(&self.rx, length, response);
     }
-    SDL_UnlockMutex(self.rx.mutex);
+    SDL_UnlockMutex(self.rx_mutex);
   }
 }
 
@@ -92,65 +140,118 @@ static void error(void) {
 }
 
 
-static void copy_to_rx(size_t n) {
-  /* Patch size. */
-  snprintf((char *) &self.rx_temp[5], 4 + 1, "%04lu", n);
-  self.rx_temp[HEADER_SIZE - 1] = ':';
+/* Responses about a link are prefixed with its ID in multiple connection mode. */
+static int link_response(char* s, size_t size, int id, const char* response) {
+  if (self.is_mux) {
+    return snprintf(s, size, "%d,%s" CRLF, id, response);
+  }
+  return snprintf(s, size, "%s" CRLF, response);
+}
+
+
+static void respond_link(int id, const char* response) {
+  char s[16];
+
+  (void) link_response(s, sizeof(s), id, response);
+  respond(s);
+}
+
+
+static void wake_io_thread(void) {
+  const u8_t value = 0;
 
-  /* Copy data to rx buffer. */
-  respond_n(self.rx_temp, HEADER_SIZE + n);
+  (void) write(self.wake[1], &value, 1);
 }
 
 
-static int rx_thread(void *ptr) {
-  TCPsocket socket;
-  size_t    i;
+/* Must be called with the links mutex locked. */
+static void link_close(int id) {
+  if (self.links[id].type != E_LINK_NONE) {
+    close(self.links[id].fd);
+    self.links[id].type = E_LINK_NONE;
+    self.links[id].fd   = -1;
+  }
+}
 
-  /* Prepend the header. */
-  snprintf((char *) self.rx_temp, HEADER_SIZE, "%s", HEADER);
+
+/**
+ * Waits for data on any link with poll(), and hands each chunk received to
+ * the UART as one +IPD frame. Links are only looked at with the mutex held,
+ * so that a link closed in the meantime is never read from. Data is received
+ * just after room for the header, so that the frame goes out in one write.
+ */
+static int io_thread(void *ptr) {
+  struct pollfd fds[1 + N_LINKS];
+  int           ids[1 + N_LINKS];
+  char          header[MAX_IPD_HEADER_LENGTH];
+  u8_t*         data = &self.rx_temp[MAX_IPD_HEADER_LENGTH];
+  int           header_length;
+  u8_t          value;
+  nfds_t        n_fds;
+  ssize_t       n;
+  int           is_closed;
+  int           id;
+  nfds_t        i;
 
   while (!self.do_finit) {
+    fds[0].fd     = self.wake[0];
+    fds[0].events = POLLIN;
+    n_fds         = 1;
+
+    SDL_LockMutex(self.links_mutex);
+    for (id = 0; id < N_LINKS; id++) {
+      if (self.links[id].type != E_LINK_NONE) {
+        fds[n_fds].fd     = self.links[id].fd;
+        fds[n_fds].events = POLLIN;
+        ids[n_fds]        = id;
+        n_fds++;
+      }
+    }
+    SDL_UnlockMutex(self.links_mutex);
+
+    if (poll(fds, n_fds, RX_WAIT_MS) <= 0) {
+      continue;
+    }
 
-    /* Wait until we have a socket. */
-    SDL_LockMutex(self.socket_mutex);
-    while (self.socket == NULL && !self.do_finit) {
-      SDL_CondWaitTimeout(self.socket_changed, self.socket_mutex, 1000);
+    if (fds[0].revents & POLLIN) {
+      while (read(self.wake[0], &value, 1) == 1);
     }
-    socket = self.socket;
-    SDL_UnlockMutex(self.socket_mutex);
 
-    i = HEADER_SIZE;
+    for (i = 1; i < n_fds && !self.do_finit; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
 
-    while (!self.do_finit) {
-      /* Wait until there is activity. */
-      const int result = SDLNet_CheckSockets(self.socket_set, 20);
+      id = ids[i];
 
-      if (result == 0) {
-        /* Timeout: copy to rx what we have. */
-        const size_t n = i - HEADER_SIZE;
-        if (n > 0) {
-          copy_to_rx(n);
-          i = HEADER_SIZE;
-        }
-      } else if (result == 1) {
-        /* Our socket should be ready. */
-        if (!SDLNet_SocketReady(socket)) {
-          break;
-        }
+      SDL_LockMutex(self.links_mutex);
+      if (self.links[id].type == E_LINK_NONE || self.links[id].fd != fds[i].fd) {
+        /* Closed, or even reopened, while we were waiting. */
+        SDL_UnlockMutex(self.links_mutex);
+        continue;
+      }
+      n = recv(self.links[id].fd, data, MAX_PACKET_LENGTH, MSG_DONTWAIT);
 
-        if (SDLNet_TCP_Recv(socket, &self.rx_temp[i], 1) != 1) {
-          break;
-        }
-        
-        if (++i == RX_SIZE) {
-          /* Buffer full: copy to rx what we have. */
-          const size_t n = i - HEADER_SIZE;
-          copy_to_rx(n);
-          i = HEADER_SIZE;
+      /* A UDP error is only an ICMP message about an earlier datagram. */
+      is_closed = (n == 0 && self.links[id].type == E_LINK_TCP)
+               || (n < 0 && self.links[id].type == E_LINK_TCP && errno != EAGAIN && errno != EINTR);
+      if (is_closed) {
+        link_close(id);
+      }
+      SDL_UnlockMutex(self.links_mutex);
+
+      if (n > 0) {
+        if (self.is_mux) {
+          header_length = snprintf(header, sizeof(header), "+IPD,%d,%d:", id, (int) n);
+        } else {
+          header_length = snprintf(header, sizeof(header), "+IPD,%d:", (int) n);
         }
-      } else {
-        /* Error */
-        break;
+        memcpy(data - header_length, header, header_length);
+        io_respond_n(data - header_length, header_length + n);
+      } else if (is_closed) {
+        /* Closed by the other end. */
+        header_length = link_response(header, sizeof(header), id, "CLOSED");
+        io_respond_n((const u8_t *) header, header_length);
       }
     }
   }
@@ -160,8 +261,15 @@ static int rx_thread(void *ptr) {
 
 
 int esp_init(void) {
-  self.socket   = NULL;
+  int id;
+
   self.do_finit = 0;
+  self.is_mux   = 0;
+
+  for (id = 0; id < N_LINKS; id++) {
+    self.links[id].type = E_LINK_NONE;
+    self.links[id].fd   = -1;
+  }
 
   if (buffer_init(&self.rx, RX_SIZE) != 0) {
     goto exit;
@@ -171,28 +279,29 @@ int esp_init(void) {
     goto exit_rx;
   }   
 
-  self.socket_set = SDLNet_AllocSocketSet(1);
-  if (self.socket_set == NULL) {
+  self.rx_mutex = SDL_CreateMutex();
+  if (self.rx_mutex == NULL) {
     goto exit_tx;
   }
 
-  self.socket_changed = SDL_CreateCond();
-  if (self.socket_changed == NULL) {
-    goto exit_socket_set;
+  self.links_mutex = SDL_CreateMutex();
+  if (self.links_mutex == NULL) {
+    goto exit_rx_mutex;
   }
-  
-  self.socket_mutex = SDL_CreateMutex();
-  if (self.socket_mutex == NULL) {
-    goto exit_socket_changed;
+
+  if (pipe(self.wake) != 0) {
+    goto exit_links_mutex;
   }
+  (void) fcntl(self.wake[0], F_SETFL, O_NONBLOCK);
+  (void) fcntl(self.wake[1], F_SETFL, O_NONBLOCK);
 
-  self.rx_temp = malloc(RX_SIZE + 1);
+  self.rx_temp = malloc(MAX_IPD_HEADER_LENGTH + MAX_PACKET_LENGTH);
   if (self.rx_temp == NULL) {
-    goto exit_socket_mutex;
+    goto exit_wake;
   }
   
-  self.rx_thread = SDL_CreateThread(rx_thread, "rx_thread", NULL);
-  if (self.rx_thread == NULL) {
+  self.io_thread = SDL_CreateThread(io_thread, "esp_io_thread", NULL);
+  if (self.io_thread == NULL) {
     goto exit_rx_temp;
   }
 
@@ -200,51 +309,52 @@ int esp_init(void) {
 
   return 0;
 
-exit_rx:
-  buffer_finit(&self.rx);
-exit_tx:
-  buffer_finit(&self.tx);
-exit_socket_set:
-  SDLNet_FreeSocketSet(self.socket_set);
-exit_socket_changed:
-  SDL_DestroyCond(self.socket_changed);
-exit_socket_mutex:
-  SDL_DestroyMutex(self.socket_mutex);
 exit_rx_temp:
   free(self.rx_temp);
+exit_wake:
+  close(self.wake[0]);
+  close(self.wake[1]);
+exit_links_mutex:
+  SDL_DestroyMutex(self.links_mutex);
+exit_rx_mutex:
+  SDL_DestroyMutex(self.rx_mutex);
+exit_tx:
+  buffer_finit(&self.tx);
+exit_rx:
+  buffer_finit(&self.rx);
 exit:
   log_err("esp: out of memory\n");
   return 1;
 }
 
 
-static void close_socket(void) {
-  SDL_LockMutex(self.socket_mutex);
-
-  SDLNet_TCP_Close(self.socket);
-  SDLNet_TCP_DelSocket(self.socket_set, self.socket);
+static void close_links(void) {
+  int id;
 
-  self.socket = NULL;
+  SDL_LockMutex(self.links_mutex);
+  for (id = 0; id < N_LINKS; id++) {
+    link_close(id);
+  }
+  SDL_UnlockMutex(self.links_mutex);
 
-  SDL_CondSignal(self.socket_changed);
-  SDL_UnlockMutex(self.socket_mutex);
+  wake_io_thread();
 }
 
 
 void esp_finit(void) {
   self.do_finit = 1;
+  wake_io_thread();
 
-  if (self.socket) {
-    close_socket();
-  }
+  SDL_WaitThread(self.io_thread, NULL);
 
-  SDL_WaitThread(self.rx_thread, NULL);
+  close_links();
 
   buffer_finit(&self.rx);
   buffer_finit(&self.tx);
-  SDLNet_FreeSocketSet(self.socket_set);
-  SDL_DestroyCond(self.socket_changed);
-  SDL_DestroyMutex(self.socket_mutex);
+  SDL_DestroyMutex(self.rx_mutex);
+  SDL_DestroyMutex(self.links_mutex);
+  close(self.wake[0]);
+  close(self.wake[1]);
   free(self.rx_temp);
 }
 
@@ -317,100 +427,244 @@ static void at_uart_cur(void) {
 }
 
 
+/* Reads a decimal number, leaving whatever follows it in the buffer. */
+static int read_number(u32_t* number) {
+  u8_t   value;
+  size_t n_digits = 0;
+
+  *number = 0;
+  while (buffer_peek_n(&self.tx, 0, 1, &value) && isdigit(value) && n_digits < 9) {
+    (void) buffer_read_n(&self.tx, 1, NULL);
+    *number = *number * 10 + value - '0';
+    n_digits++;
+  }
+
+  return n_digits > 0 ? 0 : -1;
+}
+
+
+static int read_expected(char expected) {
+  u8_t value;
+
+  return (buffer_read_n(&self.tx, 1, &value) && value == expected) ? 0 : -1;
+}
+
+
+/* Reads a string between speech marks. */
+static int read_string(char* string, size_t size) {
+  size_t i;
+
+  if (read_expected('"') != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < size && buffer_read_n(&self.tx, 1, (u8_t *) &string[i]); i++) {
+    if (string[i] == '"') {
+      string[i] = '\0';
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+
+/* In multiple connection mode, commands start with "<id>,". */
+static int read_link_id(int* id) {
+  u32_t number;
+
+  if (!self.is_mux) {
+    *id = 0;
+    return 0;
+  }
+
+  if (read_number(&number) != 0 || number >= N_LINKS || read_expected(',') != 0) {
+    return -1;
+  }
+
+  *id = number;
+  return 0;
+}
+
+
 /**
- * AT+CIPSTART="TCP","<host>",<port>[<keepalive>]
+ * Connects on the emulation thread, like before, as the ESP doesn't respond
+ * until it has connected either.
  */
-static void at_cipstart(void) {
-  u8_t      host[80 + 1];
-  u8_t      port[5 + 1];
-  u8_t      s[8];
-  size_t    i;
-  IPaddress ip;
+static int link_open(int id, link_type_t type, const char* host, u32_t port) {
+  struct addrinfo  hints;
+  struct addrinfo* addresses;
+  char             service[5 + 1];
+  int              fd;
 
-  if (buffer_read_n(&self.tx, sizeof(s), s) != sizeof(s)) {
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = (type == E_LINK_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+    return -1;
+  }
+
+  fd = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+  if (fd == -1) {
+    freeaddrinfo(addresses);
+    return -1;
+  }
+
+  if (connect(fd, addresses->ai_addr, addresses->ai_addrlen) != 0) {
+    freeaddrinfo(addresses);
+    close(fd);
+    return -1;
+  }
+  freeaddrinfo(addresses);
+
+  SDL_LockMutex(self.links_mutex);
+  self.links[id].type = type;
+  self.links[id].fd   = fd;
+  SDL_UnlockMutex(self.links_mutex);
+
+  wake_io_thread();
+
+  return 0;
+}
+
+
+/**
+ * AT+CIPMUX?
+ * AT+CIPMUX=<mode>
+ */
+static void at_cipmux(void) {
+  char  response[16];
+  u8_t  value;
+  u32_t mode;
+  int   id;
+
+  if (!buffer_read_n(&self.tx, 1, &value)) {
     error();
     return;
   }
 
-  if (strncmp((const char *) s, "=\"TCP\",\"", sizeof(s)) != 0) {
-    error();
+  if (value == '?') {
+    snprintf(response, sizeof(response), "+CIPMUX:%d" CRLF, self.is_mux);
+    respond(response);
+    ok();
     return;
   }
 
-  /* Read hostname or IP address until speech marks. */
-  memset(host, 0, sizeof(host));
-  for (i = 0; (i < sizeof(host)) && buffer_read_n(&self.tx, 1, &host[i]) && host[i] != '"'; i++);
-  if (i == sizeof(host)) {
+  if (value != '=' || read_number(&mode) != 0 || mode > 1) {
     error();
     return;
   }
-  if (host[i] != '"') {
+
+  /* Can only be changed without any connections. */
+  for (id = 0; id < N_LINKS; id++) {
+    if (self.links[id].type != E_LINK_NONE) {
+      respond("link is builded" CRLF);
+      error();
+      return;
+    }
+  }
+
+  self.is_mux = mode;
+  ok();
+}
+
+
+/**
+ * AT+CIPSTART="<type>","<host>",<port>[,...]
+ * AT+CIPSTART=<id>,"<type>","<host>",<port>[,...]
+ *
+ * Where type is "TCP" or "UDP". Any trailing keep-alive, local port or UDP
+ * mode is ignored.
+ */
+static void at_cipstart(void) {
+  char        type[3 + 1];
+  char        host[80 + 1];
+  u32_t       port;
+  link_type_t link_type;
+  int         id;
+
+  if (read_expected('=') != 0 || read_link_id(&id) != 0) {
     error();
     return;
   }
-  host[i] = 0;
 
-  /* Skip ",". */
-  if (!buffer_read_n(&self.tx, 1, s)) {
+  if (read_string(type, sizeof(type)) != 0 || read_expected(',') != 0) {
     error();
     return;
   }
-  if (s[0] != ',') {
+
+  if (strcmp(type, "TCP") == 0) {
+    link_type = E_LINK_TCP;
+  } else if (strcmp(type, "UDP") == 0) {
+    link_type = E_LINK_UDP;
+  } else {
     error();
     return;
   }
 
-  /* Read numeric port. */
-  memset(port, 0, sizeof(port));
-  for (i = 0; (i < sizeof(port) - 1) && buffer_read_n(&self.tx, 1, &port[i]) && isdigit(port[i]); i++);
-  if (i == sizeof(port) - 1) {
+  if (read_string(host, sizeof(host)) != 0 || read_expected(',') != 0) {
     error();
     return;
   }
-  port[i] = 0;
 
-  if (self.socket) {
-    respond("ALREADY CONNECTED" CRLF);
+  if (read_number(&port) != 0 || port > 65535) {
+    error();
     return;
   }
 
-  if (SDLNet_ResolveHost(&ip, (const char *) host, atoi((const char *) port)) != 0) {
+  if (self.links[id].type != E_LINK_NONE) {
+    respond("ALREADY CONNECTED" CRLF);
     error();
     return;
   }
 
-  SDL_LockMutex(self.socket_mutex);
-
-  self.socket = SDLNet_TCP_Open(&ip);
-  if (!self.socket) {
-    SDL_UnlockMutex(self.socket_mutex);
+  if (link_open(id, link_type, host, port) != 0) {
     error();
     return;
   }
-  SDLNet_TCP_AddSocket(self.socket_set, self.socket);
-
-  SDL_CondSignal(self.socket_changed);
-  SDL_UnlockMutex(self.socket_mutex);
 
+  respond_link(id, "CONNECT");
   ok();
 }
 
 
 /**
  * AT+CIPCLOSE
+ * AT+CIPCLOSE=<id>
+ *
+ * Where an id of 5 closes all links.
  */
 static void at_cipclose(void) {
-  if (self.socket) {
-    close_socket();
-    respond("CLOSED" CRLF);
+  u8_t  value;
+  u32_t id = 0;
+  int   i;
+
+  if (self.is_mux) {
+    if (!buffer_read_n(&self.tx, 1, &value) || value != '=' || read_number(&id) != 0 || id > N_LINKS) {
+      error();
+      return;
+    }
+  }
+
+  for (i = 0; i < N_LINKS; i++) {
+    if (((u32_t) i == id || id == N_LINKS) && self.links[i].type != E_LINK_NONE) {
+      SDL_LockMutex(self.links_mutex);
+      link_close(i);
+      SDL_UnlockMutex(self.links_mutex);
+      respond_link(i, "CLOSED");
+    }
   }
 
+  wake_io_thread();
   ok();
 }
 
 
 static void send_tx(void) {
   u8_t packet[MAX_PACKET_LENGTH];
+  int  is_sent;
 
   /* Wait for the packet. */
   if (buffer_peek_n(&self.tx, 0, self.length, packet) != self.length) {
@@ -419,24 +673,25 @@ static void send_tx(void) {
 
   (void) buffer_read_n(&self.tx, self.length, NULL);
 
-  if (SDLNet_TCP_Send(self.socket, packet, self.length) < self.length) {
-    respond("SEND FAIL" CRLF);
-  } else {
-    respond("SEND OK" CRLF);
-  }
+  SDL_LockMutex(self.links_mutex);
+  is_sent = self.links[self.send_link].type != E_LINK_NONE
+         && send(self.links[self.send_link].fd, packet, self.length, MSG_NOSIGNAL) == (ssize_t) self.length;
+  SDL_UnlockMutex(self.links_mutex);
+
+  respond(is_sent ? "SEND OK" CRLF : "SEND FAIL" CRLF);
 
   self.tx_handler = idle_tx;
 }
 
 
 /**
- * AT+CIPSEND
  * AT+CIPSEND=<length>
+ * AT+CIPSEND=<id>,<length>
  */
 static void at_cipsend(void) {
-  u8_t   length[4 + 1];  /* Max 2048. */
-  u8_t   value;
-  size_t i;
+  u8_t  value;
+  u32_t length;
+  int   id;
 
   (void) buffer_peek_n(&self.tx, 0, 1, &value);
   switch (value) {
@@ -444,20 +699,17 @@ static void at_cipsend(void) {
       /* Normal transmission mode. */
       (void) buffer_read_n(&self.tx, 1, NULL);
  
-      /* Read length. */
-      memset(length, 0, sizeof(length));
-      while (buffer_read_n(&self.tx, 1, &length[0]) && length[0] == '0');
-      for (i = 1; (i < sizeof(length) - 1) && buffer_read_n(&self.tx, 1, &length[i]) && isdigit(length[i]); i++);
-      if (i == sizeof(length) - 1) {
+      if (read_link_id(&id) != 0 || read_number(&length) != 0 || length > MAX_PACKET_LENGTH) {
         error();
         return;
       }
-      length[i] = 0;
-      self.length = atoi((const char *) length);
-      if (self.length > MAX_PACKET_LENGTH) {
+      if (self.links[id].type == E_LINK_NONE) {
+        respond("link is not valid" CRLF);
         error();
         return;
       }
+      self.send_link = id;
+      self.length    = length;
       respond(">");
       break;
 
@@ -485,7 +737,7 @@ static void at(void) {
     { "E1",        at_echo_on  },
     { "+UART_CUR", at_uart_cur },
     { "+CIPCLOSE", at_cipclose },
-    { "+CIPMUX",   ok          },
+    { "+CIPMUX",   at_cipmux   },
     { "+CIPSTART", at_cipstart },
     { "+CIPSEND",  at_cipsend  },
     { "",          ok          }
@@ -519,25 +771,22 @@ static void at(void) {
 
 
 static void idle_tx(void) {
-  u8_t prefix[2] = { 0, 0 };
+  const size_t n_elements = buffer_n_elements(&self.tx);
+  u8_t         prefix[2]  = { 0, 0 };
 
   /* Wait for carriage return. */
-  if (self.tx.n_elements < 2) {
+  if (n_elements < 2) {
     return;
   }
-  (void) buffer_peek_n(&self.tx, self.tx.n_elements - 2, 2, prefix);
+  (void) buffer_peek_n(&self.tx, n_elements - 2, 2, prefix);
   if (strncmp((const char *) prefix, CRLF, 2) != 0) {
     return;
   }
 
   /* Echo if required. */
   if (self.do_echo) {
-    size_t i;
-    for (i = 0; i < self.tx.n_elements; i++) {
-      u8_t value;
-      (void) buffer_peek_n(&self.tx, i, 1, &value);
-      (void) buffer_write(&self.rx, value);
-    }
+    u8_t echo[TX_SIZE];
+    respond_n(echo, buffer_peek_n(&self.tx, 0, n_elements, echo));
   }
 
   /* Must be AT-command. */
@@ -566,10 +815,13 @@ void esp_tx_write(u8_t value) {
 
 
 u8_t esp_tx_read(void) {
-  return (self.tx.n_elements == 0)                    << 4 /* Tx empty      */
-       | (self.rx.n_elements >= self.rx.size * 3 / 4) << 3 /* Rx near full  */
-       | (self.tx.n_elements == self.tx.size)         << 1 /* Tx full       */
-       | (self.rx.n_elements > 0);                         /* Rx not empty  */
+  const size_t tx_n_elements = buffer_n_elements(&self.tx);
+  const size_t rx_n_elements = buffer_n_elements(&self.rx);
+
+  return (tx_n_elements == 0)                    << 4 /* Tx empty      */
+       | (rx_n_elements >= self.rx.size * 3 / 4) << 3 /* Rx near full  */
+       | (tx_n_elements == self.tx.size)         << 1 /* Tx full       */
+       | (rx_n_elements > 0);                         /* Rx not empty  */
 }
 
 
@@ -581,18 +833,15 @@ u8_t esp_rx_read(void) {
 
 
 void esp_reset(reset_t reset) {
-  self.tx.read_index = 0;
-  self.tx.n_elements = 0;
-  self.rx.read_index = 0;
-  self.rx.n_elements = 0;
+  buffer_reset(&self.tx);
+  buffer_reset(&self.rx);
 
   self.tx_handler = idle_tx;
 
   self.do_echo = 1;
+  self.is_mux  = 0;
 
-  if (self.socket) {
-    close_socket();
-  }
+  close_links();
 }
 
 
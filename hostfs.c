@@ -0,0 +1,917 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "defs.h"
+#include "divmmc.h"
+#include "hostfs.h"
+#include "log.h"
+#include "memory.h"
+
+
+/**
+ * Serves the esxDOS file API from a directory on the host, by trapping
+ * RST $08 before divMMC gets to automap. Calls we don't serve, as well as
+ * calls made from within esxDOS itself, go to esxDOS as usual.
+ *
+ * See:
+ * - https://gitlab.com/thesmog358/tbblue/-/blob/master/docs/nextzxos/NextZXOS_and_esxDOS_APIs.pdf
+ */
+
+
+#define HOSTFS_N_HANDLES     16
+#define HOSTFS_HANDLE_BASE   0x40
+#define HOSTFS_MAX_PATH      256   /* Including the terminating zero. */
+#define HOSTFS_MAX_NAME      255   /* Long filename, excluding the terminating zero. */
+#define HOSTFS_STAT_SIZE     11
+#define HOSTFS_HEADER_SIZE   128   /* +3DOS header. */
+
+#define OPCODE_RST8          0xCF
+
+
+/* The ones we serve. */
+typedef enum {
+  E_HOSTFS_F_OPEN      = 0x9A,
+  E_HOSTFS_F_CLOSE     = 0x9B,
+  E_HOSTFS_F_SYNC      = 0x9C,
+  E_HOSTFS_F_READ      = 0x9D,
+  E_HOSTFS_F_WRITE     = 0x9E,
+  E_HOSTFS_F_SEEK      = 0x9F,
+  E_HOSTFS_F_FGETPOS   = 0xA0,
+  E_HOSTFS_F_FSTAT     = 0xA1,
+  E_HOSTFS_F_FTRUNCATE = 0xA2,
+  E_HOSTFS_F_OPENDIR   = 0xA3,
+  E_HOSTFS_F_READDIR   = 0xA4,
+  E_HOSTFS_F_TELLDIR   = 0xA5,
+  E_HOSTFS_F_SEEKDIR   = 0xA6,
+  E_HOSTFS_F_REWINDDIR = 0xA7,
+  E_HOSTFS_F_GETCWD    = 0xA8,
+  E_HOSTFS_F_CHDIR     = 0xA9,
+  E_HOSTFS_F_MKDIR     = 0xAA,
+  E_HOSTFS_F_RMDIR     = 0xAB,
+  E_HOSTFS_F_STAT      = 0xAC,
+  E_HOSTFS_F_UNLINK    = 0xAD,
+  E_HOSTFS_F_TRUNCATE  = 0xAE,
+  E_HOSTFS_F_RENAME    = 0xB0
+} hostfs_call_t;
+
+
+typedef enum {
+  E_HOSTFS_ERROR_OK           = 0,
+  E_HOSTFS_ERROR_ENOENT       = 5,
+  E_HOSTFS_ERROR_EIO          = 6,
+  E_HOSTFS_ERROR_EINVAL       = 7,
+  E_HOSTFS_ERROR_EACCES       = 8,
+  E_HOSTFS_ERROR_ENOSPC       = 9,
+  E_HOSTFS_ERROR_ENFILE       = 12,
+  E_HOSTFS_ERROR_EBADF        = 13,
+  E_HOSTFS_ERROR_EOVERFLOW    = 15,
+  E_HOSTFS_ERROR_EISDIR       = 16,
+  E_HOSTFS_ERROR_ENOTDIR      = 17,
+  E_HOSTFS_ERROR_EEXIST       = 18,
+  E_HOSTFS_ERROR_ENAMETOOLONG = 21,
+  E_HOSTFS_ERROR_ERDONLY      = 24
+} hostfs_error_t;
+
+
+/* F_OPEN access modes. */
+#define HOSTFS_MODE_READ          0x01
+#define HOSTFS_MODE_WRITE         0x02
+#define HOSTFS_MODE_CREAT_NOEXIST 0x04
+#define HOSTFS_MODE_OPEN_CREAT    0x08
+#define HOSTFS_MODE_CREAT_TRUNC   0x0C
+#define HOSTFS_MODE_USE_HEADER    0x40
+
+/* F_SEEK modes. */
+#define HOSTFS_SEEK_START  0
+#define HOSTFS_SEEK_FWD    1
+#define HOSTFS_SEEK_BWD    2
+
+/* FAT attributes. */
+#define HOSTFS_ATTR_READ_ONLY  0x01
+#define HOSTFS_ATTR_DIRECTORY  0x10
+
+
+typedef struct {
+  int   fd;       /* -1 if not a file. */
+  DIR*  dir;      /* NULL if not a directory. */
+  u32_t dir_index;
+  int   is_root;
+} hostfs_handle_t;
+
+
+typedef struct {
+  char*           root;
+  char            cwd[HOSTFS_MAX_PATH];  /* Always absolute and normalised. */
+  hostfs_handle_t handles[HOSTFS_N_HANDLES];
+  u8_t            buffer[65536];
+} hostfs_t;
+
+
+static hostfs_t self;
+
+
+int hostfs_init(const char* root) {
+  struct stat st;
+  int         i;
+
+  self.root = NULL;
+  strcpy(self.cwd, "/");
+
+  for (i = 0; i < HOSTFS_N_HANDLES; i++) {
+    self.handles[i].fd  = -1;
+    self.handles[i].dir = NULL;
+  }
+
+  if (root == NULL) {
+    return 0;
+  }
+
+  if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    log_err("hostfs: %s is not a directory\n", root);
+    return -1;
+  }
+
+  self.root = realpath(root, NULL);
+  if (self.root == NULL) {
+    log_err("hostfs: could not resolve %s\n", root);
+    return -1;
+  }
+
+  log_wrn("hostfs: serving esxDOS file calls from %s\n", self.root);
+
+  return 0;
+}
+
+
+static void hostfs_handle_close(hostfs_handle_t* handle) {
+  if (handle->fd != -1) {
+    close(handle->fd);
+    handle->fd = -1;
+  }
+  if (handle->dir != NULL) {
+    closedir(handle->dir);
+    handle->dir = NULL;
+  }
+}
+
+
+void hostfs_finit(void) {
+  int i;
+
+  for (i = 0; i < HOSTFS_N_HANDLES; i++) {
+    hostfs_handle_close(&self.handles[i]);
+  }
+
+  if (self.root != NULL) {
+    free(self.root);
+    self.root = NULL;
+  }
+}
+
+
+static hostfs_error_t hostfs_error(int error) {
+  switch (error) {
+    case ENOENT:       return E_HOSTFS_ERROR_ENOENT;
+    case EINVAL:       return E_HOSTFS_ERROR_EINVAL;
+    case EPERM:
+    case EACCES:       return E_HOSTFS_ERROR_EACCES;
+    case ENOSPC:       return E_HOSTFS_ERROR_ENOSPC;
+    case EMFILE:
+    case ENFILE:       return E_HOSTFS_ERROR_ENFILE;
+    case EBADF:        return E_HOSTFS_ERROR_EBADF;
+    case EOVERFLOW:
+    case EFBIG:        return E_HOSTFS_ERROR_EOVERFLOW;
+    case EISDIR:       return E_HOSTFS_ERROR_EISDIR;
+    case ENOTDIR:      return E_HOSTFS_ERROR_ENOTDIR;
+    case EEXIST:
+    case ENOTEMPTY:    return E_HOSTFS_ERROR_EEXIST;
+    case ENAMETOOLONG: return E_HOSTFS_ERROR_ENAMETOOLONG;
+    case EROFS:        return E_HOSTFS_ERROR_ERDONLY;
+    default:           return E_HOSTFS_ERROR_EIO;
+  }
+}
+
+
+static void hostfs_string_read(u16_t address, char* string, size_t size) {
+  size_t i;
+
+  for (i = 0; i < size - 1; i++) {
+    string[i] = memory_read(address + i);
+    if (string[i] == '\0' || string[i] == (char) 0xFF) {
+      break;
+    }
+  }
+  string[i] = '\0';
+}
+
+
+static void hostfs_bytes_write(u16_t address, const u8_t* bytes, size_t length) {
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    memory_write(address + i, bytes[i]);
+  }
+}
+
+
+static void hostfs_u32_write(u8_t* bytes, u32_t value) {
+  bytes[0] = value;
+  bytes[1] = value >> 8;
+  bytes[2] = value >> 16;
+  bytes[3] = value >> 24;
+}
+
+
+/**
+ * Makes an emulated path absolute and normalised, without a drive letter and
+ * with any ".." that would escape the root dropped.
+ */
+static int hostfs_path_normalise(const char* path, char* normalised) {
+  char        combined[2 * HOSTFS_MAX_PATH];
+  char*       component;
+  char*       saveptr;
+  size_t      length = 0;
+  char*       p;
+
+  /* Drop a drive letter, esxDOS only has the one drive for us. */
+  if (path[0] != '\0' && path[1] == ':') {
+    path += 2;
+  }
+
+  if (path[0] == '/' || path[0] == '\\') {
+    snprintf(combined, sizeof(combined), "%s", path);
+  } else {
+    snprintf(combined, sizeof(combined), "%s/%s", self.cwd, path);
+  }
+
+  for (p = combined; *p; p++) {
+    if (*p == '\\') {
+      *p = '/';
+    }
+  }
+
+  normalised[0] = '\0';
+
+  for (component = strtok_r(combined, "/", &saveptr); component != NULL; component = strtok_r(NULL, "/", &saveptr)) {
+    if (strcmp(component, ".") == 0) {
+      continue;
+    }
+    if (strcmp(component, "..") == 0) {
+      while (length > 0 && normalised[--length] != '/');
+      normalised[length] = '\0';
+      continue;
+    }
+    if (length + 1 + strlen(component) >= HOSTFS_MAX_PATH) {
+      return -1;
+    }
+    normalised[length++] = '/';
+    strcpy(&normalised[length], component);
+    length += strlen(component);
+  }
+
+  if (length == 0) {
+    strcpy(normalised, "/");
+  }
+
+  return 0;
+}
+
+
+/**
+ * Maps a normalised emulated path onto the host. FAT is case-insensitive, so
+ * components that don't exist as such are looked up ignoring case. Those
+ * that don't exist at all are kept as they are, to be created.
+ */
+static int hostfs_path_resolve(const char* normalised, char* resolved) {
+  char        copy[HOSTFS_MAX_PATH];
+  char*       component;
+  char*       saveptr;
+  struct stat st;
+  size_t      length;
+
+  if (strlen(self.root) >= PATH_MAX) {
+    return -1;
+  }
+  strcpy(resolved, self.root);
+  length = strlen(resolved);
+
+  strcpy(copy, normalised);
+
+  for (component = strtok_r(copy, "/", &saveptr); component != NULL; component = strtok_r(NULL, "/", &saveptr)) {
+    if (length + 1 + HOSTFS_MAX_NAME >= PATH_MAX) {
+      return -1;
+    }
+
+    resolved[length] = '/';
+    strcpy(&resolved[length + 1], component);
+
+    if (stat(resolved, &st) != 0) {
+      DIR*           dir;
+      struct dirent* entry;
+
+      resolved[length] = '\0';
+      dir = opendir(resolved);
+      resolved[length] = '/';
+
+      if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+          if (strcasecmp(entry->d_name, component) == 0) {
+            strcpy(&resolved[length + 1], entry->d_name);
+            break;
+          }
+        }
+        closedir(dir);
+      }
+    }
+
+    length += strlen(&resolved[length]);
+  }
+
+  return 0;
+}
+
+
+static int hostfs_path_read(u16_t address, char* resolved) {
+  char path[HOSTFS_MAX_PATH];
+  char normalised[HOSTFS_MAX_PATH];
+
+  hostfs_string_read(address, path, sizeof(path));
+
+  if (hostfs_path_normalise(path, normalised) != 0) {
+    return -1;
+  }
+
+  return hostfs_path_resolve(normalised, resolved);
+}
+
+
+static hostfs_handle_t* hostfs_handle_get(u8_t number) {
+  const int i = number - HOSTFS_HANDLE_BASE;
+
+  if (i < 0 || i >= HOSTFS_N_HANDLES) {
+    return NULL;
+  }
+  if (self.handles[i].fd == -1 && self.handles[i].dir == NULL) {
+    return NULL;
+  }
+
+  return &self.handles[i];
+}
+
+
+static int hostfs_handle_new(void) {
+  int i;
+
+  for (i = 0; i < HOSTFS_N_HANDLES; i++) {
+    if (self.handles[i].fd == -1 && self.handles[i].dir == NULL) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+/* FAT date in the upper and time in the lower word. */
+static u32_t hostfs_fat_datetime(time_t t) {
+  struct tm tm;
+
+  if (localtime_r(&t, &tm) == NULL || tm.tm_year < 80) {
+    return 0;
+  }
+
+  return (u32_t) ((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday) << 16
+               | (tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2);
+}
+
+
+static u8_t hostfs_fat_attributes(const struct stat* st) {
+  return (S_ISDIR(st->st_mode) ? HOSTFS_ATTR_DIRECTORY : 0)
+       | ((st->st_mode & S_IWUSR) ? 0 : HOSTFS_ATTR_READ_ONLY);
+}
+
+
+/* <byte> drive, <byte> device, <byte> attributes, <dword> date, <dword> size */
+static void hostfs_stat_write(u16_t address, const struct stat* st) {
+  u8_t bytes[HOSTFS_STAT_SIZE];
+
+  bytes[0] = 'C';
+  bytes[1] = 0;
+  bytes[2] = hostfs_fat_attributes(st);
+  hostfs_u32_write(&bytes[3], hostfs_fat_datetime(st->st_mtime));
+  hostfs_u32_write(&bytes[7], st->st_size);
+
+  hostfs_bytes_write(address, bytes, sizeof(bytes));
+}
+
+
+/**
+ * With HOSTFS_MODE_USE_HEADER, the eight bytes of BASIC header in a +3DOS
+ * header are copied to DE. Files without one are read from the start.
+ */
+static void hostfs_header_read(int fd, u16_t address) {
+  u8_t header[HOSTFS_HEADER_SIZE];
+
+  if (read(fd, header, sizeof(header)) == sizeof(header) && memcmp(header, "PLUS3DOS", 8) == 0) {
+    hostfs_bytes_write(address, &header[15], 8);
+    return;
+  }
+
+  (void) lseek(fd, 0, SEEK_SET);
+}
+
+
+static hostfs_error_t hostfs_open(cpu_registers_t* registers) {
+  const u8_t mode = registers->bc >> 8;
+  char       path[PATH_MAX];
+  int        flags;
+  int        i;
+
+  if (hostfs_path_read(registers->ix, path) != 0) {
+    return E_HOSTFS_ERROR_ENAMETOOLONG;
+  }
+
+  switch (mode & (HOSTFS_MODE_READ | HOSTFS_MODE_WRITE)) {
+    case HOSTFS_MODE_WRITE:
+      flags = O_WRONLY;
+      break;
+
+    case HOSTFS_MODE_READ | HOSTFS_MODE_WRITE:
+      flags = O_RDWR;
+      break;
+
+    default:
+      flags = O_RDONLY;
+      break;
+  }
+
+  switch (mode & HOSTFS_MODE_CREAT_TRUNC) {
+    case HOSTFS_MODE_CREAT_NOEXIST:
+      flags |= O_CREAT | O_EXCL;
+      break;
+
+    case HOSTFS_MODE_OPEN_CREAT:
+      flags |= O_CREAT;
+      break;
+
+    case HOSTFS_MODE_CREAT_TRUNC:
+      flags |= O_CREAT | O_TRUNC;
+      break;
+  }
+
+  i = hostfs_handle_new();
+  if (i == -1) {
+    return E_HOSTFS_ERROR_ENFILE;
+  }
+
+  self.handles[i].fd = open(path, flags, 0644);
+  if (self.handles[i].fd == -1) {
+    return hostfs_error(errno);
+  }
+
+  if ((mode & HOSTFS_MODE_USE_HEADER) && (flags & O_ACCMODE) != O_WRONLY) {
+    hostfs_header_read(self.handles[i].fd, registers->de);
+  }
+
+  registers->af = (HOSTFS_HANDLE_BASE + i) << 8 | (registers->af & 0xFF);
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static hostfs_error_t hostfs_read(cpu_registers_t* registers, hostfs_handle_t* handle) {
+  ssize_t n;
+
+  n = read(handle->fd, self.buffer, registers->bc);
+  if (n < 0) {
+    return hostfs_error(errno);
+  }
+
+  hostfs_bytes_write(registers->ix, self.buffer, n);
+
+  registers->bc = n;
+  registers->de = n;
+  registers->hl = registers->ix + n;
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static hostfs_error_t hostfs_write(cpu_registers_t* registers, hostfs_handle_t* handle) {
+  ssize_t n;
+  u32_t   i;
+
+  for (i = 0; i < registers->bc; i++) {
+    self.buffer[i] = memory_read(registers->ix + i);
+  }
+
+  n = write(handle->fd, self.buffer, registers->bc);
+  if (n < 0) {
+    return hostfs_error(errno);
+  }
+
+  registers->bc = n;
+  registers->de = n;
+  registers->hl = registers->ix + n;
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static void hostfs_bcde_set(cpu_registers_t* registers, u32_t value) {
+  registers->bc = value >> 16;
+  registers->de = value & 0xFFFF;
+}
+
+
+static u32_t hostfs_bcde_get(const cpu_registers_t* registers) {
+  return (u32_t) registers->bc << 16 | registers->de;
+}
+
+
+static hostfs_error_t hostfs_seek(cpu_registers_t* registers, hostfs_handle_t* handle) {
+  const u32_t offset = hostfs_bcde_get(registers);
+  off_t       position;
+
+  switch (registers->hl & 0xFF) {
+    case HOSTFS_SEEK_START:
+      position = lseek(handle->fd, offset, SEEK_SET);
+      break;
+
+    case HOSTFS_SEEK_FWD:
+      position = lseek(handle->fd, offset, SEEK_CUR);
+      break;
+
+    case HOSTFS_SEEK_BWD:
+      position = lseek(handle->fd, -(off_t) offset, SEEK_CUR);
+      break;
+
+    default:
+      return E_HOSTFS_ERROR_EINVAL;
+  }
+
+  if (position == -1) {
+    return hostfs_error(errno);
+  }
+
+  hostfs_bcde_set(registers, position);
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static hostfs_error_t hostfs_opendir(cpu_registers_t* registers) {
+  char path[PATH_MAX];
+  char normalised[HOSTFS_MAX_PATH];
+  char spec[HOSTFS_MAX_PATH];
+  int  i;
+
+  hostfs_string_read(registers->ix, spec, sizeof(spec));
+  if (hostfs_path_normalise(spec, normalised) != 0 || hostfs_path_resolve(normalised, path) != 0) {
+    return E_HOSTFS_ERROR_ENAMETOOLONG;
+  }
+
+  i = hostfs_handle_new();
+  if (i == -1) {
+    return E_HOSTFS_ERROR_ENFILE;
+  }
+
+  self.handles[i].dir = opendir(path);
+  if (self.handles[i].dir == NULL) {
+    return hostfs_error(errno);
+  }
+  self.handles[i].dir_index = 0;
+  self.handles[i].is_root   = (strcmp(normalised, "/") == 0);
+
+  registers->af = (HOSTFS_HANDLE_BASE + i) << 8 | (registers->af & 0xFF);
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+/* The root has no "." and "..", like on FAT. */
+static struct dirent* hostfs_dir_next(hostfs_handle_t* handle) {
+  struct dirent* entry;
+
+  do {
+    entry = readdir(handle->dir);
+  } while (entry != NULL && handle->is_root && (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0));
+
+  if (entry != NULL) {
+    handle->dir_index++;
+  }
+
+  return entry;
+}
+
+
+/* Entries are <byte> attributes, <asciiz> name, <dword> date, <dword> size. */
+static hostfs_error_t hostfs_readdir(cpu_registers_t* registers, hostfs_handle_t* handle) {
+  struct dirent* entry;
+  struct stat    st;
+  size_t         length;
+
+  entry = hostfs_dir_next(handle);
+  if (entry == NULL) {
+    registers->af &= 0x00FF;
+    return E_HOSTFS_ERROR_OK;
+  }
+
+  if (fstatat(dirfd(handle->dir), entry->d_name, &st, 0) != 0) {
+    memset(&st, 0, sizeof(st));
+  }
+
+  length = strlen(entry->d_name);
+  if (length > HOSTFS_MAX_NAME) {
+    length = HOSTFS_MAX_NAME;
+  }
+
+  self.buffer[0] = hostfs_fat_attributes(&st);
+  memcpy(&self.buffer[1], entry->d_name, length);
+  self.buffer[1 + length] = '\0';
+  hostfs_u32_write(&self.buffer[2 + length], hostfs_fat_datetime(st.st_mtime));
+  hostfs_u32_write(&self.buffer[6 + length], st.st_size);
+
+  hostfs_bytes_write(registers->ix, self.buffer, 10 + length);
+
+  registers->af = 0x0100 | (registers->af & 0xFF);
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static hostfs_error_t hostfs_seekdir(cpu_registers_t* registers, hostfs_handle_t* handle) {
+  const u32_t index = hostfs_bcde_get(registers);
+  u32_t       i;
+
+  rewinddir(handle->dir);
+  handle->dir_index = 0;
+
+  for (i = 0; i < index && hostfs_dir_next(handle) != NULL; i++);
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static hostfs_error_t hostfs_chdir(cpu_registers_t* registers) {
+  char        path[PATH_MAX];
+  char        normalised[HOSTFS_MAX_PATH];
+  char        spec[HOSTFS_MAX_PATH];
+  struct stat st;
+
+  hostfs_string_read(registers->ix, spec, sizeof(spec));
+  if (hostfs_path_normalise(spec, normalised) != 0 || hostfs_path_resolve(normalised, path) != 0) {
+    return E_HOSTFS_ERROR_ENAMETOOLONG;
+  }
+
+  if (stat(path, &st) != 0) {
+    return hostfs_error(errno);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return E_HOSTFS_ERROR_ENOTDIR;
+  }
+
+  strcpy(self.cwd, normalised);
+
+  return E_HOSTFS_ERROR_OK;
+}
+
+
+static hostfs_error_t hostfs_file_call(u8_t call, cpu_registers_t* registers, hostfs_handle_t* handle) {
+  struct stat st;
+  off_t       position;
+
+  if (handle->fd == -1) {
+    return E_HOSTFS_ERROR_EBADF;
+  }
+
+  switch (call) {
+    case E_HOSTFS_F_CLOSE:
+      hostfs_handle_close(handle);
+      return E_HOSTFS_ERROR_OK;
+
+    case E_HOSTFS_F_SYNC:
+      return fsync(handle->fd) == 0 ? E_HOSTFS_ERROR_OK : hostfs_error(errno);
+
+    case E_HOSTFS_F_READ:
+      return hostfs_read(registers, handle);
+
+    case E_HOSTFS_F_WRITE:
+      return hostfs_write(registers, handle);
+
+    case E_HOSTFS_F_SEEK:
+      return hostfs_seek(registers, handle);
+
+    case E_HOSTFS_F_FGETPOS:
+      position = lseek(handle->fd, 0, SEEK_CUR);
+      if (position == -1) {
+        return hostfs_error(errno);
+      }
+      hostfs_bcde_set(registers, position);
+      return E_HOSTFS_ERROR_OK;
+
+    case E_HOSTFS_F_FSTAT:
+      if (fstat(handle->fd, &st) != 0) {
+        return hostfs_error(errno);
+      }
+      hostfs_stat_write(registers->ix, &st);
+      return E_HOSTFS_ERROR_OK;
+
+    case E_HOSTFS_F_FTRUNCATE:
+      return ftruncate(handle->fd, hostfs_bcde_get(registers)) == 0 ? E_HOSTFS_ERROR_OK : hostfs_error(errno);
+
+    default:
+      return E_HOSTFS_ERROR_EBADF;
+  }
+}
+
+
+static hostfs_error_t hostfs_dir_call(u8_t call, cpu_registers_t* registers, hostfs_handle_t* handle) {
+  if (handle->dir == NULL) {
+    return E_HOSTFS_ERROR_EBADF;
+  }
+
+  switch (call) {
+    case E_HOSTFS_F_CLOSE:
+      hostfs_handle_close(handle);
+      return E_HOSTFS_ERROR_OK;
+
+    case E_HOSTFS_F_READDIR:
+      return hostfs_readdir(registers, handle);
+
+    case E_HOSTFS_F_TELLDIR:
+      hostfs_bcde_set(registers, handle->dir_index);
+      return E_HOSTFS_ERROR_OK;
+
+    case E_HOSTFS_F_SEEKDIR:
+      return hostfs_seekdir(registers, handle);
+
+    case E_HOSTFS_F_REWINDDIR:
+      rewinddir(handle->dir);
+      handle->dir_index = 0;
+      return E_HOSTFS_ERROR_OK;
+
+    default:
+      return E_HOSTFS_ERROR_EBADF;
+  }
+}
+
+
+static hostfs_error_t hostfs_path_call(u8_t call, cpu_registers_t* registers) {
+  char        path[PATH_MAX];
+  char        target[PATH_MAX];
+  struct stat st;
+  int         result;
+
+  if (hostfs_path_read(registers->ix, path) != 0) {
+    return E_HOSTFS_ERROR_ENAMETOOLONG;
+  }
+
+  switch (call) {
+    case E_HOSTFS_F_MKDIR:
+      result = mkdir(path, 0755);
+      break;
+
+    case E_HOSTFS_F_RMDIR:
+      result = rmdir(path);
+      break;
+
+    case E_HOSTFS_F_UNLINK:
+      result = unlink(path);
+      break;
+
+    case E_HOSTFS_F_TRUNCATE:
+      result = truncate(path, hostfs_bcde_get(registers));
+      break;
+
+    case E_HOSTFS_F_STAT:
+      result = stat(path, &st);
+      if (result == 0) {
+        hostfs_stat_write(registers->de, &st);
+      }
+      break;
+
+    case E_HOSTFS_F_RENAME:
+      if (hostfs_path_read(registers->de, target) != 0) {
+        return E_HOSTFS_ERROR_ENAMETOOLONG;
+      }
+      result = rename(path, target);
+      break;
+
+    default:
+      return E_HOSTFS_ERROR_EINVAL;
+  }
+
+  return result == 0 ? E_HOSTFS_ERROR_OK : hostfs_error(errno);
+}
+
+
+/**
+ * Returns whether the call was served, in which case the CPU continues after
+ * the function code following RST $08, with carry set and the error in A on
+ * failure, like esxDOS does.
+ */
+static int hostfs_call(u8_t call, cpu_registers_t* registers) {
+  hostfs_handle_t* handle;
+  hostfs_error_t   error;
+
+  switch (call) {
+    case E_HOSTFS_F_OPEN:
+      error = hostfs_open(registers);
+      break;
+
+    case E_HOSTFS_F_OPENDIR:
+      error = hostfs_opendir(registers);
+      break;
+
+    case E_HOSTFS_F_GETCWD:
+      hostfs_bytes_write(registers->ix, (const u8_t*) self.cwd, strlen(self.cwd) + 1);
+      error = E_HOSTFS_ERROR_OK;
+      break;
+
+    case E_HOSTFS_F_CHDIR:
+      error = hostfs_chdir(registers);
+      break;
+
+    case E_HOSTFS_F_MKDIR:
+    case E_HOSTFS_F_RMDIR:
+    case E_HOSTFS_F_STAT:
+    case E_HOSTFS_F_UNLINK:
+    case E_HOSTFS_F_TRUNCATE:
+    case E_HOSTFS_F_RENAME:
+      error = hostfs_path_call(call, registers);
+      break;
+
+    case E_HOSTFS_F_CLOSE:
+    case E_HOSTFS_F_SYNC:
+    case E_HOSTFS_F_READ:
+    case E_HOSTFS_F_WRITE:
+    case E_HOSTFS_F_SEEK:
+    case E_HOSTFS_F_FGETPOS:
+    case E_HOSTFS_F_FSTAT:
+    case E_HOSTFS_F_FTRUNCATE:
+    case E_HOSTFS_F_READDIR:
+    case E_HOSTFS_F_TELLDIR:
+    case E_HOSTFS_F_SEEKDIR:
+    case E_HOSTFS_F_REWINDDIR:
+      /* Leave handles that aren't ours to esxDOS. */
+      handle = hostfs_handle_get(registers->af >> 8);
+      if (handle == NULL) {
+        return 0;
+      }
+      error = (handle->dir != NULL) ? hostfs_dir_call(call, registers, handle)
+                                    : hostfs_file_call(call, registers, handle);
+      break;
+
+    default:
+      return 0;
+  }
+
+  if (error == E_HOSTFS_ERROR_OK) {
+    registers->af &= ~0x0001;
+  } else {
+    registers->af = error << 8 | (registers->af & 0xFF) | 0x0001;
+  }
+
+  return 1;
+}
+
+
+int hostfs_rst8_trap(void) {
+  cpu_registers_t registers;
+  u16_t           address;
+
+  /* Calls from within esxDOS are its own business, and programs may have
+   * their own RST $08 handler in RAM. */
+  if (self.root == NULL || divmmc_is_active() || !memory_rom_is_paged_in()) {
+    return 0;
+  }
+
+  cpu_registers_get(&registers);
+
+  /* Make sure we got here by RST $08, which is followed by the call. */
+  address = memory_read(registers.sp) | memory_read(registers.sp + 1) << 8;
+  if (memory_read(address - 1) != OPCODE_RST8) {
+    return 0;
+  }
+
+  if (!hostfs_call(memory_read(address), &registers)) {
+    return 0;
+  }
+
+  registers.pc  = address + 1;
+  registers.sp += 2;
+
+  cpu_registers_update(&registers, CPU_REGISTER_AF | CPU_REGISTER_BC | CPU_REGISTER_DE | CPU_REGISTER_HL | CPU_REGISTER_SP | CPU_REGISTER_PC);
+
+  return 1;
+}
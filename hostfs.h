@@ -0,0 +1,17 @@
+#ifndef __HOSTFS_H
+#define __HOSTFS_H
+
+
+#include "defs.h"
+
+
+/* Address of the esxDOS API entry point, RST $08. */
+#define HOSTFS_RST8  0x0008
+
+
+int  hostfs_init(const char* root);
+void hostfs_finit(void);
+int  hostfs_rst8_trap(void);
+
+
+#endif  /* __HOSTFS_H */
@@ -53,16 +53,66 @@ typedef enum {
 } io_func_t;
 
 
+/* What an I/O port decodes to. */
+typedef enum {
+  E_IO_PORT_NONE = 0,         /* Unimplemented. */
+  E_IO_PORT_DISABLED,         /* Implemented, but disabled by port decoding. */
+  E_IO_PORT_ULA,
+  E_IO_PORT_I2C_SCL,
+  E_IO_PORT_I2C_SDA,
+  E_IO_PORT_LAYER_2,
+  E_IO_PORT_UART_TX,
+  E_IO_PORT_UART_RX,
+  E_IO_PORT_UART_SELECT,
+  E_IO_PORT_UART_FRAME,
+  E_IO_PORT_PAGING_PLUS_3,
+  E_IO_PORT_NEXTREG_SELECT,
+  E_IO_PORT_NEXTREG_DATA,
+  E_IO_PORT_SPRITES_SLOT,
+  E_IO_PORT_SPRITES_ATTRIBUTE,
+  E_IO_PORT_SPRITES_PATTERN,
+  E_IO_PORT_PAGING_128K,
+  E_IO_PORT_PAGING_NEXT_BANK,
+  E_IO_PORT_MOUSE_X,
+  E_IO_PORT_MOUSE_Y,
+  E_IO_PORT_MOUSE_BUTTONS,
+  E_IO_PORT_AY_REGISTER,
+  E_IO_PORT_AY_DATA,
+  E_IO_PORT_MF_ENABLE,
+  E_IO_PORT_MF_DISABLE,
+  E_IO_PORT_DMA,
+  E_IO_PORT_KEMPSTON_1,
+  E_IO_PORT_KEMPSTON_2,
+  E_IO_PORT_DIVMMC,
+  E_IO_PORT_SPI_CS,
+  E_IO_PORT_SPI_DATA,
+  E_IO_PORT_TIMEX,
+  E_IO_PORT_DAC_A,
+  E_IO_PORT_DAC_B,
+  E_IO_PORT_DAC_C,
+  E_IO_PORT_DAC_D,
+  E_IO_PORT_DAC_AD,
+  E_IO_PORT_DAC_BC
+} io_port_t;
+
+
 typedef struct {
   int  is_enabled[E_IO_FUNC_LAST - E_IO_FUNC_FIRST + 1];
   u8_t mf_port_enable;
   u8_t mf_port_disable;
+
+  /* What each port decodes to, rebuilt when the decoding changes. */
+  u8_t read_port[0x10000];
+  u8_t write_port[0x10000];
 } io_t;
 
 
 static io_t self;
 
 
+static void io_decoding_rebuild(void);
+
+
 int io_init(void) {
   io_reset(E_RESET_HARD);
   return 0;
@@ -75,6 +125,8 @@ void io_reset(reset_t reset) {
 
   self.mf_port_enable  = 0x3F;
   self.mf_port_disable = 0xBF;
+
+  io_decoding_rebuild();
 }
 
 
@@ -85,6 +137,113 @@ void io_finit(void) {
 void io_mf_ports_set(u8_t enable, u8_t disable) {
   self.mf_port_enable  = enable;
   self.mf_port_disable = disable;
+
+  io_decoding_rebuild();
+}
+
+
+/**
+ * Makes every address that matches value on the bits in mask decode to
+ * port, or to nothing in particular if the function is disabled.
+ */
+static void io_decode(u8_t* table, u16_t mask, u16_t value, int is_enabled, io_port_t port) {
+  const u16_t any  = ~mask;
+  u16_t       free = 0;
+
+  do {
+    table[value | free] = is_enabled ? port : E_IO_PORT_DISABLED;
+    free = ((free | mask) + 1) & any;
+  } while (free != 0);
+}
+
+
+/**
+ * Works out what every port decodes to. Later decodings take precedence over
+ * earlier ones, so fully decoded ports go last.
+ */
+static void io_decoding_rebuild(void) {
+  const int* on = self.is_enabled;
+
+  memset(self.read_port,  E_IO_PORT_NONE, sizeof(self.read_port));
+  memset(self.write_port, E_IO_PORT_NONE, sizeof(self.write_port));
+
+  /* Ports decoded on their low byte. */
+  io_decode(self.read_port, 0x00FF, 0x0B, on[E_IO_FUNC_DMA_Z80],    E_IO_PORT_DMA);
+  io_decode(self.read_port, 0x00FF, 0x1F, on[E_IO_FUNC_KEMPSTON_1], E_IO_PORT_KEMPSTON_1);
+  io_decode(self.read_port, 0x00FF, 0x37, on[E_IO_FUNC_KEMPSTON_2], E_IO_PORT_KEMPSTON_2);
+  io_decode(self.read_port, 0x00FF, 0x6B, on[E_IO_FUNC_DMA_ZXN],    E_IO_PORT_DMA);
+  io_decode(self.read_port, 0x00FF, 0xE3, on[E_IO_FUNC_DIVMMC],     E_IO_PORT_DIVMMC);
+  io_decode(self.read_port, 0x00FF, 0xE7, on[E_IO_FUNC_SPI],        E_IO_PORT_SPI_CS);
+  io_decode(self.read_port, 0x00FF, 0xEB, on[E_IO_FUNC_SPI],        E_IO_PORT_SPI_DATA);
+  io_decode(self.read_port, 0x00FF, 0xFF, on[E_IO_FUNC_TIMEX],      E_IO_PORT_TIMEX);
+
+  io_decode(self.write_port, 0x00FF, 0x0B, on[E_IO_FUNC_DMA_Z80],                                                 E_IO_PORT_DMA);
+  io_decode(self.write_port, 0x00FF, 0x6B, on[E_IO_FUNC_DMA_ZXN],                                                 E_IO_PORT_DMA);
+  io_decode(self.write_port, 0x00FF, 0xE3, on[E_IO_FUNC_DIVMMC],                                                  E_IO_PORT_DIVMMC);
+  io_decode(self.write_port, 0x00FF, 0xE7, on[E_IO_FUNC_SPI],                                                     E_IO_PORT_SPI_CS);
+  io_decode(self.write_port, 0x00FF, 0xEB, on[E_IO_FUNC_SPI],                                                     E_IO_PORT_SPI_DATA);
+  io_decode(self.write_port, 0x00FF, 0xFF, on[E_IO_FUNC_TIMEX],                                                   E_IO_PORT_TIMEX);
+  io_decode(self.write_port, 0x00FF, 0x0F, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1] || on[E_IO_FUNC_DAC_STEREO_COVOX],  E_IO_PORT_DAC_B);
+  io_decode(self.write_port, 0x00FF, 0x1F, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1],                                    E_IO_PORT_DAC_A);
+  io_decode(self.write_port, 0x00FF, 0x3F, on[E_IO_FUNC_DAC_STEREO_PROFI_COVOX],                                  E_IO_PORT_DAC_A);
+  io_decode(self.write_port, 0x00FF, 0x4F, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1] || on[E_IO_FUNC_DAC_STEREO_COVOX],  E_IO_PORT_DAC_C);
+  io_decode(self.write_port, 0x00FF, 0x5F, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1] || on[E_IO_FUNC_DAC_STEREO_PROFI_COVOX], E_IO_PORT_DAC_D);
+  io_decode(self.write_port, 0x00FF, 0xB3, on[E_IO_FUNC_DAC_MONO_GS_COVOX],                                       E_IO_PORT_DAC_BC);
+  io_decode(self.write_port, 0x00FF, 0xDF, on[E_IO_FUNC_DAC_MONO_SPECDRUM],                                       E_IO_PORT_DAC_AD);
+  io_decode(self.write_port, 0x00FF, 0xF1, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2],                                    E_IO_PORT_DAC_A);
+  io_decode(self.write_port, 0x00FF, 0xF3, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2],                                    E_IO_PORT_DAC_B);
+  io_decode(self.write_port, 0x00FF, 0xF9, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2],                                    E_IO_PORT_DAC_C);
+  io_decode(self.write_port, 0x00FF, 0xFB, on[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2] || on[E_IO_FUNC_DAC_MONO_PENTAGON_ATM], E_IO_PORT_DAC_AD);
+  io_decode(self.write_port, 0x00FF, 0x57, on[E_IO_FUNC_SPRITES],                                                 E_IO_PORT_SPRITES_ATTRIBUTE);
+  io_decode(self.write_port, 0x00FF, 0x5B, on[E_IO_FUNC_SPRITES],                                                 E_IO_PORT_SPRITES_PATTERN);
+
+  /* Multiface, whose ports move around with its mode. */
+  io_decode(self.read_port,  0x00FF, self.mf_port_enable,  on[E_IO_FUNC_MF], E_IO_PORT_MF_ENABLE);
+  io_decode(self.read_port,  0x00FF, self.mf_port_disable, on[E_IO_FUNC_MF], E_IO_PORT_MF_DISABLE);
+  if (on[E_IO_FUNC_MF]) {
+    /* When disabled, the ports above decode as usual. */
+    io_decode(self.write_port, 0x00FF, self.mf_port_enable,  1, E_IO_PORT_MF_ENABLE);
+    io_decode(self.write_port, 0x00FF, self.mf_port_disable, 1, E_IO_PORT_MF_DISABLE);
+  }
+
+  /* AY, partially decoded. */
+  io_decode(self.read_port,  0xC007, 0xC005, on[E_IO_FUNC_AY], E_IO_PORT_AY_REGISTER);
+  io_decode(self.write_port, 0xC007, 0xC005, on[E_IO_FUNC_AY], E_IO_PORT_AY_REGISTER);
+  io_decode(self.write_port, 0xC007, 0x8005, on[E_IO_FUNC_AY], E_IO_PORT_AY_DATA);
+
+  /* Fully decoded ports. */
+  io_decode(self.read_port, 0xFFFF, 0x113B, on[E_IO_FUNC_I2C],              E_IO_PORT_I2C_SDA);
+  io_decode(self.read_port, 0xFFFF, 0x123B, on[E_IO_FUNC_LAYER_2],          E_IO_PORT_LAYER_2);
+  io_decode(self.read_port, 0xFFFF, 0x133B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_TX);
+  io_decode(self.read_port, 0xFFFF, 0x143B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_RX);
+  io_decode(self.read_port, 0xFFFF, 0x153B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_SELECT);
+  io_decode(self.read_port, 0xFFFF, 0x163B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_FRAME);
+  io_decode(self.read_port, 0xFFFF, 0x1FFD, on[E_IO_FUNC_PAGING_PLUS_3],    E_IO_PORT_PAGING_PLUS_3);
+  io_decode(self.read_port, 0xFFFF, 0x243B, 1,                              E_IO_PORT_NEXTREG_SELECT);
+  io_decode(self.read_port, 0xFFFF, 0x253B, 1,                              E_IO_PORT_NEXTREG_DATA);
+  io_decode(self.read_port, 0xFFFF, 0x7FFD, on[E_IO_FUNC_PAGING_128K],      E_IO_PORT_PAGING_128K);
+  io_decode(self.read_port, 0xFFFF, 0xDFFD, on[E_IO_FUNC_PAGING_NEXT_BANK], E_IO_PORT_PAGING_NEXT_BANK);
+  io_decode(self.read_port, 0xFFFF, 0xFBDF, on[E_IO_FUNC_MOUSE],            E_IO_PORT_MOUSE_X);
+  io_decode(self.read_port, 0xFFFF, 0xFFDF, on[E_IO_FUNC_MOUSE],            E_IO_PORT_MOUSE_Y);
+  io_decode(self.read_port, 0xFFFF, 0xFADF, on[E_IO_FUNC_MOUSE],            E_IO_PORT_MOUSE_BUTTONS);
+
+  io_decode(self.write_port, 0xFFFF, 0x103B, on[E_IO_FUNC_I2C],              E_IO_PORT_I2C_SCL);
+  io_decode(self.write_port, 0xFFFF, 0x113B, on[E_IO_FUNC_I2C],              E_IO_PORT_I2C_SDA);
+  io_decode(self.write_port, 0xFFFF, 0x123B, on[E_IO_FUNC_LAYER_2],          E_IO_PORT_LAYER_2);
+  io_decode(self.write_port, 0xFFFF, 0x133B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_TX);
+  io_decode(self.write_port, 0xFFFF, 0x143B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_RX);
+  io_decode(self.write_port, 0xFFFF, 0x153B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_SELECT);
+  io_decode(self.write_port, 0xFFFF, 0x163B, on[E_IO_FUNC_UART],             E_IO_PORT_UART_FRAME);
+  io_decode(self.write_port, 0xFFFF, 0x1FFD, on[E_IO_FUNC_PAGING_PLUS_3],    E_IO_PORT_PAGING_PLUS_3);
+  io_decode(self.write_port, 0xFFFF, 0x243B, 1,                              E_IO_PORT_NEXTREG_SELECT);
+  io_decode(self.write_port, 0xFFFF, 0x253B, 1,                              E_IO_PORT_NEXTREG_DATA);
+  io_decode(self.write_port, 0xFFFF, 0x303B, on[E_IO_FUNC_SPRITES],          E_IO_PORT_SPRITES_SLOT);
+  io_decode(self.write_port, 0xFFFF, 0x7FFD, on[E_IO_FUNC_PAGING_128K],      E_IO_PORT_PAGING_128K);
+  io_decode(self.write_port, 0xFFFF, 0xDFFD, on[E_IO_FUNC_PAGING_NEXT_BANK], E_IO_PORT_PAGING_NEXT_BANK);
+
+  /* The ULA takes all even ports. */
+  io_decode(self.read_port,  0x0001, 0x0000, 1, E_IO_PORT_ULA);
+  io_decode(self.write_port, 0x0001, 0x0000, 1, E_IO_PORT_ULA);
 }
 
 
@@ -138,139 +297,35 @@ static void io_contend(u16_t address) {
 u8_t io_read(u16_t address) {
   io_contend(address);
 
-  if ((address & 0x0001) == 0x0000) {
-    return ula_read(address);
-  }
-
-  switch (address) {
-    case 0x113B:
-      return self.is_enabled[E_IO_FUNC_I2C]
-        ? i2c_sda_read(address)
-        : ula_floating_bus_read();
-
-    case 0x123B:
-      return self.is_enabled[E_IO_FUNC_LAYER_2]
-        ? layer2_access_read()
-        : ula_floating_bus_read();
-
-    case 0x133B:
-      return self.is_enabled[E_IO_FUNC_UART]
-        ? uart_tx_read()
-        : ula_floating_bus_read();
-
-    case 0x143B:
-      return self.is_enabled[E_IO_FUNC_UART]
-        ? uart_rx_read()
-        : ula_floating_bus_read();
-
-    case 0x153B:
-      return self.is_enabled[E_IO_FUNC_UART]
-        ? uart_select_read()
-        : ula_floating_bus_read();
-
-    case 0x163B:
-      return self.is_enabled[E_IO_FUNC_UART]
-        ? uart_frame_read()
-        : ula_floating_bus_read();
-
-    case 0x1FFD:
-      return self.is_enabled[E_IO_FUNC_PAGING_PLUS_3]
-        ? paging_spectrum_plus_3_paging_read()
-        : ula_floating_bus_read();
-
-    case 0x243B:
-      return nextreg_select_read(address);
-
-    case 0x253B:
-      return nextreg_data_read(address);
-
-    case 0x7FFD:
-      return self.is_enabled[E_IO_FUNC_PAGING_128K]
-        ? paging_spectrum_128k_paging_read()
-        : ula_floating_bus_read();
-
-    case 0xDFFD:
-      return self.is_enabled[E_IO_FUNC_PAGING_NEXT_BANK]
-        ? paging_spectrum_next_bank_extension_read()
-        : ula_floating_bus_read();
-
-    case 0xFBDF:
-      return self.is_enabled[E_IO_FUNC_MOUSE]
-        ? mouse_read_x()
-        : ula_floating_bus_read();
-
-    case 0xFFDF:
-      return self.is_enabled[E_IO_FUNC_MOUSE]
-        ? mouse_read_y()
-        : ula_floating_bus_read();
-
-    case 0xFADF:
-      return self.is_enabled[E_IO_FUNC_MOUSE]
-        ? mouse_read_buttons()
-        : ula_floating_bus_read();
-
-    default:
-      break;
-  } 
-
-  if ((address & 0xC007) == 0xC005) {
-    return self.is_enabled[E_IO_FUNC_AY]
-      ? ay_register_read()
-      : ula_floating_bus_read();
-  }
-
-  if ((address & 0x00FF) == self.mf_port_enable) {
-    return self.is_enabled[E_IO_FUNC_MF]
-      ? mf_enable_read(address)
-      : ula_floating_bus_read();
-  }
-
-  if ((address & 0x00FF) == self.mf_port_disable) {
-    return self.is_enabled[E_IO_FUNC_MF]
-      ? mf_disable_read(address)
-      : ula_floating_bus_read();
-  }
-
-  switch (address & 0x00FF) {
-    case 0x0B:
-      return self.is_enabled[E_IO_FUNC_DMA_Z80]
-        ? dma_read(address)
-        : ula_floating_bus_read();
-
-    case 0x1F:
-      return self.is_enabled[E_IO_FUNC_KEMPSTON_1]
-        ? joystick_kempston_read(E_JOYSTICK_LEFT)
-        : ula_floating_bus_read();
-
-    case 0x37:
-      return self.is_enabled[E_IO_FUNC_KEMPSTON_2]
-        ? joystick_kempston_read(E_JOYSTICK_RIGHT)
-        : ula_floating_bus_read();
-
-    case 0x6B:
-      return self.is_enabled[E_IO_FUNC_DMA_ZXN]
-        ? dma_read(address)
-        : ula_floating_bus_read();
-
-    case 0xE3:
-      return self.is_enabled[E_IO_FUNC_DIVMMC]
-        ? divmmc_control_read(address)
-        : ula_floating_bus_read();
-
-    case 0xE7:
-      return self.is_enabled[E_IO_FUNC_SPI]
-        ? spi_cs_read(address)
-        : ula_floating_bus_read();
-
-    case 0xEB:
-      return self.is_enabled[E_IO_FUNC_SPI]
-        ? spi_data_read(address)
-        : ula_floating_bus_read();
-
-    case 0xFF:
-      return self.is_enabled[E_IO_FUNC_TIMEX]
-        ? ula_timex_read(address)
-        : ula_floating_bus_read();
+  switch (self.read_port[address]) {
+    case E_IO_PORT_ULA:              return ula_read(address);
+    case E_IO_PORT_I2C_SDA:          return i2c_sda_read(address);
+    case E_IO_PORT_LAYER_2:          return layer2_access_read();
+    case E_IO_PORT_UART_TX:          return uart_tx_read();
+    case E_IO_PORT_UART_RX:          return uart_rx_read();
+    case E_IO_PORT_UART_SELECT:      return uart_select_read();
+    case E_IO_PORT_UART_FRAME:       return uart_frame_read();
+    case E_IO_PORT_PAGING_PLUS_3:    return paging_spectrum_plus_3_paging_read();
+    case E_IO_PORT_NEXTREG_SELECT:   return nextreg_select_read(address);
+    case E_IO_PORT_NEXTREG_DATA:     return nextreg_data_read(address);
+    case E_IO_PORT_PAGING_128K:      return paging_spectrum_128k_paging_read();
+    case E_IO_PORT_PAGING_NEXT_BANK: return paging_spectrum_next_bank_extension_read();
+    case E_IO_PORT_MOUSE_X:          return mouse_read_x();
+    case E_IO_PORT_MOUSE_Y:          return mouse_read_y();
+    case E_IO_PORT_MOUSE_BUTTONS:    return mouse_read_buttons();
+    case E_IO_PORT_AY_REGISTER:      return ay_register_read();
+    case E_IO_PORT_MF_ENABLE:        return mf_enable_read(address);
+    case E_IO_PORT_MF_DISABLE:       return mf_disable_read(address);
+    case E_IO_PORT_DMA:              return dma_read(address);
+    case E_IO_PORT_KEMPSTON_1:       return joystick_kempston_read(E_JOYSTICK_LEFT);
+    case E_IO_PORT_KEMPSTON_2:       return joystick_kempston_read(E_JOYSTICK_RIGHT);
+    case E_IO_PORT_DIVMMC:           return divmmc_control_read(address);
+    case E_IO_PORT_SPI_CS:           return spi_cs_read(address);
+    case E_IO_PORT_SPI_DATA:         return spi_data_read(address);
+    case E_IO_PORT_TIMEX:            return ula_timex_read(address);
+
+    case E_IO_PORT_DISABLED:
+      return ula_floating_bus_read();
 
     default:
       break;
@@ -282,239 +337,56 @@ u8_t io_read(u16_t address) {
 }
 
 
-void io_write(u16_t address, u8_t value) {
-  io_contend(address);
-
-  if ((address & 0x0001) == 0x0000) {
-    ula_write(address, value);
-    return;
-  }
-
-  switch (address) {
-    case 0x103B:
-      if (self.is_enabled[E_IO_FUNC_I2C]) {
-        i2c_scl_write(address, value);
-      }
-      return;
-
-    case 0x113B:
-      if (self.is_enabled[E_IO_FUNC_I2C]) {
-        i2c_sda_write(address, value);
-      }
-      return;
-
-    case 0x123B:
-      if (self.is_enabled[E_IO_FUNC_LAYER_2]) {
-        layer2_access_write(value);
-      }
-      return;
-
-    case 0x133B:
-      if (self.is_enabled[E_IO_FUNC_UART]) {
-        uart_tx_write(value);
-      }
-      return;
-
-    case 0x143B:
-      if (self.is_enabled[E_IO_FUNC_UART]) {
-        uart_rx_write(value);
-      }
-      return;
-
-    case 0x153B:
-      if (self.is_enabled[E_IO_FUNC_UART]) {
-        uart_select_write(value);
-      }
-      return;
-
-    case 0x163B:
-      if (self.is_enabled[E_IO_FUNC_UART]) {
-        uart_frame_write(value);
-      }
-      return;
-
-    case 0x1FFD:
-      if (self.is_enabled[E_IO_FUNC_PAGING_PLUS_3]) {
-        paging_spectrum_plus_3_paging_write(value);
-      }
-      return;
-
-    case 0x243B:
-      nextreg_select_write(address, value);
-      return;
-
-    case 0x253B:
-      nextreg_data_write(address, value);
-      return;
-
-    case 0x303B:
-      if (self.is_enabled[E_IO_FUNC_SPRITES]) {
-        sprites_slot_set(value);
-      }
-      return;
-
-    case 0x7FFD:
-      if (self.is_enabled[E_IO_FUNC_PAGING_128K]) {
-        paging_spectrum_128k_paging_write(value);
-      }
-      return;
-
-    case 0xDFFD:
-      if (self.is_enabled[E_IO_FUNC_PAGING_NEXT_BANK]) {
-        paging_spectrum_next_bank_extension_write(value);
-      }
-      return;
-
-    default:
-      break;
-  }
-
-  if (self.is_enabled[E_IO_FUNC_MF]) {
-    if ((address & 0x00FF) == self.mf_port_enable) {
-      mf_enable_write(address, value);
-      return;
-    }
-
-    if (address == self.mf_port_disable) {
-      mf_disable_write(address, value);
-      return;
-    }
-  }
-
-  switch (address & 0xC007) {
-    case 0xC005:  /* 0xFFFD */
-      if (self.is_enabled[E_IO_FUNC_AY]) {
-        ay_register_select(value);
-      }
-      return;
-
-    case 0x8005:  /* 0xBFFD */
-      if (self.is_enabled[E_IO_FUNC_AY]) {
-        ay_register_write(value);
-      }
-      return;
-
-    default:
-      break;
+/**
+ * Reads up to length bytes from a port in one go, for ports that support it.
+ * Returns the number of bytes, or zero if the port should be read normally.
+ */
+u32_t io_read_n(u16_t address, const u8_t** data, u32_t length) {
+  if (self.read_port[address] == E_IO_PORT_SPI_DATA) {
+    return spi_data_read_n(address, data, length);
   }
 
-  switch (address & 0x00FF) {
-    case 0x0B:
-      if (self.is_enabled[E_IO_FUNC_DMA_Z80]) {
-        dma_write(address, value);
-      }
-      break;
-
-    case 0x6B:
-      if (self.is_enabled[E_IO_FUNC_DMA_ZXN]) {
-        dma_write(address, value);
-      }
-      return;
-
-    case 0xE3:
-      if (self.is_enabled[E_IO_FUNC_DIVMMC]) {
-        divmmc_control_write(address, value);
-      }
-      return;
-
-    case 0xE7:
-      if (self.is_enabled[E_IO_FUNC_SPI]) {
-        spi_cs_write(address, value);
-      }
-      return;
-
-    case 0xEB:
-      if (self.is_enabled[E_IO_FUNC_SPI]) {
-        spi_data_write(address, value);
-      }
-      return;
-
-    case 0xFF:
-      if (self.is_enabled[E_IO_FUNC_TIMEX]) {
-        ula_timex_write(address, value);
-      }
-      return;
-
-    case 0x0F:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1] ||
-          self.is_enabled[E_IO_FUNC_DAC_STEREO_COVOX]) {
-        dac_write(DAC_B, value);
-      }
-      return;
-
-    case 0x1F:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1]) {
-        dac_write(DAC_A, value);
-      }
-      return;
-
-    case 0x3F:
-      if (self.is_enabled[E_IO_FUNC_DAC_STEREO_PROFI_COVOX]) {
-        dac_write(DAC_A, value);
-      }
-      return;
-
-    case 0x4F:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1] ||
-          self.is_enabled[E_IO_FUNC_DAC_STEREO_COVOX]) {
-        dac_write(DAC_C, value);
-      }
-      return;
-
-    case 0x5F:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_1] ||
-          self.is_enabled[E_IO_FUNC_DAC_STEREO_PROFI_COVOX]) {
-        dac_write(DAC_D, value);
-      }
-      return;
-
-    case 0xB3:
-      if (self.is_enabled[E_IO_FUNC_DAC_MONO_GS_COVOX]) {
-        dac_write(DAC_B | DAC_C, value);
-      }
-      return;
-
-    case 0xDF:
-      if (self.is_enabled[E_IO_FUNC_DAC_MONO_SPECDRUM]) {
-        dac_write(DAC_A | DAC_D, value);
-      }
-      return;
-
-    case 0xF1:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2]) {
-        dac_write(DAC_A, value);
-      }
-      return;
-
-    case 0xF3:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2]) {
-        dac_write(DAC_B, value);
-      }
-      return;
+  return 0;
+}
 
-    case 0xF9:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2]) {
-        dac_write(DAC_C, value);
-      }
-      return;
 
-    case 0xFB:
-      if (self.is_enabled[E_IO_FUNC_DAC_SOUNDRIVE_MODE_2] ||
-          self.is_enabled[E_IO_FUNC_DAC_MONO_PENTAGON_ATM]) {
-        dac_write(DAC_A | DAC_D, value);
-      }
-      return;
-
-    case 0x57:
-      if (self.is_enabled[E_IO_FUNC_SPRITES]) {
-        sprites_next_attribute_set(value);
-      }
-      return;
+void io_write(u16_t address, u8_t value) {
+  io_contend(address);
 
-    case 0x5B:
-      if (self.is_enabled[E_IO_FUNC_SPRITES]) {
-        sprites_next_pattern_set(value);
-      }
+  switch (self.write_port[address]) {
+    case E_IO_PORT_ULA:               ula_write(address, value);                           return;
+    case E_IO_PORT_I2C_SCL:           i2c_scl_write(address, value);                       return;
+    case E_IO_PORT_I2C_SDA:           i2c_sda_write(address, value);                       return;
+    case E_IO_PORT_LAYER_2:           layer2_access_write(value);                          return;
+    case E_IO_PORT_UART_TX:           uart_tx_write(value);                                return;
+    case E_IO_PORT_UART_RX:           uart_rx_write(value);                                return;
+    case E_IO_PORT_UART_SELECT:       uart_select_write(value);                            return;
+    case E_IO_PORT_UART_FRAME:        uart_frame_write(value);                             return;
+    case E_IO_PORT_PAGING_PLUS_3:     paging_spectrum_plus_3_paging_write(value);          return;
+    case E_IO_PORT_NEXTREG_SELECT:    nextreg_select_write(address, value);                return;
+    case E_IO_PORT_NEXTREG_DATA:      nextreg_data_write(address, value);                  return;
+    case E_IO_PORT_SPRITES_SLOT:      sprites_slot_set(value);                             return;
+    case E_IO_PORT_SPRITES_ATTRIBUTE: sprites_next_attribute_set(value);                   return;
+    case E_IO_PORT_SPRITES_PATTERN:   sprites_next_pattern_set(value);                     return;
+    case E_IO_PORT_PAGING_128K:       paging_spectrum_128k_paging_write(value);            return;
+    case E_IO_PORT_PAGING_NEXT_BANK:  paging_spectrum_next_bank_extension_write(value);    return;
+    case E_IO_PORT_AY_REGISTER:       ay_register_select(value);                           return;
+    case E_IO_PORT_AY_DATA:           ay_register_write(value);                            return;
+    case E_IO_PORT_MF_ENABLE:         mf_enable_write(address, value);                     return;
+    case E_IO_PORT_MF_DISABLE:        mf_disable_write(address, value);                    return;
+    case E_IO_PORT_DMA:               dma_write(address, value);                           return;
+    case E_IO_PORT_DIVMMC:            divmmc_control_write(address, value);                return;
+    case E_IO_PORT_SPI_CS:            spi_cs_write(address, value);                        return;
+    case E_IO_PORT_SPI_DATA:          spi_data_write(address, value);                      return;
+    case E_IO_PORT_TIMEX:             ula_timex_write(address, value);                     return;
+    case E_IO_PORT_DAC_A:             dac_write(DAC_A, value);                             return;
+    case E_IO_PORT_DAC_B:             dac_write(DAC_B, value);                             return;
+    case E_IO_PORT_DAC_C:             dac_write(DAC_C, value);                             return;
+    case E_IO_PORT_DAC_D:             dac_write(DAC_D, value);                             return;
+    case E_IO_PORT_DAC_AD:            dac_write(DAC_A | DAC_D, value);                     return;
+    case E_IO_PORT_DAC_BC:            dac_write(DAC_B | DAC_C, value);                     return;
+
+    case E_IO_PORT_DISABLED:
       return;
 
     default:
@@ -569,6 +441,8 @@ void io_decoding_write(u8_t index, u8_t value) {
       break;
 
     default:
-      break;
+      return;
   }
+
+  io_decoding_rebuild();
 }
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include "defs.h"
 #include "layer2.h"
@@ -6,6 +7,25 @@
 #include "palette.h"
 
 
+/**
+ * Pixels are produced a scanline at a time into a line of palette indices,
+ * which is rendered again whenever anything it depends on changes, so that
+ * mid-line changes by the copper still take effect at the right pixel.
+ *
+ * The 320x256 and 640x256 modes are stored column by column. To not stride
+ * through memory for every pixel, those are read from a transposed copy of
+ * the five banks involved, which is built a row at a time when first
+ * needed and then kept up to date by every write to those banks.
+ */
+
+
+#define BANK_SIZE         (16 * 1024)
+#define N_ROWS            256
+#define N_COLUMNS         320  /* Bytes per row in 320x256 and 640x256. */
+#define LINE_CLIPPED      0x100
+#define LINE_INVALID      0xFFFFFFFF
+
+
 typedef enum {
   E_RESOLUTION_256X192 = 0,
   E_RESOLUTION_320X256,
@@ -42,6 +62,15 @@ typedef struct {
   int          clip_y2;
   u8_t         offset_y;
   u16_t        offset_x;
+
+  /* Scanline being displayed, in frame buffer columns. */
+  u16_t        line[FRAME_BUFFER_WIDTH];
+  u32_t        line_row;
+  u32_t        line_source_row;
+
+  /* Transposed copy of the active banks, for 320x256 and 640x256. */
+  u8_t       (*transposed)[N_COLUMNS];
+  u8_t         is_transposed_row_valid[N_ROWS];
 } self_t;
 
 
@@ -51,6 +80,12 @@ static self_t self;
 int layer2_init(u8_t* sram) {
   memset(&self, 0, sizeof(self));
 
+  self.transposed = malloc(N_ROWS * N_COLUMNS);
+  if (self.transposed == NULL) {
+    log_err("layer2: out of memory\n");
+    return -1;
+  }
+
   self.ram = &sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM];
 
   layer2_reset(E_RESET_HARD);
@@ -60,10 +95,26 @@ int layer2_init(u8_t* sram) {
 
 
 void layer2_finit(void) {
+  if (self.transposed != NULL) {
+    free(self.transposed);
+    self.transposed = NULL;
+  }
+}
+
+
+static void layer2_line_invalidate(void) {
+  self.line_row = LINE_INVALID;
+}
+
+
+void layer2_ram_invalidate(void) {
+  memset(self.is_transposed_row_valid, 0, sizeof(self.is_transposed_row_valid));
+  layer2_line_invalidate();
 }
 
 
 void layer2_reset(reset_t reset) {
+  layer2_ram_invalidate();
   layer2_access_write(0x00);
   layer2_access_write(0x10);
   layer2_active_bank_write(8);
@@ -115,12 +166,14 @@ void layer2_access_write(u8_t value) {
 void layer2_control_write(u8_t value) {
   self.resolution     = (value & 0x30) >> 4;
   self.palette_offset = value & 0x0F;
+  layer2_line_invalidate();
 }
 
 
 void layer2_active_bank_write(u8_t bank) {
   if (bank != self.active_bank) {
     self.active_bank = bank;
+    layer2_ram_invalidate();
   }
 }
 
@@ -132,79 +185,156 @@ void layer2_shadow_bank_write(u8_t bank) {
 }
 
 
-void layer2_tick(u32_t row, u32_t column, int* is_enabled, const palette_entry_t** rgb, int* is_priority) {
-  u8_t palette_index ;
+static const u8_t* layer2_transposed_row(u32_t row) {
+  if (!self.is_transposed_row_valid[row]) {
+    const u8_t* src = &self.ram[self.active_bank * BANK_SIZE + row];
+    u32_t       column;
 
-  if (!self.is_visible) {
-    *is_enabled = 0;
+    for (column = 0; column < N_COLUMNS; column++) {
+      self.transposed[row][column] = src[column * N_ROWS];
+    }
+    self.is_transposed_row_valid[row] = 1;
+  }
+
+  return self.transposed[row];
+}
+
+
+static void layer2_line_render_256x192(u32_t row) {
+  const u8_t* src;
+  u32_t       column;
+  u32_t       x;
+
+  for (column = 0; column < FRAME_BUFFER_WIDTH; column++) {
+    self.line[column] = LINE_CLIPPED;
+  }
+
+  if (row < 32 || row >= 32 + 192) {
+    return;
+  }
+
+  /* Convert to interior 256x192 space. */
+  row -= 32;
+  if (row < self.clip_y1 || row > self.clip_y2) {
+    return;
+  }
+
+  self.line_source_row = (row + self.offset_y) % 192;
+  src = &self.ram[self.active_bank * BANK_SIZE + self.line_source_row * 256];
+
+  for (x = self.clip_x1; x <= self.clip_x2; x++) {
+    const u8_t index = (self.palette_offset << 4) + src[(x + self.offset_x) & 0xFF];
+
+    self.line[(32 + x) * 2]     = index;
+    self.line[(32 + x) * 2 + 1] = index;
+  }
+}
+
+
+static void layer2_line_render_320x256(u32_t row) {
+  const u8_t* src;
+  u32_t       x_end;
+  u32_t       x;
+  u32_t       source_x;
+
+  for (x = 0; x < FRAME_BUFFER_WIDTH; x++) {
+    self.line[x] = LINE_CLIPPED;
+  }
+
+  if (row < self.clip_y1 || row > self.clip_y2) {
+    return;
+  }
+
+  self.line_source_row = (row + self.offset_y) % 256;
+  src = layer2_transposed_row(self.line_source_row);
+
+  x_end    = (self.clip_x2 * 2 < N_COLUMNS) ? self.clip_x2 * 2 : N_COLUMNS - 1;
+  source_x = (self.clip_x1 * 2 + self.offset_x) % N_COLUMNS;
+
+  for (x = self.clip_x1 * 2; x <= x_end; x++) {
+    const u8_t index = (self.palette_offset << 4) + src[source_x];
+
+    self.line[x * 2]     = index;
+    self.line[x * 2 + 1] = index;
+
+    if (++source_x == N_COLUMNS) {
+      source_x = 0;
+    }
+  }
+}
+
+
+static void layer2_line_render_640x256(u32_t row) {
+  const u8_t* src;
+  u32_t       x_end;
+  u32_t       x;
+  u32_t       source_x;
+
+  for (x = 0; x < FRAME_BUFFER_WIDTH; x++) {
+    self.line[x] = LINE_CLIPPED;
+  }
+
+  if (row < self.clip_y1 || row > self.clip_y2) {
     return;
   }
 
+  self.line_source_row = (row + self.offset_y) % 256;
+  src = layer2_transposed_row(self.line_source_row);
+
+  x_end    = self.clip_x2 * 2 + 1;
+  source_x = (self.clip_x1 * 2 + self.offset_x) % (N_COLUMNS * 2);
+
+  for (x = self.clip_x1 * 2; x <= x_end; x++) {
+    const u8_t pixels = src[source_x / 2];
+
+    self.line[x] = (u8_t) ((self.palette_offset << 4) + ((source_x & 1) ? (pixels & 0x0F) : (pixels >> 4)));
+
+    if (++source_x == N_COLUMNS * 2) {
+      source_x = 0;
+    }
+  }
+}
+
+
+static void layer2_line_render(u32_t row) {
   switch (self.resolution) {
     case E_RESOLUTION_256X192:
-      if (row < 32 || row >= 32 + 192 || column < 32 * 2 || column >= (32 + 256) * 2) {
-        *is_enabled = 0;
-        return;
-      }
-
-      /* Convert to interior 256x192 space. */
-      row    = row - 32;
-      column = (column - 32 * 2) / 2;
-
-      /* Honour the clipping area. */
-      if (row     < self.clip_y1
-       || row     > self.clip_y2
-       || column  < self.clip_x1
-       || column  > self.clip_x2) {
-        *is_enabled = 0;
-        return;
-      }
-
-      row    = (row    + self.offset_y) % 192;
-      column = (column + self.offset_x) % 256;
-
-      palette_index = self.ram[self.active_bank * 16 * 1024 + row * 256 + column];
+      layer2_line_render_256x192(row);
       break;
 
     case E_RESOLUTION_320X256:
-      column /= 2;
-
-      /* Honour the clipping area. */
-      if (row        < self.clip_y1
-       || row        > self.clip_y2
-       || column     < self.clip_x1 * 2
-       || column     > self.clip_x2 * 2) {
-        *is_enabled = 0;
-        return;
-      }
-
-      row    = (row    + self.offset_y) % 256;
-      column = (column + self.offset_x) % 320;
-
-      palette_index = self.ram[self.active_bank * 16 * 1024 + column * 256 + row];
+      layer2_line_render_320x256(row);
       break;
 
     default:
-      /* Honour the clipping area. */
-      if (row        < self.clip_y1
-       || row        > self.clip_y2
-       || column / 2 < self.clip_x1
-       || column / 2 > self.clip_x2) {
-        *is_enabled = 0;
-        return;
-      }
-
-      row    = (row    + self.offset_y) % 256;
-      column = (column + self.offset_x) % 640;
-
-      palette_index = self.ram[self.active_bank * 16 * 1024 + column / 2 * 256 + row];
-      palette_index = (column & 1) ? (palette_index & 0x0F) : (palette_index >> 4);
+      layer2_line_render_640x256(row);
       break;
   }
 
-  *is_enabled  = 1;
-  *rgb         = palette_read(self.palette, (self.palette_offset << 4) + palette_index);
-  *is_priority = (*rgb)->is_layer2_priority;
+  self.line_row = row;
+}
+
+
+void layer2_tick(u32_t row, u32_t column, int* is_enabled, u16_t* colour) {
+  u16_t palette_index;
+
+  if (!self.is_visible) {
+    *is_enabled = 0;
+    return;
+  }
+
+  if (row != self.line_row) {
+    layer2_line_render(row);
+  }
+
+  palette_index = self.line[column];
+  if (palette_index == LINE_CLIPPED) {
+    *is_enabled = 0;
+    return;
+  }
+
+  *is_enabled = 1;
+  *colour     = PALETTE_COLOUR(self.palette, palette_index);
 }
 
 
@@ -269,7 +399,32 @@ u8_t layer2_read(u16_t address) {
 
 
 void layer2_write(u16_t address, u8_t value) {
-  self.ram[layer2_translate(address)] = value;
+  const u32_t offset = layer2_translate(address);
+
+  self.ram[offset] = value;
+  memory_ram_written(offset, value);
+}
+
+
+/**
+ * Called for every write to the ZX Spectrum RAM, with the offset into it,
+ * to keep the transposed copy current and to render the scanline again when
+ * the write changed it.
+ */
+void layer2_ram_written(u32_t offset, u8_t value) {
+  const u32_t relative = offset - self.active_bank * BANK_SIZE;
+
+  if (relative >= N_ROWS * N_COLUMNS) {
+    return;
+  }
+
+  self.transposed[relative % N_ROWS][relative / N_ROWS] = value;
+
+  if (self.line_row != LINE_INVALID) {
+    if (self.resolution == E_RESOLUTION_256X192 ? (relative / 256 == self.line_source_row) : (relative % N_ROWS == self.line_source_row)) {
+      layer2_line_invalidate();
+    }
+  }
 }
 
 
@@ -283,21 +438,25 @@ void layer2_clip_set(u8_t x1, u8_t x2, u8_t y1, u8_t y2) {
   self.clip_x2 = x2;
   self.clip_y1 = y1;
   self.clip_y2 = y2;
+  layer2_line_invalidate();
 }
 
 
 void layer2_offset_x_msb_write(u8_t value) {
   self.offset_x = (value << 8) | (self.offset_x & 0x00FF);
+  layer2_line_invalidate();
 }
 
 
 void layer2_offset_x_lsb_write(u8_t value) {
   self.offset_x = (self.offset_x & 0xFF00) | value;
+  layer2_line_invalidate();
 }
 
 
 void layer2_offset_y_write(u8_t value) {
   self.offset_y = value;
+  layer2_line_invalidate();
 }
 
 
@@ -14,11 +14,13 @@ void layer2_access_write(u8_t value);
 void layer2_control_write(u8_t value);
 void layer2_active_bank_write(u8_t bank);
 void layer2_shadow_bank_write(u8_t bank);
-void layer2_tick(u32_t row, u32_t column, int* is_enabled, const palette_entry_t** rgb, int* is_priority);
+void layer2_tick(u32_t row, u32_t column, int* is_enabled, u16_t* colour);
 int  layer2_is_readable(int page);
 int  layer2_is_writable(int page);
 u8_t layer2_read(u16_t address);
 void layer2_write(u16_t address, u8_t value);
+void layer2_ram_written(u32_t offset, u8_t value);
+void layer2_ram_invalidate(void);
 void layer2_palette_set(int use_second);
 void layer2_clip_set(u8_t x1, u8_t x2, u8_t y1, u8_t y2);
 void layer2_offset_x_msb_write(u8_t value);
@@ -0,0 +1,694 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "ay.h"
+#include "cpu.h"
+#include "defs.h"
+#include "loader.h"
+#include "log.h"
+#include "memory.h"
+#include "nextreg.h"
+#include "paging.h"
+#include "palette.h"
+#include "tape.h"
+#include "ula.h"
+#include "utils.h"
+
+
+/**
+ * Loads a program straight into memory, without going through the boot ROM
+ * and the TBBlue firmware on the SD card. The firmware would normally put the
+ * Spectrum ROMs in place and set up the palettes, so we do that ourselves.
+ */
+#define LOADER_ROM_FILENAME  "enNextZX.rom"
+#define LOADER_ROM_SIZE      (64 * 1024)
+#define LOADER_BANK_SIZE     (16 * 1024)
+#define LOADER_N_BANKS       ((MEMORY_SRAM_SIZE - MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM) / LOADER_BANK_SIZE)
+
+
+typedef struct {
+  u8_t* sram;
+} self_t;
+
+
+static self_t self;
+
+
+int loader_init(u8_t* sram) {
+  self.sram = sram;
+
+  return 0;
+}
+
+
+void loader_finit(void) {
+}
+
+
+static u16_t loader_u16(const u8_t* data) {
+  return data[0] | data[1] << 8;
+}
+
+
+static u32_t loader_u32(const u8_t* data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (u32_t) data[3] << 24;
+}
+
+
+static u8_t* loader_bank(u8_t bank) {
+  return &self.sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM + bank * LOADER_BANK_SIZE];
+}
+
+
+static void loader_palettes_reset(void) {
+  /* Standard ULA colours, normal and bright, in RRRGGGBB. */
+  const u8_t colours[2][8] = {
+    {0x00, 0x02, 0xA0, 0xA2, 0x14, 0x16, 0xB4, 0xB6},
+    {0x00, 0x03, 0xE0, 0xE7, 0x1C, 0x1F, 0xFC, 0xFF}
+  };
+  palette_t palette;
+  int       i;
+
+  for (palette = E_PALETTE_ULA_FIRST; palette <= E_PALETTE_TILEMAP_SECOND; palette++) {
+    for (i = 0; i < 256; i++) {
+      palette_write_rgb8(palette, i, i);
+    }
+  }
+
+  /**
+   * https://gitlab.com/SpectrumNext/ZX_Spectrum_Next_FPGA/-/raw/master/cores/zxnext/nextreg.txt
+   *
+   * > ULA Classic mode: 0-7 Ink, 8-15 Bright Ink, 16-23 Paper, 24-31 Bright Paper
+   */
+  for (i = 0; i < 16; i++) {
+    const u8_t rgb8 = colours[i >> 3][i & 0x07];
+
+    palette_write_rgb8(E_PALETTE_ULA_FIRST,  i,      rgb8);
+    palette_write_rgb8(E_PALETTE_ULA_FIRST,  i + 16, rgb8);
+    palette_write_rgb8(E_PALETTE_ULA_SECOND, i,      rgb8);
+    palette_write_rgb8(E_PALETTE_ULA_SECOND, i + 16, rgb8);
+  }
+}
+
+
+static int loader_machine_set(machine_type_t machine) {
+  if (utils_load_rom(LOADER_ROM_FILENAME, LOADER_ROM_SIZE, &self.sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_ROM]) != 0) {
+    return -1;
+  }
+
+  /* We have no Pentagon ROM support, so run those in 128K mode. */
+  if (machine == E_MACHINE_TYPE_PENTAGON) {
+    machine = E_MACHINE_TYPE_ZX_128K_PLUS2;
+  }
+
+  /* Sets the display timing and leaves config mode, just as the firmware. */
+  nextreg_write_internal(E_NEXTREG_REGISTER_MACHINE_TYPE, 0x80 | machine << 4 | machine);
+
+  loader_palettes_reset();
+
+  return 0;
+}
+
+
+/**
+ * https://worldofspectrum.org/faq/reference/formats.htm
+ *
+ * > Offset   Size   Description
+ * > ------------------------------------------------------------------------
+ * > 0        1      byte   I
+ * > 1        8      word   HL',DE',BC',AF'
+ * > 9        10     word   HL,DE,BC,IY,IX
+ * > 19       1      byte   Interrupt (bit 2 contains IFF2, 1=EI/0=DI)
+ * > 20       1      byte   R
+ * > 21       4      words  AF,SP
+ * > 25       1      byte   IntMode (0=IM0/1=IM1/2=IM2)
+ * > 26       1      byte   BorderColor (0..7, not used by Spectrum 1.7)
+ * > 27       49152  bytes  RAM dump 16384..65535
+ */
+#define SNA_HEADER_SIZE   27
+#define SNA_48K_SIZE      (SNA_HEADER_SIZE + 3 * LOADER_BANK_SIZE)
+#define SNA_128K_SIZE     (SNA_48K_SIZE + 4 + 5 * LOADER_BANK_SIZE)
+#define SNA_128K_SIZE_2   (SNA_128K_SIZE + LOADER_BANK_SIZE)
+
+
+static int loader_load_sna(const u8_t* data, size_t size) {
+  const u8_t      banks_48k[3] = {5, 2, 0};
+  const int       is_128k      = (size == SNA_128K_SIZE || size == SNA_128K_SIZE_2);
+  cpu_registers_t registers;
+  u8_t            paged_bank   = 0;
+  int             i;
+
+  if (size != SNA_48K_SIZE && !is_128k) {
+    log_err("loader: invalid SNA size %lu\n", size);
+    return -1;
+  }
+
+  if (is_128k) {
+    paged_bank = data[SNA_48K_SIZE + 2] & 0x07;
+
+    /* The paged bank is only stored once, so six banks follow if it's 5 or 2. */
+    if ((paged_bank == 5 || paged_bank == 2) != (size == SNA_128K_SIZE_2)) {
+      log_err("loader: SNA size %lu does not match paged bank %u\n", size, paged_bank);
+      return -1;
+    }
+  }
+
+  if (loader_machine_set(is_128k ? E_MACHINE_TYPE_ZX_128K_PLUS2 : E_MACHINE_TYPE_ZX_48K) != 0) {
+    return -1;
+  }
+
+  /* The 48K part holds banks 5, 2 and whatever bank is paged in at $C000. */
+  for (i = 0; i < 3; i++) {
+    const u8_t bank = (i == 2) ? paged_bank : banks_48k[i];
+    memcpy(loader_bank(bank), &data[SNA_HEADER_SIZE + i * LOADER_BANK_SIZE], LOADER_BANK_SIZE);
+  }
+
+  registers.i    = data[0];
+  registers.hl_  = loader_u16(&data[1]);
+  registers.de_  = loader_u16(&data[3]);
+  registers.bc_  = loader_u16(&data[5]);
+  registers.af_  = loader_u16(&data[7]);
+  registers.hl   = loader_u16(&data[9]);
+  registers.de   = loader_u16(&data[11]);
+  registers.bc   = loader_u16(&data[13]);
+  registers.iy   = loader_u16(&data[15]);
+  registers.ix   = loader_u16(&data[17]);
+  registers.iff1 = (data[19] & 0x04) >> 2;
+  registers.iff2 = registers.iff1;
+  registers.r    = data[20];
+  registers.af   = loader_u16(&data[21]);
+  registers.sp   = loader_u16(&data[23]);
+  registers.im   = data[25] & 0x03;
+
+  ula_write(0x00FE, data[26] & 0x07);
+
+  if (is_128k) {
+    const u8_t* next = &data[SNA_48K_SIZE + 4];
+    u8_t        bank;
+
+    registers.pc = loader_u16(&data[SNA_48K_SIZE]);
+
+    for (bank = 0; bank < 8; bank++) {
+      if (bank == 5 || bank == 2 || bank == paged_bank) {
+        continue;
+      }
+      memcpy(loader_bank(bank), next, LOADER_BANK_SIZE);
+      next += LOADER_BANK_SIZE;
+    }
+
+    paging_spectrum_128k_paging_write(data[SNA_48K_SIZE + 2]);
+  } else {
+    /* A 48K snapshot is taken during an interrupt, with PC on the stack. */
+    if (registers.sp < 0x4000 || registers.sp == 0xFFFF) {
+      log_err("loader: SNA stack pointer %04X outside RAM\n", registers.sp);
+      return -1;
+    }
+    registers.pc  = loader_u16(&data[SNA_HEADER_SIZE + registers.sp - 0x4000]);
+    registers.sp += 2;
+  }
+
+  cpu_registers_set(&registers);
+
+  return 0;
+}
+
+
+/**
+ * https://worldofspectrum.org/faq/reference/z80format.htm
+ *
+ * > The compression method is very simple: it replaces repetitions of at
+ * > least five equal bytes by a four-byte code ED ED xx yy, which stands for
+ * > "byte yy repeated xx times".
+ */
+static int loader_z80_decompress(const u8_t* src, size_t src_size, u8_t* dst, size_t dst_size) {
+  size_t i = 0;
+  size_t j = 0;
+
+  while (i < src_size && j < dst_size) {
+    if (i + 3 < src_size && src[i] == 0xED && src[i + 1] == 0xED) {
+      const u8_t count = src[i + 2];
+      const u8_t value = src[i + 3];
+      u8_t       k;
+
+      for (k = 0; k < count && j < dst_size; k++) {
+        dst[j++] = value;
+      }
+      i += 4;
+    } else {
+      dst[j++] = src[i++];
+    }
+  }
+
+  if (j != dst_size) {
+    log_err("loader: Z80 block decompresses to %lu instead of %lu bytes\n", j, dst_size);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int loader_z80_page_to_bank(int is_48k, u8_t page, u8_t* bank) {
+  if (is_48k) {
+    switch (page) {
+      case 4: *bank = 2; return 0;
+      case 5: *bank = 0; return 0;
+      case 8: *bank = 5; return 0;
+      default:           return -1;
+    }
+  }
+
+  if (page < 3 || page > 10) {
+    return -1;
+  }
+
+  *bank = page - 3;
+  return 0;
+}
+
+
+static int loader_load_z80(const u8_t* data, size_t size) {
+  cpu_registers_t registers;
+  machine_type_t  machine = E_MACHINE_TYPE_ZX_48K;
+  size_t          offset;
+  u16_t           extra   = 0;
+  u8_t            flags;
+  int             i;
+
+  if (size < 30) {
+    log_err("loader: Z80 file too short\n");
+    return -1;
+  }
+
+  flags = data[12];
+  if (flags == 0xFF) {
+    /* For compatibility reasons, a value of 255 has to be regarded as 1. */
+    flags = 0x01;
+  }
+
+  registers.af   = data[0] << 8 | data[1];
+  registers.bc   = loader_u16(&data[2]);
+  registers.hl   = loader_u16(&data[4]);
+  registers.pc   = loader_u16(&data[6]);
+  registers.sp   = loader_u16(&data[8]);
+  registers.i    = data[10];
+  registers.r    = (data[11] & 0x7F) | (flags & 0x01) << 7;
+  registers.de   = loader_u16(&data[13]);
+  registers.bc_  = loader_u16(&data[15]);
+  registers.de_  = loader_u16(&data[17]);
+  registers.hl_  = loader_u16(&data[19]);
+  registers.af_  = data[21] << 8 | data[22];
+  registers.iy   = loader_u16(&data[23]);
+  registers.ix   = loader_u16(&data[25]);
+  registers.iff1 = data[27] != 0;
+  registers.iff2 = data[28] != 0;
+  registers.im   = data[29] & 0x03;
+
+  if (registers.pc == 0) {
+    /* Version 2 or 3, which has an additional header. */
+    if (size < 32) {
+      log_err("loader: Z80 file too short\n");
+      return -1;
+    }
+
+    extra = loader_u16(&data[30]);
+    if ((extra != 23 && extra != 54 && extra != 55) || size < 32 + (size_t) extra) {
+      log_err("loader: invalid Z80 additional header length %u\n", extra);
+      return -1;
+    }
+
+    registers.pc = loader_u16(&data[32]);
+
+    switch (data[34]) {
+      case 0:
+      case 1:
+        machine = E_MACHINE_TYPE_ZX_48K;
+        break;
+
+      case 3:
+        machine = (extra == 23) ? E_MACHINE_TYPE_ZX_128K_PLUS2 : E_MACHINE_TYPE_ZX_48K;
+        break;
+
+      case 4:
+      case 5:
+      case 6:
+      case 12:
+        machine = E_MACHINE_TYPE_ZX_128K_PLUS2;
+        break;
+
+      case 7:
+      case 8:
+      case 13:
+        machine = E_MACHINE_TYPE_ZX_PLUS2A_PLUS2B_PLUS3;
+        break;
+
+      case 9:
+        machine = E_MACHINE_TYPE_PENTAGON;
+        break;
+
+      default:
+        log_err("loader: unsupported Z80 hardware mode %u\n", data[34]);
+        return -1;
+    }
+  }
+
+  if (loader_machine_set(machine) != 0) {
+    return -1;
+  }
+
+  ula_write(0x00FE, (flags >> 1) & 0x07);
+
+  if (extra == 0) {
+    /* Version 1 is always a 48K snapshot of 16384..65535. */
+    const u8_t* src      = &data[30];
+    size_t      src_size = size - 30;
+    u8_t*       ram;
+    u8_t        banks[3] = {5, 2, 0};
+
+    ram = malloc(3 * LOADER_BANK_SIZE);
+    if (ram == NULL) {
+      log_err("loader: out of memory\n");
+      return -1;
+    }
+
+    if (flags & 0x20) {
+      /* Drop the 00 ED ED 00 end marker. */
+      if (src_size >= 4 && memcmp(&src[src_size - 4], "\x00\xED\xED\x00", 4) == 0) {
+        src_size -= 4;
+      }
+      if (loader_z80_decompress(src, src_size, ram, 3 * LOADER_BANK_SIZE) != 0) {
+        free(ram);
+        return -1;
+      }
+    } else if (src_size >= 3 * LOADER_BANK_SIZE) {
+      memcpy(ram, src, 3 * LOADER_BANK_SIZE);
+    } else {
+      log_err("loader: Z80 file too short\n");
+      free(ram);
+      return -1;
+    }
+
+    for (i = 0; i < 3; i++) {
+      memcpy(loader_bank(banks[i]), &ram[i * LOADER_BANK_SIZE], LOADER_BANK_SIZE);
+    }
+
+    free(ram);
+    cpu_registers_set(&registers);
+    return 0;
+  }
+
+  for (offset = 32 + extra; offset + 3 <= size; ) {
+    const u16_t length = loader_u16(&data[offset]);
+    const u8_t  page   = data[offset + 2];
+    const u16_t n      = (length == 0xFFFF) ? LOADER_BANK_SIZE : length;
+    u8_t        bank;
+
+    offset += 3;
+
+    if (offset + n > size) {
+      log_err("loader: Z80 page %u truncated\n", page);
+      return -1;
+    }
+
+    if (loader_z80_page_to_bank(machine == E_MACHINE_TYPE_ZX_48K, page, &bank) != 0) {
+      log_wrn("loader: ignoring Z80 page %u\n", page);
+    } else if (length == 0xFFFF) {
+      memcpy(loader_bank(bank), &data[offset], LOADER_BANK_SIZE);
+    } else if (loader_z80_decompress(&data[offset], n, loader_bank(bank), LOADER_BANK_SIZE) != 0) {
+      return -1;
+    }
+
+    offset += n;
+  }
+
+  if (machine != E_MACHINE_TYPE_ZX_48K) {
+    for (i = 0; i < 16; i++) {
+      ay_register_select(i);
+      ay_register_write(data[39 + i]);
+    }
+    ay_register_select(data[38]);
+
+    if (machine == E_MACHINE_TYPE_ZX_PLUS2A_PLUS2B_PLUS3 && extra == 55) {
+      paging_spectrum_plus_3_paging_write(data[86]);
+    }
+    paging_spectrum_128k_paging_write(data[35]);
+  }
+
+  cpu_registers_set(&registers);
+
+  return 0;
+}
+
+
+/**
+ * https://wiki.specnext.dev/NEX_file_format
+ *
+ * A 512-byte header, followed by the optional palette, loading screens and
+ * copper code, followed by the 16K banks present in the order 5, 2, 0, 1, 3,
+ * 4, 6, 7, 8, 9, ..., 111.
+ */
+#define NEX_HEADER_SIZE              512
+#define NEX_OFFSET_N_BANKS             9
+#define NEX_OFFSET_SCREENS            10
+#define NEX_OFFSET_BORDER             11
+#define NEX_OFFSET_SP                 12
+#define NEX_OFFSET_PC                 14
+#define NEX_OFFSET_BANKS              18
+#define NEX_OFFSET_HI_RES_COLOUR     138
+#define NEX_OFFSET_ENTRY_BANK        139
+#define NEX_OFFSET_FILE_HANDLE       140
+#define NEX_OFFSET_BANKS_OFFSET      144
+#define NEX_OFFSET_SCREENS_2         152
+#define NEX_OFFSET_HAS_COPPER_CODE   153
+
+#define NEX_SCREEN_LAYER2           0x01
+#define NEX_SCREEN_ULA              0x02
+#define NEX_SCREEN_LO_RES           0x04
+#define NEX_SCREEN_HI_RES           0x08
+#define NEX_SCREEN_HI_COLOUR        0x10
+#define NEX_SCREEN_EXTENDED         0x40
+#define NEX_SCREEN_NO_PALETTE       0x80
+
+#define NEX_SCREEN_2_LAYER2_320X256    1
+#define NEX_SCREEN_2_LAYER2_640X256    2
+#define NEX_SCREEN_2_TILEMAP           3
+
+#define NEX_LOADING_SCREEN_BANK        9
+
+
+static int loader_nex_take(const u8_t* data, size_t size, size_t* offset, size_t n, const u8_t** block) {
+  if (*offset + n > size) {
+    log_err("loader: NEX file truncated\n");
+    return -1;
+  }
+
+  *block   = &data[*offset];
+  *offset += n;
+
+  return 0;
+}
+
+
+static int loader_load_nex(const u8_t* data, size_t size) {
+  const u8_t      order[8] = {5, 2, 0, 1, 3, 4, 6, 7};
+  cpu_registers_t registers;
+  const u8_t*     block;
+  size_t          offset   = NEX_HEADER_SIZE;
+  u32_t           banks_offset;
+  u8_t            screens;
+  u8_t            screens_2;
+  u8_t            entry_bank;
+  int             has_palette;
+  int             i;
+
+  if (size < NEX_HEADER_SIZE || memcmp(data, "Next", 4) != 0) {
+    log_err("loader: not a NEX file\n");
+    return -1;
+  }
+
+  screens      = data[NEX_OFFSET_SCREENS];
+  screens_2    = (screens & NEX_SCREEN_EXTENDED) ? data[NEX_OFFSET_SCREENS_2] : 0;
+  entry_bank   = data[NEX_OFFSET_ENTRY_BANK];
+  banks_offset = loader_u32(&data[NEX_OFFSET_BANKS_OFFSET]);
+  has_palette  = !(screens & NEX_SCREEN_NO_PALETTE)
+                 && ((screens & (NEX_SCREEN_LAYER2 | NEX_SCREEN_LO_RES)) || screens_2 != 0);
+
+  if (loader_machine_set(E_MACHINE_TYPE_ZX_PLUS2A_PLUS2B_PLUS3) != 0) {
+    return -1;
+  }
+
+  if (has_palette) {
+    const palette_t palette = (screens & NEX_SCREEN_LO_RES) ? E_PALETTE_ULA_FIRST : E_PALETTE_LAYER2_FIRST;
+
+    if (loader_nex_take(data, size, &offset, 512, &block) != 0) {
+      return -1;
+    }
+    for (i = 0; i < 256; i++) {
+      palette_write_rgb8(palette, i, block[i * 2]);
+      palette_write_rgb9(palette, i, block[i * 2 + 1]);
+    }
+  }
+
+  if (screens & NEX_SCREEN_LAYER2) {
+    if (loader_nex_take(data, size, &offset, 3 * LOADER_BANK_SIZE, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(NEX_LOADING_SCREEN_BANK), block, 3 * LOADER_BANK_SIZE);
+    nextreg_write_internal(E_NEXTREG_REGISTER_LAYER2_ACTIVE_RAM_BANK, NEX_LOADING_SCREEN_BANK);
+    nextreg_write_internal(E_NEXTREG_REGISTER_LAYER2_CONTROL, 0x00);
+    nextreg_write_internal(E_NEXTREG_REGISTER_DISPLAY_CONTROL_1, 0x80);
+  }
+
+  if (screens & NEX_SCREEN_ULA) {
+    if (loader_nex_take(data, size, &offset, 6912, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(5), block, 6912);
+  }
+
+  if (screens & NEX_SCREEN_LO_RES) {
+    if (loader_nex_take(data, size, &offset, 12288, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(5),          block,        6144);
+    memcpy(loader_bank(5) + 0x2000, block + 6144, 6144);
+    ula_lo_res_enable_set(1);
+  }
+
+  if (screens & NEX_SCREEN_HI_RES) {
+    if (loader_nex_take(data, size, &offset, 12288, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(5),          block,        6144);
+    memcpy(loader_bank(5) + 0x2000, block + 6144, 6144);
+    ula_timex_write(0x00FF, 0x06 | (data[NEX_OFFSET_HI_RES_COLOUR] & 0x38));
+  }
+
+  if (screens & NEX_SCREEN_HI_COLOUR) {
+    if (loader_nex_take(data, size, &offset, 12288, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(5),          block,        6144);
+    memcpy(loader_bank(5) + 0x2000, block + 6144, 6144);
+    ula_timex_write(0x00FF, 0x02);
+  }
+
+  if (screens_2 == NEX_SCREEN_2_LAYER2_320X256 || screens_2 == NEX_SCREEN_2_LAYER2_640X256) {
+    if (loader_nex_take(data, size, &offset, 5 * LOADER_BANK_SIZE, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(NEX_LOADING_SCREEN_BANK), block, 5 * LOADER_BANK_SIZE);
+    nextreg_write_internal(E_NEXTREG_REGISTER_LAYER2_ACTIVE_RAM_BANK, NEX_LOADING_SCREEN_BANK);
+    nextreg_write_internal(E_NEXTREG_REGISTER_LAYER2_CONTROL, screens_2 << 4);
+    nextreg_write_internal(E_NEXTREG_REGISTER_DISPLAY_CONTROL_1, 0x80);
+  } else if (screens_2 == NEX_SCREEN_2_TILEMAP && banks_offset == 0) {
+    log_err("loader: NEX tilemap loading screen needs a banks offset\n");
+    return -1;
+  }
+
+  if (data[NEX_OFFSET_HAS_COPPER_CODE]) {
+    if (loader_nex_take(data, size, &offset, 2048, &block) != 0) {
+      return -1;
+    }
+    nextreg_write_internal(E_NEXTREG_REGISTER_COPPER_CONTROL, 0x00);
+    nextreg_write_internal(E_NEXTREG_REGISTER_COPPER_ADDRESS, 0x00);
+    for (i = 0; i < 2048; i++) {
+      nextreg_write_internal(E_NEXTREG_REGISTER_COPPER_DATA_8BIT, block[i]);
+    }
+    nextreg_write_internal(E_NEXTREG_REGISTER_COPPER_ADDRESS, 0x00);
+    nextreg_write_internal(E_NEXTREG_REGISTER_COPPER_CONTROL, 0xC0);
+  }
+
+  if (banks_offset != 0) {
+    /* V1.3 tells us where the banks start, so skip whatever we don't parse. */
+    offset = banks_offset;
+  }
+
+  for (i = 0; i < LOADER_N_BANKS; i++) {
+    const u8_t bank = (i < 8) ? order[i] : i;
+
+    if (!data[NEX_OFFSET_BANKS + bank]) {
+      continue;
+    }
+    if (loader_nex_take(data, size, &offset, LOADER_BANK_SIZE, &block) != 0) {
+      return -1;
+    }
+    memcpy(loader_bank(bank), block, LOADER_BANK_SIZE);
+  }
+
+  if (loader_u16(&data[NEX_OFFSET_FILE_HANDLE]) != 0) {
+    log_wrn("loader: NEX file handle not supported, program may misbehave\n");
+  }
+
+  ula_write(0x00FE, data[NEX_OFFSET_BORDER] & 0x07);
+
+  /* Select the 48K BASIC ROM and page in the entry bank at $C000. */
+  paging_spectrum_plus_3_paging_write(0x04);
+  paging_spectrum_128k_paging_write(0x10 | (entry_bank & 0x07));
+  paging_spectrum_next_bank_extension_write(entry_bank >> 3);
+
+  memset(&registers, 0, sizeof(registers));
+  registers.af   = 0xFFFF;
+  registers.sp   = loader_u16(&data[NEX_OFFSET_SP]);
+  registers.pc   = loader_u16(&data[NEX_OFFSET_PC]);
+  registers.iy   = 0x5C3A;
+  registers.im   = 1;
+  registers.iff1 = 1;
+  registers.iff2 = 1;
+
+  if (registers.pc == 0) {
+    log_wrn("loader: NEX file has no entry point\n");
+  }
+
+  cpu_registers_set(&registers);
+
+  return 0;
+}
+
+
+int loader_load(const char* filename) {
+  const char* extension = strrchr(filename, '.');
+  u8_t*       data;
+  size_t      size;
+  int         result;
+
+  if (extension == NULL) {
+    log_err("loader: %s has no extension\n", filename);
+    return -1;
+  }
+
+  if (strcasecmp(extension, ".tap") == 0 || strcasecmp(extension, ".tzx") == 0) {
+    /* Boot into the 128K ROM with the tape inserted, ready for LOAD "". */
+    if (loader_machine_set(E_MACHINE_TYPE_ZX_128K_PLUS2) != 0) {
+      return -1;
+    }
+    return tape_open(filename);
+  }
+
+  if (utils_load_file(filename, &data, &size) != 0) {
+    return -1;
+  }
+
+  if (strcasecmp(extension, ".nex") == 0) {
+    result = loader_load_nex(data, size);
+  } else if (strcasecmp(extension, ".sna") == 0) {
+    result = loader_load_sna(data, size);
+  } else if (strcasecmp(extension, ".z80") == 0) {
+    result = loader_load_z80(data, size);
+  } else {
+    log_err("loader: unsupported file type %s\n", extension);
+    result = -1;
+  }
+
+  free(data);
+
+  /* Banks were filled behind the video layers' back. */
+  memory_ram_invalidate();
+
+  if (result == 0) {
+    log_wrn("loader: %s loaded\n", filename);
+  }
+
+  return result;
+}
@@ -0,0 +1,13 @@
+#ifndef __LOADER_H
+#define __LOADER_H
+
+
+#include "defs.h"
+
+
+int  loader_init(u8_t* sram);
+void loader_finit(void);
+int  loader_load(const char* filename);
+
+
+#endif  /* __LOADER_H */
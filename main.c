@@ -1,5 +1,5 @@
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_net.h>
+#include <unistd.h>
 #include "altrom.h"
 #include "audio.h"
 #include "ay.h"
@@ -13,11 +13,13 @@
 #include "defs.h"
 #include "divmmc.h"
 #include "esp.h"
+#include "hostfs.h"
 #include "i2c.h"
 #include "io.h"
 #include "joystick.h"
 #include "keyboard.h"
 #include "layer2.h"
+#include "loader.h"
 #include "log.h"
 #include "memory.h"
 #include "mf.h"
@@ -27,11 +29,14 @@
 #include "sprites.h"
 #include "paging.h"
 #include "palette.h"
+#include "pi.h"
 #include "rom.h"
 #include "rtc.h"
 #include "sdcard.h"
 #include "slu.h"
 #include "spi.h"
+#include "tape.h"
+#include "timeline.h"
 #include "tilemap.h"
 #include "uart.h"
 #include "ula.h"
@@ -71,7 +76,19 @@ typedef struct {
 static self_t self;
 
 
-static int main_init(void) {
+/* Set from the command line. */
+typedef struct {
+  const char*       sdcard_delta;
+  int               is_sdcard_delta_committed;
+  spi_accelerator_t spi_accelerator;
+  const char*       hostfs_root;
+  const char*       pi_device;
+  int               is_pi_unthrottled;
+  const char*       timeline;
+} main_options_t;
+
+
+static int main_init(const main_options_t* options) {
   SDL_DisplayMode mode = {
     .format       = MAIN_PIXELFORMAT,
     .w            = FULLSCREEN_MIN_WIDTH,
@@ -184,13 +201,8 @@ static int main_init(void) {
   self.is_function_key_down = 0;
   self.is_windowed          = 1;
 
-  if (SDLNet_Init() != 0) {
-    log_err("SDLNet_Init: %s\n", SDLNet_GetError());
-    goto exit_sdl;
-  }
-
   if (audio_init(self.audio_device) != 0) {
-    goto exit_sdlnet;
+    goto exit_sdl;
   }
 
   if (ay_init() != 0) {
@@ -213,11 +225,11 @@ static int main_init(void) {
     goto exit_rtc;
   }
 
-  if (sdcard_init() != 0) {
+  if (sdcard_init(options->sdcard_delta, options->is_sdcard_delta_committed) != 0) {
     goto exit_i2c;
   }
 
-  if (spi_init() != 0) {
+  if (spi_init(options->spi_accelerator) != 0) {
     goto exit_sdcard;
   }
 
@@ -225,10 +237,14 @@ static int main_init(void) {
     goto exit_spi;
   }
 
-  if (uart_init() != 0) {
+  if (pi_init(options->pi_device, options->is_pi_unthrottled) != 0) {
     goto exit_esp;
   }
 
+  if (uart_init() != 0) {
+    goto exit_pi;
+  }
+
   if (palette_init() != 0) {
     goto exit_uart;
   }
@@ -327,6 +343,22 @@ static int main_init(void) {
     goto exit_copper;
   }
 
+  if (tape_init() != 0) {
+    goto exit_cpu;
+  }
+
+  if (hostfs_init(options->hostfs_root) != 0) {
+    goto exit_tape;
+  }
+
+  if (loader_init(sram) != 0) {
+    goto exit_hostfs;
+  }
+
+  if (timeline_init(options->timeline) != 0) {
+    goto exit_loader;
+  }
+
   memory_refresh_accessors(0, 8);
 
   self.is_60hz = ula_60hz_get();
@@ -336,6 +368,14 @@ static int main_init(void) {
 
   return 0;
 
+exit_loader:
+  loader_finit();
+exit_hostfs:
+  hostfs_finit();
+exit_tape:
+  tape_finit();
+exit_cpu:
+  cpu_finit();
 exit_copper:
   copper_finit();
 exit_slu:
@@ -384,6 +424,8 @@ exit_palette:
   palette_finit();
 exit_uart:
   uart_finit();
+exit_pi:
+  pi_finit();
 exit_esp:
   esp_finit();
 exit_spi:
@@ -402,8 +444,6 @@ exit_ay:
   ay_finit();
 exit_audio:
   audio_finit();
-exit_sdlnet:
-  SDLNet_Quit();
 exit_sdl:
   if (self.controller_left != NULL) {
     SDL_GameControllerClose(self.controller_left);
@@ -545,16 +585,26 @@ static void main_handle_function_keys(void) {
   const int key_cpu_speed  = keyboard_is_special_key_pressed(E_KEYBOARD_SPECIAL_KEY_CPU_SPEED);
   const int key_nmi        = keyboard_is_special_key_pressed(E_KEYBOARD_SPECIAL_KEY_NMI);
   const int key_drive      = keyboard_is_special_key_pressed(E_KEYBOARD_SPECIAL_KEY_DRIVE);
+  const int f10            = self.keyboard_state[SDL_SCANCODE_F10];
   const int f11            = self.keyboard_state[SDL_SCANCODE_F11];
   const int f12            = self.keyboard_state[SDL_SCANCODE_F12];
 
-  if (key_reset_hard || key_reset_soft || key_cpu_speed || key_nmi || key_drive || f11 || f12) {
+  if (key_reset_hard || key_reset_soft || key_cpu_speed || key_nmi || key_drive || f10 || f11 || f12) {
     if (!self.is_function_key_down) {
       if (key_reset_hard)  self.task = E_MAIN_TASK_RESET_HARD;
       if (key_reset_soft)  self.task = E_MAIN_TASK_RESET_SOFT;
       if (key_cpu_speed)   main_change_cpu_speed();
       if (key_nmi)         main_nmi_multiface();
       if (key_drive)       main_nmi_divmmc();
+      if (f10) {
+        if (self.keyboard_state[SDL_SCANCODE_LSHIFT]) {
+          tape_fast_load_toggle();
+        } else if (self.keyboard_state[SDL_SCANCODE_RSHIFT]) {
+          tape_unthrottled_toggle();
+        } else {
+          tape_play_toggle();
+        }
+      }
       if (f11)             mouse_toggle();
       if (f12) {
         if (self.keyboard_state[SDL_SCANCODE_LSHIFT]) {
@@ -596,6 +646,10 @@ static void main_eventloop(void) {
 
 
 static void main_finit(void) {
+  timeline_finit();
+  loader_finit();
+  hostfs_finit();
+  tape_finit();
   cpu_finit();
   copper_finit();
   slu_finit();
@@ -621,6 +675,7 @@ static void main_finit(void) {
   nextreg_finit();
   palette_finit();
   uart_finit();
+  pi_finit();
   esp_finit();
   spi_finit();
   sdcard_finit();
@@ -630,7 +685,6 @@ static void main_finit(void) {
   joystick_finit();
   ay_finit();
   audio_finit();
-  SDLNet_Quit();
   if (self.controller_left) {
     SDL_GameControllerClose(self.controller_left);
   }
@@ -662,12 +716,86 @@ void main_sync(void) {
     self.task = E_MAIN_TASK_QUIT;
   }
 
-  audio_sync();
+  /* Let the tape run as fast as we can. */
+  if (!tape_is_unthrottled()) {
+    audio_sync();
+  }
 }
 
 
+/**
+ * Usage: zxnxt [-a | -A] [-d delta [-c]] [-m directory] [-p device [-P]] [-t trace] [program]
+ *
+ * -a  Move SD card blocks read with INIR in one go, with the usual timing.
+ * -A  Idem, but only charging the time of a single INIR iteration.
+ * -d  Leave the SD card image untouched and write sectors to a delta file,
+ *     which is removed at exit.
+ * -c  Commit the delta to the SD card image at exit.
+ * -m  Serve esxDOS file calls from a host directory.
+ * -p  Connect the Pi UART to a Unix socket, or to a new pseudo-terminal
+ *     if the device is "pty".
+ * -P  Let the Pi UART go as fast as the host, rather than the baud rate.
+ * -t  Record raster events and write them to a Chrome trace file at exit.
+ */
 int main(int argc, char* argv[]) {
-  if (main_init() != 0) {
+  main_options_t options = {
+    .sdcard_delta              = NULL,
+    .is_sdcard_delta_committed = 0,
+    .spi_accelerator           = E_SPI_ACCELERATOR_OFF,
+    .hostfs_root               = NULL,
+    .pi_device                 = NULL,
+    .is_pi_unthrottled         = 0,
+    .timeline                  = NULL
+  };
+  int option;
+
+  while ((option = getopt(argc, argv, "aAcd:m:p:Pt:")) != -1) {
+    switch (option) {
+      case 'a':
+        options.spi_accelerator = E_SPI_ACCELERATOR_EXACT;
+        break;
+
+      case 'A':
+        options.spi_accelerator = E_SPI_ACCELERATOR_FAST;
+        break;
+
+      case 'c':
+        options.is_sdcard_delta_committed = 1;
+        break;
+
+      case 'd':
+        options.sdcard_delta = optarg;
+        break;
+
+      case 'm':
+        options.hostfs_root = optarg;
+        break;
+
+      case 'p':
+        options.pi_device = optarg;
+        break;
+
+      case 'P':
+        options.is_pi_unthrottled = 1;
+        break;
+
+      case 't':
+        options.timeline = optarg;
+        break;
+
+      default:
+        log_err("usage: %s [-a | -A] [-d delta [-c]] [-m directory] [-p device [-P]] [-t trace] [program]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (main_init(&options) != 0) {
+    return 1;
+  }
+
+  /* Optionally run a program directly, bypassing the boot ROM. */
+  if (optind < argc && loader_load(argv[optind]) != 0) {
+    main_finit();
     return 1;
   }
 
@@ -9,6 +9,7 @@
 #include "mmu.h"
 #include "memory.h"
 #include "rom.h"
+#include "tilemap.h"
 #include "ula.h"
 #include "utils.h"
 
@@ -29,7 +30,8 @@ typedef void (*writer_t)(u16_t address, u8_t value);
 
 
 typedef struct {
-  u8_t*    sram;
+  u8_t*       sram;
+  const u8_t* divmmc_traps;
   reader_t readers[ADDRESS_SPACE_SIZE / ADDRESS_PAGE_SIZE];
   writer_t writers[ADDRESS_SPACE_SIZE / ADDRESS_PAGE_SIZE];
 } memory_t;
@@ -51,6 +53,8 @@ int memory_init(void) {
     self.sram[i] = rand() % 256;
   }
 
+  self.divmmc_traps = divmmc_traps();
+
   return 0;
 }
 
@@ -172,12 +176,55 @@ u8_t memory_read(u16_t address) {
 }
 
 
+/**
+ * Whether 0x0000 - 0x1FFF reads from the ROM itself, rather than RAM, Layer 2
+ * or any of the ROMs that can be paged over it.
+ */
+int memory_rom_is_paged_in(void) {
+  return self.readers[0] == rom_read;
+}
+
+
+/**
+ * Opcode fetch. Only fetches from the DivMMC entry points in the lower 16K
+ * take the slow path through the automap logic.
+ */
+u8_t memory_fetch(u16_t address) {
+  if (address < 0x4000 && (self.divmmc_traps[address >> 3] & (1 << (address & 0x07)))) {
+    return divmmc_fetch(address);
+  }
+
+  return memory_read(address);
+}
+
+
 void memory_write(u16_t address, u8_t value) {
   const u8_t page = address / ADDRESS_PAGE_SIZE;
   self.writers[page](address, value);
 }
 
 
+/**
+ * Tells the video layers that cache what is in RAM about a write to the
+ * ZX Spectrum RAM, at an offset into it.
+ */
+void memory_ram_written(u32_t offset, u8_t value) {
+  layer2_ram_written(offset, value);
+  tilemap_ram_written(offset, value);
+  ula_ram_written(offset, value);
+}
+
+
+/**
+ * For when the ZX Spectrum RAM was changed wholesale.
+ */
+void memory_ram_invalidate(void) {
+  layer2_ram_invalidate();
+  tilemap_ram_invalidate();
+  ula_ram_invalidate();
+}
+
+
 u8_t* memory_sram(void) {
   return self.sram;
 }
@@ -20,10 +20,14 @@
 int   memory_init(void);
 void  memory_finit(void);
 u8_t  memory_read(u16_t address);
+u8_t  memory_fetch(u16_t address);
 void  memory_write(u16_t address, u8_t value);
 void  memory_contend(u16_t address);
 u8_t* memory_sram(void);
 void  memory_refresh_accessors(int page, int n_pages);
+void  memory_ram_written(u32_t offset, u8_t value);
+void  memory_ram_invalidate(void);
+int   memory_rom_is_paged_in(void);
 
 
 #endif  /* __MEMORY_H */
@@ -96,5 +96,8 @@ u8_t mmu_read(u16_t address) {
 
 
 void mmu_write(u16_t address, u8_t value) {
-  self.ram[mmu_translate(address)] = value;
+  const u32_t offset = mmu_translate(address);
+
+  self.ram[offset] = value;
+  memory_ram_written(offset, value);
 }
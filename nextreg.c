@@ -8,6 +8,7 @@
 #include "cpu.h"
 #include "dac.h"
 #include "defs.h"
+#include "divmmc.h"
 #include "dma.h"
 #include "i2c.h"
 #include "io.h"
@@ -23,6 +24,7 @@
 #include "slu.h"
 #include "sprites.h"
 #include "tilemap.h"
+#include "timeline.h"
 #include "rom.h"
 #include "uart.h"
 #include "ula.h"
@@ -43,6 +45,7 @@ typedef struct {
 
 typedef struct {
   u8_t                     registers[256];
+  u8_t                     is_written[256];  /* Since the last reset. */
   u8_t                     selected_register;
   int                      is_hard_reset;
   int                      palette_disable_auto_increment;
@@ -71,7 +74,16 @@ typedef struct {
 static nextreg_t self;
 
 
-static void nextreg_cpu_speed_write(u8_t value);
+/* Kept apart, so that it survives a hard reset. */
+typedef struct {
+  nextreg_trace_t hook;
+} nextreg_trace_state_t;
+
+
+static nextreg_trace_state_t trace;
+
+
+static void nextreg_cpu_speed_write(u8_t reg, u8_t value);
 
 
 static void nextreg_reset(reset_t reset) {
@@ -89,6 +101,7 @@ static void nextreg_reset(reset_t reset) {
   }
 
   /* Both hard and soft resets. */
+  memset(self.is_written, 0, sizeof(self.is_written));
   self.palette_disable_auto_increment    = 0;
   self.palette_selected                  = E_PALETTE_ULA_FIRST;
   self.palette_index                     = 0;
@@ -102,6 +115,7 @@ static void nextreg_reset(reset_t reset) {
   ay_reset(reset);
   copper_reset(reset);
   dac_reset(reset);
+  divmmc_reset(reset);
   dma_reset(reset);
   i2c_reset(reset);
   io_reset(reset);
@@ -118,7 +132,7 @@ static void nextreg_reset(reset_t reset) {
   rom_lock(self.altrom_soft_reset_lock);
   altrom_activate(self.altrom_soft_reset_enable, self.altrom_soft_reset_during_writes);
 
-  nextreg_cpu_speed_write(E_CPU_SPEED_3MHZ);
+  nextreg_cpu_speed_write(E_NEXTREG_REGISTER_CPU_SPEED, E_CPU_SPEED_3MHZ);
 }
 
 
@@ -142,7 +156,7 @@ u8_t nextreg_select_read(u16_t address) {
 }
 
 
-static void nextreg_reset_write(u8_t value) {
+static void nextreg_reset_write(u8_t reg, u8_t value) {
   if (value & 0x03) {
     /* Hard or soft reset. */
     self.is_hard_reset = value & 0x02;
@@ -157,19 +171,20 @@ static void nextreg_reset_write(u8_t value) {
   }
 
   if (value & 0x04) {
+    divmmc_nmi_button_press();
     cpu_nmi(E_CPU_NMI_DIVMMC);
     return;
   }
 }
 
 
-static void nextreg_config_mapping_write(u8_t value) {
+static void nextreg_config_mapping_write(u8_t reg, u8_t value) {
   /* Only bits 4:0 are specified, but FPGA uses bits 6:0. */
   config_set_rom_ram_bank(value & 0x7F);
 }
 
 
-static void nextreg_machine_type_write(u8_t value) {
+static void nextreg_machine_type_write(u8_t reg, u8_t value) {
   if (value & 0x80) {
     const u8_t machine_type = (value >> 4) & 0x03;
     if (machine_type <= E_MACHINE_TYPE_PENTAGON) {
@@ -197,13 +212,13 @@ static void nextreg_machine_type_write(u8_t value) {
 }
 
 
-static u8_t nextreg_core_boot_read(void) {
+static u8_t nextreg_core_boot_read(u8_t reg) {
   return keyboard_is_special_key_pressed(E_KEYBOARD_SPECIAL_KEY_DRIVE) << 1
        | keyboard_is_special_key_pressed(E_KEYBOARD_SPECIAL_KEY_NMI);
 }
 
 
-static u8_t nextreg_peripheral_1_setting_read(void) {
+static u8_t nextreg_peripheral_1_setting_read(u8_t reg) {
   const u8_t j1 = joystick_type_get(E_JOYSTICK_LEFT);
   const u8_t j2 = joystick_type_get(E_JOYSTICK_RIGHT);
 
@@ -215,21 +230,21 @@ static u8_t nextreg_peripheral_1_setting_read(void) {
 }
 
 
-static void nextreg_peripheral_1_setting_write(u8_t value) {
+static void nextreg_peripheral_1_setting_write(u8_t reg, u8_t value) {
   joystick_type_set(E_JOYSTICK_LEFT, (((value & 0x08) >> 1) | (value & 0xC0) >> 6));
   joystick_type_set(E_JOYSTICK_RIGHT, (((value & 0x02) << 1) | (value & 0x30) >> 4));
   ula_60hz_set(value & 0x04);
 }
 
 
-static u8_t nextreg_peripheral_2_setting_read(void) {
+static u8_t nextreg_peripheral_2_setting_read(u8_t reg) {
   return self.is_hotkey_cpu_speed_enabled     << 7
        | self.is_hotkey_nmi_divmmc_enabled    << 4
        | self.is_hotkey_nmi_multiface_enabled << 3;
 }
 
 
-static void nextreg_peripheral_2_setting_write(u8_t value) {
+static void nextreg_peripheral_2_setting_write(u8_t reg, u8_t value) {
   self.is_hotkey_cpu_speed_enabled     = (value & 0x80) >> 7;
   self.is_hotkey_nmi_divmmc_enabled    = (value & 0x10) >> 4;
   self.is_hotkey_nmi_multiface_enabled = (value & 0x08) >> 3;
@@ -237,7 +252,7 @@ static void nextreg_peripheral_2_setting_write(u8_t value) {
 }
 
 
-static u8_t nextreg_peripheral_3_setting_read(void) {
+static u8_t nextreg_peripheral_3_setting_read(u8_t reg) {
   return !paging_spectrum_128k_paging_is_locked() << 7
        | !ula_contention_get() << 6
        | (ay_stereo_acb_get() != 0) << 5
@@ -245,7 +260,7 @@ static u8_t nextreg_peripheral_3_setting_read(void) {
 }
 
 
-static void nextreg_peripheral_3_setting_write(u8_t value) {
+static void nextreg_peripheral_3_setting_write(u8_t reg, u8_t value) {
   if (value & 0x80) {
     paging_spectrum_128k_paging_unlock();
   }
@@ -258,7 +273,7 @@ static void nextreg_peripheral_3_setting_write(u8_t value) {
 }
 
 
-static u8_t nextreg_peripheral_4_setting_read(void) {
+static u8_t nextreg_peripheral_4_setting_read(u8_t reg) {
   return (ay_mono_enable_get(2) != 0) << 7
        | (ay_mono_enable_get(1) != 0) << 6
        | (ay_mono_enable_get(0) != 0) << 5
@@ -266,7 +281,7 @@ static u8_t nextreg_peripheral_4_setting_read(void) {
 }
 
 
-static void nextreg_peripheral_4_setting_write(u8_t value) {
+static void nextreg_peripheral_4_setting_write(u8_t reg, u8_t value) {
   ay_mono_enable_set(2, value & 0x80);
   ay_mono_enable_set(1, value & 0x40);
   ay_mono_enable_set(0, value & 0x20);
@@ -275,7 +290,9 @@ static void nextreg_peripheral_4_setting_write(u8_t value) {
 }
 
 
-static void nextreg_peripheral_5_setting_write(u8_t value) {
+static void nextreg_peripheral_5_setting_write(u8_t reg, u8_t value) {
+  divmmc_automap_enable((value & 0x10) >> 4);
+
   if (!config_is_active()) {
     return;
   }
@@ -299,19 +316,19 @@ static void nextreg_peripheral_5_setting_write(u8_t value) {
 }
 
 
-static u8_t nextreg_cpu_speed_read(void) {
+static u8_t nextreg_cpu_speed_read(u8_t reg) {
   const u8_t speed = clock_cpu_speed_get();
 
   return speed << 4 | speed;
 }
 
 
-static void nextreg_cpu_speed_write(u8_t value) {
+static void nextreg_cpu_speed_write(u8_t reg, u8_t value) {
   clock_cpu_speed_set(value & 0x03);
 }
 
 
-static void nextreg_spectrum_memory_mapping_write(u8_t value) {
+static void nextreg_spectrum_memory_mapping_write(u8_t reg, u8_t value) {
   const int change_bank = value & 0x08;
   const int paging_mode = value & 0x04;
   
@@ -328,7 +345,7 @@ static void nextreg_spectrum_memory_mapping_write(u8_t value) {
 }
 
 
-static void nextreg_alternate_rom_write(u8_t value) {
+static void nextreg_alternate_rom_write(u8_t reg, u8_t value) {
   const int  enable        = value & 0x80;
   const int  during_writes = value & 0x40;
   const u8_t rom           = (value & 0x30) >> 4;
@@ -342,7 +359,7 @@ static void nextreg_alternate_rom_write(u8_t value) {
 }
 
 
-static void nextreg_clip_window_ula_write(u8_t value) {
+static void nextreg_clip_window_ula_write(u8_t reg, u8_t value) {
   self.ula_clip.values[self.ula_clip.index] = value;
 
   if (++self.ula_clip.index == 4) {
@@ -352,7 +369,7 @@ static void nextreg_clip_window_ula_write(u8_t value) {
 }
 
 
-static void nextreg_clip_window_tilemap_write(u8_t value) {
+static void nextreg_clip_window_tilemap_write(u8_t reg, u8_t value) {
   self.tilemap_clip.values[self.tilemap_clip.index] = value;
 
   if (++self.tilemap_clip.index == 4) {
@@ -362,7 +379,7 @@ static void nextreg_clip_window_tilemap_write(u8_t value) {
 }
 
 
-static void nextreg_clip_window_sprites_write(u8_t value) {
+static void nextreg_clip_window_sprites_write(u8_t reg, u8_t value) {
   self.sprites_clip.values[self.sprites_clip.index] = value;
 
   if (++self.sprites_clip.index == 4) {
@@ -372,7 +389,7 @@ static void nextreg_clip_window_sprites_write(u8_t value) {
 }
 
 
-static void nextreg_clip_window_layer2_write(u8_t value) {
+static void nextreg_clip_window_layer2_write(u8_t reg, u8_t value) {
   self.layer2_clip.values[self.layer2_clip.index] = value;
 
   if (++self.layer2_clip.index == 4) {
@@ -382,7 +399,7 @@ static void nextreg_clip_window_layer2_write(u8_t value) {
 }
 
 
-static u8_t nextreg_clip_window_control_read(void) {
+static u8_t nextreg_clip_window_control_read(u8_t reg) {
   return self.tilemap_clip.index << 6
        | self.ula_clip.index     << 4
        | self.sprites_clip.index << 2
@@ -390,7 +407,7 @@ static u8_t nextreg_clip_window_control_read(void) {
 }
 
 
-static void nextreg_clip_window_control_write(u8_t value) {
+static void nextreg_clip_window_control_write(u8_t reg, u8_t value) {
   if (value & 0x08) self.tilemap_clip.index = 0;
   if (value & 0x04) self.ula_clip.index     = 0;
   if (value & 0x02) self.sprites_clip.index = 0;
@@ -398,7 +415,7 @@ static void nextreg_clip_window_control_write(u8_t value) {
 }
 
 
-static u8_t nextreg_palette_control_read(void) {
+static u8_t nextreg_palette_control_read(u8_t reg) {
   return self.palette_disable_auto_increment << 7
        | self.palette_selected               << 4
        | self.is_palette_sprites_second      << 3
@@ -408,7 +425,7 @@ static u8_t nextreg_palette_control_read(void) {
 }
 
 
-static void nextreg_palette_control_write(u8_t value) {
+static void nextreg_palette_control_write(u8_t reg, u8_t value) {
   self.palette_disable_auto_increment = value >> 7;
   self.palette_selected               = (value & 0x70) >> 4;
   self.is_palette_sprites_second      = (value & 0x08) >> 3;
@@ -425,18 +442,19 @@ static void nextreg_palette_control_write(u8_t value) {
 }
 
 
-static void nextreg_palette_index_write(u8_t value) {
+static void nextreg_palette_index_write(u8_t reg, u8_t value) {
   self.palette_index                     = value;
   self.palette_index_9bit_is_first_write = 1;
 }
 
 
-static u8_t nextreg_palette_value_8bits_read(void) {
+static u8_t nextreg_palette_value_8bits_read(u8_t reg) {
   return palette_read(self.palette_selected, self.palette_index)->rgb8;
 }
 
 
-static void nextreg_palette_value_8bits_write(u8_t value) {
+static void nextreg_palette_value_8bits_write(u8_t reg, u8_t value) {
+  timeline_event(E_TIMELINE_EVENT_PALETTE_WRITE, self.palette_selected, self.palette_index, value);
   palette_write_rgb8(self.palette_selected, self.palette_index, value);
   self.palette_index_9bit_is_first_write = 1;
   if (!self.palette_disable_auto_increment) {
@@ -445,13 +463,15 @@ static void nextreg_palette_value_8bits_write(u8_t value) {
 }
 
 
-static u8_t nextreg_palette_value_9bits_read(void) {
+static u8_t nextreg_palette_value_9bits_read(u8_t reg) {
   const palette_entry_t* entry = palette_read(self.palette_selected, self.palette_index);
   return (entry->is_layer2_priority << 7) | (entry->rgb9 & 1);
 }
 
 
-static void nextreg_palette_value_9bits_write(u8_t value) {
+static void nextreg_palette_value_9bits_write(u8_t reg, u8_t value) {
+  timeline_event(E_TIMELINE_EVENT_PALETTE_WRITE, self.palette_selected, self.palette_index, value);
+
   if (self.palette_index_9bit_is_first_write) {
     palette_write_rgb8(self.palette_selected, self.palette_index, value);
   } else {
@@ -465,7 +485,7 @@ static void nextreg_palette_value_9bits_write(u8_t value) {
 }
 
 
-static u8_t nextreg_sprite_layers_system_read(void) {
+static u8_t nextreg_sprite_layers_system_read(u8_t reg) {
   return (slu_layer_priority_get() << 2)                      |
     (sprites_priority_get()                    ? 0x40 : 0x00) |
     (sprites_enable_clipping_over_border_get() ? 0x20 : 0x00) |
@@ -474,7 +494,7 @@ static u8_t nextreg_sprite_layers_system_read(void) {
 }
 
 
-static void nextreg_sprite_layers_system_write(u8_t value) {
+static void nextreg_sprite_layers_system_write(u8_t reg, u8_t value) {
   ula_lo_res_enable_set(value & 0x80);
   slu_layer_priority_set((value & 0x1C) >> 2);
   sprites_priority_set(value & 0x40);
@@ -484,445 +504,509 @@ static void nextreg_sprite_layers_system_write(u8_t value) {
 }
 
 
-static void nextreg_interrupt_control_write(u8_t value) {
+static void nextreg_interrupt_control_write(u8_t reg, u8_t value) {
   /* TODO */
 }
 
 
-static void nextreg_int_en_0_write(u8_t value) {
+static void nextreg_int_en_0_write(u8_t reg, u8_t value) {
   slu_line_interrupt_enable_set(value & 0x02);
   ula_irq_enable_set(value & 0x01);
 }
 
 
-void nextreg_data_write(u16_t address, u8_t value) {
-  nextreg_write_internal(self.selected_register, value);
+/* Register writes that only need to be remembered. */
+static void nextreg_ignored_write(u8_t reg, u8_t value) {
 }
 
 
-void nextreg_write_internal(u8_t reg, u8_t value) {
-  switch (reg) {
-    case E_NEXTREG_REGISTER_CONFIG_MAPPING:
-      nextreg_config_mapping_write(value);
-      break;
+/* Register reads that return the last value written. */
+static u8_t nextreg_cached_read(u8_t reg) {
+  return self.registers[reg];
+}
 
-    case E_NEXTREG_REGISTER_RESET:
-      nextreg_reset_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_MACHINE_TYPE:
-      nextreg_machine_type_write(value);
-      break;
+static u8_t nextreg_machine_id_read(u8_t reg) {
+  return MACHINE_ID;
+}
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_1_SETTING:
-      nextreg_peripheral_1_setting_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_2_SETTING:
-      nextreg_peripheral_2_setting_write(value);
-      break;
+static u8_t nextreg_core_version_read(u8_t reg) {
+  return CORE_VERSION_MAJOR << 4 | CORE_VERSION_MINOR;
+}
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_3_SETTING:
-      nextreg_peripheral_3_setting_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_4_SETTING:
-      nextreg_peripheral_4_setting_write(value);
-      break;
+static u8_t nextreg_core_version_sub_minor_read(u8_t reg) {
+  return CORE_VERSION_SUB_MINOR;
+}
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_5_SETTING:
-      nextreg_peripheral_5_setting_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_CPU_SPEED:
-      nextreg_cpu_speed_write(value);
-      break;
+static u8_t nextreg_video_timing_read(u8_t reg) {
+  return clock_timing_read();
+}
 
-    case E_NEXTREG_REGISTER_VIDEO_TIMING:
-      if (config_is_active()) {
-        clock_timing_write(value);
-      }
-      break;
 
-    case E_NEXTREG_REGISTER_LAYER2_ACTIVE_RAM_BANK:
-      layer2_active_bank_write(value);
-      break;
+static void nextreg_video_timing_write(u8_t reg, u8_t value) {
+  if (config_is_active()) {
+    clock_timing_write(value);
+  }
+}
 
-    case E_NEXTREG_REGISTER_LAYER2_SHADOW_RAM_BANK:
-      layer2_shadow_bank_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_LAYER2_CONTROL:
-      layer2_control_write(value);
-      break;
+static void nextreg_layer2_active_ram_bank_write(u8_t reg, u8_t value) {
+  layer2_active_bank_write(value);
+}
 
-    case E_NEXTREG_REGISTER_SPRITE_LAYERS_SYSTEM:
-      nextreg_sprite_layers_system_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_ULA:
-      nextreg_clip_window_ula_write(value);
-      break;
+static void nextreg_layer2_shadow_ram_bank_write(u8_t reg, u8_t value) {
+  layer2_shadow_bank_write(value);
+}
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_TILEMAP:
-      nextreg_clip_window_tilemap_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_SPRITES:
-      nextreg_clip_window_sprites_write(value);
-      break;
+static void nextreg_layer2_control_write(u8_t reg, u8_t value) {
+  layer2_control_write(value);
+}
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_LAYER2:
-      nextreg_clip_window_layer2_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_CONTROL:
-      nextreg_clip_window_control_write(value);
-      break;
+static u8_t nextreg_clip_window_ula_read(u8_t reg) {
+  return self.ula_clip.values[self.ula_clip.index];
+}
 
-    case E_NEXTREG_REGISTER_PALETTE_INDEX:
-      nextreg_palette_index_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_PALETTE_CONTROL:
-      nextreg_palette_control_write(value);
-      break;
+static u8_t nextreg_clip_window_tilemap_read(u8_t reg) {
+  return self.tilemap_clip.values[self.tilemap_clip.index];
+}
 
-    case E_NEXTREG_REGISTER_PALETTE_VALUE_8BITS:
-      nextreg_palette_value_8bits_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_PALETTE_VALUE_9BITS:
-      nextreg_palette_value_9bits_write(value);
-      break;
+static u8_t nextreg_clip_window_sprites_read(u8_t reg) {
+  return self.sprites_clip.values[self.sprites_clip.index];
+}
 
-    case E_NEXTREG_REGISTER_GLOBAL_TRANSPARENCY_COLOUR:
-      slu_transparent_set(value);
-      break;
 
-    case E_NEXTREG_REGISTER_FALLBACK_COLOUR:
-      slu_transparency_fallback_colour_write(value);
-      break;
+static u8_t nextreg_clip_window_layer2_read(u8_t reg) {
+  return self.layer2_clip.values[self.layer2_clip.index];
+}
 
-    case E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT1_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT2_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT3_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT4_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT5_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT6_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT7_CONTROL:
-      mmu_page_set(reg - E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL, value);
-      break;
 
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_0:
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_1:
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_2:
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_3:
-      io_decoding_write(reg - E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_0, value);
-      break;
+static u8_t nextreg_palette_index_read(u8_t reg) {
+  return self.palette_index;
+}
 
-    case E_NEXTREG_REGISTER_EXTERNAL_PORT_DECODING_0:
-    case E_NEXTREG_REGISTER_EXTERNAL_PORT_DECODING_1:
-    case E_NEXTREG_REGISTER_EXTERNAL_PORT_DECODING_2:
-    case E_NEXTREG_REGISTER_EXTERNAL_PORT_DECODING_3:
-      /* Ignored. */
-      break;
 
-    case E_NEXTREG_REGISTER_ALTERNATE_ROM:
-      nextreg_alternate_rom_write(value);
-      break;
+static u8_t nextreg_global_transparency_colour_read(u8_t reg) {
+  return slu_transparent_get()->rgb8;
+}
 
-    case E_NEXTREG_REGISTER_SPECTRUM_MEMORY_MAPPING:
-      nextreg_spectrum_memory_mapping_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_TILEMAP_CONTROL:
-      tilemap_tilemap_control_write(value);
-      break;
+static void nextreg_global_transparency_colour_write(u8_t reg, u8_t value) {
+  slu_transparent_set(value);
+}
 
-    case E_NEXTREG_REGISTER_TILEMAP_DEFAULT_TILEMAP_ATTRIBUTE:
-      tilemap_default_tilemap_attribute_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_TILEMAP_TILEMAP_BASE_ADDRESS:
-      tilemap_tilemap_base_address_write(value);
-      break;
+static void nextreg_fallback_colour_write(u8_t reg, u8_t value) {
+  slu_transparency_fallback_colour_write(value);
+}
 
-    case E_NEXTREG_REGISTER_TILEMAP_TILE_DEFINITIONS_BASE_ADDRESS:
-      tilemap_tilemap_tile_definitions_address_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_TILEMAP_TRANSPARENCY_INDEX:
-      tilemap_transparency_index_write(value);
-      break;
+static u8_t nextreg_mmu_slot_control_read(u8_t reg) {
+  return mmu_page_get(reg - E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL);
+}
 
-    case E_NEXTREG_REGISTER_SPRITES_TRANSPARENCY_INDEX:
-      sprites_transparency_index_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_ULA_CONTROL:
-      slu_ula_control_write(value);
-      break;
+static void nextreg_mmu_slot_control_write(u8_t reg, u8_t value) {
+  mmu_page_set(reg - E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL, value);
+}
 
-    case E_NEXTREG_REGISTER_DISPLAY_CONTROL_1:
-      layer2_enable(value >> 7);
-      /* TODO: other bits in this register. */
-      break;
 
-    case E_NEXTREG_REGISTER_TILEMAP_X_SCROLL_MSB:
-      tilemap_offset_x_msb_write(value);
-      break;
+static void nextreg_internal_port_decoding_write(u8_t reg, u8_t value) {
+  io_decoding_write(reg - E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_0, value);
+}
 
-    case E_NEXTREG_REGISTER_TILEMAP_X_SCROLL_LSB:
-      tilemap_offset_x_lsb_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_TILEMAP_Y_SCROLL:
-      tilemap_offset_y_write(value);
-      break;
+static void nextreg_tilemap_control_write(u8_t reg, u8_t value) {
+  tilemap_tilemap_control_write(value);
+}
 
-    case E_NEXTREG_REGISTER_LAYER2_X_SCROLL_MSB:
-      layer2_offset_x_msb_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_LAYER2_X_SCROLL_LSB:
-      layer2_offset_x_lsb_write(value);
-      break;
+static void nextreg_tilemap_default_tilemap_attribute_write(u8_t reg, u8_t value) {
+  tilemap_default_tilemap_attribute_write(value);
+}
 
-    case E_NEXTREG_REGISTER_LAYER2_Y_SCROLL:
-      layer2_offset_y_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_LO_RES_X_SCROLL:
-      ula_lo_res_offset_x_write(value);
-      break;
+static void nextreg_tilemap_tilemap_base_address_write(u8_t reg, u8_t value) {
+  tilemap_tilemap_base_address_write(value);
+}
 
-    case E_NEXTREG_REGISTER_LO_RES_Y_SCROLL:
-      ula_lo_res_offset_y_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_ULANEXT_ATTRIBUTE_BYTE_FORMAT:
-      ula_attribute_byte_format_write(value);
-      break;
+static void nextreg_tilemap_tile_definitions_base_address_write(u8_t reg, u8_t value) {
+  tilemap_tilemap_tile_definitions_address_write(value);
+}
 
-    case E_NEXTREG_REGISTER_SPRITE_NUMBER:
-      if (self.is_sprites_lockstepped) {
-        sprites_slot_set(value);
-      } else {
-        self.sprite_number = value & 0x7F;
-      }
-      break;
 
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_1:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_2:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_3:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_4:
-    {
-      const u8_t sprite_number = self.is_sprites_lockstepped ? sprites_slot_get() : self.sprite_number;
-      sprites_attribute_set(sprite_number, reg - E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0, value);
-    }
-    break;
-
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0_POST_INCREMENT:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_1_POST_INCREMENT:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_2_POST_INCREMENT:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_3_POST_INCREMENT:
-    case E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_4_POST_INCREMENT:
-    {
-      const u8_t sprite_number = self.is_sprites_lockstepped ? sprites_slot_get() : self.sprite_number;
-      sprites_attribute_set(sprite_number, reg - E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0_POST_INCREMENT, value);
-      if (self.is_sprites_lockstepped) {
-        sprites_slot_set(sprite_number + 1);
-      } else {
-        self.sprite_number = (self.sprite_number + 1) & 0x7F;
-      }
-    }
-    break;
+static void nextreg_tilemap_transparency_index_write(u8_t reg, u8_t value) {
+  tilemap_transparency_index_write(value);
+}
 
-    case E_NEXTREG_REGISTER_COPPER_DATA_8BIT:
-      copper_data_8bit_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_COPPER_ADDRESS:
-      copper_address_write(value);
-      break;
+static void nextreg_sprites_transparency_index_write(u8_t reg, u8_t value) {
+  sprites_transparency_index_write(value);
+}
 
-    case E_NEXTREG_REGISTER_COPPER_CONTROL:
-      copper_control_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_COPPER_DATA_16BIT:
-      copper_data_16bit_write(value);
-      break;
+static void nextreg_ula_control_write(u8_t reg, u8_t value) {
+  slu_ula_control_write(value);
+}
 
-    case E_NEXTREG_REGISTER_LINE_INTERRUPT_CONTROL:
-      slu_line_interrupt_control_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_LINE_INTERRUPT_VALUE_LSB:
-      slu_line_interrupt_value_lsb_write(value);
-      break;
+static void nextreg_display_control_1_write(u8_t reg, u8_t value) {
+  layer2_enable(value >> 7);
+  /* TODO: other bits in this register. */
+}
 
-    case E_NEXTREG_REGISTER_ULA_X_SCROLL:
-      ula_offset_x_write(value);
-      break;
 
-    case E_NEXTREG_REGISTER_ULA_Y_SCROLL:
-      ula_offset_y_write(value);
-      break;
+static void nextreg_tilemap_x_scroll_msb_write(u8_t reg, u8_t value) {
+  tilemap_offset_x_msb_write(value);
+}
 
-    case E_NEXTREG_REGISTER_PS2_KEYMAP_DATA_MSB:
-    case E_NEXTREG_REGISTER_PS2_KEYMAP_DATA_LSB:
-      /* Ignore these. */
-      break;
-      
-    case E_NEXTREG_REGISTER_DAC_B_MIRROR:
-      dac_write(DAC_B, value);
-      break;
 
-    case E_NEXTREG_REGISTER_DAC_A_D_MIRROR:
-      dac_write(DAC_A | DAC_D, value);
-      break;
+static void nextreg_tilemap_x_scroll_lsb_write(u8_t reg, u8_t value) {
+  tilemap_offset_x_lsb_write(value);
+}
 
-     case E_NEXTREG_REGISTER_DAC_C_MIRROR:
-      dac_write(DAC_C, value);
-      break;
 
-    case E_NEXTREG_REGISTER_INTERRUPT_CONTROL:
-      nextreg_interrupt_control_write(value);
-      break;
+static void nextreg_tilemap_y_scroll_write(u8_t reg, u8_t value) {
+  tilemap_offset_y_write(value);
+}
 
-    case E_NEXTREG_REGISTER_INT_EN_0:
-      nextreg_int_en_0_write(value);
-      break;
 
-    default:
-      log_wrn("nextreg: unimplemented write of $%02X to register $%02X from PC=$%04X\n", value, reg, cpu_pc_get());
-      break;
+static void nextreg_layer2_x_scroll_msb_write(u8_t reg, u8_t value) {
+  layer2_offset_x_msb_write(value);
+}
+
+
+static void nextreg_layer2_x_scroll_lsb_write(u8_t reg, u8_t value) {
+  layer2_offset_x_lsb_write(value);
+}
+
+
+static void nextreg_layer2_y_scroll_write(u8_t reg, u8_t value) {
+  layer2_offset_y_write(value);
+}
+
+
+static void nextreg_lo_res_x_scroll_write(u8_t reg, u8_t value) {
+  ula_lo_res_offset_x_write(value);
+}
+
+
+static void nextreg_lo_res_y_scroll_write(u8_t reg, u8_t value) {
+  ula_lo_res_offset_y_write(value);
+}
+
+
+static u8_t nextreg_ulanext_attribute_byte_format_read(u8_t reg) {
+  return ula_attribute_byte_format_read();
+}
+
+
+static void nextreg_ulanext_attribute_byte_format_write(u8_t reg, u8_t value) {
+  ula_attribute_byte_format_write(value);
+}
+
+
+static void nextreg_sprite_number_write(u8_t reg, u8_t value) {
+  if (self.is_sprites_lockstepped) {
+    sprites_slot_set(value);
+  } else {
+    self.sprite_number = value & 0x7F;
   }
+}
 
-  /* Always remember the last value written. */
-  self.registers[reg] = value;
+
+static void nextreg_sprite_attribute_write(u8_t reg, u8_t value) {
+  const u8_t sprite_number = self.is_sprites_lockstepped ? sprites_slot_get() : self.sprite_number;
+
+  sprites_attribute_set(sprite_number, reg - E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0, value);
 }
 
 
-u8_t nextreg_data_read(u16_t address) {
-  return nextreg_read_internal(self.selected_register);
+static void nextreg_sprite_attribute_post_increment_write(u8_t reg, u8_t value) {
+  const u8_t sprite_number = self.is_sprites_lockstepped ? sprites_slot_get() : self.sprite_number;
+
+  sprites_attribute_set(sprite_number, reg - E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0_POST_INCREMENT, value);
+  if (self.is_sprites_lockstepped) {
+    sprites_slot_set(sprite_number + 1);
+  } else {
+    self.sprite_number = (self.sprite_number + 1) & 0x7F;
+  }
 }
 
 
-u8_t nextreg_read_internal(u8_t reg) {
-  switch (reg) {
-    case E_NEXTREG_REGISTER_MACHINE_ID:
-      return MACHINE_ID;
+static void nextreg_copper_data_8bit_write(u8_t reg, u8_t value) {
+  copper_data_8bit_write(value);
+}
 
-    case E_NEXTREG_REGISTER_CORE_VERSION:
-      return CORE_VERSION_MAJOR << 4 | CORE_VERSION_MINOR;
 
-    case E_NEXTREG_REGISTER_CORE_VERSION_SUB_MINOR:
-      return CORE_VERSION_SUB_MINOR;
+static void nextreg_copper_address_write(u8_t reg, u8_t value) {
+  copper_address_write(value);
+}
 
-    case E_NEXTREG_REGISTER_CORE_BOOT:
-      return nextreg_core_boot_read();
 
-    case E_NEXTREG_REGISTER_CPU_SPEED:
-      return nextreg_cpu_speed_read();
+static void nextreg_copper_control_write(u8_t reg, u8_t value) {
+  copper_control_write(value);
+}
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_1_SETTING:
-      return nextreg_peripheral_1_setting_read();
-      
-    case E_NEXTREG_REGISTER_PERIPHERAL_2_SETTING:
-      return nextreg_peripheral_2_setting_read();
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_3_SETTING:
-      return nextreg_peripheral_3_setting_read();
+static void nextreg_copper_data_16bit_write(u8_t reg, u8_t value) {
+  copper_data_16bit_write(value);
+}
 
-    case E_NEXTREG_REGISTER_PERIPHERAL_4_SETTING:
-      return nextreg_peripheral_4_setting_read();
 
-    case E_NEXTREG_REGISTER_VIDEO_TIMING:
-      return clock_timing_read();
+static u8_t nextreg_active_video_line_msb_read(u8_t reg) {
+  return (slu_active_video_line_get() >> 8) & 0x01;
+}
 
-    case E_NEXTREG_REGISTER_SPRITE_LAYERS_SYSTEM:
-      return nextreg_sprite_layers_system_read();
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_ULA:
-      return self.ula_clip.values[self.ula_clip.index];
+static u8_t nextreg_active_video_line_lsb_read(u8_t reg) {
+  return slu_active_video_line_get() & 0xFF;
+}
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_TILEMAP:
-      return self.tilemap_clip.values[self.tilemap_clip.index];
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_SPRITES:
-      return self.sprites_clip.values[self.sprites_clip.index];
+static u8_t nextreg_line_interrupt_control_read(u8_t reg) {
+  return slu_line_interrupt_control_read();
+}
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_LAYER2:
-      return self.layer2_clip.values[self.layer2_clip.index];
 
-    case E_NEXTREG_REGISTER_CLIP_WINDOW_CONTROL:
-      return nextreg_clip_window_control_read();
+static void nextreg_line_interrupt_control_write(u8_t reg, u8_t value) {
+  slu_line_interrupt_control_write(value);
+}
 
-    case E_NEXTREG_REGISTER_PALETTE_INDEX:
-      return self.palette_index;
 
-    case E_NEXTREG_REGISTER_PALETTE_CONTROL:
-      return nextreg_palette_control_read();
+static u8_t nextreg_line_interrupt_value_lsb_read(u8_t reg) {
+  return slu_line_interrupt_value_lsb_read();
+}
+
 
-    case E_NEXTREG_REGISTER_PALETTE_VALUE_8BITS:
-      return nextreg_palette_value_8bits_read();
+static void nextreg_line_interrupt_value_lsb_write(u8_t reg, u8_t value) {
+  slu_line_interrupt_value_lsb_write(value);
+}
 
-    case E_NEXTREG_REGISTER_PALETTE_VALUE_9BITS:
-      return nextreg_palette_value_9bits_read();
 
-    case E_NEXTREG_REGISTER_GLOBAL_TRANSPARENCY_COLOUR:
-      return slu_transparent_get()->rgb8;
+static u8_t nextreg_ula_x_scroll_read(u8_t reg) {
+  return ula_offset_x_read();
+}
 
-    case E_NEXTREG_REGISTER_ULANEXT_ATTRIBUTE_BYTE_FORMAT:
-      return ula_attribute_byte_format_read();
 
-    case E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT1_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT2_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT3_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT4_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT5_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT6_CONTROL:
-    case E_NEXTREG_REGISTER_MMU_SLOT7_CONTROL:
-      return mmu_page_get(self.selected_register - E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL);
+static void nextreg_ula_x_scroll_write(u8_t reg, u8_t value) {
+  ula_offset_x_write(value);
+}
 
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_0:
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_1:
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_2:
-    case E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_3:
-      /* Return cached value. */
-      break;
 
-    case E_NEXTREG_REGISTER_ACTIVE_VIDEO_LINE_MSB:
-      return (slu_active_video_line_get() >> 8) & 0x01;
+static u8_t nextreg_ula_y_scroll_read(u8_t reg) {
+  return ula_offset_y_read();
+}
 
-    case E_NEXTREG_REGISTER_ACTIVE_VIDEO_LINE_LSB:
-      return slu_active_video_line_get() & 0xFF;
 
-    case E_NEXTREG_REGISTER_LINE_INTERRUPT_CONTROL:
-      return slu_line_interrupt_control_read();
+static void nextreg_ula_y_scroll_write(u8_t reg, u8_t value) {
+  ula_offset_y_write(value);
+}
 
-    case E_NEXTREG_REGISTER_LINE_INTERRUPT_VALUE_LSB:
-      return slu_line_interrupt_value_lsb_read();
 
-    case E_NEXTREG_REGISTER_ULA_X_SCROLL:
-      return ula_offset_x_read();
+static void nextreg_dac_b_mirror_write(u8_t reg, u8_t value) {
+  dac_write(DAC_B, value);
+}
 
-    case E_NEXTREG_REGISTER_ULA_Y_SCROLL:
-      return ula_offset_y_read();
 
-    default:
-      log_wrn("nextreg: unimplemented read from register $%02X\n", reg);
-      break;
+static void nextreg_dac_a_d_mirror_write(u8_t reg, u8_t value) {
+  dac_write(DAC_A | DAC_D, value);
+}
+
+
+static void nextreg_dac_c_mirror_write(u8_t reg, u8_t value) {
+  dac_write(DAC_C, value);
+}
+
+
+static u8_t nextreg_divmmc_entry_points_read(u8_t reg) {
+  return divmmc_entry_points_read(reg - E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_0);
+}
+
+
+static void nextreg_divmmc_entry_points_write(u8_t reg, u8_t value) {
+  divmmc_entry_points_write(reg - E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_0, value);
+}
+
+
+typedef u8_t (*nextreg_read_t)(u8_t reg);
+typedef void (*nextreg_write_t)(u8_t reg, u8_t value);
+
+
+/* Writing the value a register already holds changes nothing. */
+#define NEXTREG_IDEMPOTENT  0x01
+
+
+typedef struct {
+  nextreg_read_t  read;   /* NULL if unimplemented. */
+  nextreg_write_t write;  /* NULL if unimplemented. */
+  int             flags;
+} nextreg_handler_t;
+
+
+#define MMU_SLOT(n)              [E_NEXTREG_REGISTER_MMU_SLOT0_CONTROL + (n)]                  = { nextreg_mmu_slot_control_read,    nextreg_mmu_slot_control_write,                0 }
+#define INTERNAL_PORT_DECODING(n) [E_NEXTREG_REGISTER_INTERNAL_PORT_DECODING_0 + (n)]          = { nextreg_cached_read,              nextreg_internal_port_decoding_write,          0 }
+#define EXTERNAL_PORT_DECODING(n) [E_NEXTREG_REGISTER_EXTERNAL_PORT_DECODING_0 + (n)]          = { NULL,                             nextreg_ignored_write,                         0 }
+#define SPRITE_ATTRIBUTE(n)      [E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0 + (n)]                 = { NULL,                             nextreg_sprite_attribute_write,                0 }
+#define SPRITE_ATTRIBUTE_INC(n)  [E_NEXTREG_REGISTER_SPRITE_ATTRIBUTE_0_POST_INCREMENT + (n)]  = { NULL,                             nextreg_sprite_attribute_post_increment_write, 0 }
+#define DIVMMC_ENTRY_POINTS(n)   [E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_0 + (n)]              = { nextreg_divmmc_entry_points_read, nextreg_divmmc_entry_points_write,             0 }
+
+
+static const nextreg_handler_t handlers[256] = {
+  [E_NEXTREG_REGISTER_MACHINE_ID]                            = { nextreg_machine_id_read,                    NULL,                                                 0 },
+  [E_NEXTREG_REGISTER_CORE_VERSION]                          = { nextreg_core_version_read,                  NULL,                                                 0 },
+  [E_NEXTREG_REGISTER_RESET]                                 = { NULL,                                       nextreg_reset_write,                                  0 },
+  [E_NEXTREG_REGISTER_MACHINE_TYPE]                          = { NULL,                                       nextreg_machine_type_write,                           0 },
+  [E_NEXTREG_REGISTER_CONFIG_MAPPING]                        = { NULL,                                       nextreg_config_mapping_write,                         0 },
+  [E_NEXTREG_REGISTER_PERIPHERAL_1_SETTING]                  = { nextreg_peripheral_1_setting_read,          nextreg_peripheral_1_setting_write,                   0 },
+  [E_NEXTREG_REGISTER_PERIPHERAL_2_SETTING]                  = { nextreg_peripheral_2_setting_read,          nextreg_peripheral_2_setting_write,                   0 },
+  [E_NEXTREG_REGISTER_CPU_SPEED]                             = { nextreg_cpu_speed_read,                     nextreg_cpu_speed_write,                              0 },
+  [E_NEXTREG_REGISTER_PERIPHERAL_3_SETTING]                  = { nextreg_peripheral_3_setting_read,          nextreg_peripheral_3_setting_write,                   0 },
+  [E_NEXTREG_REGISTER_PERIPHERAL_4_SETTING]                  = { nextreg_peripheral_4_setting_read,          nextreg_peripheral_4_setting_write,                   0 },
+  [E_NEXTREG_REGISTER_PERIPHERAL_5_SETTING]                  = { NULL,                                       nextreg_peripheral_5_setting_write,                   0 },
+  [E_NEXTREG_REGISTER_CORE_VERSION_SUB_MINOR]                = { nextreg_core_version_sub_minor_read,        NULL,                                                 0 },
+  [E_NEXTREG_REGISTER_CORE_BOOT]                             = { nextreg_core_boot_read,                     NULL,                                                 0 },
+  [E_NEXTREG_REGISTER_VIDEO_TIMING]                          = { nextreg_video_timing_read,                  nextreg_video_timing_write,                           0 },
+  [E_NEXTREG_REGISTER_LAYER2_ACTIVE_RAM_BANK]                = { NULL,                                       nextreg_layer2_active_ram_bank_write,                 NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_LAYER2_SHADOW_RAM_BANK]                = { NULL,                                       nextreg_layer2_shadow_ram_bank_write,                 NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_GLOBAL_TRANSPARENCY_COLOUR]            = { nextreg_global_transparency_colour_read,    nextreg_global_transparency_colour_write,             NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_SPRITE_LAYERS_SYSTEM]                  = { nextreg_sprite_layers_system_read,          nextreg_sprite_layers_system_write,                   0 },
+  [E_NEXTREG_REGISTER_LAYER2_X_SCROLL_LSB]                   = { NULL,                                       nextreg_layer2_x_scroll_lsb_write,                    NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_LAYER2_Y_SCROLL]                       = { NULL,                                       nextreg_layer2_y_scroll_write,                        NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_CLIP_WINDOW_LAYER2]                    = { nextreg_clip_window_layer2_read,            nextreg_clip_window_layer2_write,                     0 },
+  [E_NEXTREG_REGISTER_CLIP_WINDOW_SPRITES]                   = { nextreg_clip_window_sprites_read,           nextreg_clip_window_sprites_write,                    0 },
+  [E_NEXTREG_REGISTER_CLIP_WINDOW_ULA]                       = { nextreg_clip_window_ula_read,               nextreg_clip_window_ula_write,                        0 },
+  [E_NEXTREG_REGISTER_CLIP_WINDOW_TILEMAP]                   = { nextreg_clip_window_tilemap_read,           nextreg_clip_window_tilemap_write,                    0 },
+  [E_NEXTREG_REGISTER_CLIP_WINDOW_CONTROL]                   = { nextreg_clip_window_control_read,           nextreg_clip_window_control_write,                    0 },
+  [E_NEXTREG_REGISTER_ACTIVE_VIDEO_LINE_MSB]                 = { nextreg_active_video_line_msb_read,         NULL,                                                 0 },
+  [E_NEXTREG_REGISTER_ACTIVE_VIDEO_LINE_LSB]                 = { nextreg_active_video_line_lsb_read,         NULL,                                                 0 },
+  [E_NEXTREG_REGISTER_LINE_INTERRUPT_CONTROL]                = { nextreg_line_interrupt_control_read,        nextreg_line_interrupt_control_write,                 0 },
+  [E_NEXTREG_REGISTER_LINE_INTERRUPT_VALUE_LSB]              = { nextreg_line_interrupt_value_lsb_read,      nextreg_line_interrupt_value_lsb_write,               0 },
+  [E_NEXTREG_REGISTER_ULA_X_SCROLL]                          = { nextreg_ula_x_scroll_read,                  nextreg_ula_x_scroll_write,                           NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_ULA_Y_SCROLL]                          = { nextreg_ula_y_scroll_read,                  nextreg_ula_y_scroll_write,                           NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_PS2_KEYMAP_DATA_MSB]                   = { NULL,                                       nextreg_ignored_write,                                0 },
+  [E_NEXTREG_REGISTER_PS2_KEYMAP_DATA_LSB]                   = { NULL,                                       nextreg_ignored_write,                                0 },
+  [E_NEXTREG_REGISTER_DAC_B_MIRROR]                          = { NULL,                                       nextreg_dac_b_mirror_write,                           0 },
+  [E_NEXTREG_REGISTER_DAC_A_D_MIRROR]                        = { NULL,                                       nextreg_dac_a_d_mirror_write,                         0 },
+  [E_NEXTREG_REGISTER_DAC_C_MIRROR]                          = { NULL,                                       nextreg_dac_c_mirror_write,                           0 },
+  [E_NEXTREG_REGISTER_TILEMAP_X_SCROLL_MSB]                  = { NULL,                                       nextreg_tilemap_x_scroll_msb_write,                   NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_TILEMAP_X_SCROLL_LSB]                  = { NULL,                                       nextreg_tilemap_x_scroll_lsb_write,                   NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_TILEMAP_Y_SCROLL]                      = { NULL,                                       nextreg_tilemap_y_scroll_write,                       NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_LO_RES_X_SCROLL]                       = { NULL,                                       nextreg_lo_res_x_scroll_write,                        NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_LO_RES_Y_SCROLL]                       = { NULL,                                       nextreg_lo_res_y_scroll_write,                        NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_SPRITE_NUMBER]                         = { NULL,                                       nextreg_sprite_number_write,                          0 },
+  SPRITE_ATTRIBUTE(0),
+  SPRITE_ATTRIBUTE(1),
+  SPRITE_ATTRIBUTE(2),
+  SPRITE_ATTRIBUTE(3),
+  SPRITE_ATTRIBUTE(4),
+  [E_NEXTREG_REGISTER_PALETTE_INDEX]                         = { nextreg_palette_index_read,                 nextreg_palette_index_write,                          0 },
+  [E_NEXTREG_REGISTER_PALETTE_VALUE_8BITS]                   = { nextreg_palette_value_8bits_read,           nextreg_palette_value_8bits_write,                    0 },
+  [E_NEXTREG_REGISTER_ULANEXT_ATTRIBUTE_BYTE_FORMAT]         = { nextreg_ulanext_attribute_byte_format_read, nextreg_ulanext_attribute_byte_format_write,          NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_PALETTE_CONTROL]                       = { nextreg_palette_control_read,               nextreg_palette_control_write,                        0 },
+  [E_NEXTREG_REGISTER_PALETTE_VALUE_9BITS]                   = { nextreg_palette_value_9bits_read,           nextreg_palette_value_9bits_write,                    0 },
+  [E_NEXTREG_REGISTER_FALLBACK_COLOUR]                       = { NULL,                                       nextreg_fallback_colour_write,                        NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_SPRITES_TRANSPARENCY_INDEX]            = { NULL,                                       nextreg_sprites_transparency_index_write,             NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_TILEMAP_TRANSPARENCY_INDEX]            = { NULL,                                       nextreg_tilemap_transparency_index_write,             NEXTREG_IDEMPOTENT },
+  MMU_SLOT(0),
+  MMU_SLOT(1),
+  MMU_SLOT(2),
+  MMU_SLOT(3),
+  MMU_SLOT(4),
+  MMU_SLOT(5),
+  MMU_SLOT(6),
+  MMU_SLOT(7),
+  [E_NEXTREG_REGISTER_COPPER_DATA_8BIT]                      = { NULL,                                       nextreg_copper_data_8bit_write,                       0 },
+  [E_NEXTREG_REGISTER_COPPER_ADDRESS]                        = { NULL,                                       nextreg_copper_address_write,                         0 },
+  [E_NEXTREG_REGISTER_COPPER_CONTROL]                        = { NULL,                                       nextreg_copper_control_write,                         0 },
+  [E_NEXTREG_REGISTER_COPPER_DATA_16BIT]                     = { NULL,                                       nextreg_copper_data_16bit_write,                      0 },
+  [E_NEXTREG_REGISTER_ULA_CONTROL]                           = { NULL,                                       nextreg_ula_control_write,                            NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_DISPLAY_CONTROL_1]                     = { NULL,                                       nextreg_display_control_1_write,                      0 },
+  [E_NEXTREG_REGISTER_TILEMAP_CONTROL]                       = { NULL,                                       nextreg_tilemap_control_write,                        NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_TILEMAP_DEFAULT_TILEMAP_ATTRIBUTE]     = { NULL,                                       nextreg_tilemap_default_tilemap_attribute_write,      NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_TILEMAP_TILEMAP_BASE_ADDRESS]          = { NULL,                                       nextreg_tilemap_tilemap_base_address_write,           NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_TILEMAP_TILE_DEFINITIONS_BASE_ADDRESS] = { NULL,                                       nextreg_tilemap_tile_definitions_base_address_write,  NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_LAYER2_CONTROL]                        = { NULL,                                       nextreg_layer2_control_write,                         NEXTREG_IDEMPOTENT },
+  [E_NEXTREG_REGISTER_LAYER2_X_SCROLL_MSB]                   = { NULL,                                       nextreg_layer2_x_scroll_msb_write,                    NEXTREG_IDEMPOTENT },
+  SPRITE_ATTRIBUTE_INC(0),
+  SPRITE_ATTRIBUTE_INC(1),
+  SPRITE_ATTRIBUTE_INC(2),
+  SPRITE_ATTRIBUTE_INC(3),
+  SPRITE_ATTRIBUTE_INC(4),
+  INTERNAL_PORT_DECODING(0),
+  INTERNAL_PORT_DECODING(1),
+  INTERNAL_PORT_DECODING(2),
+  INTERNAL_PORT_DECODING(3),
+  EXTERNAL_PORT_DECODING(0),
+  EXTERNAL_PORT_DECODING(1),
+  EXTERNAL_PORT_DECODING(2),
+  EXTERNAL_PORT_DECODING(3),
+  [E_NEXTREG_REGISTER_ALTERNATE_ROM]                         = { NULL,                                       nextreg_alternate_rom_write,                          0 },
+  [E_NEXTREG_REGISTER_SPECTRUM_MEMORY_MAPPING]               = { NULL,                                       nextreg_spectrum_memory_mapping_write,                0 },
+  DIVMMC_ENTRY_POINTS(0),
+  DIVMMC_ENTRY_POINTS(1),
+  DIVMMC_ENTRY_POINTS(2),
+  DIVMMC_ENTRY_POINTS(3),
+  [E_NEXTREG_REGISTER_INTERRUPT_CONTROL]                     = { NULL,                                       nextreg_interrupt_control_write,                      0 },
+  [E_NEXTREG_REGISTER_INT_EN_0]                              = { NULL,                                       nextreg_int_en_0_write,                               0 }
+};
+
+
+void nextreg_data_write(u16_t address, u8_t value) {
+  nextreg_write_internal(self.selected_register, value);
+}
+
+
+void nextreg_write_internal(u8_t reg, u8_t value) {
+  const nextreg_handler_t* handler = &handlers[reg];
+
+  if (trace.hook) {
+    trace.hook(reg, value);
+  }
+
+  if ((handler->flags & NEXTREG_IDEMPOTENT) && self.is_written[reg] && self.registers[reg] == value) {
+    return;
+  }
+
+  if (handler->write) {
+    handler->write(reg, value);
+  } else {
+    log_wrn("nextreg: unimplemented write of $%02X to register $%02X from PC=$%04X\n", value, reg, cpu_pc_get());
+  }
+
+  /* Always remember the last value written. */
+  self.registers[reg]  = value;
+  self.is_written[reg] = 1;
+}
+
+
+u8_t nextreg_data_read(u16_t address) {
+  return nextreg_read_internal(self.selected_register);
+}
+
+
+u8_t nextreg_read_internal(u8_t reg) {
+  const nextreg_handler_t* handler = &handlers[reg];
+
+  if (handler->read) {
+    return handler->read(reg);
   }
 
+  log_wrn("nextreg: unimplemented read from register $%02X\n", reg);
+
   /* By default, return the last value written. */
   return self.registers[reg];
 }
 
 
+void nextreg_trace_set(nextreg_trace_t hook) {
+  trace.hook = hook;
+}
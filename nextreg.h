@@ -102,19 +102,28 @@ typedef enum {
   E_NEXTREG_REGISTER_ALTERNATE_ROM                         = 0x8C,
   E_NEXTREG_REGISTER_SPECTRUM_MEMORY_MAPPING               = 0x8E,
   E_NEXTREG_REGISTER_MEMORY_MAPPING_MODE                   = 0x8F,
+  E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_0                 = 0xB8,
+  E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_VALID_0           = 0xB9,
+  E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_TIMING_0          = 0xBA,
+  E_NEXTREG_REGISTER_DIVMMC_ENTRY_POINTS_1                 = 0xBB,
   E_NEXTREG_REGISTER_INTERRUPT_CONTROL                     = 0xC0,
   E_NEXTREG_REGISTER_INT_EN_0                              = 0xC4
 } nextreg_register_t;
 
 
-int  nextreg_init(void);
-void nextreg_finit(void);
-void nextreg_data_write(u16_t address, u8_t value);
-u8_t nextreg_data_read(u16_t address);
-void nextreg_select_write(u16_t address, u8_t value);
-u8_t nextreg_select_read(u16_t address);
-void nextreg_write_internal(u8_t reg, u8_t value);
-u8_t nextreg_read_internal(u8_t reg);
+/* Called on every register write, before it takes effect. */
+typedef void (*nextreg_trace_t)(u8_t reg, u8_t value);
+
+
+int   nextreg_init(void);
+void  nextreg_finit(void);
+void  nextreg_data_write(u16_t address, u8_t value);
+u8_t  nextreg_data_read(u16_t address);
+void  nextreg_select_write(u16_t address, u8_t value);
+u8_t  nextreg_select_read(u16_t address);
+void  nextreg_write_internal(u8_t reg, u8_t value);
+u8_t  nextreg_read_internal(u8_t reg);
+void  nextreg_trace_set(nextreg_trace_t hook);
 
 
 #endif  /* __NEXTREG_H */
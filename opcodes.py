@@ -405,6 +405,9 @@ def inx(op: str) -> C:
 
 def inxr(op: str) -> C:
     return f'''
+        if (cpu_inir_accelerated({op}1)) {{
+            return;
+        }}
         T(1);
         Z = io_read(BC);
         memory_write(HL, Z); T(3);
@@ -824,6 +827,7 @@ def retn() -> C:
         PCL = memory_read(SP++); T(3);
         PCH = memory_read(SP++); T(3);
         IFF1 = IFF2;
+        divmmc_retn();
     '''
 
 def rl_pss(xy: Optional[str] = None) -> C:
@@ -1631,9 +1635,11 @@ PC++;
 {name}[opcode]();
 '''
 
-    # Return the body that uses the table.
+    # Return the body that uses the table. Only the first opcode byte is
+    # fetched through memory_fetch(), which handles DivMMC automapping.
+    fetch = 'memory_read' if prefix else 'memory_fetch'
     return f'''
-const u8_t opcode = memory_read(PC++); T(4);
+const u8_t opcode = {fetch}(PC++); T(4);
 {name}[opcode]();
 '''
 
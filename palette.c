@@ -3,11 +3,9 @@
 #include "palette.h"
 
 
-#define N_PALETTES  (E_PALETTE_TILEMAP_SECOND - E_PALETTE_ULA_FIRST + 1)
-
-
 typedef struct {
-  palette_entry_t palette[N_PALETTES][256];
+  palette_entry_t entries[PALETTE_COLOUR_TRANSPARENT + 1];
+  u8_t            transparent_rgb8;
 } self_t;
 
 
@@ -24,12 +22,17 @@ void palette_finit(void) {
 
 
 const palette_entry_t* palette_read(palette_t palette, u8_t index) {
-  return &self.palette[palette][index];
+  return &self.entries[PALETTE_COLOUR(palette, index)];
+}
+
+
+const palette_entry_t* palette_entries(void) {
+  return self.entries;
 }
 
 
 void palette_write_rgb8(palette_t palette, u8_t index, u8_t value) {
-  palette_entry_t* entry = &self.palette[palette][index];
+  palette_entry_t* entry = &self.entries[PALETTE_COLOUR(palette, index)];
 
   /**
    * https://gitlab.com/SpectrumNext/ZX_Spectrum_Next_FPGA/-/raw/master/cores/zxnext/nextreg.txt
@@ -41,12 +44,14 @@ void palette_write_rgb8(palette_t palette, u8_t index, u8_t value) {
   entry->rgb9               = PALETTE_RGB8_TO_RGB9(value);
   entry->rgb16              = PALETTE_RGB9_TO_RGB16(entry->rgb9);
   entry->is_layer2_priority = 0;
+  entry->is_transparent     = (value == self.transparent_rgb8);
 }
 
 
 void palette_write_rgb9(palette_t palette, u8_t index, u8_t value) {
-  palette_entry_t* entry = &self.palette[palette][index];
+  palette_entry_t* entry = &self.entries[PALETTE_COLOUR(palette, index)];
 
+  /* Transparency is decided on the 8-bit colour, which does not change. */
   entry->rgb9               = (entry->rgb9 & 0x1FE) | (value & 1);
   entry->rgb16              = PALETTE_RGB9_TO_RGB16(entry->rgb9);
   entry->is_layer2_priority = value >> 7;
@@ -57,3 +62,25 @@ u16_t palette_rgb8_rgb16(u8_t rgb8) {
   const u16_t rgb9 = PALETTE_RGB8_TO_RGB9(rgb8);
   return PALETTE_RGB9_TO_RGB16(rgb9);
 }
+
+
+/**
+ * Marks the entries that match the global transparency colour, so the SLU
+ * need not compare colours for every pixel.
+ */
+void palette_transparent_set(u8_t rgb8) {
+  palette_entry_t* transparent = &self.entries[PALETTE_COLOUR_TRANSPARENT];
+  int              i;
+
+  self.transparent_rgb8 = rgb8;
+
+  for (i = 0; i < PALETTE_COLOUR_TRANSPARENT; i++) {
+    self.entries[i].is_transparent = (self.entries[i].rgb8 == rgb8);
+  }
+
+  transparent->rgb8               = rgb8;
+  transparent->rgb9               = PALETTE_RGB8_TO_RGB9(rgb8);
+  transparent->rgb16              = PALETTE_RGB9_TO_RGB16(transparent->rgb9);
+  transparent->is_layer2_priority = 0;
+  transparent->is_transparent     = 1;
+}
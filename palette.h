@@ -9,6 +9,16 @@
 #define PALETTE_RGB9_TO_RGB16(rgb9) ((((rgb9) & 0x1C0) << 7) | (((rgb9) & 0x38) << 6) | (((rgb9) & 0x07) << 5))
 
 
+/**
+ * Layers hand colours to the SLU as indices into the table returned by
+ * palette_entries(), which has all eight palettes one after the other,
+ * followed by the global transparency colour.
+ */
+#define PALETTE_N_PALETTES              (E_PALETTE_TILEMAP_SECOND - E_PALETTE_ULA_FIRST + 1)
+#define PALETTE_COLOUR(palette, index)  (((palette) << 8) | (index))
+#define PALETTE_COLOUR_TRANSPARENT      (PALETTE_N_PALETTES << 8)
+
+
 typedef enum {
   E_PALETTE_ULA_FIRST = 0,
   E_PALETTE_LAYER2_FIRST,
@@ -26,6 +36,7 @@ typedef struct {
   u16_t rgb9;
   u16_t rgb16;
   u8_t  is_layer2_priority;
+  u8_t  is_transparent;      /** Matches the global transparency colour. */
 } palette_entry_t;
 
 
@@ -33,8 +44,10 @@ int  palette_init(void);
 void palette_finit(void);
 
 const palette_entry_t* palette_read(palette_t palette, u8_t index);
+const palette_entry_t* palette_entries(void);
 void                   palette_write_rgb8(palette_t palette, u8_t index, u8_t  rgb);
 void                   palette_write_rgb9(palette_t palette, u8_t index, u8_t rgb);
 u16_t                  palette_rgb8_rgb16(u8_t rgb8);
+void                   palette_transparent_set(u8_t rgb8);
 
 #endif  /* __PALETTE_H */
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE  /* For posix_openpt() and cfmakeraw() on glibc. */
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "clock.h"
+#include "defs.h"
+#include "log.h"
+#include "pi.h"
+
+
+/**
+ * The UART that goes to the Raspberry Pi on a real Next, bridged to a
+ * pseudo-terminal or to a Unix socket someone else listens on.
+ *
+ * An I/O thread moves bytes between the host and the two FIFOs. The
+ * emulated side sees received bytes arrive, and sent bytes leave, at the
+ * pace of the programmed baud rate, unless unthrottled, in which case a
+ * byte is there as soon as the host has delivered it.
+ */
+
+
+/* Those of the real UART. */
+#define RX_SIZE  512
+#define TX_SIZE  64
+
+#define IO_WAIT_MS  1000
+
+
+typedef struct {
+  int          fd;
+  int          pty_slave_fd;   /* Kept open so the master never hangs up. */
+  int          is_unthrottled;
+
+  buffer_t     rx;             /* Filled by the I/O thread. */
+  buffer_t     tx;             /* Emptied by the I/O thread. */
+  int          wake[2];
+  SDL_atomic_t is_polling;
+  SDL_atomic_t is_closed;      /* By the host. */
+  SDL_Thread*  io_thread;
+  int          do_finit;
+
+  /* Emulation thread only. */
+  u32_t        prescalar;
+  int          bits_per_frame;
+  int          use_parity_check;
+  int          use_two_stop_bits;
+  u64_t        frame_ticks;    /* 28 MHz ticks per byte on the wire. */
+  size_t       rx_arrived;     /* Bytes in the RX ring that are done arriving. */
+  u64_t        rx_tick;        /* When the next byte will have arrived. */
+  u64_t        tx_tick;        /* When the last byte sent will have left. */
+} pi_t;
+
+
+static pi_t self;
+
+
+/* Wakes up the I/O thread if it is waiting in poll(). */
+static void wake_io_thread(void) {
+  const u8_t value = 0;
+
+  if (SDL_AtomicSet(&self.is_polling, 0)) {
+    (void) write(self.wake[1], &value, 1);
+  }
+}
+
+
+static int io_thread(void* ptr) {
+  struct pollfd fds[2];
+  u8_t          data[RX_SIZE > TX_SIZE ? RX_SIZE : TX_SIZE];
+  size_t        space;
+  size_t        n_tx;
+  ssize_t       n;
+
+  while (!self.do_finit) {
+    fds[0].fd     = self.wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd     = self.fd;
+
+    /* Announce we're going to sleep before looking, so that the emulation
+     * thread either sees us polling or we see what it did. */
+    SDL_AtomicSet(&self.is_polling, 1);
+
+    space = self.rx.size - buffer_n_elements(&self.rx);
+    n_tx  = buffer_n_elements(&self.tx);
+
+    fds[1].events = (space ? POLLIN : 0) | (n_tx ? POLLOUT : 0);
+    if (fds[1].events == 0) {
+      /* Nothing to do until the emulation thread wakes us. */
+      fds[1].fd = -1;
+    }
+
+    n = poll(fds, 2, IO_WAIT_MS);
+    SDL_AtomicSet(&self.is_polling, 0);
+    if (n <= 0) {
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      while (read(self.wake[0], data, sizeof(data)) > 0);
+    }
+
+    if (fds[1].revents & POLLOUT) {
+      n_tx = buffer_peek_n(&self.tx, 0, n_tx, data);
+      n    = write(self.fd, data, n_tx);
+      if (n > 0) {
+        (void) buffer_read_n(&self.tx, n, NULL);
+      }
+    }
+
+    if (space && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+      n = read(self.fd, data, space);
+      if (n > 0) {
+        (void) buffer_write_n(&self.rx, n, data);
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        log_wrn("pi: host side closed\n");
+        SDL_AtomicSet(&self.is_closed, 1);
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+static int pi_open_pty(void) {
+  struct termios termios;
+  const char*    name;
+
+  self.fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (self.fd == -1) {
+    goto exit;
+  }
+  if (grantpt(self.fd) != 0 || unlockpt(self.fd) != 0 || (name = ptsname(self.fd)) == NULL) {
+    goto exit_fd;
+  }
+
+  self.pty_slave_fd = open(name, O_RDWR | O_NOCTTY);
+  if (self.pty_slave_fd == -1) {
+    goto exit_fd;
+  }
+
+  /* Bytes go through untouched. */
+  if (tcgetattr(self.pty_slave_fd, &termios) == 0) {
+    cfmakeraw(&termios);
+    (void) tcsetattr(self.pty_slave_fd, TCSANOW, &termios);
+  }
+
+  log_wrn("pi: UART on %s\n", name);
+  return 0;
+
+exit_fd:
+  close(self.fd);
+  self.fd = -1;
+exit:
+  log_err("pi: could not open a pseudo-terminal\n");
+  return -1;
+}
+
+
+static int pi_open_socket(const char* path) {
+  struct sockaddr_un address;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    log_err("pi: socket path %s too long\n", path);
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  self.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (self.fd == -1) {
+    goto exit;
+  }
+  if (connect(self.fd, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+    goto exit_fd;
+  }
+
+  log_wrn("pi: UART on %s\n", path);
+  return 0;
+
+exit_fd:
+  close(self.fd);
+  self.fd = -1;
+exit:
+  log_err("pi: could not connect to %s: %s\n", path, strerror(errno));
+  return -1;
+}
+
+
+int pi_init(const char* device, int is_unthrottled) {
+  self.fd             = -1;
+  self.pty_slave_fd   = -1;
+  self.io_thread      = NULL;
+  self.do_finit       = 0;
+  self.is_unthrottled = is_unthrottled;
+
+  SDL_AtomicSet(&self.is_polling, 0);
+  SDL_AtomicSet(&self.is_closed,  0);
+
+  if (buffer_init(&self.rx, RX_SIZE) != 0) {
+    goto exit;
+  }
+  if (buffer_init(&self.tx, TX_SIZE) != 0) {
+    goto exit_rx;
+  }
+
+  pi_reset(E_RESET_HARD);
+
+  if (device == NULL) {
+    return 0;
+  }
+
+  if (pipe(self.wake) != 0) {
+    log_err("pi: could not create pipe\n");
+    goto exit_tx;
+  }
+  (void) fcntl(self.wake[0], F_SETFL, O_NONBLOCK);
+  (void) fcntl(self.wake[1], F_SETFL, O_NONBLOCK);
+
+  if ((strcmp(device, PI_DEVICE_PTY) == 0 ? pi_open_pty() : pi_open_socket(device)) != 0) {
+    goto exit_wake;
+  }
+  (void) fcntl(self.fd, F_SETFL, O_NONBLOCK);
+
+  self.io_thread = SDL_CreateThread(io_thread, "pi_io_thread", NULL);
+  if (self.io_thread == NULL) {
+    log_err("pi: could not create thread\n");
+    goto exit_fd;
+  }
+
+  return 0;
+
+exit_fd:
+  close(self.fd);
+  if (self.pty_slave_fd != -1) {
+    close(self.pty_slave_fd);
+  }
+exit_wake:
+  close(self.wake[0]);
+  close(self.wake[1]);
+exit_tx:
+  buffer_finit(&self.tx);
+exit_rx:
+  buffer_finit(&self.rx);
+exit:
+  return -1;
+}
+
+
+void pi_finit(void) {
+  const u8_t value = 0;
+
+  if (self.io_thread) {
+    self.do_finit = 1;
+    (void) write(self.wake[1], &value, 1);
+    SDL_WaitThread(self.io_thread, NULL);
+    self.io_thread = NULL;
+
+    close(self.fd);
+    if (self.pty_slave_fd != -1) {
+      close(self.pty_slave_fd);
+    }
+    close(self.wake[0]);
+    close(self.wake[1]);
+  }
+
+  buffer_finit(&self.tx);
+  buffer_finit(&self.rx);
+}
+
+
+static void pi_frame_ticks_update(void) {
+  const int bits = 1 + self.bits_per_frame + self.use_parity_check + (self.use_two_stop_bits ? 2 : 1);
+
+  self.frame_ticks = self.is_unthrottled ? 0 : (u64_t) self.prescalar * bits;
+}
+
+
+void pi_reset(reset_t reset) {
+  /* Whatever is on its way to the host still goes. */
+  buffer_reset(&self.rx);
+
+  self.rx_arrived = 0;
+  self.rx_tick    = clock_ticks();
+  self.tx_tick    = clock_ticks();
+
+  if (reset == E_RESET_HARD) {
+    self.prescalar         = 0;
+    self.bits_per_frame    = 8;
+    self.use_parity_check  = 0;
+    self.use_two_stop_bits = 0;
+    pi_frame_ticks_update();
+  }
+}
+
+
+void pi_prescalar_set(u32_t prescalar) {
+  self.prescalar = prescalar;
+  pi_frame_ticks_update();
+}
+
+
+void pi_dataformat_set(int bits_per_frame, int use_parity_check, int use_odd_parity, int use_two_stop_bits) {
+  self.bits_per_frame    = bits_per_frame;
+  self.use_parity_check  = use_parity_check;
+  self.use_two_stop_bits = use_two_stop_bits;
+  pi_frame_ticks_update();
+}
+
+
+/* Lets the bytes through that have had time to arrive by now. */
+static void pi_rx_arrive(void) {
+  const size_t n_elements = buffer_n_elements(&self.rx);
+  const u64_t  now        = clock_ticks();
+  u64_t        n;
+
+  if (self.frame_ticks == 0) {
+    self.rx_arrived = n_elements;
+    return;
+  }
+
+  if (self.rx_arrived == n_elements) {
+    /* Line idle, so the next byte starts arriving now. */
+    self.rx_tick = now + self.frame_ticks;
+    return;
+  }
+
+  if (now < self.rx_tick) {
+    return;
+  }
+
+  n = (now - self.rx_tick) / self.frame_ticks + 1;
+  if (n > n_elements - self.rx_arrived) {
+    n = n_elements - self.rx_arrived;
+  }
+  self.rx_arrived += n;
+  self.rx_tick    += n * self.frame_ticks;
+}
+
+
+u8_t pi_rx_read(void) {
+  int  was_full;
+  u8_t value;
+
+  pi_rx_arrive();
+
+  if (self.rx_arrived == 0) {
+    return 0x00;
+  }
+
+  was_full = (buffer_n_elements(&self.rx) == self.rx.size);
+  (void) buffer_read_n(&self.rx, 1, &value);
+  self.rx_arrived--;
+
+  /* The I/O thread stops reading from the host while we're full. */
+  if (was_full) {
+    wake_io_thread();
+  }
+
+  return value;
+}
+
+
+void pi_tx_write(u8_t value) {
+  const u64_t now = clock_ticks();
+
+  if (self.io_thread == NULL || SDL_AtomicGet(&self.is_closed)) {
+    return;
+  }
+
+  if (!buffer_write(&self.tx, value)) {
+    log_wrn("pi: TX overrun\n");
+    return;
+  }
+  wake_io_thread();
+
+  if (self.tx_tick < now) {
+    self.tx_tick = now;
+  }
+  self.tx_tick += self.frame_ticks;
+}
+
+
+u8_t pi_tx_read(void) {
+  const u64_t now      = clock_ticks();
+  const u64_t tx_ticks = (self.tx_tick > now) ? self.tx_tick - now : 0;
+
+  pi_rx_arrive();
+
+  return (tx_ticks == 0)                                    << 4 /* Tx empty      */
+       | (self.rx_arrived >= self.rx.size * 3 / 4)          << 3 /* Rx near full  */
+       | (self.rx_arrived == self.rx.size)                  << 2 /* Rx full       */
+       | (tx_ticks > (TX_SIZE - 1) * self.frame_ticks
+          || buffer_n_elements(&self.tx) == self.tx.size)   << 1 /* Tx full       */
+       | (self.rx_arrived > 0);                                  /* Rx not empty  */
+}
@@ -0,0 +1,22 @@
+#ifndef __PI_H
+#define __PI_H
+
+
+#include "defs.h"
+
+
+/* Device name that asks for a pseudo-terminal rather than a Unix socket. */
+#define PI_DEVICE_PTY  "pty"
+
+
+int  pi_init(const char* device, int is_unthrottled);
+void pi_finit(void);
+void pi_reset(reset_t reset);
+u8_t pi_tx_read(void);
+void pi_tx_write(u8_t value);
+u8_t pi_rx_read(void);
+void pi_prescalar_set(u32_t prescalar);
+void pi_dataformat_set(int bits_per_frame, int use_parity_check, int use_odd_parity, int use_two_stop_bits);
+
+
+#endif  /* __PI_H */
@@ -15,6 +15,7 @@ typedef struct {
   u8_t*          sram;
   rom_t          selected;
   rom_t          locked;
+  rom_t          active;
   machine_type_t machine_type;
   u8_t*          ptr;
 } self_t;
@@ -57,7 +58,8 @@ static void rom_refresh_ptr(void) {
       return;
   }
 
-  self.ptr = &self.sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_ROM + active * 16 * 1024];
+  self.active = active;
+  self.ptr    = &self.sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_ROM + active * 16 * 1024];
 }
 
 
@@ -101,6 +103,11 @@ rom_t rom_selected(void) {
 }
 
 
+rom_t rom_active(void) {
+  return self.active;
+}
+
+
 void rom_select(rom_t rom) {
   if (rom != self.selected) {
     self.selected = rom;
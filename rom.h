@@ -19,6 +19,7 @@ u8_t  rom_read(u16_t address);
 void  rom_write(u16_t address, u8_t value);
 void  rom_select(rom_t rom);
 rom_t rom_selected(void);
+rom_t rom_active(void);
 void  rom_lock(rom_t rom);
 void  rom_set_machine_type(machine_type_t machine_type);
 
@@ -1,5 +1,12 @@
+#include <SDL2/SDL.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "cpu.h"
 #include "defs.h"
 #include "log.h"
@@ -17,27 +24,40 @@
 #define N_SDCARDS         2
 #define MAX_BLOCK_LENGTH  1024
 #define SDCARD_IMAGE      "tbblue.mmc"
+#define SECTOR_SIZE       512
+
+#define CACHE_SIZE         1024  /* Sectors. */
+#define CACHE_HASH_SIZE    2048
+#define CACHE_NONE         -1
+#define FLUSH_INTERVAL_MS  100
+#define FLUSH_BATCH_SIZE   64
 
 #define TOKEN_BUSY        0x00
 #define TOKEN_NOT_BUSY    0xAA  /* Anything other than TOKEN_BUSY or TOKEN_NO_DATA. */
 #define TOKEN_START_DATA  0xFE
 #define TOKEN_NO_DATA     0xFF
 
+/* Tokens for CMD25. */
+#define TOKEN_START_DATA_MULTIPLE  0xFC
+#define TOKEN_STOP_TRAN            0xFD
+
 
 typedef enum {
-  E_CMD_GO_IDLE_STATE       = 0,
-  E_CMD_SEND_OP_COND        = 1,
-  E_CMD_SEND_IF_COND        = 8,
-  E_CMD_SEND_CSD            = 9,
-  E_CMD_STOP_TRANSMISSION   = 12,
-  E_CMD_SEND_STATUS         = 13,
-  E_CMD_SET_BLOCKLEN        = 16,
-  E_CMD_READ_SINGLE_BLOCK   = 17,
-  E_CMD_READ_MULTIPLE_BLOCK = 18,
-  E_CMD_WRITE_SINGLE_BLOCK  = 24,
-  E_CMD_APP_SEND_OP_COND    = 41,  /* Prepended by E_CMD_APP_CMD */
-  E_CMD_APP_CMD             = 55,
-  E_CMD_READ_OCR            = 58
+  E_CMD_GO_IDLE_STATE        = 0,
+  E_CMD_SEND_OP_COND         = 1,
+  E_CMD_SEND_IF_COND         = 8,
+  E_CMD_SEND_CSD             = 9,
+  E_CMD_STOP_TRANSMISSION    = 12,
+  E_CMD_SEND_STATUS          = 13,
+  E_CMD_SET_BLOCKLEN         = 16,
+  E_CMD_READ_SINGLE_BLOCK    = 17,
+  E_CMD_READ_MULTIPLE_BLOCK  = 18,
+  E_CMD_SET_BLOCK_COUNT      = 23,  /* Or ACMD23 when prepended by E_CMD_APP_CMD. */
+  E_CMD_WRITE_SINGLE_BLOCK   = 24,
+  E_CMD_WRITE_MULTIPLE_BLOCK = 25,
+  E_CMD_APP_SEND_OP_COND     = 41,  /* Prepended by E_CMD_APP_CMD */
+  E_CMD_APP_CMD              = 55,
+  E_CMD_READ_OCR             = 58
 } cmd_t;
 
 typedef enum {
@@ -65,30 +85,593 @@ typedef enum {
   E_STATE_INACTIVE
 } state_t;
   
+/* A sector written by the emulated machine but not necessarily by us yet. */
+typedef struct {
+  u64_t sector;
+  int   is_used;
+  int   is_dirty;
+  int   is_flushing;  /* Being written, so must not be evicted yet. */
+  int   newer;  /* LRU list. */
+  int   older;
+  int   next;   /* Hash chain. */
+  u8_t  data[SECTOR_SIZE];
+} cache_entry_t;
+
+
+typedef struct {
+  cache_entry_t entries[CACHE_SIZE];
+  int           buckets[CACHE_HASH_SIZE];
+  int           newest;
+  int           oldest;
+  int           n_dirty;
+} cache_t;
+
+
 typedef struct {
   state_t    state;
   u8_t       command_buffer[6];
   int        command_length;
   u8_t       command;
-  u8_t       response_buffer[1 + 1 + MAX_BLOCK_LENGTH + 2];  /* R1 + start data token + block + CRC. */
+  u8_t       response_buffer[2 + 16 + 2];  /* R1 + start data token + CSD + CRC. */
   int        response_length;
   int        response_index;
-  u8_t       data_buffer[MAX_BLOCK_LENGTH + 2];  /* block + CRC. */
+  const u8_t* block;        /* Block being sent, straight from the image. */
+  u32_t       block_index;
+  u32_t       block_size;
+  int         crc_length;
+  u8_t       data_buffer[1 + MAX_BLOCK_LENGTH + 2];  /* Start data token + block + CRC. */
   int        data_index;
   u8_t       error;
   u32_t      block_length;
-  u32_t      position;
+  u64_t      position;
+  u32_t      block_count;  /* Set by CMD23 for the next multiple block command, or 0. */
+  u32_t      blocks_left;  /* Of the current transfer, or 0 if until stopped. */
   int        in_app_cmd;
-  FILE*      fp;
-  long       size;
+  int        fd;
+  u8_t*      image;        /* Read-only when overlaid by a delta. */
+  u64_t      size;
   int        is_sdsc;
+  cache_t    cache;        /* Write-back cache, when not overlaid by a delta. */
+  int        delta_fd;
+  u8_t*      delta;        /* Sparse copy of the image, valid for dirty sectors only. */
+  u8_t*      dirty;        /* One bit per sector that lives in the delta. */
+  const char* delta_filename;
+  int         is_delta_committed;
+  u8_t        bounce[MAX_BLOCK_LENGTH];  /* For blocks partly in the image and partly in the delta. */
 } sdcard_t;
 
 
 static sdcard_t self[N_SDCARDS];
 
 
-int sdcard_init(void) {
+/* Writes cached sectors back to the images, away from the emulation thread. */
+typedef struct {
+  SDL_Thread* thread;
+  SDL_mutex*  mutex;
+  SDL_cond*   dirtied;
+  SDL_cond*   flushed;
+  int         do_finit;
+  u32_t       barriers_requested;
+  u32_t       barriers_completed;
+  u64_t       n_lookups;
+  u64_t       n_hits;
+  u64_t       n_sectors_flushed;
+  u64_t       n_syncs;
+  u64_t       sync_ticks;
+  u64_t       sync_ticks_max;
+} flusher_t;
+
+
+static flusher_t flusher;
+
+
+static int sdcard_is_dirty(sdcard_nr_t n, u64_t sector) {
+  return self[n].dirty[sector / 8] & (1 << (sector % 8));
+}
+
+
+/**
+ * Writes the dirty sectors back into the image, which we have to open for
+ * writing separately since the shared mapping is read-only.
+ */
+static void sdcard_delta_commit(sdcard_nr_t n, const char* filename) {
+  const u64_t n_sectors = (self[n].size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  u64_t       sector;
+  u64_t       n_committed = 0;
+  int         fd;
+
+  fd = open(filename, O_WRONLY);
+  if (fd == -1) {
+    log_err("sdcard%d: could not open %s for committing %s\n", n, filename, self[n].delta_filename);
+    return;
+  }
+
+  for (sector = 0; sector < n_sectors; sector++) {
+    const u64_t offset = sector * SECTOR_SIZE;
+    const u64_t length = (self[n].size - offset < SECTOR_SIZE) ? self[n].size - offset : SECTOR_SIZE;
+
+    if (self[n].dirty[sector / 8] == 0) {
+      sector |= 7;
+      continue;
+    }
+    if (!sdcard_is_dirty(n, sector)) {
+      continue;
+    }
+    if (pwrite(fd, &self[n].delta[offset], length, offset) != (ssize_t) length) {
+      log_err("sdcard%d: error committing sector %llu to %s\n", n, sector, filename);
+      break;
+    }
+    n_committed++;
+  }
+
+  (void) fsync(fd);
+  close(fd);
+
+  log_wrn("sdcard%d: committed %llu sectors from %s to %s\n", n, n_committed, self[n].delta_filename, filename);
+}
+
+
+static void sdcard_delta_close(sdcard_nr_t n, const char* filename) {
+  if (self[n].delta != NULL) {
+    if (self[n].is_delta_committed) {
+      sdcard_delta_commit(n, filename);
+    }
+    (void) munmap(self[n].delta, self[n].size);
+    self[n].delta = NULL;
+  }
+
+  if (self[n].delta_fd != -1) {
+    close(self[n].delta_fd);
+    (void) unlink(self[n].delta_filename);
+    self[n].delta_fd = -1;
+  }
+
+  if (self[n].dirty != NULL) {
+    free(self[n].dirty);
+    self[n].dirty = NULL;
+  }
+}
+
+
+static void sdcard_close(sdcard_nr_t n, const char* filename) {
+  sdcard_delta_close(n, filename);
+
+  if (self[n].image != NULL) {
+    (void) munmap(self[n].image, self[n].size);
+    self[n].image = NULL;
+  }
+
+  if (self[n].fd != -1) {
+    close(self[n].fd);
+    self[n].fd = -1;
+  }
+}
+
+
+/**
+ * The image is mapped rather than read, so that sectors can be served
+ * straight from the mapping and large images don't need to be read in
+ * completely. The mapping is read-only: written sectors go to the write-back
+ * cache, from where the flusher writes them to the file, which the mapping
+ * then reflects.
+ *
+ * With a delta the image is only opened for reading, so that many instances
+ * can share it, and written sectors go to the delta instead.
+ */
+static int sdcard_open(sdcard_nr_t n, const char* filename) {
+  const int   is_overlaid = (self[n].delta_filename != NULL);
+  struct stat st;
+  void*       image;
+
+  self[n].fd = open(filename, is_overlaid ? O_RDONLY : O_RDWR);
+  if (self[n].fd == -1) {
+    log_err("sdcard%d: could not open %s for %s\n", n, filename, is_overlaid ? "reading" : "reading and writing");
+    return -1;
+  }
+
+  if (fstat(self[n].fd, &st) != 0 || st.st_size == 0) {
+    log_err("sdcard%d: could not determine the size of %s\n", n, filename);
+    sdcard_close(n, filename);
+    return -1;
+  }
+
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, self[n].fd, 0);
+  if (image == MAP_FAILED) {
+    log_err("sdcard%d: could not map %s into memory\n", n, filename);
+    sdcard_close(n, filename);
+    return -1;
+  }
+
+  self[n].image = image;
+  self[n].size  = st.st_size;
+
+  if (!is_overlaid) {
+    return 0;
+  }
+
+  /* Truncating to the image size makes for a sparse file: only the sectors
+   * that are written take up disk space. */
+  self[n].delta_fd = open(self[n].delta_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (self[n].delta_fd == -1 || ftruncate(self[n].delta_fd, self[n].size) != 0) {
+    log_err("sdcard%d: could not create delta %s\n", n, self[n].delta_filename);
+    sdcard_close(n, filename);
+    return -1;
+  }
+
+  image = mmap(NULL, self[n].size, PROT_READ | PROT_WRITE, MAP_SHARED, self[n].delta_fd, 0);
+  if (image == MAP_FAILED) {
+    log_err("sdcard%d: could not map delta %s into memory\n", n, self[n].delta_filename);
+    sdcard_close(n, filename);
+    return -1;
+  }
+  self[n].delta = image;
+
+  self[n].dirty = calloc((self[n].size + SECTOR_SIZE - 1) / SECTOR_SIZE / 8 + 1, 1);
+  if (self[n].dirty == NULL) {
+    log_err("sdcard%d: out of memory\n", n);
+    sdcard_close(n, filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void sdcard_cache_reset(sdcard_nr_t n) {
+  cache_t* cache = &self[n].cache;
+  int      i;
+
+  for (i = 0; i < CACHE_SIZE; i++) {
+    cache->entries[i].is_used  = 0;
+    cache->entries[i].is_dirty    = 0;
+    cache->entries[i].is_flushing = 0;
+    cache->entries[i].newer    = (i == 0)              ? CACHE_NONE : i - 1;
+    cache->entries[i].older    = (i == CACHE_SIZE - 1) ? CACHE_NONE : i + 1;
+    cache->entries[i].next     = CACHE_NONE;
+  }
+  for (i = 0; i < CACHE_HASH_SIZE; i++) {
+    cache->buckets[i] = CACHE_NONE;
+  }
+
+  cache->newest  = 0;
+  cache->oldest  = CACHE_SIZE - 1;
+  cache->n_dirty = 0;
+}
+
+
+static void sdcard_cache_touch(cache_t* cache, int i) {
+  cache_entry_t* entry = &cache->entries[i];
+
+  if (cache->newest == i) {
+    return;
+  }
+
+  /* Unlink. */
+  cache->entries[entry->newer].older = entry->older;
+  if (entry->older != CACHE_NONE) {
+    cache->entries[entry->older].newer = entry->newer;
+  } else {
+    cache->oldest = entry->newer;
+  }
+
+  /* Link as newest. */
+  entry->newer                        = CACHE_NONE;
+  entry->older                        = cache->newest;
+  cache->entries[cache->newest].newer = i;
+  cache->newest                       = i;
+}
+
+
+/* Must be called with the flusher mutex locked. */
+static cache_entry_t* sdcard_cache_lookup(sdcard_nr_t n, u64_t sector) {
+  cache_t* cache = &self[n].cache;
+  int      i;
+
+  flusher.n_lookups++;
+
+  for (i = cache->buckets[sector % CACHE_HASH_SIZE]; i != CACHE_NONE; i = cache->entries[i].next) {
+    if (cache->entries[i].sector == sector) {
+      flusher.n_hits++;
+      sdcard_cache_touch(cache, i);
+      return &cache->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+static void sdcard_cache_unhash(cache_t* cache, int i) {
+  int* link = &cache->buckets[cache->entries[i].sector % CACHE_HASH_SIZE];
+
+  while (*link != i) {
+    link = &cache->entries[*link].next;
+  }
+  *link = cache->entries[i].next;
+}
+
+
+/**
+ * Evicts the least recently used clean sector. Sectors being flushed are
+ * not clean yet: until their write lands, the image still has the old data.
+ * Only when every sector is dirty or being flushed do we have to wait for the
+ * flusher. Must be called with the flusher mutex locked.
+ */
+static cache_entry_t* sdcard_cache_insert(sdcard_nr_t n, u64_t sector) {
+  cache_t*       cache = &self[n].cache;
+  cache_entry_t* entry;
+  int            i;
+
+  for (;;) {
+    for (i = cache->oldest; i != CACHE_NONE && (cache->entries[i].is_dirty || cache->entries[i].is_flushing); i = cache->entries[i].newer);
+    if (i != CACHE_NONE) {
+      break;
+    }
+    SDL_CondSignal(flusher.dirtied);
+    SDL_CondWait(flusher.flushed, flusher.mutex);
+  }
+
+  entry = &cache->entries[i];
+  if (entry->is_used) {
+    sdcard_cache_unhash(cache, i);
+  }
+
+  entry->sector  = sector;
+  entry->is_used = 1;
+  entry->next    = cache->buckets[sector % CACHE_HASH_SIZE];
+  cache->buckets[sector % CACHE_HASH_SIZE] = i;
+  sdcard_cache_touch(cache, i);
+
+  return entry;
+}
+
+
+/**
+ * Writes all dirty sectors of a card in batches, so that the emulation
+ * thread can keep going while we wait for the host. Sectors in a batch are
+ * pinned in the cache until written, and may be dirtied again meanwhile.
+ * Must be called with the flusher mutex locked, returns the number of
+ * sectors written.
+ */
+static u64_t sdcard_cache_flush(sdcard_nr_t n) {
+  static u8_t  batch[FLUSH_BATCH_SIZE][SECTOR_SIZE];
+  static u64_t sectors[FLUSH_BATCH_SIZE];
+  static int   batched[FLUSH_BATCH_SIZE];
+  cache_t*     cache     = &self[n].cache;
+  u64_t        n_flushed = 0;
+  int          n_batched;
+  int          i;
+
+  while (cache->n_dirty > 0) {
+    n_batched = 0;
+    for (i = 0; i < CACHE_SIZE && n_batched < FLUSH_BATCH_SIZE; i++) {
+      if (cache->entries[i].is_dirty) {
+        memcpy(batch[n_batched], cache->entries[i].data, SECTOR_SIZE);
+        sectors[n_batched]            = cache->entries[i].sector;
+        batched[n_batched++]          = i;
+        cache->entries[i].is_dirty    = 0;
+        cache->entries[i].is_flushing = 1;
+        cache->n_dirty--;
+      }
+    }
+
+    SDL_UnlockMutex(flusher.mutex);
+    for (i = 0; i < n_batched; i++) {
+      const u64_t offset = sectors[i] * SECTOR_SIZE;
+      const u64_t length = (self[n].size - offset < SECTOR_SIZE) ? self[n].size - offset : SECTOR_SIZE;
+
+      if (pwrite(self[n].fd, batch[i], length, offset) != (ssize_t) length) {
+        log_err("sdcard%d: error writing sector %llu to %s\n", n, sectors[i], SDCARD_IMAGE);
+      }
+    }
+    SDL_LockMutex(flusher.mutex);
+
+    for (i = 0; i < n_batched; i++) {
+      cache->entries[batched[i]].is_flushing = 0;
+    }
+
+    n_flushed += n_batched;
+    SDL_CondBroadcast(flusher.flushed);
+  }
+
+  return n_flushed;
+}
+
+
+static int sdcard_has_cache(sdcard_nr_t n) {
+  return self[n].image != NULL && self[n].delta == NULL;
+}
+
+
+/**
+ * Flushes periodically, when half of the cache is dirty, or when a barrier
+ * is requested. A barrier completes once every sector written before it has
+ * reached the disk, which it reports only after syncing.
+ */
+static int sdcard_flusher(void* data) {
+  int n;
+
+  SDL_LockMutex(flusher.mutex);
+
+  for (;;) {
+    const u32_t barrier   = flusher.barriers_requested;
+    const int   do_finit  = flusher.do_finit;
+    u64_t       n_flushed = 0;
+
+    for (n = 0; n < N_SDCARDS; n++) {
+      if (sdcard_has_cache(n)) {
+        n_flushed += sdcard_cache_flush(n);
+      }
+    }
+
+    if (n_flushed > 0 || barrier != flusher.barriers_completed) {
+      const Uint64 start = SDL_GetPerformanceCounter();
+      Uint64       ticks;
+
+      SDL_UnlockMutex(flusher.mutex);
+      for (n = 0; n < N_SDCARDS; n++) {
+        if (sdcard_has_cache(n)) {
+          (void) fdatasync(self[n].fd);
+        }
+      }
+      ticks = SDL_GetPerformanceCounter() - start;
+      SDL_LockMutex(flusher.mutex);
+
+      flusher.n_sectors_flushed += n_flushed;
+      flusher.n_syncs++;
+      flusher.sync_ticks += ticks;
+      if (ticks > flusher.sync_ticks_max) {
+        flusher.sync_ticks_max = ticks;
+      }
+      flusher.barriers_completed = barrier;
+      SDL_CondBroadcast(flusher.flushed);
+    }
+
+    if (do_finit) {
+      break;
+    }
+
+    if (flusher.barriers_requested == flusher.barriers_completed && !flusher.do_finit) {
+      (void) SDL_CondWaitTimeout(flusher.dirtied, flusher.mutex, FLUSH_INTERVAL_MS);
+    }
+  }
+
+  SDL_UnlockMutex(flusher.mutex);
+
+  return 0;
+}
+
+
+/**
+ * Asks the flusher to make everything written so far durable, without
+ * waiting for it.
+ */
+static void sdcard_barrier(void) {
+  SDL_LockMutex(flusher.mutex);
+  flusher.barriers_requested++;
+  SDL_CondSignal(flusher.dirtied);
+  SDL_UnlockMutex(flusher.mutex);
+}
+
+
+/**
+ * Last resort when we are about to die: write the dirty sectors without
+ * locking, since the emulation thread may hold the mutex, and sync.
+ */
+static void sdcard_signal_handler(int signal) {
+  int n;
+  int i;
+
+  for (n = 0; n < N_SDCARDS; n++) {
+    if (!sdcard_has_cache(n)) {
+      continue;
+    }
+    for (i = 0; i < CACHE_SIZE; i++) {
+      const cache_entry_t* entry = &self[n].cache.entries[i];
+      if ((entry->is_dirty || entry->is_flushing) && (entry->sector + 1) * SECTOR_SIZE <= self[n].size) {
+        (void) pwrite(self[n].fd, entry->data, SECTOR_SIZE, entry->sector * SECTOR_SIZE);
+      }
+    }
+    (void) fdatasync(self[n].fd);
+  }
+
+  (void) raise(signal);
+}
+
+
+/* SIGINT and SIGTERM are left to SDL, which turns them into a regular quit. */
+static const int flushing_signals[] = {
+  SIGHUP, SIGQUIT, SIGABRT, SIGBUS, SIGSEGV
+};
+
+
+static void sdcard_signals_set(void (*handler)(int)) {
+  struct sigaction action;
+  size_t           i;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handler;
+  action.sa_flags   = (handler == SIG_DFL) ? 0 : SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+
+  for (i = 0; i < sizeof(flushing_signals) / sizeof(*flushing_signals); i++) {
+    (void) sigaction(flushing_signals[i], &action, NULL);
+  }
+}
+
+
+static int sdcard_flusher_init(void) {
+  memset(&flusher, 0, sizeof(flusher));
+
+  flusher.mutex = SDL_CreateMutex();
+  if (flusher.mutex == NULL) {
+    log_err("sdcard: SDL_CreateMutex error: %s\n", SDL_GetError());
+    goto exit;
+  }
+
+  flusher.dirtied = SDL_CreateCond();
+  if (flusher.dirtied == NULL) {
+    log_err("sdcard: SDL_CreateCond error: %s\n", SDL_GetError());
+    goto exit_mutex;
+  }
+
+  flusher.flushed = SDL_CreateCond();
+  if (flusher.flushed == NULL) {
+    log_err("sdcard: SDL_CreateCond error: %s\n", SDL_GetError());
+    goto exit_dirtied;
+  }
+
+  flusher.thread = SDL_CreateThread(sdcard_flusher, "sdcard_flusher", NULL);
+  if (flusher.thread == NULL) {
+    log_err("sdcard: SDL_CreateThread error: %s\n", SDL_GetError());
+    goto exit_flushed;
+  }
+
+  sdcard_signals_set(sdcard_signal_handler);
+
+  return 0;
+
+exit_flushed:
+  SDL_DestroyCond(flusher.flushed);
+exit_dirtied:
+  SDL_DestroyCond(flusher.dirtied);
+exit_mutex:
+  SDL_DestroyMutex(flusher.mutex);
+exit:
+  return -1;
+}
+
+
+static void sdcard_flusher_finit(void) {
+  const double freq = SDL_GetPerformanceFrequency() / 1000000.0;
+
+  SDL_LockMutex(flusher.mutex);
+  flusher.do_finit = 1;
+  SDL_CondSignal(flusher.dirtied);
+  SDL_UnlockMutex(flusher.mutex);
+
+  /* The flusher does a final flush before it exits. */
+  SDL_WaitThread(flusher.thread, NULL);
+  sdcard_signals_set(SIG_DFL);
+
+  SDL_DestroyCond(flusher.flushed);
+  SDL_DestroyCond(flusher.dirtied);
+  SDL_DestroyMutex(flusher.mutex);
+
+  if (flusher.n_lookups > 0 || flusher.n_syncs > 0) {
+    log_wrn("sdcard: cache hit rate %.1f%% (%llu/%llu), %llu sectors flushed, %llu syncs taking %.0f us on average and %.0f us at most\n",
+            flusher.n_lookups ? 100.0 * flusher.n_hits / flusher.n_lookups : 0.0,
+            flusher.n_hits,
+            flusher.n_lookups,
+            flusher.n_sectors_flushed,
+            flusher.n_syncs,
+            flusher.n_syncs ? flusher.sync_ticks / freq / flusher.n_syncs : 0.0,
+            flusher.sync_ticks_max / freq);
+  }
+}
+
+
+int sdcard_init(const char* delta_filename, int is_delta_committed) {
   int n;
 
   for (n = 0; n < N_SDCARDS; n++) {
@@ -97,37 +680,42 @@ int sdcard_init(void) {
     self[n].command_length  = 0;
     self[n].response_length = 0;
     self[n].response_index  = 0;
+    self[n].block           = NULL;
+    self[n].block_index     = 0;
+    self[n].block_size      = 0;
+    self[n].crc_length      = 0;
     self[n].position        = 0;
+    self[n].block_count     = 0;
+    self[n].blocks_left     = 0;
     self[n].in_app_cmd      = 0;
     self[n].block_length    = 512;
-    self[n].fp              = NULL;
+    self[n].fd              = -1;
+    self[n].image           = NULL;
     self[n].size            = 0;
     self[n].is_sdsc         = 1;
+    self[n].delta_fd        = -1;
+    self[n].delta           = NULL;
+    self[n].dirty           = NULL;
+    self[n].delta_filename  = NULL;
+    self[n].is_delta_committed = 0;
+    sdcard_cache_reset(n);
+  }
 
-    if (n == 0) {
-      self[n].fp = fopen(SDCARD_IMAGE, "r+");
-      if (self[n].fp == NULL) {
-        log_err("sdcard%d: could not open %s for reading and writing\n", n, SDCARD_IMAGE);
-        for (n--; n >= 0; n--) {
-          fclose(self[n].fp);
-        }
-        return -1;
-      }
+  self[E_SDCARD_0].delta_filename     = delta_filename;
+  self[E_SDCARD_0].is_delta_committed = is_delta_committed;
 
-      if (fseek(self[n].fp, 0L, SEEK_END) != 0) {
-        log_err("sdcard%d: error seeking to the end in %s\n", n, SDCARD_IMAGE);
-        for (n--; n >= 0; n--) {
-          fclose(self[n].fp);
-        }
-        return -1;
-      }
+  if (sdcard_open(E_SDCARD_0, SDCARD_IMAGE) != 0) {
+    return -1;
+  }
 
-      self[n].size    = ftell(self[n].fp);
-      self[n].is_sdsc = self[n].size <= SDSC_MAX_SIZE;
-      if (self[n].is_sdsc) {
-        self[n].block_length = self[n].size == SDSC_MAX_SIZE ? 1024 : 512;
-      }
-    }
+  self[E_SDCARD_0].is_sdsc = self[E_SDCARD_0].size <= SDSC_MAX_SIZE;
+  if (self[E_SDCARD_0].is_sdsc) {
+    self[E_SDCARD_0].block_length = self[E_SDCARD_0].size == SDSC_MAX_SIZE ? 1024 : 512;
+  }
+
+  if (sdcard_flusher_init() != 0) {
+    sdcard_close(E_SDCARD_0, SDCARD_IMAGE);
+    return -1;
   }
 
   return 0;
@@ -137,55 +725,167 @@ int sdcard_init(void) {
 void sdcard_finit(void) {
   int n;
 
+  sdcard_flusher_finit();
+
   for (n = 0; n < N_SDCARDS; n++) {
-    if (self[n].fp != NULL) {
-      fclose(self[n].fp);
-      self[n].fp = NULL;
-    }
+    sdcard_close(n, SDCARD_IMAGE);
   }
 }
 
 
-static int sdcard_block_read(sdcard_nr_t n, u8_t* response_buffer) {
-  if (fread(&response_buffer[1], self[n].block_length, 1, self[n].fp) != 1) {
-    log_err("sdcard%d: error reading %u bytes from %s\n", n, self[n].block_length, SDCARD_IMAGE);
-    response_buffer[0] = 0x03;  /* Data error token (card controller error) . */
-    return 1;
+/**
+ * Returns the block at a position, which is only copied when it straddles
+ * sectors in both the image and the delta.
+ */
+static const u8_t* sdcard_delta_get(sdcard_nr_t n, u64_t position, u32_t length) {
+  const u64_t first = position / SECTOR_SIZE;
+  const u64_t last  = (position + length - 1) / SECTOR_SIZE;
+  u64_t       sector;
+  u64_t       n_dirty = 0;
+
+  for (sector = first; sector <= last; sector++) {
+    n_dirty += sdcard_is_dirty(n, sector) != 0;
+  }
+
+  if (n_dirty == 0) {
+    return &self[n].image[position];
+  }
+  if (n_dirty == last - first + 1) {
+    return &self[n].delta[position];
   }
 
-  response_buffer[0]                            = TOKEN_START_DATA;
-  response_buffer[1 + self[n].block_length + 0] = 0x00;  /* CRC. */
-  response_buffer[1 + self[n].block_length + 1] = 0x00;
+  for (sector = first; sector <= last; sector++) {
+    const u64_t start = (sector == first) ? position : sector * SECTOR_SIZE;
+    const u64_t end   = (sector == last)  ? position + length : (sector + 1) * SECTOR_SIZE;
+    const u8_t* from  = sdcard_is_dirty(n, sector) ? self[n].delta : self[n].image;
 
-  return 1 + self[n].block_length + 2;
+    memcpy(&self[n].bounce[start - position], &from[start], end - start);
+  }
+
+  return self[n].bounce;
 }
 
 
-u8_t sdcard_read(sdcard_nr_t n, u16_t address) {
-#if 0
-  u8_t response;
-#endif
-
-  /* If there is no response left, should we request one on the fly? */
-  if (self[n].fp != NULL) {
-    if (self[n].response_index == self[n].response_length) {
-      if (self[n].command == E_CMD_READ_MULTIPLE_BLOCK) {
-        self[n].position += self[n].block_length;
-        self[n].response_length = sdcard_block_read(n, self[n].response_buffer);
-        self[n].response_index  = 0;
-      }
-    }
+/**
+ * Returns the block at a position, which is only copied when some of its
+ * sectors are in the cache.
+ */
+static const u8_t* sdcard_cache_get(sdcard_nr_t n, u64_t position, u32_t length) {
+  const u64_t    first = position / SECTOR_SIZE;
+  const u64_t    last  = (position + length - 1) / SECTOR_SIZE;
+  cache_entry_t* entries[MAX_BLOCK_LENGTH / SECTOR_SIZE + 1];
+  u64_t          sector;
+  int            n_cached = 0;
+
+  SDL_LockMutex(flusher.mutex);
+
+  for (sector = first; sector <= last; sector++) {
+    entries[sector - first] = sdcard_cache_lookup(n, sector);
+    n_cached += entries[sector - first] != NULL;
+  }
+
+  if (n_cached == 0) {
+    SDL_UnlockMutex(flusher.mutex);
+    return &self[n].image[position];
   }
 
+  for (sector = first; sector <= last; sector++) {
+    const u64_t    offset = sector * SECTOR_SIZE;
+    const u64_t    start  = (sector == first) ? position : offset;
+    const u64_t    end    = (sector == last)  ? position + length : offset + SECTOR_SIZE;
+    cache_entry_t* entry  = entries[sector - first];
+
+    memcpy(&self[n].bounce[start - position], entry ? &entry->data[start - offset] : &self[n].image[start], end - start);
+  }
+
+  SDL_UnlockMutex(flusher.mutex);
+
+  return self[n].bounce;
+}
+
+
+/**
+ * Queues a start data token, the block at the current position and its CRC
+ * after whatever is in the response buffer. The block itself is not copied.
+ */
+static void sdcard_block_read(sdcard_nr_t n) {
+  if (self[n].position + self[n].block_length > self[n].size) {
+    log_err("sdcard%d: error reading %u bytes from %s at position %llu\n", n, self[n].block_length, SDCARD_IMAGE, self[n].position);
+    self[n].response_buffer[self[n].response_length++] = 0x03;  /* Data error token (card controller error) . */
+    self[n].block_size = 0;
+    self[n].crc_length = 0;
+    return;
+  }
+
+  self[n].response_buffer[self[n].response_length++] = TOKEN_START_DATA;
+
+  self[n].block       = self[n].delta ? sdcard_delta_get(n, self[n].position, self[n].block_length)
+                                      : sdcard_cache_get(n, self[n].position, self[n].block_length);
+  self[n].block_index = 0;
+  self[n].block_size  = self[n].block_length;
+  self[n].crc_length  = 2;
+}
+
+
+u8_t sdcard_read(sdcard_nr_t n, u16_t address) {
   /* Is there a response available? */
   if (self[n].response_index < self[n].response_length) {
     return self[n].response_buffer[self[n].response_index++];
   }
 
+  if (self[n].block_index < self[n].block_size) {
+    return self[n].block[self[n].block_index++];
+  }
+
+  if (self[n].crc_length > 0) {
+    self[n].crc_length--;
+    return 0x00;
+  }
+
+  /* Keep sending blocks until stopped, or until the CMD23 count is reached. */
+  if (self[n].image != NULL && self[n].command == E_CMD_READ_MULTIPLE_BLOCK && self[n].state == E_STATE_SENDING_DATA) {
+    if (self[n].blocks_left == 1) {
+      self[n].state = E_STATE_TRANSFER;
+      return TOKEN_NO_DATA;
+    }
+    if (self[n].blocks_left > 1) {
+      self[n].blocks_left--;
+    }
+
+    self[n].position       += self[n].block_length;
+    self[n].response_index  = 0;
+    self[n].response_length = 0;
+    sdcard_block_read(n);
+    return self[n].response_buffer[self[n].response_index++];
+  }
+
   return TOKEN_NO_DATA;
 }
 
 
+/**
+ * Hands out up to length bytes of the block being sent in one go, provided
+ * that the host has already consumed the response and the start data token.
+ * Returns the number of bytes, which may be zero.
+ */
+u32_t sdcard_read_n(sdcard_nr_t n, const u8_t** data, u32_t length) {
+  const u32_t available = self[n].block_size - self[n].block_index;
+
+  if (self[n].response_index < self[n].response_length || available == 0) {
+    return 0;
+  }
+
+  if (length > available) {
+    length = available;
+  }
+
+  *data                = &self[n].block[self[n].block_index];
+  self[n].block_index += length;
+
+  return length;
+}
+
+
 static void sdcard_fill_csd(sdcard_nr_t n, u8_t* csd) {
   memset(csd, 0x00, 16);
 
@@ -221,13 +921,17 @@ static void sdcard_fill_csd(sdcard_nr_t n, u8_t* csd) {
 
 
 static void sdcard_handle_command(sdcard_nr_t n) {
-  if (self[n].fp != NULL) {
+  if (self[n].image != NULL) {
     u32_t block_length;
 
     self[n].response_index = 0;
+    self[n].block_size     = 0;
+    self[n].crc_length     = 0;
 
     switch (self[n].command) {
       case E_CMD_GO_IDLE_STATE:
+        /* The host is (re)initialising the card, a good moment to sync. */
+        sdcard_barrier();
         self[n].state              = E_STATE_IDLE;
         self[n].response_buffer[0] = 0x01;  /* R1 indicating idle. */
         self[n].response_length    = 1;
@@ -296,18 +1000,30 @@ static void sdcard_handle_command(sdcard_nr_t n) {
           self[n].position *= self[n].block_length;
         }
 
-        if (fseek(self[n].fp, (long) self[n].position, SEEK_SET) != 0) {
-          log_err("sdcard%d: error seeking to position %u in %s\n", n, self[n].position, SDCARD_IMAGE);
-          self[n].error = E_ERROR_PARAMETER_ERROR;
-          return;
-        }
-
         self[n].state              = E_STATE_SENDING_DATA;
+        self[n].blocks_left        = (self[n].command == E_CMD_READ_MULTIPLE_BLOCK) ? self[n].block_count : 1;
+        self[n].block_count        = 0;
         self[n].response_buffer[0] = 0x00;  /* R1. */
-        self[n].response_length    = 1 + sdcard_block_read(n, &self[n].response_buffer[1]);
+        self[n].response_length    = 1;
+        sdcard_block_read(n);
+        return;
+
+      case E_CMD_SET_BLOCK_COUNT:
+        if (self[n].in_app_cmd) {
+          /* ACMD23 SET_WR_BLK_ERASE_COUNT is only a hint, ignore it. */
+          self[n].in_app_cmd = 0;
+        } else {
+          self[n].block_count = self[n].command_buffer[1] << 24
+                              | self[n].command_buffer[2] << 16
+                              | self[n].command_buffer[3] << 8
+                              | self[n].command_buffer[4];
+        }
+        self[n].response_buffer[0] = 0x00;  /* R1. */
+        self[n].response_length    = 1;
         return;
 
       case E_CMD_WRITE_SINGLE_BLOCK:
+      case E_CMD_WRITE_MULTIPLE_BLOCK:
         self[n].position = self[n].command_buffer[1] << 24
                          | self[n].command_buffer[2] << 16
                          | self[n].command_buffer[3] << 8
@@ -318,13 +1034,18 @@ static void sdcard_handle_command(sdcard_nr_t n) {
           self[n].position *= self[n].block_length;
         }
 
-        if (fseek(self[n].fp, (long) self[n].position, SEEK_SET) != 0) {
-          log_err("sdcard%d: error seeking to position %u in %s\n", n, self[n].position, SDCARD_IMAGE);
-          self[n].error = E_ERROR_PARAMETER_ERROR;
+        if (self[n].position + self[n].block_length > self[n].size) {
+          log_err("sdcard%d: position %llu beyond end of %s\n", n, self[n].position, SDCARD_IMAGE);
+          self[n].error              = E_ERROR_PARAMETER_ERROR;
+          self[n].response_buffer[0] = E_ERROR_PARAMETER_ERROR;
+          self[n].response_length    = 1;
           return;
         }
 
         self[n].state              = E_STATE_RECEIVE_DATA;
+        self[n].blocks_left        = (self[n].command == E_CMD_WRITE_MULTIPLE_BLOCK) ? self[n].block_count : 1;
+        self[n].block_count        = 0;
+        self[n].data_index         = 0;
         self[n].response_buffer[0] = 0x00;  /* R1. */
         self[n].response_length    = 1;
         return;
@@ -365,25 +1086,92 @@ static void sdcard_handle_command(sdcard_nr_t n) {
 }
 
 
+/**
+ * Sectors that are only partly written are first copied from the image, so
+ * that a dirty sector in the delta is always complete.
+ */
+static void sdcard_delta_put(sdcard_nr_t n, u64_t position, const u8_t* data, u32_t length) {
+  const u64_t first = position / SECTOR_SIZE;
+  const u64_t last  = (position + length - 1) / SECTOR_SIZE;
+  u64_t       sector;
+
+  for (sector = first; sector <= last; sector++) {
+    const u64_t offset = sector * SECTOR_SIZE;
+
+    if (sdcard_is_dirty(n, sector)) {
+      continue;
+    }
+    if (offset < position || offset + SECTOR_SIZE > position + length) {
+      const u64_t available = self[n].size - offset;
+      memcpy(&self[n].delta[offset], &self[n].image[offset], available < SECTOR_SIZE ? available : SECTOR_SIZE);
+    }
+    self[n].dirty[sector / 8] |= 1 << (sector % 8);
+  }
+
+  memcpy(&self[n].delta[position], data, length);
+}
+
+
+/**
+ * Written sectors only go into the cache, the flusher takes it from there.
+ * A sector that is only partly written is first filled from the image, which
+ * is up to date for any sector not in the cache.
+ */
+static void sdcard_cache_put(sdcard_nr_t n, u64_t position, const u8_t* data, u32_t length) {
+  const u64_t first = position / SECTOR_SIZE;
+  const u64_t last  = (position + length - 1) / SECTOR_SIZE;
+  cache_t*    cache = &self[n].cache;
+  u64_t       sector;
+
+  SDL_LockMutex(flusher.mutex);
+
+  for (sector = first; sector <= last; sector++) {
+    const u64_t    offset = sector * SECTOR_SIZE;
+    const u64_t    start  = (sector == first) ? position : offset;
+    const u64_t    end    = (sector == last)  ? position + length : offset + SECTOR_SIZE;
+    cache_entry_t* entry  = sdcard_cache_lookup(n, sector);
+
+    if (entry == NULL) {
+      entry = sdcard_cache_insert(n, sector);
+      if (start != offset || end != offset + SECTOR_SIZE) {
+        const u64_t available = self[n].size - offset;
+        memcpy(entry->data, &self[n].image[offset], available < SECTOR_SIZE ? available : SECTOR_SIZE);
+      }
+    }
+
+    memcpy(&entry->data[start - offset], &data[start - position], end - start);
+
+    if (!entry->is_dirty) {
+      entry->is_dirty = 1;
+      cache->n_dirty++;
+    }
+  }
+
+  if (cache->n_dirty >= CACHE_SIZE / 2) {
+    SDL_CondSignal(flusher.dirtied);
+  }
+
+  SDL_UnlockMutex(flusher.mutex);
+}
+
+
 static void sdcard_block_write(sdcard_nr_t n) {
   /* Assume we reject the data. */
   self[n].response_index     = 0;
   self[n].response_length    = 1;
   self[n].response_buffer[0] = 0x0D;  /* Data rejected. */
 
-  if (self[n].data_buffer[0] != TOKEN_START_DATA) {
-    log_err("sdcard%d: block of data to write did not start with start-of-data token\n", n);
+  if (self[n].position + self[n].block_length > self[n].size) {
+    log_err("sdcard%d: position %llu beyond end of %s\n", n, self[n].position, SDCARD_IMAGE);
     return;
   }
 
-  if (fwrite(&self[n].data_buffer[1], self[n].block_length, 1, self[n].fp) != 1) {
-    log_err("sdcard%d: error writing %u bytes to %s\n", n, self[n].block_length, SDCARD_IMAGE);
-    return;
+  if (self[n].delta) {
+    sdcard_delta_put(n, self[n].position, &self[n].data_buffer[1], self[n].block_length);
+  } else {
+    sdcard_cache_put(n, self[n].position, &self[n].data_buffer[1], self[n].block_length);
   }
 
-  /* Ensure everything is written. */
-  (void) fflush(self[n].fp);
-  
   self[n].response_buffer[0] = 0x05;  /* Data accepted. */
   self[n].response_buffer[1] = TOKEN_NOT_BUSY;
   self[n].response_length    = 2;
@@ -391,17 +1179,50 @@ static void sdcard_block_write(sdcard_nr_t n) {
 
 
 static void sdcard_receive_data(sdcard_nr_t n, u8_t value) {
+  const int is_multiple = (self[n].command == E_CMD_WRITE_MULTIPLE_BLOCK);
+
   /* Preconditions:
-   * - self[n].block_length + 2 <= sizeof(self[n].data_buffer)
-   * - self[n].data_index       <  sizeof(self[n].data_buffer)
+   * - 1 + self[n].block_length + 2 <= sizeof(self[n].data_buffer)
+   * - self[n].data_index           <  sizeof(self[n].data_buffer)
    */
+  if (self[n].data_index == 0) {
+    if (is_multiple && value == TOKEN_STOP_TRAN) {
+      self[n].state              = E_STATE_TRANSFER;
+      self[n].response_index     = 0;
+      self[n].response_buffer[0] = TOKEN_NOT_BUSY;
+      self[n].response_length    = 1;
+      return;
+    }
+
+    if (value == TOKEN_NO_DATA) {
+      /* Host is still clocking bytes before the start token. */
+      return;
+    }
+
+    if (value != (is_multiple ? TOKEN_START_DATA_MULTIPLE : TOKEN_START_DATA)) {
+      log_err("sdcard%d: block of data to write did not start with start-of-data token\n", n);
+      self[n].response_index     = 0;
+      self[n].response_buffer[0] = 0x0D;  /* Data rejected. */
+      self[n].response_length    = 1;
+      self[n].state              = E_STATE_TRANSFER;
+      return;
+    }
+  }
+
   self[n].data_buffer[self[n].data_index++] = value;
 
   if (self[n].data_index == 1 + self[n].block_length + 2) {
     sdcard_block_write(n);
 
     self[n].data_index = 0;
-    self[n].state      = E_STATE_TRANSFER;
+    self[n].position  += self[n].block_length;
+
+    /* CMD25 continues until a stop token, or until the CMD23 count is reached. */
+    if (!is_multiple || self[n].blocks_left == 1) {
+      self[n].state = E_STATE_TRANSFER;
+    } else if (self[n].blocks_left > 1) {
+      self[n].blocks_left--;
+    }
   }
 }
 
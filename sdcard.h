@@ -11,10 +11,11 @@ typedef enum {
 } sdcard_nr_t;
 
 
-int  sdcard_init(void);
-void sdcard_finit(void);
-u8_t sdcard_read(sdcard_nr_t card, u16_t address);
-void sdcard_write(sdcard_nr_t card, u16_t address, u8_t value);
+int   sdcard_init(const char* delta_filename, int is_delta_committed);
+void  sdcard_finit(void);
+u8_t  sdcard_read(sdcard_nr_t card, u16_t address);
+u32_t sdcard_read_n(sdcard_nr_t card, const u8_t** data, u32_t length);
+void  sdcard_write(sdcard_nr_t card, u16_t address, u8_t value);
 
 
 #endif  /* __SDCARD_H */
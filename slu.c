@@ -9,6 +9,7 @@
 #include "slu.h"
 #include "sprites.h"
 #include "tilemap.h"
+#include "timeline.h"
 #include "ula.h"
 
 
@@ -21,25 +22,26 @@ typedef enum {
 
 
 typedef struct {
-  SDL_Renderer*        renderer;
-  SDL_Texture*         texture;
-  u16_t*               frame_buffer;
-  u32_t                beam_row;
-  u32_t                beam_column;
-  int                  is_beam_visible;
-  int                  do_skip_frame;
-  u32_t                display_rows;
-  u32_t                display_columns;
+  SDL_Renderer*          renderer;
+  SDL_Texture*           texture;
+  u16_t*                 frame_buffer;
+  u32_t                  beam_row;
+  u32_t                  beam_column;
+  int                    is_beam_visible;
+  int                    do_skip_frame;
+  u32_t                  display_rows;
+  u32_t                  display_columns;
+  const palette_entry_t* palette;  /* Indexed by PALETTE_COLOUR(). */
 
   /* Resettable. */
-  slu_layer_priority_t layer_priority;
-  int                  line_irq_active;
-  int                  line_irq_enabled;
-  u16_t                line_irq_row;
-  int                  stencil_mode;
-  blend_mode_t         blend_mode;
-  palette_entry_t      transparent;
-  u16_t                fallback_rgba;
+  slu_layer_priority_t   layer_priority;
+  int                    line_irq_active;
+  int                    line_irq_enabled;
+  u16_t                  line_irq_row;
+  int                    stencil_mode;
+  blend_mode_t           blend_mode;
+  palette_entry_t        transparent;
+  u16_t                  fallback_rgba;
 } self_t;
 
 
@@ -57,6 +59,7 @@ int slu_init(SDL_Renderer* renderer, SDL_Texture* texture) {
 
   self.renderer = renderer;
   self.texture  = texture;
+  self.palette  = palette_entries();
 
   slu_reset(E_RESET_HARD);
 
@@ -153,7 +156,13 @@ static void slu_beam_advance(void) {
  * > signal.
  */
 static void slu_irq(void) {
-  self.line_irq_active = (self.line_irq_enabled && ((self.beam_row == self.display_rows - 1 && self.line_irq_row == 0) || self.beam_row == self.line_irq_row - 1) && self.beam_column >= 256 * 2);
+  const int is_active = (self.line_irq_enabled && ((self.beam_row == self.display_rows - 1 && self.line_irq_row == 0) || self.beam_row == self.line_irq_row - 1) && self.beam_column >= 256 * 2);
+
+  if (is_active != self.line_irq_active) {
+    timeline_event(E_TIMELINE_EVENT_LINE_IRQ, is_active, 0, 0);
+  }
+
+  self.line_irq_active = is_active;
   cpu_irq(E_CPU_IRQ_LINE, self.line_irq_active);
 }
 
@@ -204,7 +213,8 @@ void slu_run(u32_t ticks_14mhz) {
     .rgb8               = 0,
     .rgb9               = 0,
     .rgb16              = 0,
-    .is_layer2_priority = 0
+    .is_layer2_priority = 0,
+    .is_transparent     = 0
   };
 
   u32_t                  tick;
@@ -216,6 +226,7 @@ void slu_run(u32_t ticks_14mhz) {
   int                    ula_border;
   int                    ula_clipped;
   int                    ula_transparent;
+  u16_t                  ula_colour     = PALETTE_COLOUR_TRANSPARENT;
   const palette_entry_t* ula_rgb;
 
   int                    ulatm_transparent;
@@ -229,6 +240,7 @@ void slu_run(u32_t ticks_14mhz) {
 
   int                    tm_en;
   int                    tm_transparent;
+  u16_t                  tm_colour      = PALETTE_COLOUR_TRANSPARENT;
   const palette_entry_t* tm_rgb;
   int                    tm_pixel_en;
   int                    tm_pixel_textmode;
@@ -241,6 +253,7 @@ void slu_run(u32_t ticks_14mhz) {
   int                    layer2_pixel_en;
   int                    layer2_priority;
   int                    layer2_transparent;
+  u16_t                  layer2_colour  = PALETTE_COLOUR_TRANSPARENT;
   const palette_entry_t* layer2_rgb;
 
   int                    stencil_transparent;
@@ -263,8 +276,7 @@ void slu_run(u32_t ticks_14mhz) {
     slu_beam_advance();
     slu_irq();
 
-    /* Copper runs at 28 MHz. */
-    copper_tick(self.beam_row, self.beam_column);
+    /* Copper runs at 28 MHz, so two cycles per tick. */
     copper_tick(self.beam_row, self.beam_column);
 
     if (!ula_beam_to_frame_buffer(self.beam_row, self.beam_column, &frame_buffer_row, &frame_buffer_column)) {
@@ -276,20 +288,23 @@ void slu_run(u32_t ticks_14mhz) {
       continue;
     }
 
-    ula_tick(    frame_buffer_row, frame_buffer_column, &ula_en, &ula_border, &ula_clipped, &ula_rgb);
-    tilemap_tick(frame_buffer_row, frame_buffer_column, &tm_en, &tm_pixel_en, &tm_pixel_below, &tm_pixel_textmode, &tm_rgb);
+    ula_tick(    frame_buffer_row, frame_buffer_column, &ula_en, &ula_border, &ula_clipped, &ula_colour);
+    tilemap_tick(frame_buffer_row, frame_buffer_column, &tm_en, &tm_pixel_en, &tm_pixel_below, &tm_pixel_textmode, &tm_colour);
     sprites_tick(frame_buffer_row, frame_buffer_column, &sprite_pixel_en, &sprite_rgb16);
-    layer2_tick( frame_buffer_row, frame_buffer_column, &layer2_pixel_en, &layer2_rgb, &layer2_priority);
+    layer2_tick( frame_buffer_row, frame_buffer_column, &layer2_pixel_en, &layer2_colour);
+
+    /* Layers hand over palette indices, resolved here in one lookup. */
+    ula_rgb    = &self.palette[ula_colour];
+    tm_rgb     = &self.palette[tm_colour];
+    layer2_rgb = &self.palette[layer2_colour];
 
-    ula_transparent = !ula_en || ula_clipped || (ula_rgb->rgb8 == self.transparent.rgb8);
-    tm_transparent  = !tm_en || !tm_pixel_en || (tm_pixel_textmode && tm_rgb->rgb8 == self.transparent.rgb8);
+    ula_transparent = !ula_en || ula_clipped || ula_rgb->is_transparent;
+    tm_transparent  = !tm_en || !tm_pixel_en || (tm_pixel_textmode && tm_rgb->is_transparent);
 
     sprite_transparent = !sprite_pixel_en;
 
-    layer2_transparent = !layer2_pixel_en || (layer2_rgb->rgb8 == self.transparent.rgb8);
-    if (layer2_transparent) {
-      layer2_priority = 0;
-    }
+    layer2_transparent = !layer2_pixel_en || layer2_rgb->is_transparent;
+    layer2_priority    = !layer2_transparent && layer2_rgb->is_layer2_priority;
 
     if (self.stencil_mode && ula_en && tm_en) {
       stencil_transparent   = ula_transparent || tm_transparent;
@@ -380,7 +395,7 @@ void slu_run(u32_t ticks_14mhz) {
 
       case E_SLU_LAYER_PRIORITY_BLEND:
       case E_SLU_LAYER_PRIORITY_BLEND_5:
-        ula_mix_transparent = ula_clipped || (ula_rgb->rgb8 == self.transparent.rgb8);
+        ula_mix_transparent = ula_clipped || ula_rgb->is_transparent;
         ula_mix_rgb         = ula_mix_transparent ? ula_rgb : &black;
 
         switch (self.blend_mode) {
@@ -507,6 +522,9 @@ void slu_transparent_set(u8_t rgb8) {
   self.transparent.rgb9               = PALETTE_RGB8_TO_RGB9(rgb8);
   self.transparent.rgb16              = PALETTE_RGB9_TO_RGB16(self.transparent.rgb9);
   self.transparent.is_layer2_priority = 0;
+  self.transparent.is_transparent     = 1;
+
+  palette_transparent_set(rgb8);
 }
 
 
@@ -518,6 +536,9 @@ const palette_entry_t* slu_transparent_get(void) {
 void slu_line_interrupt_enable_set(int enable) {
   self.line_irq_enabled = enable;
   if (!self.line_irq_enabled) {
+    if (self.line_irq_active) {
+      timeline_event(E_TIMELINE_EVENT_LINE_IRQ, 0, 0, 0);
+    }
     self.line_irq_active = 0;
     cpu_irq(E_CPU_IRQ_LINE, 0);
   }  
@@ -528,3 +549,9 @@ void slu_display_size_set(unsigned int rows, unsigned int columns) {
   self.display_rows    = rows;
   self.display_columns = columns;
 }
+
+
+void slu_beam_get(u32_t* row, u32_t* column) {
+  *row    = self.beam_row;
+  *column = self.beam_column;
+}
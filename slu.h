@@ -36,6 +36,7 @@ void                   slu_transparent_set(u8_t rgb8);
 const palette_entry_t* slu_transparent_get(void);
 void                   slu_reset(reset_t reset);
 void                   slu_display_size_set(unsigned int rows, unsigned int columns);
+void                   slu_beam_get(u32_t* row, u32_t* column);
 
 
 #endif  /* __SLU_H */
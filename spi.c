@@ -1,6 +1,7 @@
 #include "defs.h"
 #include "log.h"
 #include "sdcard.h"
+#include "spi.h"
 
 
 typedef enum {
@@ -24,15 +25,17 @@ static const char* spi_device_names[] = {
 
 
 typedef struct {
-  spi_device_t device;
+  spi_device_t      device;
+  spi_accelerator_t accelerator;
 } spi_t;
 
 
 static spi_t self;
 
 
-int spi_init(void) {
-  self.device = E_SPI_DEVICE_NONE;
+int spi_init(spi_accelerator_t accelerator) {
+  self.device      = E_SPI_DEVICE_NONE;
+  self.accelerator = accelerator;
   return 0;
 }
 
@@ -112,6 +115,34 @@ u8_t spi_data_read(u16_t address) {
 }
 
 
+spi_accelerator_t spi_accelerator_get(void) {
+  return self.accelerator;
+}
+
+
+/**
+ * Reads up to length bytes in one go, for when the CPU repeatedly reads the
+ * data port with INIR. Only SD cards that are sending a block oblige, for any
+ * other device or state this returns zero and the CPU carries on as normal.
+ */
+u32_t spi_data_read_n(u16_t address, const u8_t** data, u32_t length) {
+  if (self.accelerator == E_SPI_ACCELERATOR_OFF) {
+    return 0;
+  }
+
+  switch (self.device) {
+    case E_SPI_DEVICE_SDCARD_0:
+      return sdcard_read_n(E_SDCARD_0, data, length);
+
+    case E_SPI_DEVICE_SDCARD_1:
+      return sdcard_read_n(E_SDCARD_1, data, length);
+
+    default:
+      return 0;
+  }
+}
+
+
 void spi_data_write(u16_t address, u8_t value) {
   switch (self.device) {
     case E_SPI_DEVICE_SDCARD_0:
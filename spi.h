@@ -5,12 +5,22 @@
 #include "defs.h"
 
 
-int  spi_init(void);
-void spi_finit(void);
-u8_t spi_cs_read(u16_t address);
-void spi_cs_write(u16_t address, u8_t value);
-u8_t spi_data_read(u16_t address);
-void spi_data_write(u16_t address, u8_t value);
+/* How to move SD card blocks read by INIR from the data port. */
+typedef enum {
+  E_SPI_ACCELERATOR_OFF = 0,  /* Byte by byte. */
+  E_SPI_ACCELERATOR_EXACT,    /* In one go, charging the usual T-states. */
+  E_SPI_ACCELERATOR_FAST      /* In one go, charging a single iteration. */
+} spi_accelerator_t;
+
+
+int               spi_init(spi_accelerator_t accelerator);
+void              spi_finit(void);
+spi_accelerator_t spi_accelerator_get(void);
+u8_t              spi_cs_read(u16_t address);
+void              spi_cs_write(u16_t address, u8_t value);
+u8_t              spi_data_read(u16_t address);
+u32_t             spi_data_read_n(u16_t address, const u8_t** data, u32_t length);
+void              spi_data_write(u16_t address, u8_t value);
 
 
 #endif  /* __SPI_H */
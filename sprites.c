@@ -5,7 +5,16 @@
 #include "sprites.h"
 
 
-#define N_SPRITES  128
+#define N_SPRITES     128
+#define N_PATTERNS    128  /* In 128-byte units. */
+#define N_TRANSFORMS  8
+#define LINE_WIDTH    (FRAME_BUFFER_WIDTH / 2)
+#define LINE_INVALID  0xFFFFFFFF
+
+/* Transform bits, as a key into the pattern cache. */
+#define TRANSFORM_ROTATE    0x04
+#define TRANSFORM_MIRROR_X  0x02
+#define TRANSFORM_MIRROR_Y  0x01
 
 
 typedef struct {
@@ -62,6 +71,44 @@ const sprite_t initial_anchor = {
 };
 
 
+/**
+ * Where a sprite ends up, resolved from its own attributes and those of its
+ * anchor.
+ */
+typedef struct {
+  int  is_visible;
+  int  x;
+  int  y;
+  int  xf;  /* Magnification. */
+  int  yf;
+  int  n;   /* Pattern, in 128-byte units. */
+  int  h;   /* 4-bit pattern. */
+  int  p;   /* Palette offset. */
+  int  r;
+  int  xm;
+  int  ym;
+} placement_t;
+
+
+/**
+ * A pattern expanded to one index per pixel, rotated and mirrored, with
+ * the opaque span of each row.
+ */
+typedef struct {
+  u8_t pixels[16][16];
+  u8_t first[16];  /* Row is fully transparent when first > last. */
+  u8_t last[16];
+} transformed_t;
+
+
+/* What happens to a sprite pixel at a column of the scanline. */
+typedef enum {
+  E_VISIBILITY_NONE = 0,
+  E_VISIBILITY_CLIPPED,   /* Subject to the clip window and priority. */
+  E_VISIBILITY_ALWAYS     /* Over the border without clipping. */
+} visibility_t;
+
+
 /**
  * https://wiki.specnext.dev/Sprites
  *
@@ -69,32 +116,40 @@ const sprite_t initial_anchor = {
  *
  * That's 64 x 8-bit sprites of 256 bytes each, or
  *       128 x 4-bit sprites of 128 bytes each.
+ *
+ * Like the hardware, sprites are drawn into a line buffer a scanline at a
+ * time, so that changes made mid-frame, such as multiplexing sprites from
+ * a line interrupt or the copper, show from the next scanline on.
  */
 
 typedef struct {
-  u8_t*     patterns;
-  sprite_t* sprites;
-  u16_t*    frame_buffer;
-  u8_t*     is_transparent;
-  int       is_enabled;
-  int       is_enabled_over_border;
-  int       is_enabled_clipping_over_border;
-  int       is_zero_on_top;
-  int       clip_x1;
-  int       clip_x2;
-  int       clip_y1;
-  int       clip_y2;
-  int       clip_x1_eff;
-  int       clip_x2_eff;
-  int       clip_y1_eff;
-  int       clip_y2_eff;  
-  u8_t      transparency_index;
-  u8_t      sprite_index;
-  u8_t      pattern_index;
-  u16_t     pattern_address;
-  u8_t      attribute_index;
-  int       is_dirty;
-  palette_t palette;
+  u8_t*          patterns;
+  sprite_t*      sprites;
+  transformed_t (*transformed)[N_PATTERNS][N_TRANSFORMS];  /* By h, pattern, transform. */
+  u8_t           is_transformed[2][N_PATTERNS];             /* One bit per transform. */
+  int            is_enabled;
+  int            is_enabled_over_border;
+  int            is_enabled_clipping_over_border;
+  int            is_zero_on_top;
+  int            clip_x1;
+  int            clip_x2;
+  int            clip_y1;
+  int            clip_y2;
+  int            clip_x1_eff;
+  int            clip_x2_eff;
+  int            clip_y1_eff;
+  int            clip_y2_eff;  
+  u8_t           transparency_index;
+  u8_t           sprite_index;
+  u8_t           pattern_index;
+  u16_t          pattern_address;
+  u8_t           attribute_index;
+  int            is_dirty;  /* Placements need resolving. */
+  palette_t      palette;
+  placement_t placements[N_SPRITES];
+  u16_t          line_rgb[LINE_WIDTH];
+  u8_t           line_is_opaque[LINE_WIDTH];
+  u32_t          line_row;
 } sprites_t;
 
 
@@ -106,12 +161,11 @@ int sprites_init(void) {
 
   memset(&self, 0, sizeof(self));
 
-  self.patterns       = (u8_t*)     calloc(16, 1024);
-  self.sprites        = (sprite_t*) calloc(N_SPRITES, sizeof(sprite_t));
-  self.frame_buffer   = (u16_t*)    malloc(FRAME_BUFFER_HEIGHT * (FRAME_BUFFER_WIDTH / 2) * 2);
-  self.is_transparent = (u8_t*)     malloc(FRAME_BUFFER_HEIGHT * (FRAME_BUFFER_WIDTH / 2));
+  self.patterns    = (u8_t*)     calloc(16, 1024);
+  self.sprites     = (sprite_t*) calloc(N_SPRITES, sizeof(sprite_t));
+  self.transformed = malloc(2 * sizeof(*self.transformed));
 
-  if (self.patterns == NULL || self.sprites == NULL || self.frame_buffer == NULL || self.is_transparent == NULL) {
+  if (self.patterns == NULL || self.sprites == NULL || self.transformed == NULL) {
     log_err("sprites: out of memory\n");
     sprites_finit();
     return -1;
@@ -128,13 +182,9 @@ int sprites_init(void) {
 
 
 void sprites_finit(void) {
-  if (self.is_transparent != NULL) {
-    free(self.is_transparent);
-    self.is_transparent = NULL;
-  }
-  if (self.frame_buffer != NULL) {
-    free(self.frame_buffer);
-    self.frame_buffer = NULL;
+  if (self.transformed != NULL) {
+    free(self.transformed);
+    self.transformed = NULL;
   }
   if (self.sprites != NULL) {
     free(self.sprites);
@@ -184,444 +234,284 @@ void sprites_reset(reset_t reset) {
   self.transparency_index              = 0xE3;
   self.palette                         = E_PALETTE_SPRITES_FIRST;
   self.is_dirty                        = 1;
-}
-
+  self.line_row                        = LINE_INVALID;
 
-typedef u8_t pattern_t[256];
+  memset(self.is_transformed, 0, sizeof(self.is_transformed));
 
+  sprites_update_effective_clipping_area();
+}
 
-static void rotate(pattern_t pattern) {
-  pattern_t rotated;
-  int       row;
-  int       col;
 
-  for (row = 0; row < 16; row++) {
-    for (col = 0; col < 16; col++) {
-      rotated[row * 16 + col] = pattern[(15 - col) * 16 + row];
-    }
+static void place_anchor(sprite_t* sprite, placement_t* placement) {
+  placement->is_visible = sprite->v;
+  if (!sprite->v) {
+    return;
   }
 
-  memcpy(pattern, rotated, 256);
+  sprite->n60 = (sprite->n50 << 1) | sprite->n6;
+  sprite->x80 = (sprite->x8_pr << 8) | sprite->x70;
+  sprite->y80 = (sprite->y8    << 8) | sprite->y70;
+
+  placement->x  = sprite->x80;
+  placement->y  = sprite->y80;
+  placement->xf = 1 << sprite->xx;
+  placement->yf = 1 << sprite->yy;
+  placement->n  = sprite->n60;
+  placement->h  = sprite->h;
+  placement->p  = sprite->p;
+  placement->r  = sprite->r;
+  placement->xm = sprite->xm;
+  placement->ym = sprite->ym;
 }
 
 
-static void mirror_x(pattern_t pattern) {
-  int   row;
-  int   col;
-  u8_t* a;
-  u8_t* b;
-  u8_t  tmp;
+static void place_composite(const sprite_t* sprite, const sprite_t* anchor, placement_t* placement) {
+  int n;
 
-  for (row = 0; row < 16; row++) {
-    for (col = 0; col < 8; col++) {
-      a = &pattern[row * 16 + col];
-      b = &pattern[row * 16 + (15 - col)];
+  n = (sprite->n50 << 1) | sprite->n6;
+  if (sprite->po) n += anchor->n60;
 
-      tmp = *a;
-      *a  = *b;
-      *b  = tmp;
-    }
-  }
+  placement->x  = anchor->x80 + (s8_t) sprite->x70;
+  placement->y  = anchor->y80 + (s8_t) sprite->y70;
+  placement->xf = 1 << sprite->xx;
+  placement->yf = 1 << sprite->yy;
+  placement->n  = n & 0x7F;
+  placement->h  = anchor->h;
+  placement->p  = sprite->x8_pr ? (anchor->p + sprite->p) : sprite->p;
+  placement->r  = sprite->r;
+  placement->xm = sprite->xm;
+  placement->ym = sprite->ym;
 }
 
 
-static void mirror_y(pattern_t pattern) {
-  int   row;
-  int   col;
-  u8_t* a;
-  u8_t* b;
-  u8_t  tmp;
+static void place_unified(const sprite_t* sprite, const sprite_t* anchor, placement_t* placement) {
+  int  n;
+  int  xf = 1 << anchor->xx;
+  int  yf = 1 << anchor->yy;
+  s8_t xd = (s8_t) sprite->x70;
+  s8_t yd = (s8_t) sprite->y70;
+  int  tmp;
 
-  for (col = 0; col < 16; col++) {
-    for (row = 0; row < 8; row++) {
-      a = &pattern[row        * 16 + col];
-      b = &pattern[(15 - row) * 16 + col];
+  n = (sprite->n50 << 1) | sprite->n6;
+  if (sprite->po) n += anchor->n60;
 
-      tmp = *a;
-      *a  = *b;
-      *b  = tmp;
-    }
+  if (anchor->r) {
+    tmp = xd;
+    xd  = -yd;
+    yd  = tmp;
   }
-}
-
 
-static void fetch_pattern(int n, int h, pattern_t pattern) {
-  if (h) {
-    const u8_t* src = &self.patterns[n * 128];
-    u8_t*       dst = pattern;
-    int         i;
+  if (anchor->xm) {
+    xd = -xd;
+  }
 
-    for (i = 0; i < 128; i++) {
-      *dst++ = (*src  ) >> 4;
-      *dst++ = (*src++) & 0x0F;
-    }
-  } else {
-    memcpy(pattern, &self.patterns[(n & 0xFE) * 128], 256);
+  if (anchor->ym) {
+    yd = -yd;
   }
-}
 
+  placement->x  = anchor->x80 + xd * xf;
+  placement->y  = anchor->y80 + yd * yf;
+  placement->xf = xf;
+  placement->yf = yf;
+  placement->n  = n & 0x7F;
+  placement->h  = anchor->h;
+  placement->p  = sprite->x8_pr ? (anchor->p + sprite->p) : sprite->p;
+  placement->r  = anchor->r;
+  placement->xm = anchor->xm;
+  placement->ym = anchor->ym;
+}
 
-static int is_pixel_visible(int x, int y) {
-  if (x < 0 || x >= 320 || y < 0 || y >= 256) {
-    /* Outside 320x256 area. */
-    return 0;
-  }
 
-  if (x < 32 || x >= 320 - 32 || y < 32 || y >= 256 - 32) {
-    /* Over border. */
-    if (!self.is_enabled_over_border) {
-      /* Not enabled over border. */
-      return 0;
-    }
-    if (!self.is_enabled_clipping_over_border) {
-      /* Not clipped over border, only in 256x192 interior. */
-      return 1;
-    }
+static int place_sprite(sprite_t* sprite, const sprite_t* anchor, placement_t* placement) {
+  if (!sprite->e || (sprite->attr[4] & 0xC0) != 0x40) {
+    place_anchor(sprite, placement);
+    return 1;
   }
 
-  if (x < self.clip_x1_eff || x > self.clip_x2_eff || y < self.clip_y1_eff || y > self.clip_y2_eff) {
-    /* Clipped. */
+  placement->is_visible = anchor->v && sprite->v;
+  if (!placement->is_visible) {
     return 0;
   }
 
-  if (self.is_zero_on_top && !self.is_transparent[y * 320 + x]) {
-    /* Earlier higher priority sprite plotted here. */
-    return 0;
+  if (anchor->t) {
+    place_unified(sprite, anchor, placement);
+  } else {
+    place_composite(sprite, anchor, placement);
   }
 
-  return 1;
+  return 0;
 }
 
 
-static void draw_pixel(u16_t rgb, int x, int y, int xf, int yf) {
-  const int dr = (yf < 0) ? -1 : +1;
-  const int dc = (xf < 0) ? -1 : +1;
-  int       row;
-  int       col;
-  int       offset;
-  int       xs;
-  int       ys;
-
-  for (row = 0; row != yf; row += dr) {
-    ys = y + row;
-    for (col = 0; col != xf; col += dc) {
-      xs = x + col;
-      if (is_pixel_visible(xs, ys)) {
-        offset = ys * 320 + xs;
-        self.frame_buffer[  offset] = rgb;
-        self.is_transparent[offset] = 0;
-      }
-    }
-  }
-}
-
+static void place_sprites(void) {
+  const sprite_t* anchor = &initial_anchor;
+  sprite_t*       sprite;
+  size_t          i;
 
-#if 0
-
-static void draw_hex1(u8_t number, u16_t rgb, int x, int y) {
-  char patterns[16][5 * 3] = {
-    "xxx"
-    "x x"
-    "x x"
-    "x x"
-    "xxx",
-
-    "  x"
-    "  x"
-    "  x"
-    "  x"
-    "  x",
-
-    "xxx"
-    "  x"
-    "xxx"
-    "x  "
-    "xxx",
-
-    "xxx"
-    "  x"
-    "xxx"
-    "  x"
-    "xxx",
-
-    "  x"
-    "x x"
-    "xxx"
-    "  x"
-    "  x",
-
-    "xxx"
-    "x  "
-    "xxx"
-    "  x"
-    "xxx",
-
-    "x  "
-    "x  "
-    "xxx"
-    "x x"
-    "xxx",
-
-    "xxx"
-    "  x"
-    "  x"
-    "  x"
-    "  x",
-
-    "xxx"
-    "x x"
-    "xxx"
-    "x x"
-    "xxx",
-
-    "xxx"
-    "x x"
-    "xxx"
-    "  x"
-    "  x",
-
-    "xxx"
-    "x x"
-    "xxx"
-    "x x"
-    "x x",
-
-    "xx "
-    "x x"
-    "xx "
-    "x x"
-    "xx ",
-
-    "xxx"
-    "x  "
-    "x  "
-    "x  "
-    "xxx",
-
-    "xx "
-    "x x"
-    "x x"
-    "x x"
-    "xx ",
-
-    "xxx"
-    "x  "
-    "xxx"
-    "x  "
-    "xxx",
-
-    "xxx"
-    "x  "
-    "xxx"
-    "x  "
-    "x  "
-  };
-
-  int   row;
-  int   col;
-  int   ys;
-  int   xs;
-  u32_t offset;
-  char* ptr = patterns[number];
-
-  for (row = 0; row < 5; row++) {
-    ys = y + row;
-    for (col = 0; col < 3; col++) {
-      xs = x + col;
-      if (*ptr++ == 'x') {
-        if (is_pixel_visible(xs, ys)) {
-          offset = ys * 320 + xs;
-          self.frame_buffer[  offset] = rgb;
-          self.is_transparent[offset] = 0;
-        }
-      }
+  for (i = 0; i < N_SPRITES; i++) {
+    sprite = &self.sprites[i];
+    if (place_sprite(sprite, anchor, &self.placements[i])) {
+      anchor = sprite;
     }
   }
 }
 
-static void draw_hex2(u8_t number, u16_t rgb, int x, int y) {
-  draw_hex1(number >> 4  , rgb, x,     y);
-  draw_hex1(number & 0x0F, rgb, x + 4, y);
-}
-
-#endif
 
+static void line_visibility(u32_t row, u8_t* visibility) {
+  const int is_row_over_border = row < 32 || row >= 256 - 32;
+  const int is_row_clipped     = (int) row < self.clip_y1_eff || (int) row > self.clip_y2_eff;
+  int       x;
 
-static void draw_pattern(const pattern_t pattern, int p, int x, int y, int xf, int yf, u8_t sprite_number, u8_t pattern_number, u16_t dbg_rgb) {
-  const palette_entry_t* entry;
-  int                    row;
-  int                    col;
-  u8_t                   index;
-
-  for (row = 0; row < 16; row++) {
-    for (col = 0; col < 16; col++) {
-      index = pattern[row * 16 + col];
-      if (index != self.transparency_index) {
-        entry = palette_read(self.palette, (p << 4) + index);
-        draw_pixel(entry->rgb16, x + col * xf, y + row * yf, xf, yf);
+  for (x = 0; x < LINE_WIDTH; x++) {
+    if (is_row_over_border || x < 32 || x >= LINE_WIDTH - 32) {
+      if (!self.is_enabled_over_border) {
+        visibility[x] = E_VISIBILITY_NONE;
+        continue;
+      }
+      if (!self.is_enabled_clipping_over_border) {
+        /* Not clipped over border, only in 256x192 interior. */
+        visibility[x] = E_VISIBILITY_ALWAYS;
+        continue;
       }
     }
-  }
-
-#if 0
-  if (is_pixel_visible(x, y)) {
-    const u32_t offset = y * 320 + x;
-    self.frame_buffer[  offset] = dbg_rgb;
-    self.is_transparent[offset] = 0;
 
-    draw_hex2(sprite_number,  dbg_rgb, x + 2, y + 2);
-    draw_hex2(pattern_number, dbg_rgb, x + 2, y + 8);
+    visibility[x] = (is_row_clipped || x < self.clip_x1_eff || x > self.clip_x2_eff) ? E_VISIBILITY_NONE : E_VISIBILITY_CLIPPED;
   }
-#endif
 }
 
 
-static void draw_anchor(sprite_t* sprite) {
-  pattern_t pattern;
-
-  if (!sprite->v) {
-    return;
+static u8_t pattern_pixel(int n, int h, int i) {
+  if (h) {
+    const u8_t pixels = self.patterns[n * 128 + i / 2];
+    return (i & 1) ? (pixels & 0x0F) : (pixels >> 4);
   }
 
-  sprite->n60 = (sprite->n50 << 1) | sprite->n6;
-  sprite->x80 = (sprite->x8_pr << 8) | sprite->x70;
-  sprite->y80 = (sprite->y8    << 8) | sprite->y70;
-
-  fetch_pattern(sprite->n60, sprite->h, pattern);
-
-  if (sprite->r)  rotate(pattern);
-  if (sprite->xm) mirror_x(pattern);
-  if (sprite->ym) mirror_y(pattern);
-
-  draw_pattern(pattern, sprite->p, sprite->x80, sprite->y80, 1 << sprite->xx, 1 << sprite->yy, sprite->number, sprite->n60, 0xE000);
+  return self.patterns[n * 128 + i];
 }
 
 
-static void draw_composite(sprite_t* sprite, const sprite_t* anchor) {
-  pattern_t pattern;
-  int       x;
-  int       y;
-  int       n;
-  int       p;
-
-  n = (sprite->n50 << 1) | sprite->n6;
-  if (sprite->po) n += anchor->n60;
+/**
+ * Expands a pattern, rotated first and then mirrored.
+ */
+static void pattern_transform(int n, int h, int transform, transformed_t* transformed) {
+  int row;
+  int col;
+  int i;
+  int step;
 
-  fetch_pattern(n, anchor->h, pattern);
+  for (row = 0; row < 16; row++) {
+    const int r = (transform & TRANSFORM_MIRROR_Y) ? 15 - row : row;
+
+    if (transform & TRANSFORM_ROTATE) {
+      i    = ((transform & TRANSFORM_MIRROR_X) ? 0 : 15) * 16 + r;
+      step = (transform & TRANSFORM_MIRROR_X) ? 16 : -16;
+    } else {
+      i    = r * 16 + ((transform & TRANSFORM_MIRROR_X) ? 15 : 0);
+      step = (transform & TRANSFORM_MIRROR_X) ? -1 : 1;
+    }
 
-  if (sprite->r)  rotate(pattern);
-  if (sprite->xm) mirror_x(pattern);
-  if (sprite->ym) mirror_y(pattern);
+    transformed->first[row] = 16;
+    transformed->last[row]  = 0;
 
-  x = anchor->x80 + (s8_t) sprite->x70;
-  y = anchor->y80 + (s8_t) sprite->y70;
-  p = sprite->x8_pr ? (anchor->p + sprite->p) : sprite->p;
+    for (col = 0; col < 16; col++, i += step) {
+      const u8_t index = pattern_pixel(n, h, i);
 
-  draw_pattern(pattern, p, x, y, 1 << sprite->xx, 1 << sprite->yy, sprite->number, n, 0x0E00);
+      transformed->pixels[row][col] = index;
+      if (index != self.transparency_index) {
+        if (transformed->first[row] == 16) {
+          transformed->first[row] = col;
+        }
+        transformed->last[row] = col;
+      }
+    }
+  }
 }
 
 
-static void draw_unified(sprite_t* sprite, const sprite_t* anchor) {
-  pattern_t pattern;
-  int       x;
-  int       y;
-  int       n;
-  int       p;
-  int       xf = 1 << anchor->xx;
-  int       yf = 1 << anchor->yy;
-  s8_t      xd = (s8_t) sprite->x70;
-  s8_t      yd = (s8_t) sprite->y70;
-  int       tmp;
-  int       xm;
-  int       ym;
-
-  n = (sprite->n50 << 1) | sprite->n6;
-  if (sprite->po) n += anchor->n60;
-
-  fetch_pattern(n, anchor->h, pattern);
-
-  if (anchor->r) {
-    rotate(pattern);
-    tmp = xd;
-    xd  = -yd;
-    yd  = tmp;
-  }
-
-  xm = (!anchor->r && anchor->xm) || (anchor->r && anchor->ym);
-  ym = (!anchor->r && anchor->ym) || (anchor->r && anchor->xm);
+static const transformed_t* pattern_get(const placement_t* placement) {
+  const int h         = placement->h;
+  const int n         = h ? placement->n : (placement->n & 0xFE);
+  const int transform = (placement->r << 2) | (placement->xm << 1) | placement->ym;
 
-  if (anchor->xm) {
-    mirror_x(pattern);
-    xd = -xd;
+  if (!(self.is_transformed[h][n] & (1 << transform))) {
+    pattern_transform(n, h, transform, &self.transformed[h][n][transform]);
+    self.is_transformed[h][n] |= 1 << transform;
   }
 
-  if (anchor->ym) {
-    mirror_y(pattern);
-    yd = -yd;
-  }
+  return &self.transformed[h][n][transform];
+}
 
-  x = anchor->x80 + xd * xf;
-  y = anchor->y80 + yd * yf;
-  p = sprite->x8_pr ? (anchor->p + sprite->p) : sprite->p;
 
-  draw_pattern(pattern, p, x, y, xf, yf, sprite->number, n, 0x00E0);
-}
+static void line_draw(const placement_t* placement, int pattern_row, const u8_t* visibility) {
+  const transformed_t* transformed = pattern_get(placement);
+  const u8_t*          pixels      = transformed->pixels[pattern_row];
+  int                  col;
+  int                  k;
+  int                  x;
+  u8_t                 index;
+  u16_t                rgb;
 
+  for (col = transformed->first[pattern_row]; col <= transformed->last[pattern_row]; col++) {
+    index = pixels[col];
+    if (index == self.transparency_index) {
+      continue;
+    }
 
-static int draw_sprite(sprite_t* sprite, const sprite_t* anchor) {
-  if (!sprite->e || (sprite->attr[4] & 0xC0) != 0x40) {
-    draw_anchor(sprite);
-    return 1;
-  }
+    rgb = palette_read(self.palette, (placement->p << 4) + index)->rgb16;
 
-  if (!anchor->v || !sprite->v) {
-    return 0;
-  }
+    for (k = 0, x = placement->x + col * placement->xf; k < placement->xf; k++, x++) {
+      if (x < 0 || x >= LINE_WIDTH || visibility[x] == E_VISIBILITY_NONE) {
+        continue;
+      }
+      if (visibility[x] == E_VISIBILITY_CLIPPED && self.is_zero_on_top && self.line_is_opaque[x]) {
+        /* Earlier higher priority sprite plotted here. */
+        continue;
+      }
 
-  if (anchor->t) {
-    draw_unified(sprite, anchor);
-  } else {
-    draw_composite(sprite, anchor);
+      self.line_rgb[x]       = rgb;
+      self.line_is_opaque[x] = 1;
+    }
   }
-
-  return 0;
 }
 
 
-static void draw_sprites(void) {
-  const sprite_t* anchor = &initial_anchor;
-  sprite_t*       sprite;
-  size_t          i;
+static void line_render(u32_t row) {
+  u8_t visibility[LINE_WIDTH];
+  int  i;
 
-  /* Assume no sprites visible. */
-  memset(self.is_transparent, 1, FRAME_BUFFER_HEIGHT * FRAME_BUFFER_WIDTH / 2);
+  if (self.is_dirty) {
+    place_sprites();
+    self.is_dirty = 0;
+  }
 
-  /* Draw the sprites in order. */
+  memset(self.line_is_opaque, 0, sizeof(self.line_is_opaque));
+  line_visibility(row, visibility);
+
+  /* Draw the sprites on this line in order. */
   for (i = 0; i < N_SPRITES; i++) {
-    sprite = &self.sprites[i];
-    if (draw_sprite(sprite, anchor)) {
-      anchor = sprite;
+    const placement_t* placement = &self.placements[i];
+
+    if (placement->is_visible && (int) row >= placement->y && (int) row < placement->y + 16 * placement->yf) {
+      line_draw(placement, ((int) row - placement->y) / placement->yf, visibility);
     }
   }
+
+  self.line_row = row;
 }
 
 
 void sprites_tick(u32_t row, u32_t column, int* is_enabled, u16_t* rgb) {
-  size_t offset;
-
   if (!self.is_enabled) {
     *is_enabled = 0;
     return;
   }
 
-  if (self.is_dirty && row == self.clip_y1_eff && column == self.clip_x1_eff) {
-    draw_sprites();
-    self.is_dirty = 0;
+  if (row != self.line_row) {
+    line_render(row);
   }
 
-  offset      = row * FRAME_BUFFER_WIDTH / 2 + column / 2;
-  *rgb        = self.frame_buffer[offset];
-  *is_enabled = !self.is_transparent[offset];
+  *rgb        = self.line_rgb[column / 2];
+  *is_enabled = self.line_is_opaque[column / 2];
 }
 
 
@@ -633,7 +523,6 @@ int sprites_priority_get(void) {
 void sprites_priority_set(int is_zero_on_top) {
   if (is_zero_on_top != self.is_zero_on_top) {
     self.is_zero_on_top = is_zero_on_top;
-    self.is_dirty       = 1;
   }
 }
 
@@ -646,6 +535,7 @@ int sprites_enable_get(void) {
 void sprites_enable_set(int enable) {
   if (enable != self.is_enabled) {
     self.is_enabled = enable;
+    self.line_row   = LINE_INVALID;
   }
 }
 
@@ -658,7 +548,6 @@ int sprites_enable_over_border_get(void) {
 void sprites_enable_over_border_set(int enable) {
   if (enable != self.is_enabled_over_border) {
     self.is_enabled_over_border = enable;
-    self.is_dirty               = 1;
 
     sprites_update_effective_clipping_area();
   }
@@ -673,7 +562,6 @@ int sprites_enable_clipping_over_border_get(void) {
 void sprites_enable_clipping_over_border_set(int enable) {
   if (enable != self.is_enabled_clipping_over_border) {
     self.is_enabled_clipping_over_border = enable;
-    self.is_dirty                        = 1;
 
     sprites_update_effective_clipping_area();
   }
@@ -686,7 +574,6 @@ void sprites_clip_set(u8_t x1, u8_t x2, u8_t y1, u8_t y2) {
     self.clip_x2  = x2;
     self.clip_y1  = y1;
     self.clip_y2  = y2;
-    self.is_dirty = 1;
 
     sprites_update_effective_clipping_area();
   }
@@ -763,7 +650,9 @@ void sprites_attribute_set(u8_t slot, u8_t attribute_index, u8_t value) {
 void sprites_transparency_index_write(u8_t value) {
   if (value != self.transparency_index) {
     self.transparency_index = value;
-    self.is_dirty           = 1;
+
+    /* Opaque spans depend on it. */
+    memset(self.is_transformed, 0, sizeof(self.is_transformed));
   }
 }
 
@@ -796,17 +685,18 @@ void sprites_next_attribute_set(u8_t value) {
 
 void sprites_next_pattern_set(u8_t value) {
   if (self.patterns[self.pattern_address] != value) {
+    const int n = self.pattern_address / 128;
+
     self.patterns[self.pattern_address] = value;
-    self.is_dirty                       = 1;
+
+    /* As part of a 4-bit and of an 8-bit pattern. */
+    self.is_transformed[1][n]        = 0;
+    self.is_transformed[0][n & 0xFE] = 0;
   }
   self.pattern_address = (self.pattern_address + 1) & 0x3FFF;
 }
 
 
 void sprites_palette_set(int use_second) {
-  const palette_t palette = use_second ? E_PALETTE_SPRITES_SECOND : E_PALETTE_SPRITES_FIRST;
-  if (self.palette != palette) {
-    self.palette  = palette;
-    self.is_dirty = 1;
-  }
+  self.palette = use_second ? E_PALETTE_SPRITES_SECOND : E_PALETTE_SPRITES_FIRST;
 }
@@ -0,0 +1,706 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "altrom.h"
+#include "bootrom.h"
+#include "clock.h"
+#include "config.h"
+#include "cpu.h"
+#include "defs.h"
+#include "divmmc.h"
+#include "log.h"
+#include "memory.h"
+#include "mmu.h"
+#include "rom.h"
+#include "tape.h"
+#include "ula.h"
+#include "utils.h"
+
+
+/**
+ * Tape timings are specified in T-states of a 3.5 MHz Spectrum, regardless
+ * of the CPU speed we run at.
+ */
+#define TAPE_TICKS_PER_TSTATE     8
+#define TAPE_TSTATES_PER_MS    3500
+
+/* https://worldofspectrum.org/TZXformat.html */
+#define TAPE_TZX_HEADER_SIZE     10
+
+/* ROM timings. */
+#define TAPE_PILOT_LENGTH      2168
+#define TAPE_PILOT_HEADER      8063
+#define TAPE_PILOT_DATA        3223
+#define TAPE_SYNC_1_LENGTH      667
+#define TAPE_SYNC_2_LENGTH      735
+#define TAPE_ZERO_LENGTH        855
+#define TAPE_ONE_LENGTH        1710
+#define TAPE_PAUSE_MS          1000
+
+
+typedef enum {
+  E_TAPE_PHASE_ENTER = 0,
+  E_TAPE_PHASE_PILOT,
+  E_TAPE_PHASE_SYNC_1,
+  E_TAPE_PHASE_SYNC_2,
+  E_TAPE_PHASE_DATA,
+  E_TAPE_PHASE_PULSES,
+  E_TAPE_PHASE_PAUSE,
+  E_TAPE_PHASE_DONE
+} tape_phase_t;
+
+
+typedef enum {
+  E_TAPE_BLOCK_END = -1,
+  E_TAPE_BLOCK_META,
+  E_TAPE_BLOCK_SIGNAL,
+  E_TAPE_BLOCK_STOP
+} tape_block_t;
+
+
+typedef struct {
+  u8_t*        data;
+  size_t       size;
+  int          is_tzx;
+  int          is_playing;
+  int          is_fast_load;
+  int          is_unthrottled;
+  size_t       block;
+  size_t       block_next;
+  size_t       loop_start;
+  u16_t        loop_count;
+  int          is_standard;
+  tape_phase_t phase;
+  u16_t        pilot_length;
+  u16_t        sync_1_length;
+  u16_t        sync_2_length;
+  u16_t        zero_length;
+  u16_t        one_length;
+  u32_t        pulses_left;
+  const u8_t*  pulses;
+  const u8_t*  bytes;
+  size_t       n_bytes;
+  u8_t         last_byte_bits;
+  u16_t        pause_ms;
+  size_t       byte_index;
+  u8_t         bit_index;
+  int          is_second_half;
+  int          ear;
+  int          level_after;    /* 0 or 1, or -1 to toggle at the next edge. */
+  u64_t        edge_ticks;
+} self_t;
+
+
+static self_t self;
+
+
+int tape_init(void) {
+  memset(&self, 0, sizeof(self));
+
+  self.is_fast_load   = 1;
+  self.is_unthrottled = 1;
+
+  return 0;
+}
+
+
+void tape_finit(void) {
+  if (self.data != NULL) {
+    free(self.data);
+    self.data = NULL;
+  }
+}
+
+
+static u16_t tape_u16(const u8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+
+static u32_t tape_u24(const u8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+
+static u32_t tape_u32(const u8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (u32_t) p[3] << 24;
+}
+
+
+int tape_open(const char* filename) {
+  const char* extension = strrchr(filename, '.');
+  u8_t*       data;
+  size_t      size;
+
+  if (utils_load_file(filename, &data, &size) != 0) {
+    return -1;
+  }
+
+  self.is_tzx = (extension != NULL && strcasecmp(extension, ".tzx") == 0);
+  if (self.is_tzx && (size < TAPE_TZX_HEADER_SIZE || memcmp(data, "ZXTape!\x1A", 8) != 0)) {
+    log_err("tape: %s is not a TZX file\n", filename);
+    free(data);
+    return -1;
+  }
+
+  tape_finit();
+
+  self.data       = data;
+  self.size       = size;
+  self.block      = self.is_tzx ? TAPE_TZX_HEADER_SIZE : 0;
+  self.phase      = E_TAPE_PHASE_ENTER;
+  self.is_playing = 0;
+  self.ear        = 0;
+
+  log_wrn("tape: %s inserted\n", filename);
+
+  return 0;
+}
+
+
+static void tape_block_data(const u8_t* bytes, size_t n_bytes, u8_t last_byte_bits, u16_t pause_ms) {
+  self.bytes          = bytes;
+  self.n_bytes        = n_bytes;
+  self.last_byte_bits = (last_byte_bits == 0 || last_byte_bits > 8) ? 8 : last_byte_bits;
+  self.pause_ms       = pause_ms;
+  self.byte_index     = 0;
+  self.bit_index      = 0;
+  self.is_second_half = 0;
+}
+
+
+static void tape_block_standard(const u8_t* bytes, size_t n_bytes, u16_t pause_ms) {
+  self.pilot_length  = TAPE_PILOT_LENGTH;
+  self.pulses_left   = (n_bytes > 0 && bytes[0] < 0x80) ? TAPE_PILOT_HEADER : TAPE_PILOT_DATA;
+  self.sync_1_length = TAPE_SYNC_1_LENGTH;
+  self.sync_2_length = TAPE_SYNC_2_LENGTH;
+  self.zero_length   = TAPE_ZERO_LENGTH;
+  self.one_length    = TAPE_ONE_LENGTH;
+  self.phase         = E_TAPE_PHASE_PILOT;
+  self.is_standard   = 1;
+
+  tape_block_data(bytes, n_bytes, 8, pause_ms);
+}
+
+
+static int tape_block_skip(size_t n) {
+  if (self.block + n > self.size) {
+    log_wrn("tape: truncated block at offset %lu\n", self.block);
+    return -1;
+  }
+
+  self.block_next = self.block + n;
+  return 0;
+}
+
+
+static tape_block_t tape_block_enter_tap(void) {
+  const u8_t* p = &self.data[self.block];
+  u16_t       n;
+
+  if (self.block + 2 > self.size) {
+    return E_TAPE_BLOCK_END;
+  }
+
+  n = tape_u16(p);
+  if (tape_block_skip(2 + n) != 0) {
+    return E_TAPE_BLOCK_END;
+  }
+
+  tape_block_standard(&p[2], n, TAPE_PAUSE_MS);
+
+  return E_TAPE_BLOCK_SIGNAL;
+}
+
+
+/**
+ * Sets up playback of the block at the current offset and determines the
+ * offset of the next one. Only the block types that make sense for a
+ * Spectrum are supported.
+ */
+static tape_block_t tape_block_enter_tzx(void) {
+  const u8_t* p = &self.data[self.block];
+  u32_t       n;
+
+  if (self.block >= self.size) {
+    return E_TAPE_BLOCK_END;
+  }
+
+  self.is_standard = 0;
+
+  /* Make sure the fixed part of each block is present. */
+  switch (p[0]) {
+    case 0x10: n = 0x05; break;
+    case 0x11: n = 0x13; break;
+    case 0x12: n = 0x05; break;
+    case 0x13: n = 0x02; break;
+    case 0x14: n = 0x0B; break;
+    case 0x15: n = 0x09; break;
+    case 0x18:
+    case 0x19: n = 0x05; break;
+    case 0x20: n = 0x03; break;
+    case 0x21: n = 0x02; break;
+    case 0x23:
+    case 0x24: n = 0x03; break;
+    case 0x26:
+    case 0x28: n = 0x03; break;
+    case 0x2A: n = 0x05; break;
+    case 0x2B: n = 0x06; break;
+    case 0x30: n = 0x02; break;
+    case 0x31: n = 0x03; break;
+    case 0x32: n = 0x03; break;
+    case 0x33: n = 0x02; break;
+    case 0x35: n = 0x15; break;
+    case 0x5A: n = 0x0A; break;
+    default:   n = 0x01; break;
+  }
+  if (tape_block_skip(n) != 0) {
+    return E_TAPE_BLOCK_END;
+  }
+
+  switch (p[0]) {
+    case 0x10:  /* Standard speed data. */
+      n = tape_u16(&p[3]);
+      if (tape_block_skip(0x05 + n) != 0) {
+        return E_TAPE_BLOCK_END;
+      }
+      tape_block_standard(&p[5], n, tape_u16(&p[1]));
+      return E_TAPE_BLOCK_SIGNAL;
+
+    case 0x11:  /* Turbo speed data. */
+      n = tape_u24(&p[16]);
+      if (tape_block_skip(0x13 + n) != 0) {
+        return E_TAPE_BLOCK_END;
+      }
+      self.pilot_length  = tape_u16(&p[1]);
+      self.sync_1_length = tape_u16(&p[3]);
+      self.sync_2_length = tape_u16(&p[5]);
+      self.zero_length   = tape_u16(&p[7]);
+      self.one_length    = tape_u16(&p[9]);
+      self.pulses_left   = tape_u16(&p[11]);
+      self.phase         = E_TAPE_PHASE_PILOT;
+      tape_block_data(&p[19], n, p[13], tape_u16(&p[14]));
+      return E_TAPE_BLOCK_SIGNAL;
+
+    case 0x12:  /* Pure tone. */
+      self.pilot_length  = tape_u16(&p[1]);
+      self.pulses_left   = tape_u16(&p[3]);
+      self.sync_1_length = 0;
+      self.sync_2_length = 0;
+      self.phase         = E_TAPE_PHASE_PILOT;
+      tape_block_data(NULL, 0, 8, 0);
+      return E_TAPE_BLOCK_SIGNAL;
+
+    case 0x13:  /* Pulse sequence. */
+      if (tape_block_skip(0x02 + 2 * p[1]) != 0) {
+        return E_TAPE_BLOCK_END;
+      }
+      self.pulses      = &p[2];
+      self.pulses_left = p[1];
+      self.phase       = E_TAPE_PHASE_PULSES;
+      return E_TAPE_BLOCK_SIGNAL;
+
+    case 0x14:  /* Pure data. */
+      n = tape_u24(&p[8]);
+      if (tape_block_skip(0x0B + n) != 0) {
+        return E_TAPE_BLOCK_END;
+      }
+      self.zero_length = tape_u16(&p[1]);
+      self.one_length  = tape_u16(&p[3]);
+      self.phase       = E_TAPE_PHASE_DATA;
+      tape_block_data(&p[11], n, p[5], tape_u16(&p[6]));
+      return E_TAPE_BLOCK_SIGNAL;
+
+    case 0x15:  /* Direct recording. */
+      log_wrn("tape: skipping unsupported direct recording block\n");
+      return tape_block_skip(0x09 + tape_u24(&p[6])) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x18:  /* CSW recording. */
+    case 0x19:  /* Generalized data. */
+      log_wrn("tape: skipping unsupported block %02X\n", p[0]);
+      return tape_block_skip(0x05 + tape_u32(&p[1])) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x20:  /* Pause or stop the tape. */
+      if (tape_u16(&p[1]) == 0) {
+        return E_TAPE_BLOCK_STOP;
+      }
+      self.phase = E_TAPE_PHASE_PAUSE;
+      tape_block_data(NULL, 0, 8, tape_u16(&p[1]));
+      return E_TAPE_BLOCK_SIGNAL;
+
+    case 0x21:  /* Group start. */
+      return tape_block_skip(0x02 + p[1]) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x22:  /* Group end. */
+    case 0x23:  /* Jump, which we don't follow. */
+    case 0x27:  /* Return from sequence. */
+      return E_TAPE_BLOCK_META;
+
+    case 0x24:  /* Loop start. */
+      self.loop_start = self.block_next;
+      self.loop_count = tape_u16(&p[1]);
+      return E_TAPE_BLOCK_META;
+
+    case 0x25:  /* Loop end. */
+      if (self.loop_count > 1) {
+        self.loop_count--;
+        self.block_next = self.loop_start;
+      }
+      return E_TAPE_BLOCK_META;
+
+    case 0x26:  /* Call sequence, which we don't follow. */
+      return tape_block_skip(0x03 + 2 * tape_u16(&p[1])) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x28:  /* Select block. */
+    case 0x32:  /* Archive info. */
+      return tape_block_skip(0x03 + tape_u16(&p[1])) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x2A:  /* Stop the tape if in 48K mode. */
+      return ula_timing_get() == E_MACHINE_TYPE_ZX_48K ? E_TAPE_BLOCK_STOP : E_TAPE_BLOCK_META;
+
+    case 0x2B:  /* Set signal level. */
+      self.ear = p[5] & 0x01;
+      return E_TAPE_BLOCK_META;
+
+    case 0x30:  /* Text description. */
+      return tape_block_skip(0x02 + p[1]) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x31:  /* Message. */
+      return tape_block_skip(0x03 + p[2]) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x33:  /* Hardware type. */
+      return tape_block_skip(0x02 + 3 * p[1]) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x35:  /* Custom info. */
+      return tape_block_skip(0x15 + tape_u32(&p[17])) == 0 ? E_TAPE_BLOCK_META : E_TAPE_BLOCK_END;
+
+    case 0x5A:  /* Glue. */
+      return E_TAPE_BLOCK_META;
+
+    default:
+      log_wrn("tape: unsupported block %02X at offset %lu\n", p[0], self.block);
+      return E_TAPE_BLOCK_END;
+  }
+}
+
+
+static tape_block_t tape_block_enter(void) {
+  return self.is_tzx ? tape_block_enter_tzx() : tape_block_enter_tap();
+}
+
+
+static void tape_block_advance(void) {
+  self.block = self.block_next;
+  self.phase = E_TAPE_PHASE_ENTER;
+}
+
+
+/**
+ * Determines the length of the next pulse in T-states and what the EAR level
+ * will be at its end. Returns -1 when the tape stops.
+ */
+static int tape_pulse_next(u32_t* tstates) {
+  for (;;) {
+    switch (self.phase) {
+      case E_TAPE_PHASE_ENTER:
+        switch (tape_block_enter()) {
+          case E_TAPE_BLOCK_END:
+            return -1;
+
+          case E_TAPE_BLOCK_STOP:
+            tape_block_advance();
+            return -1;
+
+          case E_TAPE_BLOCK_META:
+            tape_block_advance();
+            break;
+
+          case E_TAPE_BLOCK_SIGNAL:
+            break;
+        }
+        break;
+
+      case E_TAPE_PHASE_PILOT:
+        if (self.pulses_left > 0) {
+          self.pulses_left--;
+          self.level_after = -1;
+          *tstates         = self.pilot_length;
+          return 0;
+        }
+        self.phase = E_TAPE_PHASE_SYNC_1;
+        break;
+
+      case E_TAPE_PHASE_SYNC_1:
+        self.phase = E_TAPE_PHASE_SYNC_2;
+        if (self.sync_1_length > 0) {
+          self.level_after = -1;
+          *tstates         = self.sync_1_length;
+          return 0;
+        }
+        break;
+
+      case E_TAPE_PHASE_SYNC_2:
+        self.phase = E_TAPE_PHASE_DATA;
+        if (self.sync_2_length > 0) {
+          self.level_after = -1;
+          *tstates         = self.sync_2_length;
+          return 0;
+        }
+        break;
+
+      case E_TAPE_PHASE_DATA:
+        if (self.byte_index < self.n_bytes) {
+          const u8_t n_bits = (self.byte_index == self.n_bytes - 1) ? self.last_byte_bits : 8;
+          const int  is_one = self.bytes[self.byte_index] & (0x80 >> self.bit_index);
+
+          /* Each bit is two equal pulses. */
+          if (self.is_second_half) {
+            self.is_second_half = 0;
+            if (++self.bit_index == n_bits) {
+              self.bit_index = 0;
+              self.byte_index++;
+            }
+          } else {
+            self.is_second_half = 1;
+          }
+
+          self.level_after = -1;
+          *tstates         = is_one ? self.one_length : self.zero_length;
+          return 0;
+        }
+        self.phase = E_TAPE_PHASE_PAUSE;
+        break;
+
+      case E_TAPE_PHASE_PULSES:
+        if (self.pulses_left > 0) {
+          self.pulses_left--;
+          self.level_after = -1;
+          *tstates         = tape_u16(self.pulses);
+          self.pulses     += 2;
+          return 0;
+        }
+        self.phase = E_TAPE_PHASE_DONE;
+        break;
+
+      case E_TAPE_PHASE_PAUSE:
+        self.phase = E_TAPE_PHASE_DONE;
+        if (self.pause_ms > 0) {
+          /* The signal is low by the end of a pause. */
+          self.level_after = 0;
+          *tstates         = self.pause_ms * TAPE_TSTATES_PER_MS;
+          return 0;
+        }
+        break;
+
+      case E_TAPE_PHASE_DONE:
+        tape_block_advance();
+        break;
+    }
+  }
+}
+
+
+static void tape_edge(void) {
+  u32_t tstates;
+
+  self.ear = (self.level_after < 0) ? !self.ear : self.level_after;
+
+  if (tape_pulse_next(&tstates) != 0) {
+    tape_stop();
+    return;
+  }
+
+  self.edge_ticks += tstates * TAPE_TICKS_PER_TSTATE;
+}
+
+
+void tape_play(void) {
+  if (self.data == NULL || self.is_playing) {
+    return;
+  }
+
+  /* Start with a level that doesn't change at the first edge. */
+  self.is_playing  = 1;
+  self.level_after = self.ear;
+  self.edge_ticks  = clock_ticks();
+
+  tape_edge();
+
+  if (self.is_playing) {
+    log_wrn("tape: playing\n");
+  }
+}
+
+
+void tape_stop(void) {
+  if (self.is_playing) {
+    self.is_playing = 0;
+    log_wrn("tape: stopped\n");
+  }
+}
+
+
+void tape_play_toggle(void) {
+  if (self.is_playing) {
+    tape_stop();
+  } else {
+    tape_play();
+  }
+}
+
+
+void tape_fast_load_toggle(void) {
+  self.is_fast_load = !self.is_fast_load;
+  log_wrn("tape: fast load %s\n", self.is_fast_load ? "enabled" : "disabled");
+}
+
+
+void tape_unthrottled_toggle(void) {
+  self.is_unthrottled = !self.is_unthrottled;
+  log_wrn("tape: unthrottled playback %s\n", self.is_unthrottled ? "enabled" : "disabled");
+}
+
+
+int tape_is_unthrottled(void) {
+  return self.is_playing && self.is_unthrottled;
+}
+
+
+int tape_ear_read(void) {
+  if (self.is_playing) {
+    const u64_t now = clock_ticks();
+
+    while (self.is_playing && now >= self.edge_ticks) {
+      tape_edge();
+    }
+  }
+
+  return self.ear;
+}
+
+
+/**
+ * Finds the next block that the ROM could load. Returns 0 when found, 1 when
+ * the next block needs edge playback, and -1 at the end of the tape.
+ */
+static int tape_block_next_standard(void) {
+  if (self.phase != E_TAPE_PHASE_ENTER) {
+    /* Don't resume a block half-way. */
+    tape_block_advance();
+  }
+
+  for (;;) {
+    switch (tape_block_enter()) {
+      case E_TAPE_BLOCK_END:
+        return -1;
+
+      case E_TAPE_BLOCK_META:
+      case E_TAPE_BLOCK_STOP:
+        tape_block_advance();
+        break;
+
+      case E_TAPE_BLOCK_SIGNAL:
+        if (self.is_standard) {
+          return 0;
+        }
+        if (self.phase == E_TAPE_PHASE_PAUSE) {
+          tape_block_advance();
+          break;
+        }
+        return 1;
+    }
+  }
+}
+
+
+static int tape_rom_is_paged_in(void) {
+  return !bootrom_is_active()
+    && !config_is_active()
+    && !divmmc_is_active()
+    && !altrom_is_active_on_read()
+    && mmu_page_get(0) == MMU_ROM_PAGE
+    && rom_active() == E_ROM_48K_BASIC;
+}
+
+
+/**
+ * Called when PC reaches LD-BYTES. In fast-load mode the next standard block
+ * is copied straight into memory and we return to the caller as the ROM
+ * would. Returns 1 if so, 0 to let the ROM routine run.
+ *
+ * https://skoolkid.github.io/rom/asm/0556.html
+ *
+ * > A  +00 (header block) or +FF (data block)
+ * > F  Carry flag set if loading, reset if verifying
+ * > DE Block length
+ * > IX Start address
+ */
+int tape_ld_bytes_trap(void) {
+  cpu_registers_t registers;
+  u8_t            parity;
+  u16_t           de;
+  u16_t           ix;
+  size_t          i;
+  int             is_ok;
+  int             is_load;
+
+  if (self.data == NULL || self.is_playing || !tape_rom_is_paged_in()) {
+    return 0;
+  }
+
+  if (!self.is_fast_load) {
+    tape_play();
+    return 0;
+  }
+
+  switch (tape_block_next_standard()) {
+    case -1:
+      return 0;
+
+    case 1:
+      /* Probably a custom loader, so fall back to the real signal. */
+      tape_play();
+      return 0;
+  }
+
+  cpu_registers_get(&registers);
+
+  is_load = registers.af & 0x0001;
+  de      = registers.de;
+  ix      = registers.ix;
+  is_ok   = (self.n_bytes > 0 && self.bytes[0] == registers.af >> 8);
+  parity  = is_ok ? self.bytes[0] : 0;
+
+  if (is_ok) {
+    for (i = 1; de > 0 && i < self.n_bytes; i++, de--, ix++) {
+      if (is_load) {
+        memory_write(ix, self.bytes[i]);
+      } else if (memory_read(ix) != self.bytes[i]) {
+        is_ok = 0;
+        break;
+      }
+      parity ^= self.bytes[i];
+    }
+
+    /* The byte after the data is the checksum. */
+    if (is_ok && de == 0 && i < self.n_bytes) {
+      parity ^= self.bytes[i];
+      is_ok   = (parity == 0);
+    } else {
+      is_ok   = 0;
+    }
+  }
+
+  tape_block_advance();
+
+  /* The ROM returns with LD A,H; CP $01, so carry means success. */
+  registers.af  = parity << 8 | 0x02 | (is_ok ? 0x01 : 0x00) | (parity == 1 ? 0x40 : 0x00);
+  registers.de  = de;
+  registers.ix  = ix;
+  registers.pc  = memory_read(registers.sp) | memory_read(registers.sp + 1) << 8;
+  registers.sp += 2;
+
+  cpu_registers_update(&registers, CPU_REGISTER_AF | CPU_REGISTER_DE | CPU_REGISTER_IX | CPU_REGISTER_SP | CPU_REGISTER_PC);
+
+  return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef __TAPE_H
+#define __TAPE_H
+
+
+#include "defs.h"
+
+
+/* Address of LD-BYTES in the 48K BASIC ROM. */
+#define TAPE_LD_BYTES  0x0556
+
+
+int  tape_init(void);
+void tape_finit(void);
+int  tape_open(const char* filename);
+void tape_play(void);
+void tape_stop(void);
+void tape_play_toggle(void);
+void tape_fast_load_toggle(void);
+void tape_unthrottled_toggle(void);
+int  tape_is_unthrottled(void);
+int  tape_ear_read(void);
+int  tape_ld_bytes_trap(void);
+
+
+#endif  /* __TAPE_H */
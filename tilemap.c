@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include "log.h"
 #include "memory.h"
@@ -6,12 +7,34 @@
 
 
 /**
- * TODO:
- * - tile rotation
- * - tile mirroring
+ * Pixels are produced a scanline at a time into a line of palette indices
+ * and flags, rendered again whenever a register or a write to bank 5 changes
+ * what the line shows.
+ *
+ * Tile definitions are decoded once into rows of eight indices, one set per
+ * combination of mirroring and rotation, and kept until the definition is
+ * written to.
  */
 
 
+#define BANK5_SIZE         (16 * 1024)
+#define N_TILES            512
+#define N_TRANSFORMS       8
+#define TILE_SIZE          8
+
+#define LINE_IS_ENABLED    0x100
+#define LINE_IS_BELOW      0x200
+#define LINE_INVALID       0xFFFFFFFF
+
+/* Attribute bits 3-1, outside of text mode. */
+#define TRANSFORM_MIRROR_X 0x04
+#define TRANSFORM_MIRROR_Y 0x02
+#define TRANSFORM_ROTATE   0x01
+
+
+typedef u8_t tile_row_t[TILE_SIZE];
+
+
 typedef struct {
   u8_t*     bank5;
   u8_t      default_attribute;
@@ -31,6 +54,15 @@ typedef struct {
   int       clip_x2;
   int       clip_y1;
   int       clip_y2;
+
+  /* Scanline being displayed, in frame buffer columns. */
+  u16_t       line[FRAME_BUFFER_WIDTH];
+  u32_t       line_row;
+  u16_t       line_map_offset;  /* First map byte of the row shown. */
+
+  /* Decoded definitions, by tile, transform and row. */
+  tile_row_t (*tiles)[N_TRANSFORMS][TILE_SIZE];
+  u8_t        is_tile_decoded[N_TILES];  /* One bit per transform. */
 } tilemap_t;
 
 
@@ -40,6 +72,12 @@ static tilemap_t self;
 int tilemap_init(u8_t* sram) {
   memset(&self, 0, sizeof(self));
 
+  self.tiles = malloc(N_TILES * sizeof(*self.tiles));
+  if (self.tiles == NULL) {
+    log_err("tilemap: out of memory\n");
+    return -1;
+  }
+
   self.bank5 = &sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM + 5 * 16 * 1024];
 
   tilemap_reset(E_RESET_HARD);
@@ -49,10 +87,27 @@ int tilemap_init(u8_t* sram) {
 
 
 void tilemap_finit(void) {
+  if (self.tiles != NULL) {
+    free(self.tiles);
+    self.tiles = NULL;
+  }
+}
+
+
+static void tilemap_line_invalidate(void) {
+  self.line_row = LINE_INVALID;
+}
+
+
+void tilemap_ram_invalidate(void) {
+  memset(self.is_tile_decoded, 0, sizeof(self.is_tile_decoded));
+  tilemap_line_invalidate();
 }
 
 
 void tilemap_reset(reset_t reset) {
+  tilemap_ram_invalidate();
+
   self.definitions_base_address = 0x0C00;
   self.tilemap_base_address     = 0x2C00;
   self.transparency_index       = 0x0F;
@@ -82,26 +137,33 @@ void tilemap_tilemap_control_write(u8_t value) {
   self.tilemap_over_ula      = value & 0x01;
 
   self.palette = (value & 0x10) ? E_PALETTE_TILEMAP_SECOND : E_PALETTE_TILEMAP_FIRST;
+
+  /* Text mode definitions are laid out differently. */
+  tilemap_ram_invalidate();
 }
 
 
 void tilemap_default_tilemap_attribute_write(u8_t value) {
   self.default_attribute = value;
+  tilemap_line_invalidate();
 }
 
 
 void tilemap_tilemap_base_address_write(u8_t value) {
   self.tilemap_base_address = (value & 0x3F) << 8;
+  tilemap_line_invalidate();
 }
 
 
 void tilemap_tilemap_tile_definitions_address_write(u8_t value) {
   self.definitions_base_address = (value & 0x3F) << 8;
+  tilemap_ram_invalidate();
 }
 
 
 void tilemap_transparency_index_write(u8_t value) {
   self.transparency_index = value;
+  tilemap_line_invalidate();
 }
 
 
@@ -125,54 +187,164 @@ static u8_t tilemap_attribute_get(u32_t row, u32_t column) {
 }
 
 
-void tilemap_tick(u32_t row, u32_t column, int* is_enabled, int* is_pixel_enabled, int* is_pixel_below, int* is_pixel_textmode, const palette_entry_t** rgb) {
+static u8_t tilemap_read(u32_t offset) {
+  return self.bank5[offset & (BANK5_SIZE - 1)];
+}
+
+
+/**
+ * Mirroring is applied to the rotated tile, as it is for sprites.
+ */
+static void tilemap_tile_decode(u16_t tile, u8_t transform) {
+  const u32_t definition = self.definitions_base_address + tile * (self.use_text_mode ? 8 : 32);
+  tile_row_t* rows       = self.tiles[tile][transform];
+  u8_t        x;
+  u8_t        y;
+
+  for (y = 0; y < TILE_SIZE; y++) {
+    for (x = 0; x < TILE_SIZE; x++) {
+      u8_t sx = (transform & TRANSFORM_MIRROR_X) ? 7 - x : x;
+      u8_t sy = (transform & TRANSFORM_MIRROR_Y) ? 7 - y : y;
+      u8_t pattern;
+
+      if (transform & TRANSFORM_ROTATE) {
+        const u8_t t = sx;
+        sx = sy;
+        sy = 7 - t;
+      }
+
+      if (self.use_text_mode) {
+        pattern    = tilemap_read(definition + sy);
+        rows[y][x] = (pattern & (0x80 >> sx)) ? 1 : 0;
+      } else {
+        pattern    = tilemap_read(definition + sy * 4 + sx / 2);
+        rows[y][x] = (sx & 0x01) ? (pattern & 0x0F) : (pattern >> 4);
+      }
+    }
+  }
+
+  self.is_tile_decoded[tile] |= 1 << transform;
+}
+
+
+static const u8_t* tilemap_tile_row(u16_t tile, u8_t transform, u8_t row) {
+  if (!(self.is_tile_decoded[tile] & (1 << transform))) {
+    tilemap_tile_decode(tile, transform);
+  }
+
+  return self.tiles[tile][transform][row];
+}
+
+
+static void tilemap_line_render(u32_t frame_row) {
+  const u32_t  shift          = self.use_80x32 ? 3 : 4;
+  const u32_t  n_columns      = self.use_80x32 ? 80 : 40;
+  const u32_t  map_stride     = self.use_default_attribute ? 1 : 2;
+  const u32_t  start          = (self.offset_x * (self.use_80x32 ? 1 : 2)) % FRAME_BUFFER_WIDTH;
+  const u8_t*  run            = NULL;
+  u32_t        map_column     = ~0;
+  u32_t        column;
+  u32_t        x;
+  u16_t        flags          = 0;
+  u8_t         palette_offset = 0;
+  const u32_t  row            = (frame_row + self.offset_y) % FRAME_BUFFER_HEIGHT;
+  const int    is_row_clipped = row < self.clip_y1 || row > self.clip_y2;
+
+  self.line_map_offset = (self.tilemap_base_address + (row / 8) * n_columns * map_stride) & (BANK5_SIZE - 1);
+
+  for (column = 0, x = start; column < FRAME_BUFFER_WIDTH; column++) {
+    u8_t palette_index;
+
+    if ((x >> shift) != map_column) {
+      const u32_t map       = self.line_map_offset + (x >> shift) * map_stride;
+      const u8_t  attribute = self.use_default_attribute ? self.default_attribute : tilemap_read(map + 1);
+      const u16_t tile      = tilemap_read(map) | (self.use_512_tiles ? (attribute & 0x01) << 8 : 0);
+      const u8_t  transform = self.use_text_mode ? 0 : (attribute >> 1) & 0x07;
+
+      map_column     = x >> shift;
+      run            = tilemap_tile_row(tile, transform, row % 8);
+      palette_offset = attribute & (self.use_text_mode ? 0xFE : 0xF0);
+      flags          = (!self.use_512_tiles && (attribute & 1)) ? LINE_IS_BELOW : 0;
+    }
+
+    palette_index = run[(x >> (shift - 3)) % 8];
+
+    self.line[column] = flags | (palette_offset | palette_index);
+    if (!is_row_clipped && x / 4 >= self.clip_x1 && x / 4 <= self.clip_x2 && palette_index != self.transparency_index) {
+      self.line[column] |= LINE_IS_ENABLED;
+    }
+
+    if (++x == FRAME_BUFFER_WIDTH) {
+      x = 0;
+    }
+  }
+
+  self.line_row = frame_row;
+}
+
+
+void tilemap_tick(u32_t row, u32_t column, int* is_enabled, int* is_pixel_enabled, int* is_pixel_below, int* is_pixel_textmode, u16_t* colour) {
+  u16_t pixel;
+
   if (!self.is_enabled) {
     *is_enabled = 0;
     return;
   }
 
-  row    = (row    + self.offset_y                           ) % FRAME_BUFFER_HEIGHT;
-  column = (column + self.offset_x * (self.use_80x32 ? 1 : 2)) % FRAME_BUFFER_WIDTH;
-
-  const int is_clipped = \
-    row        < self.clip_y1 || row        > self.clip_y2 ||
-    column / 4 < self.clip_x1 || column / 4 > self.clip_x2;
-
-  const u16_t map_offset     = tilemap_map_offset_get(row, column);
-  const u8_t  attribute      = tilemap_attribute_get(row, column);
-  const u8_t  tile           = self.bank5[map_offset] | (self.use_512_tiles ? (attribute & 0x01) << 8 : 0);
-  const u8_t  def_row        = row    % 8;
-  const u8_t  def_column     = (column / (self.use_80x32 ? 1 : 2)) % 8;
-  const u16_t def_offset     = self.use_text_mode
-    ? (self.definitions_base_address + (tile *  8 + def_row))
-    : (self.definitions_base_address + (tile * 32 + def_row * 4 + def_column / 2));
-  const u8_t  pattern        = self.bank5[def_offset];
-  const u8_t  palette_offset = attribute & (self.use_text_mode ? 0xFE : 0xF0);
-  const u8_t  palette_index  = (self.use_text_mode
-                                ? ((pattern & (0x80 >> def_column)) ? 1 : 0)
-                                : ((def_column & 0x01) ? (pattern & 0x0F) : (pattern >> 4)));
-  const int   is_transparent = palette_index == self.transparency_index;
+  if (row != self.line_row) {
+    tilemap_line_render(row);
+  }
+
+  pixel = self.line[column];
 
   *is_enabled        = 1;
-  *is_pixel_enabled  = !(is_clipped || is_transparent);
-  *is_pixel_below    = self.use_512_tiles ? 0 : (attribute & 1);
+  *is_pixel_enabled  = pixel & LINE_IS_ENABLED;
+  *is_pixel_below    = (pixel & LINE_IS_BELOW) != 0;
   *is_pixel_textmode = self.use_text_mode;
-  *rgb               = palette_read(self.palette, palette_offset | palette_index);
+  *colour            = PALETTE_COLOUR(self.palette, pixel & 0xFF);
+}
+
+
+/**
+ * Called for every write to the ZX Spectrum RAM, with the offset into it,
+ * to forget decoded tiles whose definition changed and to render the
+ * scanline again when it shows what was written.
+ */
+void tilemap_ram_written(u32_t offset, u8_t value) {
+  const u32_t relative = offset - 5 * BANK5_SIZE;
+  u32_t       tile;
+
+  if (relative >= BANK5_SIZE) {
+    return;
+  }
+
+  tile = ((relative - self.definitions_base_address) & (BANK5_SIZE - 1)) / (self.use_text_mode ? 8 : 32);
+  if (tile < N_TILES && self.is_tile_decoded[tile]) {
+    self.is_tile_decoded[tile] = 0;
+    tilemap_line_invalidate();
+  }
+
+  if (((relative - self.line_map_offset) & (BANK5_SIZE - 1)) < (self.use_80x32 ? 80 : 40) * (self.use_default_attribute ? 1 : 2)) {
+    tilemap_line_invalidate();
+  }
 }
 
 
 void tilemap_offset_x_msb_write(u8_t value) {
   self.offset_x = (value << 8) | (self.offset_x & 0x00FF);
+  tilemap_line_invalidate();
 }
 
 
 void tilemap_offset_x_lsb_write(u8_t value) {
   self.offset_x = (self.offset_x & 0xFF00) | value;
+  tilemap_line_invalidate();
 }
 
 
 void tilemap_offset_y_write(u8_t value) {
   self.offset_y = value;
+  tilemap_line_invalidate();
 }
 
 
@@ -203,4 +375,5 @@ void tilemap_clip_set(u8_t x1, u8_t x2, u8_t y1, u8_t y2) {
   self.clip_x2 = x2;
   self.clip_y1 = y1;
   self.clip_y2 = y2;
+  tilemap_line_invalidate();
 }
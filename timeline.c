@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "clock.h"
+#include "defs.h"
+#include "log.h"
+#include "nextreg.h"
+#include "slu.h"
+#include "timeline.h"
+
+
+/**
+ * Records raster-related events with the beam position and the 28 MHz tick
+ * they happened at, and writes them out at exit in the Chrome trace event
+ * format, to be opened with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Events go into a ring, so the trace covers the last frames before exit.
+ *
+ * See:
+ * - https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+ */
+
+
+#define TIMELINE_SIZE  (1 << 20)  /* Events, a power of two. */
+
+
+typedef struct {
+  u64_t ticks;
+  u32_t duration;  /* In ticks, for spans. */
+  u16_t row;
+  u16_t column;
+  u16_t a;
+  u16_t b;
+  u16_t c;
+  u8_t  event;
+} timeline_entry_t;
+
+
+typedef struct {
+  const char*       filename;
+  timeline_entry_t* entries;
+  u64_t             n_entries;  /* Ever recorded. */
+} timeline_t;
+
+
+static timeline_t self;
+
+
+/* Chrome lays out threads by ID, one track each. */
+static const struct {
+  int         tid;
+  const char* name;
+} tracks[] = {
+  [E_TIMELINE_EVENT_FRAME]         = { 1, "Frames"   },
+  [E_TIMELINE_EVENT_ULA_IRQ]       = { 2, "IRQs"     },
+  [E_TIMELINE_EVENT_LINE_IRQ]      = { 2, "IRQs"     },
+  [E_TIMELINE_EVENT_COPPER_MOVE]   = { 3, "Copper"   },
+  [E_TIMELINE_EVENT_NEXTREG_WRITE] = { 4, "NextREG"  },
+  [E_TIMELINE_EVENT_PALETTE_WRITE] = { 5, "Palette"  },
+  [E_TIMELINE_EVENT_DMA]           = { 6, "DMA"      }
+};
+
+
+static void timeline_nextreg_write(u8_t reg, u8_t value) {
+  timeline_event(E_TIMELINE_EVENT_NEXTREG_WRITE, reg, value, 0);
+}
+
+
+int timeline_init(const char* filename) {
+  self.filename  = filename;
+  self.entries   = NULL;
+  self.n_entries = 0;
+
+  if (filename == NULL) {
+    return 0;
+  }
+
+  self.entries = malloc(TIMELINE_SIZE * sizeof(timeline_entry_t));
+  if (self.entries == NULL) {
+    log_err("timeline: out of memory\n");
+    return -1;
+  }
+
+  nextreg_trace_set(timeline_nextreg_write);
+
+  return 0;
+}
+
+
+static timeline_entry_t* timeline_add(timeline_event_t event, u64_t ticks, u16_t a, u16_t b, u16_t c) {
+  timeline_entry_t* entry = &self.entries[self.n_entries++ & (TIMELINE_SIZE - 1)];
+  u32_t             row;
+  u32_t             column;
+
+  slu_beam_get(&row, &column);
+
+  entry->ticks    = ticks;
+  entry->duration = 0;
+  entry->row      = row;
+  entry->column   = column;
+  entry->a        = a;
+  entry->b        = b;
+  entry->c        = c;
+  entry->event    = event;
+
+  return entry;
+}
+
+
+void timeline_event(timeline_event_t event, u16_t a, u16_t b, u16_t c) {
+  if (self.entries) {
+    (void) timeline_add(event, clock_ticks(), a, b, c);
+  }
+}
+
+
+void timeline_span(timeline_event_t event, u64_t start_ticks, u16_t a, u16_t b, u16_t c) {
+  if (self.entries) {
+    timeline_add(event, start_ticks, a, b, c)->duration = clock_ticks() - start_ticks;
+  }
+}
+
+
+static void timeline_write_entry(FILE* f, const timeline_entry_t* entry, double us_per_tick, u64_t frame) {
+  const double ts = entry->ticks * us_per_tick;
+  char         name[32];
+
+  switch (entry->event) {
+    case E_TIMELINE_EVENT_FRAME:
+      /* Frames are written as spans once we know where they end. */
+      return;
+
+    case E_TIMELINE_EVENT_ULA_IRQ:
+      snprintf(name, sizeof(name), "ULA IRQ %s", entry->a ? "on" : "off");
+      break;
+
+    case E_TIMELINE_EVENT_LINE_IRQ:
+      snprintf(name, sizeof(name), "Line IRQ %s", entry->a ? "on" : "off");
+      break;
+
+    case E_TIMELINE_EVENT_COPPER_MOVE:
+      snprintf(name, sizeof(name), "MOVE $%02X,$%02X", entry->a, entry->b);
+      break;
+
+    case E_TIMELINE_EVENT_NEXTREG_WRITE:
+      snprintf(name, sizeof(name), "NextREG $%02X,$%02X", entry->a, entry->b);
+      break;
+
+    case E_TIMELINE_EVENT_PALETTE_WRITE:
+      snprintf(name, sizeof(name), "Palette %u[%u]=$%02X", entry->a, entry->b, entry->c);
+      break;
+
+    case E_TIMELINE_EVENT_DMA:
+      snprintf(name, sizeof(name), "DMA %u bytes", entry->a);
+      break;
+
+    default:
+      return;
+  }
+
+  if (entry->duration) {
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f", name, ts, entry->duration * us_per_tick);
+  } else {
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f", name, ts);
+  }
+  fprintf(f, ",\"pid\":0,\"tid\":%d,\"args\":{\"frame\":%lu,\"row\":%u,\"column\":%u,\"tick\":%lu}}",
+          tracks[entry->event].tid, (unsigned long) frame, entry->row, entry->column, (unsigned long) entry->ticks);
+}
+
+
+static int timeline_write(void) {
+  const double            us_per_tick = 1000000.0 / clock_28mhz_get();
+  const u64_t             first       = (self.n_entries > TIMELINE_SIZE) ? self.n_entries - TIMELINE_SIZE : 0;
+  const timeline_entry_t* frame_start = NULL;
+  u64_t                   frame       = 0;
+  u64_t                   i;
+  size_t                  t;
+  FILE*                   f;
+
+  f = fopen(self.filename, "w");
+  if (f == NULL) {
+    log_err("timeline: could not write %s\n", self.filename);
+    return -1;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"zxnxt\"}}");
+  for (t = 0; t < sizeof(tracks) / sizeof(*tracks); t++) {
+    fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tracks[t].tid, tracks[t].name);
+  }
+
+  for (i = first; i < self.n_entries; i++) {
+    const timeline_entry_t* entry = &self.entries[i & (TIMELINE_SIZE - 1)];
+
+    if (entry->event == E_TIMELINE_EVENT_FRAME) {
+      if (frame_start) {
+        fprintf(f, ",\n{\"name\":\"Frame %lu\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}",
+                (unsigned long) frame, frame_start->ticks * us_per_tick, (entry->ticks - frame_start->ticks) * us_per_tick, tracks[E_TIMELINE_EVENT_FRAME].tid);
+      }
+      frame_start = entry;
+      frame++;
+    }
+
+    timeline_write_entry(f, entry, us_per_tick, frame);
+  }
+
+  fprintf(f, "\n]}\n");
+  fclose(f);
+
+  log_wrn("timeline: wrote %lu events to %s\n", (unsigned long) (self.n_entries - first), self.filename);
+
+  return 0;
+}
+
+
+void timeline_finit(void) {
+  if (self.entries == NULL) {
+    return;
+  }
+
+  nextreg_trace_set(NULL);
+  (void) timeline_write();
+
+  free(self.entries);
+  self.entries = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef __TIMELINE_H
+#define __TIMELINE_H
+
+
+#include "defs.h"
+
+
+typedef enum {
+  E_TIMELINE_EVENT_FRAME = 0,       /* ULA frame start.                 */
+  E_TIMELINE_EVENT_ULA_IRQ,         /* a: active.                       */
+  E_TIMELINE_EVENT_LINE_IRQ,        /* a: active.                       */
+  E_TIMELINE_EVENT_COPPER_MOVE,     /* a: register, b: value.           */
+  E_TIMELINE_EVENT_NEXTREG_WRITE,   /* a: register, b: value.           */
+  E_TIMELINE_EVENT_PALETTE_WRITE,   /* a: palette, b: index, c: value.  */
+  E_TIMELINE_EVENT_DMA              /* Span, a: bytes transferred.      */
+} timeline_event_t;
+
+
+int  timeline_init(const char* filename);
+void timeline_finit(void);
+void timeline_event(timeline_event_t event, u16_t a, u16_t b, u16_t c);
+void timeline_span(timeline_event_t event, u64_t start_ticks, u16_t a, u16_t b, u16_t c);
+
+
+#endif  /* __TIMELINE_H */
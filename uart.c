@@ -3,6 +3,7 @@
 #include "defs.h"
 #include "esp.h"
 #include "log.h"
+#include "pi.h"
 #include "uart.h"
 
 
@@ -64,6 +65,9 @@ void uart_reset(reset_t reset) {
 
   esp_baudrate_set(baudrate(self.uart[self.selected].prescalar));
   esp_dataformat_set(self.uart[E_DEVICE_ESP].bits_per_frame, self.uart[E_DEVICE_ESP].use_parity_check, self.uart[E_DEVICE_ESP].use_odd_parity, self.uart[E_DEVICE_ESP].use_two_stop_bits);
+
+  pi_prescalar_set(self.uart[E_DEVICE_PI].prescalar);
+  pi_dataformat_set(self.uart[E_DEVICE_PI].bits_per_frame, self.uart[E_DEVICE_PI].use_parity_check, self.uart[E_DEVICE_PI].use_odd_parity, self.uart[E_DEVICE_PI].use_two_stop_bits);
 }
 
 
@@ -79,6 +83,8 @@ void uart_select_write(u8_t value) {
     self.uart[self.selected].prescalar = (self.uart[self.selected].prescalar & 0x3FFF) | ((value & 0x07) << 14);
     if (self.selected == E_DEVICE_ESP) {
       esp_baudrate_set(self.uart[E_DEVICE_ESP].prescalar);
+    } else {
+      pi_prescalar_set(self.uart[E_DEVICE_PI].prescalar);
     }
   }
 
@@ -109,6 +115,8 @@ void uart_frame_write(u8_t value) {
 
   if (self.selected == E_DEVICE_ESP) {
     esp_dataformat_set(uart->bits_per_frame, uart->use_parity_check, uart->use_odd_parity, uart->use_two_stop_bits);
+  } else {
+    pi_dataformat_set(uart->bits_per_frame, uart->use_parity_check, uart->use_odd_parity, uart->use_two_stop_bits);
   }
 
   log_wrn("uart%d: bits/frame=%d parity=%c type=%c stop=%d\n",
@@ -125,6 +133,9 @@ u8_t uart_rx_read(void) {
     case E_DEVICE_ESP:
       return esp_rx_read();
 
+    case E_DEVICE_PI:
+      return pi_rx_read();
+
     default:
       break;
   }
@@ -140,6 +151,8 @@ void uart_rx_write(u8_t value) {
 
   if (self.selected == E_DEVICE_ESP) {
     esp_baudrate_set(baudrate(self.uart[self.selected].prescalar));
+  } else {
+    pi_prescalar_set(self.uart[E_DEVICE_PI].prescalar);
   }
 
   log_wrn("uart%d: prescalar=%u => %u baud\n",
@@ -154,6 +167,9 @@ u8_t uart_tx_read(void) {
     case E_DEVICE_ESP:
       return esp_tx_read();
 
+    case E_DEVICE_PI:
+      return pi_tx_read();
+
     default:
       break;
   }
@@ -169,6 +185,10 @@ void uart_tx_write(u8_t value) {
       esp_tx_write(value);
       break;
 
+    case E_DEVICE_PI:
+      pi_tx_write(value);
+      break;
+
     default:
       break;
   }
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <time.h>
 #include "audio.h"
 #include "clock.h"
@@ -10,6 +11,8 @@
 #include "memory.h"
 #include "palette.h"
 #include "slu.h"
+#include "timeline.h"
+#include "tape.h"
 #include "ula.h"
 
 
@@ -25,6 +28,8 @@ typedef enum {
 
 
 #define N_IRQ_TSTATES          32
+#define LINE_WIDTH             (256 * 2)
+#define LINE_TRANSPARENT       0x100
 #define N_DISPLAY_TIMINGS      (E_MACHINE_TYPE_LAST - E_MACHINE_TYPE_FIRST + 1)
 #define N_REFRESH_FREQUENCIES  2
 
@@ -299,6 +304,26 @@ const ula_display_spec_t ula_display_spec_vga[N_DISPLAY_TIMINGS][N_REFRESH_FREQU
 };
 
 
+/**
+ * When the ULA fetches the first display byte, in t-states after the first
+ * content pixel, e.g. at 14338 on a 48K and at 14365 on a 128K at 50 Hz.
+ */
+typedef struct {
+  u32_t fetch_delay;
+  int   has_floating_bus;
+  int   is_latched;        /** Whether the bus holds the last byte. */
+} ula_floating_bus_timing_t;
+
+
+static const ula_floating_bus_timing_t ula_floating_bus_timings[N_DISPLAY_TIMINGS] = {
+  { 2, 1, 0 },  /* Config mode, as the 48K. */
+  { 2, 1, 0 },  /* 48K.                     */
+  { 3, 1, 0 },  /* 128K/+2.                 */
+  { 3, 1, 1 },  /* +2A/+2B/+3.              */
+  { 0, 0, 0 }   /* Pentagon.                */
+};
+
+
 typedef struct {
   u8_t*                      sram;
   const ula_display_spec_t*  display_spec;
@@ -309,7 +334,6 @@ typedef struct {
   ula_display_mode_t         display_mode;
   ula_display_mode_t         display_mode_requested;
   u8_t*                      attribute_ram;
-  u8_t                       floating_bus;
   u8_t                       border_colour;
   u8_t                       speaker_state;
   palette_t                  palette;
@@ -325,6 +349,10 @@ typedef struct {
   u8_t                       hi_res_ink_colour;
   int                        do_contend;
   u32_t                      tstates_x4;
+  u8_t*                      contention_delays[2][N_DISPLAY_TIMINGS][N_REFRESH_FREQUENCIES];  /* VGA, HDMI. */
+  const u8_t*                contention;          /* Delay per t-state, or NULL. */
+  u32_t                      contention_n_tstates;
+  u8_t                       contended_banks;     /* One bit per bank 0-7. */
   int                        is_timex_enabled;
   int                        is_displaying_content;
   int                        is_enabled;
@@ -341,6 +369,18 @@ typedef struct {
   int                        is_hdmi_requested;
   u8_t                       offset_x;
   u8_t                       offset_y;
+
+  /**
+   * Content row being displayed, as palette indices per half pixel, filled
+   * in eight half pixels at a time as the beam gets there. Writes to the
+   * display memory forget just the bytes they changed.
+   */
+  u16_t                      line[LINE_WIDTH];
+  u32_t                      line_row;
+  u64_t                      line_valid;          /* One bit per 8 half pixels. */
+  u32_t                      display_offset;      /* Of display_ram in RAM. */
+  u16_t                      row_offsets[192];    /* Display byte offset per row. */
+  u8_t                       bits[256][8];        /* Display byte to pixels. */
 } self_t;
 
 
@@ -350,112 +390,120 @@ static self_t self;
 #define N_DISPLAY_MODES   (E_ULA_DISPLAY_MODE_LAST - E_ULA_DISPLAY_MODE_FIRST + 1)
 
 
-static const palette_entry_t* ula_display_mode_lo_res(u32_t row, u32_t column) {
-  column = (self.lo_res_offset_x + column) % 256;
-  row    = (self.lo_res_offset_y + row   ) % 192;
+static void ula_line_invalidate(void) {
+  self.line_valid = 0;
+}
 
-  column /= 2;
-  row    /= 2;
 
-  return palette_read(self.palette,
-                      (row < 48)
-                      ? self.display_ram[row * 128 + column]
-                      : self.display_ram_alt[(row - 48) * 128 + column]);
+/* Inverse of row_offsets. */
+static u32_t ula_row_get(u32_t display_offset) {
+  return ((display_offset >> 5) & 0xC0) | ((display_offset >> 8) & 0x07) | ((display_offset >> 2) & 0x38);
 }
 
 
-static const palette_entry_t* ula_display_mode_hi_res(u32_t row, u32_t column) {
-  const u8_t  mask             = 1 << (7 - (column & 0x07));
-  const u16_t display_offset   = ((row & 0xC0) << 5) | ((row & 0x07) << 8) | ((row & 0x38) << 2) | (((column >> 1) / 8) & 0x1F);;
-  const u8_t* display_ram      = ((column / 8) & 0x01) ? self.display_ram_alt : self.display_ram;
-  const u8_t  display_byte     = display_ram[display_offset];
+/**
+ * Expands a display byte into sixteen half pixels, given the palette
+ * indices of paper and ink.
+ */
+static void ula_line_render_byte(u32_t x, u8_t display_byte, u16_t paper, u16_t ink) {
+  const u16_t colours[2] = { paper, ink };
+  const u8_t* bits       = self.bits[display_byte];
+  u16_t*      dst        = &self.line[x * 16];
+  int         i;
+
+  for (i = 0; i < 8; i++) {
+    dst[i * 2]     = colours[bits[i]];
+    dst[i * 2 + 1] = colours[bits[i]];
+  }
 
-  return palette_read(self.palette,
-                      (display_byte & mask)
-                      ? 0  + 8 + self.hi_res_ink_colour
-                      : 16 + 8 + (~self.hi_res_ink_colour & 0x07));
+  self.line_valid |= (u64_t) 3 << (x * 2);
 }
 
 
-static const palette_entry_t* ula_display_mode_screen_x(u32_t row, u32_t column) {
-  const u32_t halved_column    = column / 2;
-  const u16_t attribute_offset = (row / 8) * 32 + halved_column / 8;
-  const u8_t  attribute_byte   = self.attribute_ram[attribute_offset];
-  const u16_t display_offset   = ((row & 0xC0) << 5) | ((row & 0x07) << 8) | ((row & 0x38) << 2) | ((halved_column / 8) & 0x1F);
-  const u8_t  display_byte     = self.display_ram[display_offset];
-  const u8_t  mask             = 1 << (7 - (halved_column & 0x07));
-  const int   is_foreground    = display_byte & mask;
-  const u32_t tstates          = self.tstates_x4 / 4;
-
-  /* 14337 = read display byte 1
-   * 14338 = read attribute 1
-   * 14339 = read display byte 2
-   * 14340 = read attribute 2
-   * 14341 = no activity
-   * 14342 = no activity
-   * 14343 = no activity
-   * 14344 = no activity
-   */
-  if (tstates < 14339) {
-    self.floating_bus = 0xFF;
-  } else {
-    self.floating_bus = ((tstates - 14339) % 224) % 8;
-  }
+static void ula_line_render_attribute_byte(u32_t x, u8_t display_byte, u8_t attribute_byte) {
+  u8_t bright;
+  u8_t ink;
+  u8_t paper;
 
   if (self.is_ula_next_mode) {
-    if (is_foreground) {
-      return palette_read(self.palette, attribute_byte & self.ula_next_mask_ink);
-    }
-    
-    if (self.ula_next_rshift_paper == 0) {
-      return slu_transparent_get();
-    }
+    ula_line_render_byte(x, display_byte,
+                         (self.ula_next_rshift_paper == 0)
+                         ? LINE_TRANSPARENT
+                         : (u8_t) (128 + ((attribute_byte & ~self.ula_next_mask_ink) >> self.ula_next_rshift_paper)),
+                         attribute_byte & self.ula_next_mask_ink);
+    return;
+  }
 
-    return palette_read(self.palette, 128 + ((attribute_byte & ~self.ula_next_mask_ink) >> self.ula_next_rshift_paper));
+  bright = (attribute_byte & 0x40) >> 3;
+  ink    = 0  + bright + (attribute_byte & 0x07);
+  paper  = 16 + bright + ((attribute_byte >> 3) & 0x07);
+
+  if ((attribute_byte & 0x80) && self.blink_state) {
+    ula_line_render_byte(x, display_byte, ink, paper);
+  } else {
+    ula_line_render_byte(x, display_byte, paper, ink);
   }
+}
+
 
-  const u8_t             bright = (attribute_byte & 0x40) >> 3;
-  const palette_entry_t* ink    = palette_read(self.palette, 0  + bright + (attribute_byte & 0x07));
-  const palette_entry_t* paper  = palette_read(self.palette, 16 + bright + ((attribute_byte >> 3) & 0x07));;
-  const u8_t             blink  = attribute_byte & 0x80;
+static void ula_display_mode_screen_x(u32_t row, u32_t cell) {
+  const u32_t x = cell / 2;
 
-  return is_foreground
-    ? ((blink && self.blink_state) ? paper : ink)
-    : ((blink && self.blink_state) ? ink : paper);
+  ula_line_render_attribute_byte(x,
+                                 self.display_ram[self.row_offsets[row] + x],
+                                 self.attribute_ram[(row / 8) * 32 + x]);
 }
 
-static const palette_entry_t* ula_display_mode_hi_colour(u32_t row, u32_t column) {
-  const u32_t halved_column    = column / 2;
-  const u16_t attribute_offset = ((row & 0xC0) << 5) | ((row & 0x07) << 8) | ((row & 0x38) << 2) | ((halved_column / 8) & 0x1F);
-  const u8_t  attribute_byte   = self.attribute_ram[attribute_offset];
-  const u8_t  display_byte     = self.display_ram[attribute_offset];
-  const u8_t  mask             = 1 << (7 - (halved_column & 0x07));
-  const int   is_foreground    = display_byte & mask;
 
-  if (self.is_ula_next_mode) {
-    if (is_foreground) {
-      return palette_read(self.palette, attribute_byte & self.ula_next_mask_ink);
-    }
-    
-    if (self.ula_next_rshift_paper == 0) {
-      return slu_transparent_get();
-    }
+static void ula_display_mode_hi_colour(u32_t row, u32_t cell) {
+  const u32_t x = cell / 2;
+
+  ula_line_render_attribute_byte(x,
+                                 self.display_ram[self.row_offsets[row] + x],
+                                 self.attribute_ram[self.row_offsets[row] + x]);
+}
+
 
-    return palette_read(self.palette, 128 + ((attribute_byte & ~self.ula_next_mask_ink) >> self.ula_next_rshift_paper));
+/* One display byte per cell, alternating between the two screens. */
+static void ula_display_mode_hi_res(u32_t row, u32_t cell) {
+  const u8_t* display_ram  = (cell & 0x01) ? self.display_ram_alt : self.display_ram;
+  const u8_t  display_byte = display_ram[self.row_offsets[row] + cell / 2];
+  const u8_t* bits         = self.bits[display_byte];
+  const u16_t colours[2]   = {
+    16 + 8 + (~self.hi_res_ink_colour & 0x07),
+    0  + 8 + self.hi_res_ink_colour
+  };
+  u16_t*      dst          = &self.line[cell * 8];
+  int         i;
+
+  for (i = 0; i < 8; i++) {
+    dst[i] = colours[bits[i]];
   }
 
-  const u8_t             bright = (attribute_byte & 0x40) >> 3;
-  const palette_entry_t* ink    = palette_read(self.palette, 0  + bright + (attribute_byte & 0x07));
-  const palette_entry_t* paper  = palette_read(self.palette, 16 + bright + ((attribute_byte >> 3) & 0x07));;
-  const u8_t             blink  = attribute_byte & 0x80;
+  self.line_valid |= (u64_t) 1 << cell;
+}
+
+
+static void ula_display_mode_lo_res(u32_t row, u32_t cell) {
+  u32_t column;
+  u32_t x;
+  u32_t y;
+
+  y = ((self.lo_res_offset_y + row) % 192) / 2;
+
+  for (column = cell * 8; column < cell * 8 + 8; column++) {
+    x = ((self.lo_res_offset_x + column) % 256) / 2;
 
-  return is_foreground
-    ? ((blink && self.blink_state) ? paper : ink)
-    : ((blink && self.blink_state) ? ink : paper);
+    self.line[column] = (y < 48)
+      ? self.display_ram[y * 128 + x]
+      : self.display_ram_alt[(y - 48) * 128 + x];
+  }
+
+  self.line_valid |= (u64_t) 1 << cell;
 }
 
 
-typedef const palette_entry_t* (*ula_display_mode_handler_t)(u32_t beam_row, u32_t beam_column);
+typedef void (*ula_display_mode_handler_t)(u32_t row, u32_t cell);
 
 const ula_display_mode_handler_t ula_display_handlers[N_DISPLAY_MODES] = {  
   ula_display_mode_screen_x,   /* E_ULA_DISPLAY_MODE_SCREEN_0 */
@@ -466,6 +514,167 @@ const ula_display_mode_handler_t ula_display_handlers[N_DISPLAY_MODES] = {
 };
 
 
+/* The t-state, counted from the ULA IRQ, at which the first content pixel is drawn. */
+static u32_t ula_content_tstate(const ula_display_spec_t* spec) {
+  return ((spec->rows - spec->vsync_row) * spec->columns - spec->vsync_column) / 4;
+}
+
+
+/**
+ * https://worldofspectrum.org/faq/reference/48kreference.htm#Contention
+ *
+ * The contention actually starts at t-state 14335, i.e. one t-state *before*
+ * the first pixel in the top-left corner is being drawn.
+ *
+ * We could otherwise have used self.displaying_content, but that is one t-state
+ * too late.
+ */
+static void ula_contention_build_48k(const ula_display_spec_t* spec, u8_t* delays) {
+  const u8_t  pattern[8]      = {
+    6, 5, 4, 3, 2, 1, 0, 0
+  };
+  const u32_t n_tstates       = spec->rows * spec->columns / 4;
+  const u32_t tstates_per_row = spec->columns / 4;
+  const u32_t first           = ula_content_tstate(spec) - 1;
+  u32_t       tstates;
+  u32_t       relative_tstate;
+
+  for (tstates = 0; tstates < n_tstates; tstates++) {
+    delays[tstates] = 0;
+
+    if (tstates < first || tstates >= first + 192 * tstates_per_row) {
+      /* Outside visible area. */
+      continue;
+    }
+
+    relative_tstate = (tstates - first) % tstates_per_row;
+    if (relative_tstate >= 128) {
+      /* In one of the borders or horizontal blanking. */
+      continue;
+    }
+
+    delays[tstates] = pattern[relative_tstate % 8];
+  }
+}
+
+
+static void ula_contention_build_128k(const ula_display_spec_t* spec, u8_t* delays) {
+  const u8_t  pattern[8]      = {
+    6, 5, 4, 3, 2, 1, 0, 0
+  };
+  const u32_t n_columns       = spec->rows * spec->columns;
+  const u32_t n_tstates       = n_columns / 4;
+  const u32_t tstates_per_row = spec->columns / 4;
+  const u32_t vsync           = spec->vsync_row * spec->columns + spec->vsync_column;
+  u32_t       tstates;
+  u32_t       beam;
+
+  for (tstates = 0; tstates < n_tstates; tstates++) {
+    /* Where the beam is, as seen by is_displaying_content. */
+    beam = (vsync + tstates * 4) % n_columns;
+
+    delays[tstates] = (beam / spec->columns < 192 && (beam % spec->columns) / 2 < 256)
+      ? pattern[((tstates + 1) % tstates_per_row) % 8]
+      : 0;
+  }
+}
+
+
+typedef void (*contention_builder_t)(const ula_display_spec_t* spec, u8_t* delays);
+
+
+static const contention_builder_t ula_contention_builders[N_DISPLAY_TIMINGS] = {
+  NULL,
+  ula_contention_build_48k,
+  ula_contention_build_128k,
+  NULL,
+  NULL
+};
+
+
+/* Banks 0-7 that are contended, one bit each. */
+static const u8_t ula_contended_banks[N_DISPLAY_TIMINGS] = {
+  0x00,  /* Config mode.                      */
+  0x20,  /* 48K: only bank 5.                 */
+  0xAA,  /* 128K/+2: only the odd banks.      */
+  0xF0,  /* +2A/+2B/+3: banks four and above. */
+  0x00   /* Pentagon.                         */
+};
+
+
+/* The display spec tstates_x4 counts by, as ula_display_reconfigure() picks it. */
+static const ula_display_spec_t* ula_contention_spec(int is_hdmi, int timing, int frequency) {
+  return is_hdmi ? &ula_display_spec_hdmi[frequency] : &ula_display_spec_vga[timing][frequency];
+}
+
+
+static int ula_contention_init(void) {
+  const ula_display_spec_t* spec;
+  int                       is_hdmi;
+  int                       timing;
+  int                       frequency;
+
+  for (is_hdmi = 0; is_hdmi < 2; is_hdmi++) {
+    for (timing = 0; timing < N_DISPLAY_TIMINGS; timing++) {
+      for (frequency = 0; frequency < N_REFRESH_FREQUENCIES; frequency++) {
+        self.contention_delays[is_hdmi][timing][frequency] = NULL;
+      }
+    }
+  }
+
+  for (is_hdmi = 0; is_hdmi < 2; is_hdmi++) {
+    for (timing = 0; timing < N_DISPLAY_TIMINGS; timing++) {
+      if (ula_contention_builders[timing] == NULL) {
+        continue;
+      }
+
+      for (frequency = 0; frequency < N_REFRESH_FREQUENCIES; frequency++) {
+        spec = ula_contention_spec(is_hdmi, timing, frequency);
+
+        self.contention_delays[is_hdmi][timing][frequency] = malloc(spec->rows * spec->columns / 4);
+        if (self.contention_delays[is_hdmi][timing][frequency] == NULL) {
+          log_err("ula: out of memory\n");
+          return -1;
+        }
+
+        ula_contention_builders[timing](spec, self.contention_delays[is_hdmi][timing][frequency]);
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+static void ula_contention_finit(void) {
+  int is_hdmi;
+  int timing;
+  int frequency;
+
+  for (is_hdmi = 0; is_hdmi < 2; is_hdmi++) {
+    for (timing = 0; timing < N_DISPLAY_TIMINGS; timing++) {
+      for (frequency = 0; frequency < N_REFRESH_FREQUENCIES; frequency++) {
+        free(self.contention_delays[is_hdmi][timing][frequency]);
+        self.contention_delays[is_hdmi][timing][frequency] = NULL;
+      }
+    }
+  }
+}
+
+
+/**
+ * Selects the delay table for the current timing, refresh rate and output,
+ * which is NULL when nothing is contended.
+ */
+static void ula_contention_select(void) {
+  const ula_display_spec_t* spec = ula_contention_spec(self.is_hdmi, self.display_timing, self.is_60hz & 1);
+
+  self.contention           = self.do_contend ? self.contention_delays[self.is_hdmi & 1][self.display_timing][self.is_60hz & 1] : NULL;
+  self.contention_n_tstates = spec->rows * spec->columns / 4;
+  self.contended_banks      = self.contention ? ula_contended_banks[self.display_timing] : 0x00;
+}
+
+
 static void ula_display_reconfigure(void) {
   /**
    * https://gitlab.com/SpectrumNext/ZX_Spectrum_Next_FPGA/-/raw/master/cores/zxnext/ports.txt
@@ -517,6 +726,10 @@ static void ula_display_reconfigure(void) {
       break;
   }
 
+  self.display_offset = self.display_ram - &self.sram[MEMORY_RAM_OFFSET_ZX_SPECTRUM_RAM];
+  ula_line_invalidate();
+  ula_contention_select();
+
   slu_display_size_set(self.display_spec->rows, self.display_spec->columns);
 
   main_show_refresh(self.is_60hz);
@@ -534,6 +747,7 @@ void ula_did_complete_frame(void) {
    */
   if ((++self.frame_counter & 15) == 0) {
     self.blink_state ^= 1;
+    ula_line_invalidate();
   }
 
   if (self.did_display_spec_change) {
@@ -560,12 +774,15 @@ int ula_beam_to_frame_buffer(u32_t beam_row, u32_t beam_column, u32_t* frame_buf
   self.tstates_x4++;
 
   if (beam_row == self.display_spec->vsync_row && beam_column == self.display_spec->vsync_column) {
+    timeline_event(E_TIMELINE_EVENT_FRAME, 0, 0, 0);
     copper_irq();
     if (!self.disable_ula_irq) {
+      timeline_event(E_TIMELINE_EVENT_ULA_IRQ, 1, 0, 0);
       cpu_irq(E_CPU_IRQ_ULA, 1);
     }
     self.tstates_x4 = 0;
   } else if (self.tstates_x4 == N_IRQ_TSTATES * 4) {
+    timeline_event(E_TIMELINE_EVENT_ULA_IRQ, 0, 0, 0);
     cpu_irq(E_CPU_IRQ_ULA, 0);
   }
 
@@ -595,7 +812,7 @@ int ula_beam_to_frame_buffer(u32_t beam_row, u32_t beam_column, u32_t* frame_buf
  * Returns the ULA pixel colour for the frame buffer position, if any, and
  * whether it is transparent or not.
  */
-void ula_tick(u32_t row, u32_t column, int* is_enabled, int* is_border, int* is_clipped, const palette_entry_t** rgb) {
+void ula_tick(u32_t row, u32_t column, int* is_enabled, int* is_border, int* is_clipped, u16_t* colour) {
   *is_enabled = self.is_enabled;
   if (!self.is_enabled) {
     return;
@@ -611,8 +828,18 @@ void ula_tick(u32_t row, u32_t column, int* is_enabled, int* is_border, int* is_
 
     row     = (row    + self.offset_y    ) % 192;
     column  = (column + self.offset_x * 2) % (256 * 2);
- 
-    *rgb = ula_display_handlers[self.display_mode](row, column);
+
+    if (row != self.line_row) {
+      self.line_row = row;
+      ula_line_invalidate();
+    }
+    if (!(self.line_valid & ((u64_t) 1 << (column / 8)))) {
+      ula_display_handlers[self.display_mode](row, column / 8);
+    }
+
+    *colour = (self.line[column] == LINE_TRANSPARENT)
+      ? PALETTE_COLOUR_TRANSPARENT
+      : PALETTE_COLOUR(self.palette, self.line[column]);
     return;
   }
   
@@ -621,17 +848,32 @@ void ula_tick(u32_t row, u32_t column, int* is_enabled, int* is_border, int* is_
 
   if (self.is_ula_next_mode) {
     if (self.ula_next_rshift_paper == 0) {
-      *rgb = slu_transparent_get();
+      *colour = PALETTE_COLOUR_TRANSPARENT;
     } else {
-      *rgb = palette_read(self.palette, 128 + self.border_colour);
+      *colour = PALETTE_COLOUR(self.palette, 128 + self.border_colour);
     }
   } else {
-    *rgb = palette_read(self.palette, 16 + self.border_colour);
+    *colour = PALETTE_COLOUR(self.palette, 16 + self.border_colour);
   }
 }
 
 
 int ula_init(u8_t* sram) {
+  u32_t row;
+  u32_t value;
+  int   i;
+
+  for (row = 0; row < 192; row++) {
+    self.row_offsets[row] = ((row & 0xC0) << 5) | ((row & 0x07) << 8) | ((row & 0x38) << 2);
+  }
+  for (value = 0; value < 256; value++) {
+    for (i = 0; i < 8; i++) {
+      self.bits[value][i] = (value >> (7 - i)) & 0x01;
+    }
+  }
+
+  self.line_row            = 0;
+  self.line_valid          = 0;
   self.sram                = sram;
   self.speaker_state       = 0;
   self.audio_last_sample   = 0;
@@ -639,6 +881,11 @@ int ula_init(u8_t* sram) {
   self.is_60hz             = 0;
   self.is_hdmi             = 0;
 
+  if (ula_contention_init() != 0) {
+    ula_contention_finit();
+    return -1;
+  }
+
   ula_reset(E_RESET_HARD);
 
   return 0;
@@ -646,6 +893,7 @@ int ula_init(u8_t* sram) {
 
 
 void ula_finit(void) {
+  ula_contention_finit();
 }
 
 
@@ -679,7 +927,7 @@ void ula_reset(reset_t reset) {
 
 
 u8_t ula_read(u16_t address) {
-  return keyboard_read(address);
+  return keyboard_read(address) | tape_ear_read() << 6;
 }
 
 
@@ -717,6 +965,7 @@ void ula_timex_write(u16_t address, u8_t value) {
   }
 
   self.hi_res_ink_colour = (value & 0x38) >> 3;
+  ula_line_invalidate();
 
   switch (value & 0x07) {
     case 0x00:
@@ -758,6 +1007,7 @@ void ula_timing_set(machine_type_t machine) {
 
   self.display_timing          = machine;
   self.did_display_spec_change = 1;
+  ula_contention_select();
 
   main_show_machine_type(self.display_timing);
 }
@@ -799,71 +1049,14 @@ int ula_contention_get(void) {
 
 void ula_contention_set(int do_contend) {
   self.do_contend = do_contend;
+  ula_contention_select();
 }
 
 
-/**
- * https://worldofspectrum.org/faq/reference/48kreference.htm#Contention
- *
- * The contention actually starts at t-state 14335, i.e. one t-state *before*
- * the first pixel in the top-left corner is being drawn.
- *
- * We could otherwise have used self.displaying_content, but that is one t-state
- * too late.
- */
-static void ula_contend_48k(void) {
-  const u32_t delays[8] = {
-    6, 5, 4, 3, 2, 1, 0, 0
-  };
-  const u32_t tstates = self.tstates_x4 / 4;
-  u32_t       relative_tstate;
-  u32_t       delay;
-
-  if (tstates < 14335 || tstates >= 14335 + 192 * 224) {
-    /* Outside visible area. */
-    return;
-  }
-
-  relative_tstate = (tstates - 14335) % 224;
-  if (relative_tstate >= 128) {
-    /* In one of the borders or horizontal blanking. */
-    return;
-  }
-
-  delay = delays[relative_tstate % 8];
-  if (delay) {
-    clock_run(delay);
-  }
-}
-
-
-static void ula_contend_128k(void) {
-  if (self.is_displaying_content) {
-    const u32_t delay[8] = {
-      6, 5, 4, 3, 2, 1, 0, 0
-    };
-    const u32_t t_states = self.tstates_x4 / 4;
-
-    clock_run(delay[((t_states + 1) % 228) % 8]);
-  }
-}
-
-
-typedef void (*contend_handler)(void);
-
-
 void ula_contend(void) {
-  const contend_handler handlers[E_MACHINE_TYPE_LAST - E_MACHINE_TYPE_FIRST + 1] = {
-    NULL,
-    ula_contend_48k,
-    ula_contend_128k,
-    NULL,
-    NULL
-  };
-
-  contend_handler handler;
+  const u32_t tstates = self.tstates_x4 / 4;
 
-  if (!self.do_contend) {
+  if (self.contention == NULL) {
     /* Contention can be disabled by writing to a Next register. */
     return;
   }
@@ -873,43 +1066,16 @@ void ula_contend(void) {
     return;
   }
 
-  handler = handlers[self.display_timing];
-  if (handler) {
-    handler();
+  if (tstates < self.contention_n_tstates && self.contention[tstates]) {
+    clock_run(self.contention[tstates]);
   }
 }
 
 
 void ula_contend_bank(u8_t bank) {
-  if (bank > 7) {
-    /* Only banks 0-7 can be contended. */
-    return;
-  }
-
-  switch (self.display_timing) {
-    case E_MACHINE_TYPE_ZX_48K:
-      if (bank == 5) {
-        /* Only bank 5 is contended. */
-        ula_contend();
-      }
-      break;
-
-    case E_MACHINE_TYPE_ZX_128K_PLUS2:
-      if ((bank & 1) == 1) {
-        /* Only odd banks are contended. */
-        ula_contend();
-      }
-      break;
-
-    case E_MACHINE_TYPE_ZX_PLUS2A_PLUS2B_PLUS3:
-      if (bank > 3) {
-        /* Only banks four and above are contended. */
-        ula_contend();
-      }
-      break;
-
-    default:
-      break;
+  /* Only banks 0-7 can be contended. */
+  if (bank < 8 && (self.contended_banks & (1 << bank))) {
+    ula_contend();
   }
 }
 
@@ -926,6 +1092,7 @@ void ula_transparency_colour_write(u8_t rgb) {
 
 void ula_attribute_byte_format_write(u8_t value) {
   self.ula_next_mask_ink = value;;
+  ula_line_invalidate();
 
   switch (value) {
     case 1:
@@ -970,6 +1137,7 @@ u8_t ula_attribute_byte_format_read(void) {
 
 void ula_next_mode_enable(int do_enable) {
   self.is_ula_next_mode = do_enable;
+  ula_line_invalidate();
 }
 
 
@@ -1002,11 +1170,13 @@ void ula_lo_res_enable_set(int enable) {
 
 void ula_lo_res_offset_x_write(u8_t value) {
   self.lo_res_offset_x = value;
+  ula_line_invalidate();
 }
 
 
 void ula_lo_res_offset_y_write(u8_t value) {
   self.lo_res_offset_y = value;
+  ula_line_invalidate();
 }
 
 
@@ -1040,9 +1210,120 @@ void ula_offset_y_write(u8_t value) {
  * Implement floating bus behaviour. This fixes Arkanoid freezing at the
  * start of the first level and prevents flickering and slowdown in
  * Short Circuit.
+ *
+ * Rather than tracking what the ULA puts on the bus while drawing, the value
+ * is worked out when read, from the current t-state. For every 8 t-states of
+ * a content row, the ULA fetches a display byte, its attribute, the next
+ * display byte and its attribute, after which the bus is idle for four
+ * t-states.
+ *
+ * The +2A/+3 keeps the last byte fetched on the bus while idle and always
+ * has bit 0 set. The Pentagon has no floating bus.
+ *
+ * https://worldofspectrum.org/faq/reference/48kreference.htm#PortFE
+ * https://worldofspectrum.org/faq/reference/128kreference.htm
  */
 u8_t ula_floating_bus_read(void) {
-  return self.floating_bus;
+  const ula_floating_bus_timing_t* timing  = &ula_floating_bus_timings[self.display_timing];
+  const ula_display_spec_t*        spec    = self.display_spec;  /* What tstates_x4 counts by. */
+  const u32_t                      tstates = self.tstates_x4 / 4;
+  u32_t                            first_fetch;
+  u32_t                            tstates_per_row;
+  u32_t                            row;
+  u32_t                            column;
+  u32_t                            x;
+  u32_t                            slot;
+  u8_t                             value;
+
+  if (!timing->has_floating_bus || self.display_mode > E_ULA_DISPLAY_MODE_SCREEN_1) {
+    return 0xFF;
+  }
+
+  first_fetch     = ula_content_tstate(spec) + timing->fetch_delay;
+  tstates_per_row = spec->columns / 4;
+
+  if (tstates < first_fetch || tstates >= first_fetch + 192 * tstates_per_row) {
+    /* Outside the content rows. */
+    return 0xFF;
+  }
+
+  row    = (tstates - first_fetch) / tstates_per_row;
+  column = (tstates - first_fetch) % tstates_per_row;
+  if (column >= 128) {
+    /* In one of the borders or horizontal blanking. */
+    return 0xFF;
+  }
+
+  x    = (column / 8) * 2;
+  slot = column % 8;
+  if (slot >= 4) {
+    if (!timing->is_latched) {
+      return 0xFF;
+    }
+    slot = 3;
+  }
+
+  x += slot / 2;
+  value = (slot & 1)
+    ? self.attribute_ram[(row / 8) * 32 + x]
+    : self.display_ram[self.row_offsets[row] + x];
+
+  return timing->is_latched ? value | 0x01 : value;
+}
+
+
+/**
+ * Called for every write to the ZX Spectrum RAM, with the offset into it,
+ * to forget the part of the displayed row that the write changed.
+ */
+void ula_ram_written(u32_t offset, u8_t value) {
+  const u32_t relative = offset - self.display_offset;
+  u32_t       display;
+
+  if (relative >= 16 * 1024 || self.line_valid == 0) {
+    return;
+  }
+
+  switch (self.display_mode) {
+    case E_ULA_DISPLAY_MODE_SCREEN_0:
+    case E_ULA_DISPLAY_MODE_SCREEN_1:
+      if (relative < 192 * 32) {
+        break;
+      }
+      if (relative < 192 * 32 + 24 * 32) {
+        if ((relative - 192 * 32) / 32 == self.line_row / 8) {
+          self.line_valid &= ~((u64_t) 3 << ((relative & 0x1F) * 2));
+        }
+      }
+      return;
+
+    case E_ULA_DISPLAY_MODE_HI_COLOUR:
+      break;
+
+    case E_ULA_DISPLAY_MODE_HI_RES:
+      display = relative & 0x1FFF;
+      if (display < 192 * 32 && ula_row_get(display) == self.line_row) {
+        self.line_valid &= ~((u64_t) 1 << ((display & 0x1F) * 2 + relative / 0x2000));
+      }
+      return;
+
+    default:
+      if (relative < 0x2000 + 48 * 128) {
+        ula_line_invalidate();
+      }
+      return;
+  }
+
+  /* Display byte, or hi-colour attribute byte. */
+  display = relative & 0x1FFF;
+  if (display < 192 * 32 && ula_row_get(display) == self.line_row) {
+    self.line_valid &= ~((u64_t) 3 << ((display & 0x1F) * 2));
+  }
+}
+
+
+void ula_ram_invalidate(void) {
+  ula_line_invalidate();
 }
 
 
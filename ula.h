@@ -33,7 +33,7 @@ void              ula_contend(void);
 void              ula_contend_bank(u8_t bank);
 void              ula_enable_set(int enable);
 void              ula_did_complete_frame(void);
-void              ula_tick(u32_t row, u32_t column, int* is_enabled, int* is_border, int* is_clipped, const palette_entry_t** rgb);
+void              ula_tick(u32_t row, u32_t column, int* is_enabled, int* is_border, int* is_clipped, u16_t* colour);
 void              ula_transparency_colour_write(u8_t rgb);
 void              ula_attribute_byte_format_write(u8_t value);
 u8_t              ula_attribute_byte_format_read(void);
@@ -53,6 +53,8 @@ u8_t              ula_offset_y_read(void);
 void              ula_offset_y_write(u8_t value);
 u8_t              ula_floating_bus_read(void);
 u32_t             ula_tstates_get(void);
+void              ula_ram_written(u32_t offset, u8_t value);
+void              ula_ram_invalidate(void);
 
 
 #endif  /* __ULA_H */
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "defs.h"
 #include "log.h"
 
@@ -45,3 +46,48 @@ exit_file:
 exit:
   return -1;
 }
+
+
+int utils_load_file(const char* filename, u8_t** data, size_t* size) {
+  FILE* fp;
+  long  n;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    log_err("utils: error opening %s\n", filename);
+    goto exit;
+  }
+
+  fseek(fp, 0L, SEEK_END);
+  n = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+
+  if (n <= 0) {
+    log_err("utils: %s is empty\n", filename);
+    goto exit_file;
+  }
+
+  *data = malloc(n);
+  if (*data == NULL) {
+    log_err("utils: out of memory reading %s\n", filename);
+    goto exit_file;
+  }
+
+  if (fread(*data, n, 1, fp) != 1) {
+    log_err("utils: error reading %s\n", filename);
+    goto exit_data;
+  }
+
+  fclose(fp);
+  *size = n;
+
+  return 0;
+
+exit_data:
+  free(*data);
+  *data = NULL;
+exit_file:
+  fclose(fp);
+exit:
+  return -1;
+}
@@ -9,6 +9,7 @@
 int  utils_init(void);
 void utils_finit(void);
 int  utils_load_rom(const char* filename, size_t expected_size, u8_t* buffer);
+int  utils_load_file(const char* filename, u8_t** data, size_t* size);
 
 
 #endif  /* __UTILS_H */